@@ -12,6 +12,97 @@
  * restarted) and the screen dims. When the timer expires, the screen 
  * brightness is restored to its original value (prevBrightness).
  *
+ * In pipeline mode (-p) the work is split across threads so that a slow
+ * display (setBrightness can take milliseconds) never holds up the EventTap:
+ *
+ *   EventTap (ingest) --ring--> detector thread --ring--> actuator thread
+ *
+ * Each ingest group (currently the single session EventTap) feeds its own
+ * bounded single-producer/single-consumer ring. The detector thread owns
+ * recentScrollTotal and the penalty deadline; the actuator thread owns the
+ * display and prevBrightness. Rings never block the producer: a full ring
+ * drops the event and counts it. Ring occupancy and per-stage latency are
+ * printed on SIGUSR1 and at exit.
+ *
+ * On Linux, scroll wheels are read from evdev and brightness is set through
+ * sysfs backlights. Input devices and backlights belong to seats. By default
+ * only our own seat is used; in daemon mode (-d) every seat with an active
+ * logind session (or every seat in a config file, -f) gets its own
+ * detector. Seats are sharded across a fixed pool of worker threads (-w),
+ * each waiting in epoll on its own seats' devices and penalty deadlines, so
+ * shards never share state or locks. A seat's devices and ingestion
+ * sockets are merged into one stream in kernel timestamp order before its
+ * detector sees them. An input flooding past eventBudget frames a second
+ * has its frames summed per interval until it calms down. Each backlight's
+ * value is shadowed and watched, so a brightness someone else sets becomes
+ * the baseline instead of being overwritten at the end of a penalty.
+ * With -i uring, workers read inputs with multishot io_uring reads and
+ * submit backlight writes along with their next wait.
+ * Each worker keeps its seats' penalty and merge deadlines on a
+ * hierarchical timer wheel, so re-arming a penalty on every scroll is a
+ * few pointer writes, and the worker's timerfd is set to the wheel's
+ * earliest slot. Built with WITH_WAYLAND, a seat without a backlight can
+ * be dimmed by scaling its Wayland outputs' gamma instead, and with
+ * WITH_X11 by a translucent X overlay window.
+ *
+ * Time asleep counts: nowNs() is CLOCK_BOOTTIME (OSX adds the time asleep
+ * on wake), so a penalty that runs out during a suspend ends on resume,
+ * and what the inputs queued around the suspend is summed, not replayed.
+ *
+ * With -u the process splits in two after opening devices: a privileged
+ * helper that owns the backlights, and the detectors running as USER. They
+ * talk through SPSC rings in shared memory with a futex doorbell; the
+ * helper validates each command and restores every dimmed backlight if the
+ * detector process dies.
+ *
+ * Each detector and backlight also publishes its state (penalized, skim
+ * score, deadline, brightness) to a shared memory status page, so status
+ * bars can poll it without syscalls. The layout and a lock-free reader are
+ * in brainthrottle.h.
+ *
+ * With -e, every scroll the detectors count and every penalty start and end
+ * is also broadcast on a shared memory ring for analytics tools. Publishing
+ * is one atomic add and a few stores; consumers keep their own cursors and
+ * are skipped forward when the producer laps them.
+ *
+ * Tunables live in an immutable config block. The control socket (-C)
+ * builds a new block and swaps the pointer; event loops pick it up at the
+ * start of their next batch, and the old block is freed once they all
+ * have.
+ *
+ * Nothing runs on a timer. Idle seat workers sleep in epoll_wait with no
+ * timeout unless a penalty is pending, the helper sleeps on its futex and
+ * the control thread in accept, so an idle brainthrottle never wakes up.
+ * Under systemd the control and ingestion sockets can be socket-activated
+ * and readiness is reported over NOTIFY_SOCKET.
+ *
+ * With -P, state survives restarts: a snapshot thread woken by state
+ * changes writes the status page and config to a flat file, and startup
+ * maps that file back into the detectors, so a penalty in progress (and
+ * the brightness to restore afterwards) is picked up where it left off.
+ *
+ * With -R, each penalty is appended to a history of episodes when it ends.
+ * Detectors hand episodes to an appender thread over SPSC rings; on disk
+ * they are delta-encoded into fixed-size blocks with a small per-block time
+ * index, so a query (-Q) maps the files and reads only the blocks it needs.
+ * The appender also keeps per-minute, -hour and -day totals of scrolling
+ * and penalties in a fixed-size mapped file for dashboards (-U).
+ *
+ * With -F, the same per-minute totals and episodes are also pushed to a
+ * telemetry collector (btcollect.c) in batched datagrams over a Unix or
+ * loopback UDP socket. Producers queue records on SPSC rings that drop when
+ * full, and a sender thread batches them and sends without blocking, so a
+ * slow or missing collector costs records, never detector latency.
+ *
+ * Each detector also sketches the distribution of gaps between scrolls and
+ * of burst sizes in constant memory (see brainthrottle.h). The sketches are
+ * printed with the stats, saved in the snapshot, and can be merged across
+ * snapshots from many machines (-M).
+ *
+ * With -o detector=model, a small fixed-point classifier over each seat's
+ * last few scrolls and navigation keys (btmodel.h) decides instead of the
+ * threshold. It is trained offline on labeled traces (btanalyze -m).
+ *
  *
  * Motvation **
  *
@@ -25,16 +116,82 @@
  * $ clang -o brainthrottle brainthrottle.c -framework IOKit -framework ApplicationServices -Wl,-U,_CGDisplayModeGetPixelWidth -Wl,-U,_CGDisplayModeGetPixelHeight -mmacosx-version-min=10.6
  * $ ./brainthrottle
  *
- * Use Ctrl-C to exit.
+ * On Linux:
+ *
+ * $ cc -O2 -pthread -o brainthrottle brainthrottle.c
+ * $ sudo ./brainthrottle
+ *
+ * Use Ctrl-C to exit. Options:
+ *
+ *   -p             Run in pipeline mode (ingest/detector/actuator threads)
+ *   -c I,D,A       Pin the ingest, detector and actuator threads to CPUs
+ *   -l             Low-latency mode: lock and prefault memory, apply -r
+ *                  and -c, and print which of these took effect
+ *   -r PRIORITY    Run the ingest thread under SCHED_FIFO at PRIORITY
+ *                  (with -l)
+ *   -b COUNT       Benchmark COUNT synthetic events through the single-
+ *                  threaded loop and the pipeline against a simulated
+ *                  display, then exit
+ *   -j SECONDS     Measure input-thread wakeup jitter and stage latency
+ *                  with one synthetic event per ms, then exit. Run under
+ *                  load, e.g. stress-ng --cpu 0 --vm 2 &
+ *   -d             Linux: daemon mode, one detector per active seat
+ *   -f CONFIG      Linux: run every seat in CONFIG, with its devices and
+ *                  backlight, instead of asking logind (see loadSeatConfig)
+ *   -w WORKERS     Linux: number of seat worker threads
+ *   -V SEATS       Linux: benchmark SEATS virtual seats (uinput wheels
+ *                  and fake backlights), then exit
+ *   -u USER        Linux: run detectors as USER, leaving backlight writes
+ *                  to a small privileged helper process
+ *   -H COUNT       Linux: benchmark COUNT helper commands, then exit
+ *   -s NAME        Publish the status page as shm object NAME instead of
+ *                  /brainthrottle-status
+ *   -S             Print a running brainthrottle's status page, then exit
+ *   -e             Broadcast scroll and penalty events on the event bus
+ *   -E             Print events from a running brainthrottle's bus
+ *   -k COUNT       Benchmark COUNT event bus publishes, then exit
+ *   -o NAME=VALUE  Set a tunable (scrollThreshold, penaltyTimeoutSec,
+ *                  restoreTimeoutSec, detector, actuator, paused,
+ *                  model, eventBudget)
+ *   -C PATH        Listen for control commands on Unix socket PATH
+ *   -X COMMAND     Send COMMAND to the control socket given by -C, print
+ *                  the reply and exit
+ *   -I PATH        Linux: accept scroll events from other programs on Unix
+ *                  socket PATH (see brainthrottle.h)
+ *   -P PATH        Save detector, brightness and config state to PATH and
+ *                  resume from it on the next start
+ *   -R DIR         Append every finished penalty to the history in DIR
+ *   -Q FROM,TO     Print the penalties in the -R history that ended between
+ *                  FROM and TO (Unix seconds, either may be left out), then
+ *                  exit
+ *   -U LEVEL       With -Q, print per-minute, -hour or -day activity totals
+ *                  (LEVEL minute, hour or day) instead of penalties
+ *   -Y             Benchmark a year of synthetic history (in -R DIR, if
+ *                  given), then exit
+ *   -T PATH        Record events from a running brainthrottle's bus to
+ *                  trace PATH for btanalyze (like -E, until interrupted)
+ *   -Z PATH        Replay trace PATH through the detector with the -o
+ *                  settings and print the penalties it starts, then exit
+ *   -B COUNT       Check batch detection against the one-at-a-time
+ *                  detector, and the input merge, and benchmark COUNT
+ *                  scrolls of each detector, then exit
+ *   -F ADDRESS     Push activity and penalty records to the btcollect
+ *                  collector at ADDRESS: a Unix socket path, a UDP port on
+ *                  127.0.0.1, or HOST:PORT
+ *   -M SNAPSHOT... Merge the scroll gap and burst sketches saved in -P
+ *                  snapshots, e.g. from many machines, print their
+ *                  quantiles and exit
  *
  *
  * Known issues **
  *
- * - Only works with the main display
+ * - Only works with the main display (OSX) or one backlight per seat (Linux)
  * - Main display brightness must be controllable via OSX
- * - OSX only
+ * - Linux needs read access to /dev/input and write access to the backlight
+ * - Linux seats and devices are discovered once at startup (no hotplug)
  * - Skim detection message should have a timestamp for analysis purposes
- * - Parameters should be command line arguments
+ * - OSX treats CPU affinity as a hint (affinity tags), not a guarantee
+ * - OSX does not implement mlockall, so -l cannot lock memory there
  *
  *
  * Author **
@@ -47,43 +204,439 @@
  * in 2008: http://mattdanger.net/
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
 #include <unistd.h>
+#ifdef __APPLE__
 #include <IOKit/graphics/IOGraphicsLib.h>
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <IOKit/IOMessage.h>
 #include <ApplicationServices/ApplicationServices.h>
+#endif
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <dirent.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <sys/sysctl.h>
+#else
+#include <sched.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+#include <linux/input.h>
+#include <linux/io_uring.h>
+#include <linux/uinput.h>
+#include <grp.h>
+#include <pwd.h>
+#endif
+#ifdef WITH_WAYLAND
+#include <poll.h>
+#include <wayland-client.h>
+#endif
+#ifdef WITH_X11
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/shape.h>
+#endif
+#include "brainthrottle.h"
+#include "bttrace.h"
+#include "btmodel.h"
+
+
+/*
+ * Tunables: Use these to tune program behavior. The defaults can be
+ * overridden with -o name=value and changed at runtime over the control
+ * socket (-C). A config block is never modified once published; changes
+ * swap in a new block between event batches.
+ */
+enum { kDetectorScroll, kDetectorModel };
+enum { kActuatorBrightness, kActuatorNone };
+const char *detectorNames[] = { "scroll", "model" };
+const char *actuatorNames[] = { "brightness", "none" };
+
+struct config {
+    int penaltyTimeoutSec;            // Seconds penalty (screen dim) lasts
+    int restoreTimeoutSec;            // Seconds before resetting scroll count
+    int64_t scrollThreshold;          // Higher=more scrolling before timeout
+    int detector;                     // How skimming is detected
+    int actuator;                     // What a penalty does (none: log only)
+    bool paused;                      // True while scrolls are ignored
+    struct btModel model;             // Used by the model detector, see btmodel.h
+    int eventBudget;                  // Wheel frames/s per input before aggregating (0: never)
+};
+
+const struct config defaultConfig = {
+    .penaltyTimeoutSec = 5,
+    .restoreTimeoutSec = 10,
+    .scrollThreshold = 1000,
+    .detector = kDetectorScroll,
+    .actuator = kActuatorBrightness,
+    .paused = false,
+    .model = { 582070, { -18204, -14640, -86328, 166002, -869529, 755102, 54282, 192424 } }, // Synthetic, see README
+    .eventBudget = 2000,
+};
 
 
 /*
- * Constants: Use these to tune program behavior
+ * Skim detector state. The EventTap and the pipeline use mainDetector; in
+ * daemon mode each seat has its own.
  */
-const int penaltyTimeoutSec = 5;      // Seconds penalty (screen dim) lasts
-const int restoreTimeoutSec = 10;     // Seconds before resetting scroll count
-const int64_t scrollThreshold = 1000; // Higher=more scrolling before timeout
+struct detectorSketches {
+    struct btSketch gaps;             // Time between scrolls (us)
+    struct btSketch bursts;           // recentScrollTotal when a burst ends
+    uint64_t lastScrollTime;          // Unlike the detector's, kept when a penalty ends
+};
+
+struct detector {
+    int64_t recentScrollTotal;        // Compared against scrollThreshold
+    uint64_t lastScrollTime;          // Last time scrolling was detected (ns)
+    uint64_t penaltyDeadline;         // When the penalty ends (ns)
+    bool penalized;                   // True if screen is penalized
+    bool dimmed;                      // True if the penalty has dimmed the screen
+    const char *name;                 // Prefix for messages, or NULL
+    struct btStatusSeat *status;      // Status page slot, or NULL
+    int id;                           // Seat index for the status page and event bus
+    uint64_t penaltyStart;            // When the current penalty started (ns)
+    int64_t peakScrollTotal;          // Highest recentScrollTotal during it
+    uint32_t penaltyScrolls;          // Scroll events that extended it
+    uint64_t activityMinute;          // Minute being counted for rollups (Unix)
+    uint64_t activityDeadline;        // When that minute ends (ns)
+    uint32_t activityEvents;          // Scroll events so far this minute
+    uint64_t activityVolume;          // Their summed scrollDiff
+    struct detectorSketches *sketches; // See brainthrottle.h, or NULL when replaying
+    int direction;                    // Sign of the last vertical scroll, 0 before any
+    struct btModelWindow window;      // Recent inputs, kept while the model detector is on
+};
 
 
 /*
  * Global variables
  */
+#ifdef __APPLE__
 CFMachPortRef scrollEventTap;         // Pointer to EventTap function
-int64_t recentScrollTotal = 0;        // Compared against scrollThreshold
-time_t lastScrollTime = 0;            // Last time scrolling was detected
+CFRunLoopTimerRef penaltyTimer;       // Penalty timer on the EventTap's run loop, or NULL
+#define kPenaltyTimerIdleSec 1.0e9    // Fire date of the disarmed penalty timer, from now
+#endif
+struct detector mainDetector;         // Detector for the EventTap/pipeline
 float prevBrightness = -1;            // Brightness before screen dim
-bool penalized = false;               // True if screen is penalized (dimmed)
+bool pipelineMode = false;            // True if running with -p
+bool daemonMode = false;              // True if running with -d
+bool simulateDisplay = false;         // True while benchmarking (-b) or replaying (-Z)
+struct btStatusPage *statusPage;      // Shared status page, see brainthrottle.h
+const char *statusName = BT_STATUS_NAME; // Its shm name (-s)
+struct btEventBus *eventBus;          // Shared event bus (-e), or NULL
+const char *eventsName = BT_EVENTS_NAME; // Its shm name
+int controlFd = -1;                   // Control socket listener (-C), or -1
+const char *snapshotPath;             // State snapshot file (-P), or NULL
+bool snapshotConfig = true;           // Take the config from the snapshot
+atomic_bool snapshotDirty;            // State changed since the last snapshot
+int snapshotPipe[2] = { -1, -1 };     // Wakes the snapshot thread
+uint64_t processStart;                // nowNs() when main started
+__thread int historyProducer;         // This thread's history ring, see startHistory
+const char *historyDir;               // Session history directory (-R), or NULL
+const char *telemetryAddress;         // Telemetry collector (-F), or NULL
+
+void recordEpisode(struct detector *d, uint64_t now); // Session history, below
+void recordActivity(struct detector *d, uint64_t now);
+void startExitThread();                 // Exit, below
 
 
 /*
  * Brightness constants and external function declarations
  */
+#ifdef __APPLE__
 const CFStringRef kDisplayBrightness = CFSTR(kIODisplayBrightnessKey);
 const int kMaxDisplays = 16;
 extern size_t CGDisplayModeGetPixelWidth(CGDisplayModeRef mode)
   __attribute__((weak_import));
 extern size_t CGDisplayModeGetPixelHeight(CGDisplayModeRef mode)
   __attribute__((weak_import));
+#endif
+
+
+/*
+ * Time constants
+ */
+const uint64_t kNsecPerSec = 1000000000ULL;
+const uint64_t kNsecPerUsec = 1000ULL;
+const int kSimulatedDisplayUsec = 500; // Cost of a simulated get/setBrightness
+const int kVirtualSeatSeconds = 10;   // Length of the -V benchmark
+const uint32_t kEventSlots = 4096;    // Event bus ring size, a power of two
+const int kBusConsumers = 4;          // Consumers attached by the -k benchmark
+const int kBusBatch = 64;             // Events published per -k batch
+
+
+/*
+ * Suspended time the system clock doesn't count: suspends simulated by the
+ * suspend control command and, on OSX, real ones (see handlePower).
+ */
+_Atomic uint64_t sleepOffsetNs;
+
+
+/*
+ * Returns a monotonic timestamp in nanoseconds that keeps counting while
+ * the machine is suspended, so a penalty or restoreTimeoutSec runs out
+ * during a suspend rather than after it. CLOCK_BOOTTIME on Linux. Used for
+ * scroll gaps, penalty deadlines and stage latencies.
+ */
+uint64_t nowNs() {
+    uint64_t offset = atomic_load_explicit(&sleepOffsetNs, memory_order_relaxed);
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (0 == timebase.denom) {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom + offset;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (uint64_t)ts.tv_sec * kNsecPerSec + ts.tv_nsec + offset;
+#endif
+}
+
+
+/*
+ * Returns how long the machine has spent suspended since boot, as far as
+ * nowNs() knows. A worker that sees this grow has just resumed.
+ */
+uint64_t sleptNs() {
+    uint64_t offset = atomic_load_explicit(&sleepOffsetNs, memory_order_relaxed);
+#ifdef __APPLE__
+    return offset;
+#else
+    struct timespec boot, mono;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    int64_t slept = (int64_t)(boot.tv_sec - mono.tv_sec) * (int64_t)kNsecPerSec + boot.tv_nsec - mono.tv_nsec;
+    return (slept > 0 ? (uint64_t)slept : 0) + offset;
+#endif
+}
+
+
+/*
+ * Spins for usec microseconds. Stands in for the display when benchmarking.
+ */
+void busyWait(int usec) {
+    uint64_t end = nowNs() + usec * kNsecPerUsec;
+    while (nowNs() < end) {
+    }
+}
+
+
+/*
+ * Runtime config
+ *
+ * Threads that read the config (the EventTap, the pipeline detector and
+ * seat workers) call beginBatch before a batch of events and endBatch
+ * before they sleep, and use the thread's config pointer in between. That
+ * pointer is read without locks. The control thread swaps in a new block
+ * and frees the old one once every reader has been through endBatch or a
+ * later beginBatch (quiescent-state-based reclamation).
+ */
+enum { kMaxConfigReaders = 128 };
+const uint64_t kReaderOffline = UINT64_MAX;
+
+struct configReader {
+    _Atomic uint64_t epoch;           // configEpoch when last online, or kReaderOffline
+} __attribute__((aligned(64)));
+
+_Atomic(const struct config *) currentConfig = &defaultConfig;
+_Atomic uint64_t configEpoch = 1;
+struct configReader configReaders[kMaxConfigReaders];
+atomic_int numConfigReaders;
+pthread_mutex_t configLock = PTHREAD_MUTEX_INITIALIZER; // Serializes writers
+__thread struct configReader *configReader;
+__thread const struct config *config; // Valid between beginBatch and endBatch
+
+
+/*
+ * Starts a batch of events on this thread: picks up the current config.
+ */
+void beginBatch() {
+    if (NULL == configReader) {
+        int index = atomic_fetch_add(&numConfigReaders, 1);
+        if (index >= kMaxConfigReaders) {
+            fprintf(stderr, "Too many config reader threads; bailing\n");
+            exit(-1);
+        }
+        configReader = &configReaders[index];
+    }
+    atomic_store(&configReader->epoch, atomic_load(&configEpoch));
+    config = atomic_load(&currentConfig);
+}
+
+
+/*
+ * Ends a batch. The thread must not touch config until its next beginBatch.
+ */
+void endBatch() {
+    config = NULL;
+    atomic_store(&configReader->epoch, kReaderOffline);
+}
+
+
+/*
+ * Publishes next as the config, then waits for every reader to stop using
+ * the old one and frees it. Callers must hold configLock.
+ */
+void swapConfig(struct config *next) {
+    const struct config *old = atomic_exchange(&currentConfig, next);
+    uint64_t target = atomic_fetch_add(&configEpoch, 1) + 1;
+
+    int count = atomic_load(&numConfigReaders);
+    for (int i = 0; i < count && i < kMaxConfigReaders; i++) {
+        uint64_t epoch;
+        while ((epoch = atomic_load(&configReaders[i].epoch)) < target) {
+            struct timespec delay = { 0, 1000000 };
+            nanosleep(&delay, NULL);
+        }
+    }
+    if (old != &defaultConfig) {
+        free((void *)old);
+    }
+}
+
+
+/*
+ * Looks name up in a list of names. Returns its index or -1.
+ */
+int findName(const char **names, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (0 == strcmp(names[i], name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Reads a model written by btanalyze -m from path. Returns 0, or -1 if it
+ * can't be read or isn't a model.
+ */
+int loadModel(const char *path, struct btModel *model) {
+    char text[1024];
+
+    FILE *file = fopen(path, "r");
+    if (NULL == file) {
+        return -1;
+    }
+    size_t len = fread(text, 1, sizeof(text) - 1, file);
+    fclose(file);
+    text[len] = '\0';
+    return btModelParse(text, model);
+}
+
+
+/*
+ * Sets one config parameter from text. Returns NULL on success or a
+ * message saying what was wrong.
+ */
+const char *setConfigParam(struct config *c, const char *name, const char *value) {
+    char *end;
+    long long number = strtoll(value, &end, 10);
+    bool isNumber = end != value && '\0' == *end;
 
+    if (0 == strcmp(name, "penaltyTimeoutSec")) {
+        if (!isNumber || number < 1 || number > 3600) {
+            return "penaltyTimeoutSec must be 1-3600";
+        }
+        c->penaltyTimeoutSec = number;
+    } else if (0 == strcmp(name, "restoreTimeoutSec")) {
+        if (!isNumber || number < 1 || number > 3600) {
+            return "restoreTimeoutSec must be 1-3600";
+        }
+        c->restoreTimeoutSec = number;
+    } else if (0 == strcmp(name, "scrollThreshold")) {
+        if (!isNumber || number < 1) {
+            return "scrollThreshold must be positive";
+        }
+        c->scrollThreshold = number;
+    } else if (0 == strcmp(name, "detector")) {
+        int index = findName(detectorNames, sizeof(detectorNames) / sizeof(*detectorNames), value);
+        if (-1 == index) {
+            return "unknown detector";
+        }
+        c->detector = index;
+    } else if (0 == strcmp(name, "actuator")) {
+        int index = findName(actuatorNames, sizeof(actuatorNames) / sizeof(*actuatorNames), value);
+        if (-1 == index) {
+            return "unknown actuator";
+        }
+        c->actuator = index;
+    } else if (0 == strcmp(name, "paused")) {
+        if (!isNumber || number < 0 || number > 1) {
+            return "paused must be 0 or 1";
+        }
+        c->paused = number;
+    } else if (0 == strcmp(name, "model")) {
+        if (0 != btModelParse(value, &c->model) && 0 != loadModel(value, &c->model)) {
+            return "model must be nine integers or a file holding them";
+        }
+    } else if (0 == strcmp(name, "eventBudget")) {
+        if (!isNumber || number < 0 || number > 1000000) {
+            return "eventBudget must be 0-1000000";
+        }
+        c->eventBudget = number;
+    } else {
+        return "unknown parameter";
+    }
+    return NULL;
+}
+
+
+/*
+ * Formats every config parameter as "name value" lines into buf.
+ */
+void formatConfig(const struct config *c, char *buf, size_t size) {
+    const int32_t *w = c->model.weights;
+
+    snprintf(buf, size,
+        "penaltyTimeoutSec %d\nrestoreTimeoutSec %d\nscrollThreshold %lld\n"
+        "detector %s\nactuator %s\npaused %d\nmodel %d,%d,%d,%d,%d,%d,%d,%d,%d\neventBudget %d\n",
+        c->penaltyTimeoutSec, c->restoreTimeoutSec, (long long)c->scrollThreshold,
+        detectorNames[c->detector], actuatorNames[c->actuator], c->paused,
+        c->model.bias, w[0], w[1], w[2], w[3], w[4], w[5], w[6], w[7], c->eventBudget);
+}
+
+
+#ifdef __APPLE__
 /*
  * Gets the main display service. Called by the get/setBrightness functions.
  */
@@ -109,6 +662,12 @@ io_service_t getDisplayService() {
 float getBrightness() {
     float brightness = -1;
     CGDisplayErr err;
+
+    if (simulateDisplay) {
+        busyWait(kSimulatedDisplayUsec);
+        return 1.0;
+    }
+
     io_service_t service = getDisplayService();
     if (0 == service) {
         return -1;
@@ -129,6 +688,12 @@ float getBrightness() {
  */
 void setBrightness(float brightness) { 
     CGDisplayErr err;
+
+    if (simulateDisplay) {
+        busyWait(kSimulatedDisplayUsec);
+        return;
+    }
+
     io_service_t service = getDisplayService();
     if (0 == service) {
         return; 
@@ -139,156 +704,8980 @@ void setBrightness(float brightness) {
         fprintf(stderr, "Failed to set brightness of display (error %d)\n", err);
     } 
 }
-
+#else
 
 /*
- * Called when the EventTap fires. Updates the scrolling global variables and
- * controls screen dimming. 
+ * io_uring engine (-i uring)
+ *
+ * An optional replacement for the seat workers' epoll loop, driven through
+ * io_uring_setup and io_uring_enter directly. Each worker has its own ring.
+ * Every input device gets one multishot read, which fills buffers the worker
+ * hands the kernel through a provided buffer ring, so wheel frames cost no
+ * read() of their own. Backlight writes made while handling a batch are
+ * queued and go in with the next wait: one io_uring_enter for all of them.
+ * The worker's other fds (timer, sockets, backlight watches) stay in its
+ * epoll set, which is itself polled through the ring. The history writer
+ * has a small ring too, to flush a block and its index entry together.
  */
-static CGEventRef handleScroll (
-    CGEventTapProxy proxy,
-    CGEventType type,
-    CGEventRef event,
-    void * refcon
-) {
-    int64_t scrollX, scrollY, scrollDiff;
-    int key;
+#ifndef IORING_OP_READ_MULTISHOT
+#define IORING_OP_READ_MULTISHOT 49     // Linux 6.7; older headers lack it
+#endif
+#define kUringEntries 256               // SQEs per worker ring
+#define kUringBuffers 64                // Provided input buffers per worker
+#define kUringBufferEvents 64           // input_events per buffer
 
+enum { kUringRead, kUringPoll, kUringWrite }; // Completion kinds, in user_data's low bits
 
+struct uring {
+    int fd;                             // -1 if not in use
+    unsigned entries;
+    unsigned *sqHead;                   // Shared with the kernel
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned tail;                      // SQEs prepared, up to here
+    unsigned submitted;                 // ... and handed to the kernel
+    struct io_uring_buf_ring *bufRing;  // Provided input buffers, or NULL
+    char *buffers;
+    size_t bufferSize;
+    uint16_t bufTail;
+};
 
-    // If the event tap has timed out, reinstall it
-    // Also, if the event isn't a scroll, just return
+bool useUring = false;                  // -i uring
+__thread struct uring *threadUring;     // This thread's ring, if backlight writes go through one
+__thread uint64_t threadSyscalls;       // Syscalls on this worker's event path, for stats
 
-    if (type == kCGEventTapDisabledByTimeout) {
-        CGEventTapEnable(scrollEventTap, true);
-        return event;
-    } else if (type != kCGEventScrollWheel) {
-        return event;
+
+/*
+ * Sets up a ring with room for entries SQEs. The calling thread must be the
+ * only one to submit to it if singleIssuer is set. Returns false (with u->fd
+ * -1) if io_uring isn't available.
+ */
+bool openUring(struct uring *u, unsigned entries, bool singleIssuer) {
+    struct io_uring_params params;
+
+    memset(u, 0, sizeof(*u));
+    memset(&params, 0, sizeof(params));
+    if (singleIssuer) {
+        params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    }
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (-1 == u->fd && EINVAL == errno && params.flags) {
+        params.flags = 0;
+        u->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (-1 == u->fd) {
+        return false;
     }
 
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+    }
+    char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+        IORING_OFF_SQ_RING);
+    char *cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq :
+        mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == sq || MAP_FAILED == cq || MAP_FAILED == u->sqes) {
+        close(u->fd);
+        u->fd = -1;
+        return false;
+    }
+    u->entries = params.sq_entries;
+    u->sqHead = (unsigned *)(sq + params.sq_off.head);
+    u->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    u->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    u->sqArray = (unsigned *)(sq + params.sq_off.array);
+    u->cqHead = (unsigned *)(cq + params.cq_off.head);
+    u->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    u->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    u->tail = u->submitted = *u->sqTail;
+    return true;
+}
+
 
-    // Store scroll stats
+/*
+ * Submits everything prepared and, if wait is set, waits for at least wait
+ * completions. Returns false on error.
+ */
+bool uringEnter(struct uring *u, unsigned wait) {
+    __atomic_store_n(u->sqTail, u->tail, __ATOMIC_RELEASE);
+    threadSyscalls++;
+    int ret = (int)syscall(__NR_io_uring_enter, u->fd, u->tail - u->submitted, wait,
+        IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+        return EINTR == errno;
+    }
+    u->submitted += ret;
+    return true;
+}
 
-    scrollX = CGEventGetIntegerValueField(event, kCGScrollWheelEventDeltaAxis1);
-    scrollY = CGEventGetIntegerValueField(event, kCGScrollWheelEventDeltaAxis2);
-    scrollDiff = 1 + llabs(scrollX) + llabs(scrollY);
 
+/*
+ * Returns a cleared SQE to fill in, submitting first if the queue is full.
+ * It goes to the kernel with the next uringEnter().
+ */
+struct io_uring_sqe *uringSqe(struct uring *u) {
+    while (u->tail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) >= u->entries) {
+        uringEnter(u, 0);
+    }
+    unsigned index = u->tail & *u->sqMask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sqArray[index] = index;
+    u->tail++;
+    return sqe;
+}
 
-    // If restoreTimeoutSec seconds have elapsed reset the scroll counter
 
-    time_t now = time(NULL);
-    if ((now - lastScrollTime) > restoreTimeoutSec) {
-        printf("Resetting scroll counter\n");
-        recentScrollTotal = scrollDiff;
-    } else {
-        recentScrollTotal += scrollDiff;
+/*
+ * Takes the next completion into cqe. Returns false if there is none.
+ */
+bool uringCompletion(struct uring *u, struct io_uring_cqe *cqe) {
+    unsigned head = *u->cqHead;
+    if (head == __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)) {
+        return false;
     }
-    lastScrollTime = now;
+    *cqe = u->cqes[head & *u->cqMask];
+    __atomic_store_n(u->cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
 
 
-    // If skimming not detected (yet), nothing to do, just return
+/*
+ * Gives the kernel buffer bid back to fill.
+ */
+void uringRecycle(struct uring *u, uint16_t bid) {
+    struct io_uring_buf *buf = &u->bufRing->bufs[u->bufTail & (kUringBuffers - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(u->buffers + bid * u->bufferSize);
+    buf->len = (uint32_t)u->bufferSize;
+    buf->bid = bid;
+    __atomic_store_n(&u->bufRing->tail, ++u->bufTail, __ATOMIC_RELEASE);
+}
 
-    if (recentScrollTotal < scrollThreshold) {
-        return event;
+
+/*
+ * Registers kUringBuffers buffers of size bytes as buffer group 0, for
+ * multishot reads. Returns false if the kernel doesn't support it.
+ */
+bool uringProvideBuffers(struct uring *u, size_t size) {
+    struct io_uring_buf_reg reg;
+
+    u->bufRing = mmap(NULL, kUringBuffers * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->buffers = malloc(kUringBuffers * size);
+    if (MAP_FAILED == u->bufRing || NULL == u->buffers) {
+        u->bufRing = NULL;
+        return false;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->bufRing;
+    reg.ring_entries = kUringBuffers;
+    reg.bgid = 0;
+    if (0 != syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        munmap(u->bufRing, kUringBuffers * sizeof(struct io_uring_buf));
+        u->bufRing = NULL;
+        return false;
     }
+    u->bufferSize = size;
+    for (int i = 0; i < kUringBuffers; i++) {
+        uringRecycle(u, (uint16_t)i);
+    }
+    return true;
+}
 
 
-    // Skimming detected: dim screen
-    // If penalty timeout timer hasn't been started yet, store brightness and start timer
-    
-    struct itimerval timerValue;
-    struct itimerval oldTimerValue;
-    struct sigaction action;
+/*
+ * Linux backlight. A backlight is a sysfs directory (or, for testing, any
+ * directory) holding brightness and max_brightness files. Brightness is
+ * exposed to the rest of the program as a fraction, like OSX.
+ *
+ * Rather than reading the hardware on every dim, a backlight keeps a shadow
+ * of its raw value, kept current by watching for changes made by anyone
+ * else: the kernel notifies pollers of actual_brightness (EPOLLPRI) when the
+ * brightness is set through sysfs or a hotkey, and fake backlights are
+ * watched with inotify.
+ */
+struct backlight {
+    int fd;                           // Open brightness file, or -1
+    bool regularFile;                 // Fake backlight: truncate on write
+    int maxBrightness;
+    float prevBrightness;             // Brightness before screen dim
+    int current;                      // Shadow: raw value last read or written, or -1
+    int written;                      // Raw value we last wrote, or -1
+    int watchFd;                      // Read-only brightness file, to read changes from, or -1
+    int notifyFd;                     // Signals changes: actual_brightness, or inotify if fake
+    bool dimmed;                      // Dimmed by us and not yet restored
+    bool overridden;                  // Changed by someone else during this penalty
+    char ringValue[16];               // io_uring engine: text of the queued write
+    unsigned ringSlot;                // ... its position in the submission queue
+    bool ringBusy;                    // ... a write is queued or in flight
+    int ringNext;                     // ... raw value to write once it completes, or -1
+};
 
-    if (-1 == getitimer(ITIMER_REAL, &timerValue)) {
-        fprintf(stderr, "Error getting timer\n");
-        return event;
+struct backlight defaultBacklight = { .fd = -1, .current = -1, .written = -1, .watchFd = -1,
+    .notifyFd = -1 };                 // Used by get/setBrightness
+
+
+/*
+ * Reads a small integer from path. Returns -1 on failure.
+ */
+int readIntFile(const char *path) {
+    char buf[32];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (-1 == fd) {
+        return -1;
     }
-    float brightness = getBrightness();
-    if (0 == timerValue.it_value.tv_sec && 0 == timerValue.it_value.tv_usec) { 
-        // Timer not set
-        prevBrightness = brightness;
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return -1;
     }
+    buf[len] = 0;
+    return atoi(buf);
+}
 
 
-    timerValue.it_value.tv_sec = penaltyTimeoutSec;
-    timerValue.it_value.tv_usec = 0;
-    if (-1 == setitimer(ITIMER_REAL, &timerValue, NULL)) {
-        fprintf(stderr, "Error setting timer\n");
-        return event;
-    }
+/*
+ * Reads a backlight's brightness as a fraction of its maximum, or -1.
+ */
+float readBacklight(struct backlight *b) {
+    char buf[32];
 
-    if (!penalized) {
-        printf("Skimming detected.\n"); 
-        penalized = true;
+    if (-1 == b->fd) {
+        return -1;
+    }
+    ssize_t len = pread(b->fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) {
+        fprintf(stderr, "failed to get brightness of backlight (error %d)\n", errno);
+        return -1;
     }
+    buf[len] = 0;
+    b->current = atoi(buf);
+    return (float)b->current / b->maxBrightness;
+}
 
-    // Decrease screen brightness
 
-    float penalty = brightness - (brightness * (float)scrollDiff/100);
-    if (penalty < 0.05) {
-        penalty = 0.0;
+/*
+ * Opens the backlight in directory dir. Returns false if it can't be used.
+ */
+bool openBacklight(struct backlight *b, const char *dir) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/max_brightness", dir);
+    b->maxBrightness = readIntFile(path);
+    snprintf(path, sizeof(path), "%s/brightness", dir);
+    b->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (-1 == b->fd || b->maxBrightness <= 0) {
+        fprintf(stderr, "cannot open backlight %s (error %d)\n", dir, errno);
+        if (-1 != b->fd) {
+            close(b->fd);
+        }
+        b->fd = -1;
+        return false;
     }
-    setBrightness(penalty); 
+    b->regularFile = (0 == fstat(b->fd, &st) && S_ISREG(st.st_mode));
+    b->prevBrightness = -1;
+    b->written = -1;
+    b->current = -1;
+    b->dimmed = false;
+    b->overridden = false;
+    b->ringBusy = false;
+    b->ringNext = -1;
 
-    return event;
+
+    // Watch for changes; without a watch the shadow is refreshed per dim
+
+    b->watchFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (b->regularFile) {
+        b->notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (-1 != b->notifyFd && -1 == inotify_add_watch(b->notifyFd, path, IN_CLOSE_WRITE)) {
+            close(b->notifyFd);
+            b->notifyFd = -1;
+        }
+    } else {
+        snprintf(path, sizeof(path), "%s/actual_brightness", dir);
+        b->notifyFd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (-1 == b->watchFd || -1 == b->notifyFd) {
+        if (!simulateDisplay) {
+            fprintf(stderr, "cannot watch backlight %s (error %d); reading it per dim\n", dir, errno);
+        }
+        if (-1 != b->notifyFd) {
+            close(b->notifyFd);
+        }
+        if (-1 != b->watchFd) {
+            close(b->watchFd);
+        }
+        b->watchFd = -1;
+        b->notifyFd = -1;
+    }
+    readBacklight(b);
+    return true;
 }
 
 
 /*
- * Screen dim timeout handler. Resets screen brightness and disables timer.
+ * Returns a backlight's brightness as a fraction of its maximum from the
+ * shadow, reading the hardware only if changes aren't being watched.
  */
-void handleTimeout(int signo)
-{
+float shadowBacklight(struct backlight *b) {
+    if (-1 == b->notifyFd || b->current < 0) {
+        return readBacklight(b);
+    }
+    return (float)b->current / b->maxBrightness;
+}
 
-    // Restore brightness if screen has been dimmed
 
-    if (penalized) {
-        setBrightness(prevBrightness);
-        penalized = false;
+/*
+ * Reads the raw value of a watched backlight after a change notification,
+ * re-arming the notification. Doesn't need the brightness file, so it works
+ * after the fd has been handed to the helper. Returns -1 on failure.
+ */
+int readBacklightChange(struct backlight *b) {
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+
+    if (b->regularFile) {
+        while (read(b->notifyFd, buf, sizeof(buf)) > 0) {
+        }
+    } else {
+        pread(b->notifyFd, buf, sizeof(buf), 0);
+    }
+    ssize_t len = pread(b->watchFd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) {
+        return -1;
     }
-    lastScrollTime = 0; 
+    buf[len] = 0;
+    return atoi(buf);
+}
 
 
-    // Disable timer
+/*
+ * Queues a write of raw to b on this thread's ring. A write that hasn't
+ * been submitted yet is simply updated, and one made while another is in
+ * flight waits for it, so writes land in order and a burst of dims costs at
+ * most two. Fake backlights get a fixed-width value instead of a truncate.
+ */
+void queueBacklightWrite(struct backlight *b, int raw) {
+    struct uring *u = threadUring;
+    bool queued = b->ringBusy && (int)(b->ringSlot - u->submitted) >= 0;
 
-    struct itimerval timerValue;
-    timerValue.it_value.tv_sec = 0;
-    timerValue.it_value.tv_usec = 0;
-    if (-1 == setitimer(ITIMER_REAL, NULL, NULL)) {
-         fprintf(stderr, "Error setting timer in signal handler; bailing\n");
-         exit(-1);
+    if (b->ringBusy && !queued) {
+        b->ringNext = raw;
+        return;
+    }
+    int len = snprintf(b->ringValue, sizeof(b->ringValue), b->regularFile ? "%10d\n" : "%d\n", raw);
+    if (queued) {
+        u->sqes[b->ringSlot & *u->sqMask].len = len;
+        return;
     }
+    b->ringSlot = u->tail;
+    struct io_uring_sqe *sqe = uringSqe(u);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = b->fd;
+    sqe->addr = (uint64_t)(uintptr_t)b->ringValue;
+    sqe->len = len;
+    sqe->user_data = (uint64_t)(uintptr_t)b | kUringWrite;
+    b->ringBusy = true;
+}
+
 
-    if (signo != SIGALRM) {
-        printf("Exiting\n");
-        exit(0);
+/*
+ * Handles the completion of a queued backlight write, issuing the next one
+ * if dims came in meanwhile.
+ */
+void completeBacklightWrite(struct backlight *b, int res) {
+    b->ringBusy = false;
+    if (res < 0) {
+        fprintf(stderr, "Failed to set brightness of backlight (error %d)\n", -res);
+    }
+    if (b->ringNext >= 0) {
+        int raw = b->ringNext;
+        b->ringNext = -1;
+        queueBacklightWrite(b, raw);
     }
 }
 
 
 /*
- * Entry point for the program. Installs the scroll-handler EventTap and runs 
- * event loop
+ * Sets a backlight's brightness from a fraction of its maximum, through
+ * this thread's ring if it has one. Returns false if it couldn't.
  */
-int main (
-    int argc,
-    char ** argv
-) {
-    prevBrightness = getBrightness();
+bool writeBacklight(struct backlight *b, float brightness) {
+    char buf[32];
 
+    if (-1 == b->fd || brightness < 0) {
+        return false;
+    }
+    int raw = (int)(brightness * b->maxBrightness + 0.5);
+    if (threadUring) {
+        queueBacklightWrite(b, raw);
+        b->written = b->current = raw;
+        return true;
+    }
+    threadSyscalls += b->regularFile ? 2 : 1;
+    int len = snprintf(buf, sizeof(buf), "%d\n", raw);
+    if (len != pwrite(b->fd, buf, len, 0)) {
+        fprintf(stderr, "Failed to set brightness of backlight (error %d)\n", errno);
+        return false;
+    } else if (b->regularFile && -1 == ftruncate(b->fd, len)) {
+        return false;
+    }
+    b->written = b->current = raw;
+    return true;
+}
 
-    // Add penalty timeout handler
 
-    struct sigaction action;
-    action.sa_handler = &handleTimeout;
-    action.sa_flags = SA_NODEFER;
-    sigaction(SIGALRM, &action, NULL);
-    sigaction(SIGINT, &action, NULL);
+/*
+ * Gets the brightness level of the default backlight
+ */
+float getBrightness() {
+    if (simulateDisplay) {
+        busyWait(kSimulatedDisplayUsec);
+        return 1.0;
+    }
 
+    float brightness = readBacklight(&defaultBacklight);
+    if (brightness >= 0) {
+        printf("display brightness %f\n", brightness);
+    }
+    return brightness;
+}
 
-    // Create scroll event handler
-    
+
+/*
+ * Sets the brightness level of the default backlight
+ */
+void setBrightness(float brightness) {
+    if (simulateDisplay) {
+        busyWait(kSimulatedDisplayUsec);
+        return;
+    }
+    writeBacklight(&defaultBacklight, brightness);
+}
+#endif
+
+
+/*
+ * Creates a fresh shared memory object with mode, replacing ours from an
+ * earlier run. O_EXCL makes sure the object is new and ours: an object some
+ * other user left under the name can't be unlinked by us (/dev/shm is
+ * sticky), so opening fails rather than writing into a page they control.
+ * fchmod undoes the umask.
+ */
+int createSharedObject(const char *name, mode_t mode) {
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, mode);
+    if (-1 != fd) {
+        fchmod(fd, mode);
+    }
+    return fd;
+}
+
+
+/*
+ * Creates the shared status page with count slots, named after names (or
+ * "main" if names is NULL). Failure only costs the status page.
+ */
+void createStatusPage(int count, const char **names) {
+    size_t size = sizeof(struct btStatusPage) + count * sizeof(struct btStatusSeat);
+
+    int fd = createSharedObject(statusName, 0644);
+    if (-1 == fd) {
+        fprintf(stderr, "cannot create status page %s (error %d)\n", statusName, errno);
+        return;
+    }
+    if (-1 == ftruncate(fd, size)) {
+        fprintf(stderr, "cannot size status page (error %d)\n", errno);
+        close(fd);
+        return;
+    }
+    statusPage = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == statusPage) {
+        statusPage = NULL;
+        return;
+    }
+
+    statusPage->version = BT_STATUS_VERSION;
+    statusPage->numSeats = count;
+    statusPage->seatSize = sizeof(struct btStatusSeat);
+    for (int i = 0; i < count; i++) {
+        struct btStatusSeat *slot = &statusPage->seats[i];
+        snprintf(slot->actuator.name, sizeof(slot->actuator.name), "%s", names ? names[i] : "main");
+        slot->detector.scrollThreshold = atomic_load(&currentConfig)->scrollThreshold;
+        slot->detector.restoreTimeout = atomic_load(&currentConfig)->restoreTimeoutSec * kNsecPerSec;
+        slot->actuator.targetBrightness = -1;
+        slot->actuator.currentBrightness = -1;
+        slot->actuator.restoreBrightness = -1;
+    }
+    __atomic_store_n(&statusPage->magic, BT_STATUS_MAGIC, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Notes that there is state worth snapshotting, waking the snapshot thread
+ * the first time. Safe in signal handlers.
+ */
+void markDirty() {
+    if (-1 != snapshotPipe[1] && !atomic_load_explicit(&snapshotDirty, memory_order_relaxed) &&
+        !atomic_exchange(&snapshotDirty, true)) {
+        char wake = 1;
+        write(snapshotPipe[1], &wake, 1);
+    }
+}
+
+
+/*
+ * Publishes a detector's state to its status slot. A handful of stores.
+ */
+void publishDetector(struct detector *d) {
+    struct btStatusDetector *slot;
+
+    if (NULL == d->status) {
+        return;
+    }
+    slot = &d->status->detector;
+    btSeqBegin(&slot->sequence);
+    if (config) {
+        BT_STORE(slot->scrollThreshold, config->scrollThreshold);
+        BT_STORE(slot->restoreTimeout, config->restoreTimeoutSec * kNsecPerSec);
+    }
+    BT_STORE(slot->penalized, d->penalized);
+    BT_STORE(slot->recentScrollTotal, d->recentScrollTotal);
+    BT_STORE(slot->lastScrollTime, d->lastScrollTime);
+    BT_STORE(slot->penaltyDeadline, d->penalized ? d->penaltyDeadline : 0);
+    btSeqEnd(&slot->sequence);
+    markDirty();
+}
+
+
+/*
+ * Publishes the brightness we asked for, the brightness the display has and
+ * the brightness to restore after the penalty (-1 if not dimmed) to a
+ * status slot.
+ */
+void publishBrightness(struct btStatusSeat *status, float target, float current, float restore) {
+    struct btStatusActuator *slot;
+
+    if (NULL == status) {
+        return;
+    }
+    slot = &status->actuator;
+    btSeqBegin(&slot->sequence);
+    __atomic_store(&slot->targetBrightness, &target, __ATOMIC_RELAXED);
+    __atomic_store(&slot->currentBrightness, &current, __ATOMIC_RELAXED);
+    __atomic_store(&slot->restoreBrightness, &restore, __ATOMIC_RELAXED);
+    btSeqEnd(&slot->sequence);
+    markDirty();
+}
+
+
+/*
+ * Prints every slot of a running brainthrottle's status page. This is what
+ * a status bar would do, minus the printing.
+ */
+int printStatus() {
+    struct stat st;
+    struct btStatusSeat seat;
+
+    int fd = shm_open(statusName, O_RDONLY, 0);
+    if (-1 == fd || -1 == fstat(fd, &st)) {
+        fprintf(stderr, "cannot open status page %s (error %d)\n", statusName, errno);
+        return -1;
+    }
+    if (st.st_size < (off_t)sizeof(struct btStatusPage)) {
+        fprintf(stderr, "status page %s is not usable\n", statusName);
+        close(fd);
+        return -1;
+    }
+    const struct btStatusPage *page = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == page || BT_STATUS_MAGIC != __atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) ||
+        BT_STATUS_VERSION != page->version || sizeof(struct btStatusSeat) != page->seatSize ||
+        st.st_size < (off_t)(sizeof(*page) + (size_t)page->numSeats * sizeof(struct btStatusSeat))) {
+        fprintf(stderr, "status page %s is not usable\n", statusName);
+        return -1;
+    }
+
+    uint64_t now = nowNs();
+    for (uint32_t i = 0; i < page->numSeats; i++) {
+        btStatusRead(&page->seats[i], &seat);
+        struct btStatusDetector *d = &seat.detector;
+        bool live = now - d->lastScrollTime <= d->restoreTimeout;
+        printf("%s: %s, score %.2f, ", seat.actuator.name,
+            d->penalized ? "penalized" : "not penalized",
+            live ? (double)d->recentScrollTotal / d->scrollThreshold : 0.0);
+        if (d->penalized && d->penaltyDeadline > now) {
+            printf("%.1f s left, ", (double)(d->penaltyDeadline - now) / kNsecPerSec);
+        }
+        printf("brightness %.2f (target %.2f)\n", seat.actuator.currentBrightness,
+            seat.actuator.targetBrightness);
+    }
+    return 0;
+}
+
+
+/*
+ * Creates the event bus. Consumers write their own cursors, so the page is
+ * world-writable; the producer never reads anything back from it except
+ * cursors for lag counting, so consumers can only confuse each other.
+ */
+void createEventBus() {
+    size_t size = sizeof(struct btEventBus) + kEventSlots * sizeof(struct btEvent);
+
+    int fd = createSharedObject(eventsName, 0666);
+    if (-1 == fd) {
+        fprintf(stderr, "cannot create event bus %s (error %d)\n", eventsName, errno);
+        return;
+    }
+    if (-1 == ftruncate(fd, size)) {
+        fprintf(stderr, "cannot size event bus (error %d)\n", errno);
+        close(fd);
+        return;
+    }
+    eventBus = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == eventBus) {
+        eventBus = NULL;
+        return;
+    }
+    eventBus->version = BT_EVENTS_VERSION;
+    eventBus->slots = kEventSlots;
+    eventBus->eventSize = sizeof(struct btEvent);
+    __atomic_store_n(&eventBus->magic, BT_EVENTS_MAGIC, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Counts consumers that have fallen a whole ring behind. Called by the
+ * producer once per quarter ring, so its cost is spread thin.
+ */
+void checkEventConsumers(uint64_t position) {
+    for (int i = 0; i < BT_EVENTS_CONSUMERS; i++) {
+        struct btEventConsumer *c = &eventBus->consumers[i];
+        if (0 != BT_LOAD(c->pid) && position - BT_LOAD(c->cursor) > kEventSlots) {
+            BT_STORE(c->lagging, BT_LOAD(c->lagging) + 1);
+        }
+    }
+}
+
+
+/*
+ * Broadcasts one event. Safe to call from several threads; never waits for
+ * consumers, which notice when they have been overwritten.
+ */
+void publishEvent(int type, int seat, uint64_t time, int64_t value) {
+    if (NULL == eventBus) {
+        return;
+    }
+    uint64_t position = __atomic_fetch_add(&eventBus->head, 1, __ATOMIC_RELAXED);
+    struct btEvent *e = &eventBus->events[position & (kEventSlots - 1)];
+    __atomic_store_n(&e->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    BT_STORE(e->time, time);
+    BT_STORE(e->type, type);
+    BT_STORE(e->seat, seat);
+    BT_STORE(e->value, value);
+    __atomic_store_n(&e->sequence, position + 1, __ATOMIC_RELEASE);
+
+    if (0 == (position & (kEventSlots / 4 - 1))) {
+        checkEventConsumers(position);
+    }
+}
+
+
+/*
+ * Maps an existing event bus for -E or returns NULL.
+ */
+struct btEventBus *openEventBus() {
+    struct stat st;
+
+    int fd = shm_open(eventsName, O_RDWR, 0);
+    if (-1 == fd || -1 == fstat(fd, &st)) {
+        fprintf(stderr, "cannot open event bus %s (error %d)\n", eventsName, errno);
+        return NULL;
+    }
+    struct btEventBus *bus = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == bus || BT_EVENTS_MAGIC != __atomic_load_n(&bus->magic, __ATOMIC_ACQUIRE) ||
+        BT_EVENTS_VERSION != bus->version ||
+        st.st_size < (off_t)(sizeof(*bus) + (size_t)bus->slots * sizeof(struct btEvent))) {
+        fprintf(stderr, "event bus %s is not usable\n", eventsName);
+        return NULL;
+    }
+    return bus;
+}
+
+
+/*
+ * Prints events from a running brainthrottle's bus as they arrive, like a
+ * downstream tool would consume them. With tracePath, records them there
+ * as a trace (see brainthrottle.h) instead.
+ */
+int tailEvents(const char *tracePath) {
+    static const char *types[] = { "?", "scroll", "penalty", "restore", "reverse", "key", "label" };
+    struct btTraceHeader header = { BT_TRACE_MAGIC, BT_TRACE_VERSION, sizeof(struct btTraceRecord), 0 };
+    struct btTraceRecord record;
+    struct btEvent event;
+    uint64_t lost = 0;
+    FILE *trace = NULL;
+
+    struct btEventBus *bus = openEventBus();
+    if (NULL == bus) {
+        return -1;
+    }
+    if (tracePath && (NULL == (trace = fopen(tracePath, "w")) ||
+        1 != fwrite(&header, sizeof(header), 1, trace))) {
+        fprintf(stderr, "Error creating trace %s: %s\n", tracePath, strerror(errno));
+        return -1;
+    }
+    struct btEventConsumer *me = btEventsAttach(bus, getpid());
+    if (NULL == me) {
+        fprintf(stderr, "all %d event bus consumer slots are taken\n", BT_EVENTS_CONSUMERS);
+        return -1;
+    }
+    for (;;) {
+        while (trace && btEventsNext(bus, me, &event)) {
+            memset(&record, 0, sizeof(record));
+            record.time = event.time;
+            record.value = event.value > INT32_MAX ? INT32_MAX : event.value < INT32_MIN ? INT32_MIN : event.value;
+            record.seat = (uint16_t)event.seat;
+            record.type = (uint8_t)event.type;
+            fwrite(&record, sizeof(record), 1, trace);
+        }
+        while (!trace && btEventsNext(bus, me, &event)) {
+            printf("%llu.%06llu seat %d %s %lld\n",
+                (unsigned long long)(event.time / kNsecPerSec),
+                (unsigned long long)(event.time % kNsecPerSec / 1000), event.seat,
+                types[event.type >= BT_EVENT_SCROLL && event.type <= BT_EVENT_LABEL ? event.type : 0],
+                (long long)event.value);
+        }
+        if (BT_LOAD(me->lost) != lost) {
+            lost = BT_LOAD(me->lost);
+            fprintf(trace ? stderr : stdout, "(%llu events lost so far)\n", (unsigned long long)lost);
+        }
+        fflush(trace ? trace : stdout);
+        usleep(10000);
+    }
+}
+
+
+/*
+ * Prints a detector message, prefixed with the detector's name if it has
+ * one. Quiet while benchmarking.
+ */
+void logDetector(struct detector *d, const char *message) {
+    if (simulateDisplay) {
+        return;
+    }
+    if (d->name) {
+        printf("%s: %s\n", d->name, message);
+    } else {
+        printf("%s\n", message);
+    }
+}
+
+
+/*
+ * Allocates a detector's gap and burst sketches.
+ */
+struct detectorSketches *newSketches() {
+    struct detectorSketches *k = calloc(1, sizeof(struct detectorSketches));
+    if (NULL == k) {
+        fprintf(stderr, "Error allocating sketches; bailing\n");
+        exit(-1);
+    }
+    return k;
+}
+
+
+/*
+ * Adds one scroll event to recentScrollTotal, resetting the count first if
+ * restoreTimeoutSec seconds have elapsed since the last scroll. Returns true
+ * if skimming is detected.
+ */
+bool updateScrollTotal(struct detector *d, uint64_t now, int64_t scrollDiff) {
+    if ((now - d->lastScrollTime) > config->restoreTimeoutSec * kNsecPerSec) {
+        logDetector(d, "Resetting scroll counter");
+        if (d->sketches && d->recentScrollTotal > 0) {
+            btSketchAdd(&d->sketches->bursts, (uint64_t)d->recentScrollTotal);
+        }
+        d->recentScrollTotal = scrollDiff;
+    } else {
+        d->recentScrollTotal += scrollDiff;
+    }
+    d->lastScrollTime = now;
+
+    return d->recentScrollTotal >= config->scrollThreshold;
+}
+
+
+/*
+ * Counts one scroll event, direction being the sign of its vertical motion
+ * (0 if none), and if the configured detector finds skimming starts or
+ * extends the penalty. Returns true if the screen should be dimmed;
+ * firstDim is set if this is the penalty's first dim. Must be called
+ * inside a batch.
+ */
+bool detectScroll(struct detector *d, uint64_t now, int64_t scrollDiff, int direction,
+        bool *firstDim) {
+    bool reversed = direction && d->direction && direction != d->direction;
+
+    if (direction) {
+        d->direction = direction;
+    }
+    if (reversed) {
+        publishEvent(BT_EVENT_REVERSE, d->id, now, direction);
+    }
+    publishEvent(BT_EVENT_SCROLL, d->id, now, scrollDiff);
+    if (historyDir || telemetryAddress) {
+        if (now >= d->activityDeadline) {
+            recordActivity(d, now);
+        }
+        d->activityEvents++;
+        d->activityVolume += scrollDiff;
+    }
+    if (d->sketches) {
+        struct detectorSketches *k = d->sketches;
+        if (k->lastScrollTime && now >= k->lastScrollTime) {
+            btSketchAdd(&k->gaps, (now - k->lastScrollTime) / kNsecPerUsec);
+        }
+        k->lastScrollTime = now;
+    }
+    if (kDetectorModel == config->detector) {
+        btModelAdd(&d->window, now / kNsecPerUsec, scrollDiff < INT32_MAX ? (uint32_t)scrollDiff : INT32_MAX,
+            reversed ? BT_MODEL_REVERSE : 0);
+    }
+    if (config->paused) {
+        return false;
+    }
+
+
+    // The model detector still keeps recentScrollTotal for the status page
+
+    bool skimming = updateScrollTotal(d, now, scrollDiff);
+    if (kDetectorModel == config->detector) {
+        int32_t features[BT_MODEL_FEATURES];
+        skimming = btModelFeatures(&d->window, features) && btModelScore(&config->model, features) > 0;
+    }
+    if (!skimming) {
+        publishDetector(d);
+        return false;
+    }
+
+    d->penaltyDeadline = now + config->penaltyTimeoutSec * kNsecPerSec;
+    if (!d->penalized) {
+        logDetector(d, "Skimming detected.");
+        publishEvent(BT_EVENT_PENALTY, d->id, now, d->recentScrollTotal);
+        d->penalized = true;
+        d->penaltyStart = now;
+        d->peakScrollTotal = 0;
+        d->penaltyScrolls = 0;
+    }
+    d->penaltyScrolls++;
+    if (d->recentScrollTotal > d->peakScrollTotal) {
+        d->peakScrollTotal = d->recentScrollTotal;
+    }
+    publishDetector(d);
+
+
+    // With no actuator the penalty is only logged and published
+
+    if (kActuatorNone == config->actuator) {
+        return false;
+    }
+    *firstDim = !d->dimmed;
+    d->dimmed = true;
+    return true;
+}
+
+
+/*
+ * Counts a navigation key press. Keys only feed the model detector's
+ * window; decisions are made on scrolls. Must be called inside a batch.
+ */
+void detectKey(struct detector *d, uint64_t now) {
+    publishEvent(BT_EVENT_KEY, d->id, now, 0);
+    if (kDetectorModel == config->detector) {
+        btModelAdd(&d->window, now / kNsecPerUsec, 0, BT_MODEL_KEY);
+    }
+}
+
+
+/*
+ * Returns when the detector next needs expirePenalty: its penalty deadline
+ * or the end of a minute with activity still to be rolled up. 0 if never.
+ */
+uint64_t detectorDeadline(const struct detector *d) {
+    uint64_t deadline = d->penalized ? d->penaltyDeadline : 0;
+    if (d->activityEvents && (0 == deadline || d->activityDeadline < deadline)) {
+        deadline = d->activityDeadline;
+    }
+    return deadline;
+}
+
+
+/*
+ * Ends the penalty if its deadline has passed, and hands over the last
+ * minute's activity once it is over. Returns true if the screen was dimmed
+ * and should be restored.
+ */
+bool expirePenalty(struct detector *d, uint64_t now) {
+    if (d->activityEvents && now >= d->activityDeadline) {
+        recordActivity(d, now);
+    }
+    if (!d->penalized || now < d->penaltyDeadline) {
+        return false;
+    }
+    bool dimmed = d->dimmed;
+    recordEpisode(d, now);
+    d->penalized = false;
+    d->dimmed = false;
+    d->lastScrollTime = 0;
+    publishDetector(d);
+    publishEvent(BT_EVENT_RESTORE, d->id, now, 0);
+    return dimmed;
+}
+
+
+/*
+ * Batch detection
+ *
+ * Replaying a trace (-Z) runs millions of scrolls through detectors with
+ * nothing to dim and nothing to publish. detectBatch takes them as arrays
+ * and makes the same decisions replayScroll makes one scroll at a time. On
+ * x86-64 CPUs with AVX2 it takes four scrolls per step: their scrollDiffs,
+ * gap resets and running totals come out of a prefix sum over the four,
+ * and the step is committed at once unless one of them crosses the
+ * threshold, or, while penalized, resets the count or outlives the
+ * penalty. Those steps, a small fraction, go through replayScroll.
+ */
+#define kBatchEvents 4096               // Scrolls per detectBatch call when replaying
+
+#ifdef __x86_64__
+bool batchAvx2;                         // detectBatch may use AVX2, see initBatchDetector
+int32_t batchBases[16][8] __attribute__((aligned(32)));  // By resets: lanes of the sums to subtract
+int64_t batchResets[16][4] __attribute__((aligned(32))); // By resets: lanes with a reset at or before them
+#endif
+
+
+/*
+ * Counts one replayed scroll the way the live detector would: a penalty
+ * past its deadline ends first, as its timer would have ended it, then the
+ * scroll is counted. Returns true if the scroll is over the threshold, and
+ * increments *penalties if it started a penalty. Must be called inside a
+ * batch.
+ */
+bool replayScroll(struct detector *d, uint64_t now, int64_t scrollDiff, uint32_t *penalties) {
+    if (d->penalized && now >= d->penaltyDeadline) {
+        d->penalized = false;
+        d->lastScrollTime = 0;
+    }
+    if (!updateScrollTotal(d, now, scrollDiff)) {
+        return false;
+    }
+    d->penaltyDeadline = now + config->penaltyTimeoutSec * kNsecPerSec;
+    if (!d->penalized) {
+        d->penalized = true;
+        d->penaltyStart = now;
+        (*penalties)++;
+    }
+    return true;
+}
+
+
+#ifdef __x86_64__
+/*
+ * Sets batchAvx2 and, for each pattern of resets among four scrolls (one
+ * bit per scroll), which scroll's running sum each scroll's total starts
+ * after and whether there is one.
+ */
+void initBatchDetector() {
+    batchAvx2 = __builtin_cpu_supports("avx2");
+    for (int mask = 0; mask < 16; mask++) {
+        int latest = -1;
+        for (int i = 0; i < 4; i++) {
+            latest = mask & (1 << i) ? i : latest;
+            batchBases[mask][2 * i] = latest > 0 ? 2 * latest : 0;
+            batchBases[mask][2 * i + 1] = latest > 0 ? 2 * latest + 1 : 1;
+            batchResets[mask][i] = latest >= 0 ? -1 : 0;
+        }
+    }
+}
+
+
+/*
+ * Commits the four scrolls at times, given the time of the scroll before
+ * each and the penalty deadline it left, and carries the last one's total
+ * in *total. Returns false, changing nothing, if the step has to go
+ * through replayScroll. restore is restoreTimeoutSec in nanoseconds with
+ * the sign bit flipped.
+ */
+static inline __attribute__((always_inline, target("avx2")))
+bool detectStepAvx2(const uint64_t *times, const int32_t *dx, const int32_t *dy, __m256i before,
+    __m256i deadlines, __m256i restore, __m256i threshold, bool penalized, __m256i *total,
+    uint8_t *decisions) {
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+
+
+    // scrollDiff = 1 + |dx| + |dy|; |INT32_MIN| fits once widened
+
+    __m256i ax = _mm256_cvtepu32_epi64(_mm_abs_epi32(_mm_loadu_si128((const __m128i *)dx)));
+    __m256i ay = _mm256_cvtepu32_epi64(_mm_abs_epi32(_mm_loadu_si128((const __m128i *)dy)));
+    __m256i diff = _mm256_add_epi64(_mm256_set1_epi64x(1), _mm256_add_epi64(ax, ay));
+
+
+    // Resets: more than restoreTimeoutSec since the scroll before, as
+    // an unsigned compare
+
+    __m256i t = _mm256_loadu_si256((const __m256i *)times);
+    __m256i reset = _mm256_cmpgt_epi64(_mm256_xor_si256(_mm256_sub_epi64(t, before), sign), restore);
+    int resets = _mm256_movemask_pd(_mm256_castsi256_pd(reset));
+    if (penalized && resets) {
+        return false;
+    }
+
+
+    // Running sums within the step. A scroll's total is its sum less
+    // the sum before the latest reset at or before it, or, with no
+    // such reset, its sum plus the total carried in. Most steps have no
+    // reset, and skip the lookup.
+
+    __m256i sums = _mm256_add_epi64(diff, _mm256_blend_epi32(
+        _mm256_permute4x64_epi64(diff, 0x90), _mm256_setzero_si256(), 0x03));
+    sums = _mm256_add_epi64(sums, _mm256_blend_epi32(
+        _mm256_permute4x64_epi64(sums, 0x40), _mm256_setzero_si256(), 0x0f));
+    __m256i totals = _mm256_add_epi64(sums, *total);
+    if (resets) {
+        __m256i bases = _mm256_permutevar8x32_epi32(_mm256_sub_epi64(sums, diff),
+            _mm256_load_si256((const __m256i *)batchBases[resets]));
+        __m256i carried = _mm256_load_si256((const __m256i *)batchResets[resets]);
+        totals = _mm256_add_epi64(_mm256_sub_epi64(sums, _mm256_and_si256(carried, bases)),
+            _mm256_andnot_si256(carried, *total));
+    }
+
+
+    // Not penalized: commit if none crosses the threshold. Penalized:
+    // commit if none resets and each comes before the deadline the
+    // scroll before it set.
+
+    if (!penalized) {
+        if (-1 != _mm256_movemask_epi8(_mm256_cmpgt_epi64(threshold, totals))) {
+            return false;
+        }
+        memset(decisions, 0, 4);
+    } else {
+        __m256i live = _mm256_cmpgt_epi64(_mm256_xor_si256(deadlines, sign), _mm256_xor_si256(t, sign));
+        if (-1 != _mm256_movemask_epi8(live)) {
+            return false;
+        }
+        memset(decisions, 1, 4);
+    }
+    *total = _mm256_permute4x64_epi64(totals, 0xff);
+    return true;
+}
+
+
+/*
+ * detectRunAvx2 for a detector that is or isn't penalized. Inlined with
+ * penalized constant, so each loop only tests its own case, and with the
+ * first step peeled off, as the only one whose scroll before isn't in
+ * times.
+ */
+static inline __attribute__((always_inline, target("avx2")))
+size_t detectStepsAvx2(struct detector *d, const uint64_t *times, const int32_t *dx,
+    const int32_t *dy, size_t count, uint8_t *decisions, bool penalized) {
+    const uint64_t penaltyNs = config->penaltyTimeoutSec * kNsecPerSec;
+    const __m256i restore = _mm256_set1_epi64x((int64_t)(config->restoreTimeoutSec * kNsecPerSec) ^ INT64_MIN);
+    const __m256i penalty = _mm256_set1_epi64x((int64_t)penaltyNs);
+    const __m256i threshold = _mm256_set1_epi64x(config->scrollThreshold);
+    __m256i total = _mm256_set1_epi64x(d->recentScrollTotal);
+    size_t i = 0;
+
+    if (count < 4) {
+        return 0;
+    }
+
+
+    // The first step's first scroll comes after d's last one, and has
+    // d's deadline to beat
+
+    __m256i t = _mm256_loadu_si256((const __m256i *)times);
+    __m256i before = _mm256_blend_epi32(_mm256_permute4x64_epi64(t, 0x90),
+        _mm256_set1_epi64x((int64_t)d->lastScrollTime), 0x03);
+    __m256i deadlines = _mm256_blend_epi32(_mm256_add_epi64(before, penalty),
+        _mm256_set1_epi64x((int64_t)d->penaltyDeadline), 0x03);
+    if (!detectStepAvx2(times, dx, dy, before, deadlines, restore, threshold, penalized, &total,
+        decisions)) {
+        return 0;
+    }
+    for (i = 4; i + 4 <= count; i += 4) {
+        before = _mm256_loadu_si256((const __m256i *)&times[i - 1]);
+        if (!detectStepAvx2(&times[i], &dx[i], &dy[i], before, _mm256_add_epi64(before, penalty),
+            restore, threshold, penalized, &total, &decisions[i])) {
+            break;
+        }
+    }
+
+    d->recentScrollTotal = _mm256_extract_epi64(total, 0);
+    d->lastScrollTime = times[i - 1];
+    if (penalized) {
+        d->penaltyDeadline = times[i - 1] + penaltyNs;
+    }
+    return i;
+}
+
+
+/*
+ * Commits scrolls four at a time for as long as none of them needs
+ * replayScroll (see above). Returns how many were committed.
+ */
+__attribute__((target("avx2")))
+size_t detectRunAvx2(struct detector *d, const uint64_t *times, const int32_t *dx,
+    const int32_t *dy, size_t count, uint8_t *decisions) {
+
+
+    // While penalized, only scrolls that extend the penalty are committed,
+    // and with no reset they all do once the total is over the threshold.
+    // (Totals are never negative, but the sums below rely on it.)
+
+    if (d->recentScrollTotal < 0) {
+        return 0;
+    }
+    if (d->penalized) {
+        if (d->recentScrollTotal < config->scrollThreshold) {
+            return 0;
+        }
+        return detectStepsAvx2(d, times, dx, dy, count, decisions, true);
+    }
+    return detectStepsAvx2(d, times, dx, dy, count, decisions, false);
+}
+#endif
+
+
+/*
+ * Counts count scrolls, given as times and axis deltas, exactly as that
+ * many replayScroll calls would, setting decisions[i] to 1 where scroll i
+ * is over the threshold. Returns the number of penalties started. Must be
+ * called inside a batch.
+ */
+uint32_t detectBatch(struct detector *d, const uint64_t *times, const int32_t *dx,
+    const int32_t *dy, size_t count, uint8_t *decisions) {
+    uint32_t penalties = 0;
+
+    if (config->paused) {
+        memset(decisions, 0, count);
+        return 0;
+    }
+    for (size_t i = 0; i < count; ) {
+        size_t end = count;
+#ifdef __x86_64__
+        if (batchAvx2) {
+            i += detectRunAvx2(d, &times[i], &dx[i], &dy[i], count - i, &decisions[i]);
+            end = i + 4 < count ? i + 4 : count;
+        }
+#endif
+
+
+        // The step the vector path stopped at (or everything, without it)
+
+        for (; i < end; i++) {
+            decisions[i] = replayScroll(d, times[i], 1 + llabs(dx[i]) + llabs(dy[i]), &penalties);
+        }
+    }
+    return penalties;
+}
+
+
+/*
+ * Returns brightness dimmed in proportion to scrollDiff.
+ */
+float dimmedBrightness(float brightness, int64_t scrollDiff) {
+    float penalty = brightness - (brightness * (float)scrollDiff/100);
+    if (penalty < 0.05) {
+        penalty = 0.0;
+    }
+    return penalty;
+}
+
+
+/*
+ * Dims the screen in proportion to scrollDiff. If this is the first dim of
+ * a penalty, the current brightness is saved for restoring later.
+ */
+void dimBrightness(bool firstDim, int64_t scrollDiff) {
+    float brightness = getBrightness();
+    if (firstDim) {
+        prevBrightness = brightness;
+    }
+    float target = dimmedBrightness(brightness, scrollDiff);
+    setBrightness(target);
+    publishBrightness(mainDetector.status, target, target, prevBrightness);
+}
+
+
+/*
+ * Restores the screen to its brightness before the penalty.
+ */
+void restoreBrightness() {
+    setBrightness(prevBrightness);
+    publishBrightness(mainDetector.status, prevBrightness, prevBrightness, -1);
+}
+
+
+/*
+ * Sets the penalty timer for the main detector's penalty deadline. On OSX
+ * it is a run loop timer, so handleTimeout runs with the EventTap rather
+ * than in a signal handler; before the run loop exists, and elsewhere, it
+ * is ITIMER_REAL.
+ */
+void setPenaltyTimer(uint64_t now) {
+    uint64_t left = mainDetector.penaltyDeadline > now ? mainDetector.penaltyDeadline - now : 1000;
+#ifdef __APPLE__
+    if (penaltyTimer) {
+        CFRunLoopTimerSetNextFireDate(penaltyTimer, CFAbsoluteTimeGetCurrent() + (double)left / kNsecPerSec);
+        return;
+    }
+#endif
+    struct itimerval timerValue;
+    memset(&timerValue, 0, sizeof(timerValue));
+    timerValue.it_value.tv_sec = left / kNsecPerSec;
+    timerValue.it_value.tv_usec = (left % kNsecPerSec + kNsecPerUsec - 1) / kNsecPerUsec;
+    if (-1 == setitimer(ITIMER_REAL, &timerValue, NULL)) {
+        fprintf(stderr, "Error setting timer\n");
+    }
+}
+
+
+/*
+ * Disarms the penalty timer.
+ */
+void clearPenaltyTimer() {
+#ifdef __APPLE__
+    if (penaltyTimer) {
+        CFRunLoopTimerSetNextFireDate(penaltyTimer, CFAbsoluteTimeGetCurrent() + kPenaltyTimerIdleSec);
+        return;
+    }
+#endif
+    struct itimerval timerValue;
+    memset(&timerValue, 0, sizeof(timerValue));
+    if (-1 == setitimer(ITIMER_REAL, &timerValue, NULL)) {
+         fprintf(stderr, "Error clearing timer; bailing\n");
+         exit(-1);
+    }
+}
+
+
+/*
+ * Runs the single-threaded skim logic for one scroll event: counts the
+ * scroll, and once skimming is detected starts the penalty timer and dims
+ * the screen. Scrolls that extend a penalty leave the timer alone; when it
+ * fires early, handleTimeout sets it again for the rest.
+ */
+void processScroll(uint64_t now, int64_t scrollX, int64_t scrollY) {
+    int64_t scrollDiff = 1 + llabs(scrollX) + llabs(scrollY);
+    uint64_t deadline = mainDetector.penaltyDeadline;
+    bool penalized = mainDetector.penalized;
+    bool firstDim;
+
+    beginBatch();
+    bool dim = detectScroll(&mainDetector, now, scrollDiff, (scrollY > 0) - (scrollY < 0), &firstDim);
+
+
+    // If skimming not detected (yet), nothing to do, just return
+
+    if (mainDetector.penaltyDeadline == deadline) {
+        endBatch();
+        return;
+    }
+
+
+    // Skimming detected: dim screen
+    // Start the penalty timer; the first dim of a penalty stores brightness
+
+    endBatch();
+    if (!penalized) {
+        setPenaltyTimer(now);
+    }
+
+    // Decrease screen brightness
+
+    if (dim) {
+        dimBrightness(firstDim, scrollDiff);
+    }
+}
+
+
+/*
+ * Pipeline rings
+ *
+ * A ring is a bounded lock-free single-producer/single-consumer queue of
+ * fixed-size slots. head and tail are free-running counters on separate
+ * cache lines. A consumer with nothing to do sleeps on a waiter; producers
+ * only touch the waiter's lock when the consumer is actually asleep.
+ */
+#define kRingSlots 1024                 // Slots per ring, power of two
+#define kMaxIngestGroups 4              // Ingest threads feeding the detector
+
+struct waiter {
+    _Atomic bool sleeping;              // Consumer is (about to be) asleep
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct ring {
+    _Atomic uint32_t head;              // Next slot to fill (producer)
+    char headPad[60];
+    _Atomic uint32_t tail;              // Next slot to drain (consumer)
+    char tailPad[60];
+    _Atomic uint32_t highWater;         // Most slots ever occupied at once
+    _Atomic uint64_t dropped;           // Pushes refused because ring was full
+    struct waiter *consumer;            // Woken when a push lands
+    size_t slotSize;
+    char *slots;
+};
+
+
+/*
+ * Initializes a waiter with no sleeping consumer.
+ */
+void initWaiter(struct waiter *w) {
+    atomic_init(&w->sleeping, false);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+}
+
+
+/*
+ * Allocates the slots for a ring whose consumer sleeps on w.
+ */
+void initRing(struct ring *r, size_t slotSize, struct waiter *w) {
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->highWater, 0);
+    atomic_init(&r->dropped, 0);
+    r->consumer = w;
+    r->slotSize = slotSize;
+    r->slots = calloc(kRingSlots, slotSize);
+    if (NULL == r->slots) {
+        fprintf(stderr, "Error allocating ring; bailing\n");
+        exit(-1);
+    }
+}
+
+
+/*
+ * Returns the number of occupied slots. Exact only on the consumer side.
+ */
+uint32_t ringOccupancy(struct ring *r) {
+    return atomic_load_explicit(&r->head, memory_order_acquire) -
+        atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+
+/*
+ * Wakes the consumer sleeping on w, if any.
+ */
+void wakeWaiter(struct waiter *w) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&w->sleeping, memory_order_relaxed)) {
+        pthread_mutex_lock(&w->lock);
+        atomic_store_explicit(&w->sleeping, false, memory_order_relaxed);
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+
+/*
+ * Copies item into the ring. Never blocks: returns false and counts a drop
+ * if the ring is full. Producer side only.
+ */
+bool ringPush(struct ring *r, const void *item) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    uint32_t used = head - tail;
+
+    if (used >= kRingSlots) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+    memcpy(r->slots + (head & (kRingSlots - 1)) * r->slotSize, item, r->slotSize);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+    if (used + 1 > atomic_load_explicit(&r->highWater, memory_order_relaxed)) {
+        atomic_store_explicit(&r->highWater, used + 1, memory_order_relaxed);
+    }
+    wakeWaiter(r->consumer);
+    return true;
+}
+
+
+/*
+ * Copies the oldest item out of the ring. Returns false if the ring is
+ * empty. Consumer side only.
+ */
+bool ringPop(struct ring *r, void *item) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    if (head == tail) {
+        return false;
+    }
+    memcpy(item, r->slots + (tail & (kRingSlots - 1)) * r->slotSize, r->slotSize);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+
+/*
+ * Returns true if all numRings rings are empty.
+ */
+bool ringsEmpty(struct ring **rings, int numRings) {
+    for (int i = 0; i < numRings; i++) {
+        if (atomic_load_explicit(&rings[i]->head, memory_order_acquire) !=
+            atomic_load_explicit(&rings[i]->tail, memory_order_relaxed)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Sleeps on w until one of rings gets an item or the monotonic deadline
+ * passes (0 = no deadline). Consumer side only.
+ */
+void waitForRings(struct waiter *w, struct ring **rings, int numRings, uint64_t deadline) {
+    atomic_store(&w->sleeping, true);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!ringsEmpty(rings, numRings)) {
+        atomic_store(&w->sleeping, false);
+        return;
+    }
+
+    struct timespec abstime;
+    if (deadline) {
+        uint64_t now = nowNs();
+        uint64_t delay = deadline > now ? deadline - now : 0;
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        uint64_t wake = (uint64_t)tv.tv_sec * kNsecPerSec + tv.tv_usec * kNsecPerUsec + delay;
+        abstime.tv_sec = wake / kNsecPerSec;
+        abstime.tv_nsec = wake % kNsecPerSec;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while (atomic_load(&w->sleeping) && ringsEmpty(rings, numRings)) {
+        if (!deadline) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        } else if (ETIMEDOUT == pthread_cond_timedwait(&w->cond, &w->lock, &abstime)) {
+            break;
+        }
+    }
+    atomic_store(&w->sleeping, false);
+    pthread_mutex_unlock(&w->lock);
+}
+
+
+/*
+ * Event merge
+ *
+ * A detector fed by several sources (a seat's wheels, keyboards and
+ * ingestion sockets, or the pipeline's ingest groups) gets each source's
+ * events in order, but not in order across sources: a worker reads one
+ * device dry before the next, and sockets lag. Gap logic such as
+ * (now - lastScrollTime) needs one ordered stream, so events are queued
+ * per source and released oldest first from a min-heap of the sources
+ * keyed by their oldest queued event, O(log k) per event for k sources.
+ *
+ * An event is released once no source can still send an older one: every
+ * source has sent something newer, or kReorderWindowNs has passed since
+ * it happened. An event that turns up after newer ones were released
+ * anyway is late; it is released at once with the newest time released
+ * so far, so time never runs backwards for the detector. Queues are
+ * allocated when a source is added, never per event, and a full queue
+ * releases the merge's oldest events early until it has room.
+ */
+#define kMergeSources 16                // Sources per merge
+#define kMergeQueue 32                  // Events queued per source, a power of two
+const uint64_t kReorderWindowNs = 5 * 1000 * 1000;
+
+struct mergeEvent {
+    uint64_t time;
+    int64_t scrollX;
+    int64_t scrollY;
+    bool key;                           // A navigation key, not a scroll
+};
+
+struct mergeSource {
+    uint64_t lastTime;                  // Newest event queued so far
+    uint32_t head;                      // Next slot to fill
+    uint32_t tail;                      // Oldest queued event
+    struct mergeEvent events[kMergeQueue];
+};
+
+typedef void (*mergeHandler)(void *context, const struct mergeEvent *event);
+
+struct merge {
+    struct mergeSource *sources[kMergeSources]; // NULL if free
+    int numSources;
+    int heap[kMergeSources];            // Sources with queued events, min-heap by oldest event
+    int heapSize;
+    uint64_t released;                  // Time of the newest event released
+    uint64_t newest;                    // Newest event seen from any source
+    mergeHandler handler;               // Gets each released event
+    void *context;
+    _Atomic uint64_t reordered;         // Events that arrived after a newer one
+    _Atomic uint64_t late;              // ... after a newer one was already released
+};
+
+
+/*
+ * Returns the time of the oldest event queued by the source at heap
+ * position i.
+ */
+static inline uint64_t mergeKey(const struct merge *m, int i) {
+    const struct mergeSource *s = m->sources[m->heap[i]];
+    return s->events[s->tail & (kMergeQueue - 1)].time;
+}
+
+
+/*
+ * Moves the heap entry at i down until its children are newer.
+ */
+void mergeSiftDown(struct merge *m, int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < m->heapSize && mergeKey(m, left) < mergeKey(m, smallest)) {
+            smallest = left;
+        }
+        if (right < m->heapSize && mergeKey(m, right) < mergeKey(m, smallest)) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        int swap = m->heap[i];
+        m->heap[i] = m->heap[smallest];
+        m->heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+
+/*
+ * Adds source to the heap.
+ */
+void mergeHeapPush(struct merge *m, int source) {
+    int i = m->heapSize++;
+    m->heap[i] = source;
+    while (i > 0 && mergeKey(m, i) < mergeKey(m, (i - 1) / 2)) {
+        int swap = m->heap[i];
+        m->heap[i] = m->heap[(i - 1) / 2];
+        m->heap[(i - 1) / 2] = swap;
+        i = (i - 1) / 2;
+    }
+}
+
+
+/*
+ * Hands the oldest queued event to the handler.
+ */
+void mergeReleaseOldest(struct merge *m) {
+    struct mergeSource *s = m->sources[m->heap[0]];
+    struct mergeEvent event = s->events[s->tail++ & (kMergeQueue - 1)];
+
+    if (s->tail == s->head) {
+        m->heap[0] = m->heap[--m->heapSize];
+    }
+    mergeSiftDown(m, 0);
+    if (event.time < m->released) {
+        atomic_fetch_add_explicit(&m->late, 1, memory_order_relaxed);
+        event.time = m->released;
+    }
+    m->released = event.time;
+    m->handler(m->context, &event);
+}
+
+
+/*
+ * Releases every queued event no source can still send an older event
+ * than, and with force everything queued. now is nowNs().
+ */
+void mergeRelease(struct merge *m, uint64_t now, bool force) {
+    uint64_t watermark = now > kReorderWindowNs ? now - kReorderWindowNs : 0;
+    uint64_t oldestLast = UINT64_MAX;
+
+    for (int i = 0; i < m->numSources; i++) {
+        if (m->sources[i] && m->sources[i]->lastTime < oldestLast) {
+            oldestLast = m->sources[i]->lastTime;
+        }
+    }
+    if (oldestLast > watermark) {
+        watermark = oldestLast;
+    }
+    while (m->heapSize > 0 && (force || mergeKey(m, 0) <= watermark)) {
+        mergeReleaseOldest(m);
+    }
+}
+
+
+/*
+ * Returns when mergeRelease next has an event to release, 0 if none is
+ * queued.
+ */
+uint64_t mergeDeadline(const struct merge *m) {
+    return m->heapSize > 0 ? mergeKey(m, 0) + kReorderWindowNs : 0;
+}
+
+
+/*
+ * Queues an event from source, or hands it straight on when there is
+ * nothing to merge it with. Never allocates.
+ */
+void mergePush(struct merge *m, int source, const struct mergeEvent *event) {
+    struct mergeEvent copy = *event;
+
+    if (copy.time < m->newest) {
+        atomic_fetch_add_explicit(&m->reordered, 1, memory_order_relaxed);
+    } else {
+        m->newest = copy.time;
+    }
+    if (copy.time < m->released) {
+        atomic_fetch_add_explicit(&m->late, 1, memory_order_relaxed);
+        copy.time = m->released;
+    }
+    if (m->numSources < 2 || source < 0) {
+        m->released = copy.time;
+        m->handler(m->context, &copy);
+        return;
+    }
+
+    struct mergeSource *s = m->sources[source];
+    while (s->head - s->tail == kMergeQueue) {
+        mergeReleaseOldest(m);
+    }
+    s->events[s->head++ & (kMergeQueue - 1)] = copy;
+    if (copy.time > s->lastTime) {
+        s->lastTime = copy.time;
+    }
+    if (s->head - s->tail == 1) {
+        mergeHeapPush(m, source);
+    }
+}
+
+
+/*
+ * Adds a source. Returns its index, or -1 if the merge is full or out of
+ * memory, in which case the source's events go straight to the handler.
+ * Not for the hot path: allocates the source's queue.
+ */
+int mergeAddSource(struct merge *m) {
+    for (int i = 0; i < kMergeSources; i++) {
+        if (NULL == m->sources[i]) {
+            m->sources[i] = calloc(1, sizeof(struct mergeSource));
+            if (NULL == m->sources[i]) {
+                return -1;
+            }
+            if (i >= m->numSources) {
+                m->numSources = i + 1;
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Removes a source, first releasing everything queued.
+ */
+void mergeRemoveSource(struct merge *m, int source) {
+    if (source < 0) {
+        return;
+    }
+    mergeRelease(m, 0, true);
+    free(m->sources[source]);
+    m->sources[source] = NULL;
+    while (m->numSources > 0 && NULL == m->sources[m->numSources - 1]) {
+        m->numSources--;
+    }
+}
+
+
+/*
+ * Pipeline messages and state
+ */
+struct scrollEvent {
+    uint64_t time;                      // When the ingest thread saw it (ns)
+    int64_t scrollX;
+    int64_t scrollY;
+};
+
+enum { kCommandDim, kCommandRestore, kCommandChanged };
+
+struct brightnessCommand {
+    uint64_t eventTime;                 // Ingest time of the triggering event
+    int op;                             // kCommand*
+    bool firstDim;                      // Save prevBrightness before dimming
+    int64_t scrollDiff;                 // Dim amount, see dimBrightness; raw brightness if changed
+    int seat;                           // Seat index (helper commands)
+};
+
+#define kLatencyBuckets 40              // Power-of-two ns buckets, up to ~9 min
+
+struct stageStats {
+    _Atomic uint64_t count;
+    _Atomic uint64_t totalNs;
+    _Atomic uint64_t maxNs;
+    _Atomic uint64_t buckets[kLatencyBuckets]; // Samples < 2^(i+1) ns
+};
+
+struct waiter detectorWaiter;
+struct waiter actuatorWaiter;
+struct ring ingestRings[kMaxIngestGroups]; // Ingest group -> detector
+struct ring *detectorRings[kMaxIngestGroups];
+int numIngestGroups = 1;
+struct ring commandRing;                // Detector -> actuator
+_Atomic uint64_t processedEvents;       // Events the detector has consumed
+struct merge pipelineMerge;             // Ingest groups in time order, with several groups
+
+struct stageStats ingestStats;          // Time spent in the EventTap callback
+struct stageStats detectStats;          // Event ingest until detector done
+struct stageStats actuateStats;         // Event ingest until display updated
+struct stageStats wakeupStats;          // Input thread wakeup lateness (-j)
+
+int cpuIngest = -1;                     // CPU to pin each stage to (-c)
+int cpuDetector = -1;
+int cpuActuator = -1;
+int realtimePriority = 0;               // SCHED_FIFO priority for ingest (-r)
+bool lowLatency = false;                // True if running with -l
+_Atomic int configuredThreads;          // Pipeline threads past configureThread
+
+
+/*
+ * Adds one latency sample to a stage's stats. Each stage has one writer.
+ */
+void recordLatency(struct stageStats *s, uint64_t ns) {
+    atomic_fetch_add_explicit(&s->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->totalNs, ns, memory_order_relaxed);
+    if (ns > atomic_load_explicit(&s->maxNs, memory_order_relaxed)) {
+        atomic_store_explicit(&s->maxNs, ns, memory_order_relaxed);
+    }
+
+    int bucket = 0;
+    while (bucket < kLatencyBuckets - 1 && (ns >> (bucket + 1))) {
+        bucket++;
+    }
+    atomic_fetch_add_explicit(&s->buckets[bucket], 1, memory_order_relaxed);
+}
+
+
+/*
+ * Returns an upper bound (in ns) on the given percentile of a stage's
+ * latency, from its power-of-two histogram.
+ */
+uint64_t stagePercentile(struct stageStats *s, double percentile) {
+    uint64_t count = atomic_load(&s->count);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < kLatencyBuckets; i++) {
+        seen += atomic_load_explicit(&s->buckets[i], memory_order_relaxed);
+        if (seen > 0 && seen >= count * percentile / 100) {
+            uint64_t bound = 2ULL << i;
+            uint64_t max = atomic_load(&s->maxNs);
+            return bound < max ? bound : max;
+        }
+    }
+    return atomic_load(&s->maxNs);
+}
+
+
+/*
+ * Prints one stage's latency summary.
+ */
+void printStage(const char *name, struct stageStats *s) {
+    uint64_t count = atomic_load(&s->count);
+    uint64_t total = atomic_load(&s->totalNs);
+    printf("  %-8s %10llu samples  avg %8.1f us  p99 < %8.1f us  max %8.1f us\n", name,
+        (unsigned long long)count,
+        count ? (double)total / count / kNsecPerUsec : 0.0,
+        (double)stagePercentile(s, 99) / kNsecPerUsec,
+        (double)atomic_load(&s->maxNs) / kNsecPerUsec);
+}
+
+
+/*
+ * Prints one ring's occupancy and drops.
+ */
+void printRing(const char *name, struct ring *r) {
+    printf("  %-8s %4u/%d slots used  high water %4u  dropped %llu\n", name,
+        ringOccupancy(r), kRingSlots, atomic_load(&r->highWater),
+        (unsigned long long)atomic_load(&r->dropped));
+}
+
+
+/*
+ * Prints ring occupancy and per-stage latency. Called on SIGUSR1 and exit.
+ */
+void printPipelineStats() {
+    char name[24];
+
+    printf("Pipeline stats:\n");
+    for (int i = 0; i < numIngestGroups; i++) {
+        snprintf(name, sizeof(name), "ingest%d", i);
+        printRing(name, &ingestRings[i]);
+    }
+    printRing("command", &commandRing);
+    if (numIngestGroups > 1) {
+        printf("  %-8s reordered %llu  late %llu\n", "merge",
+            (unsigned long long)atomic_load(&pipelineMerge.reordered),
+            (unsigned long long)atomic_load(&pipelineMerge.late));
+    }
+    printStage("ingest", &ingestStats);
+    printStage("detect", &detectStats);
+    printStage("actuate", &actuateStats);
+    fflush(stdout);
+}
+
+
+/*
+ * Pins the calling thread to cpu. On OSX this sets an affinity tag, which
+ * the scheduler treats as a hint. Returns 0 if pinned, -1 if only hinted,
+ * or an errno value.
+ */
+int pinThread(const char *name, int cpu) {
+#ifdef __APPLE__
+    thread_affinity_policy_data_t policy = { cpu + 1 };
+    kern_return_t err = thread_policy_set(pthread_mach_thread_np(pthread_self()),
+        THREAD_AFFINITY_POLICY, (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT);
+    if (err != KERN_SUCCESS) {
+        fprintf(stderr, "Failed to set %s thread affinity (error %d)\n", name, err);
+        return EINVAL;
+    }
+    return -1;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "Failed to pin %s thread to CPU %d (error %d)\n", name, cpu, err);
+        return err;
+    }
+    return 0;
+#endif
+}
+
+
+/*
+ * Low-latency mode (-l)
+ *
+ * Page faults and scheduler delays, not our own code, dominate the time
+ * between a scroll and the dim on a loaded machine. Low-latency mode locks
+ * and prefaults memory, preallocates the rings before any thread starts,
+ * optionally runs the input thread under SCHED_FIFO (-r) and pins threads
+ * (-c). Each step records whether it worked; printSelfCheck reports them.
+ */
+#define kMaxChecks 16
+#define kPrefaultStackBytes (256 * 1024)
+
+struct selfCheck {
+    char what[48];                      // Guarantee requested
+    char result[48];                    // "yes", "hint" or "no (why)"
+};
+
+struct selfCheck selfChecks[kMaxChecks];
+_Atomic int numSelfChecks;
+
+
+/*
+ * Records the outcome of one low-latency step. err is 0 on success, -1 if
+ * the platform only offers a hint, or an errno value.
+ */
+void recordCheck(int err, const char *format, ...) {
+    int i = atomic_fetch_add(&numSelfChecks, 1);
+    if (i >= kMaxChecks) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(selfChecks[i].what, sizeof(selfChecks[i].what), format, args);
+    va_end(args);
+    if (0 == err) {
+        snprintf(selfChecks[i].result, sizeof(selfChecks[i].result), "yes");
+    } else if (-1 == err) {
+        snprintf(selfChecks[i].result, sizeof(selfChecks[i].result), "hint only");
+    } else {
+        snprintf(selfChecks[i].result, sizeof(selfChecks[i].result), "no (%s)", strerror(err));
+    }
+}
+
+
+/*
+ * Prints which low-latency guarantees were obtained.
+ */
+void printSelfCheck() {
+    int n = atomic_load(&numSelfChecks);
+
+    printf("Low-latency self-check:\n");
+    for (int i = 0; i < n && i < kMaxChecks; i++) {
+        printf("  %-40s %s\n", selfChecks[i].what, selfChecks[i].result);
+    }
+    fflush(stdout);
+}
+
+
+/*
+ * Touches the calling thread's stack so later calls don't fault it in.
+ */
+void prefaultStack() {
+    volatile char stack[kPrefaultStackBytes];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+
+/*
+ * Locks current and future memory and keeps the allocator from handing
+ * pages back to the kernel. Called once, before any thread starts.
+ */
+void lockMemory() {
+    int err = 0;
+
+    if (-1 == mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        err = errno;
+    }
+    recordCheck(err, "memory locked (mlockall)");
+#ifdef __GLIBC__
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+#endif
+    prefaultStack();
+}
+
+
+/*
+ * Applies the low-latency settings for one thread: stack prefault, CPU
+ * pinning and, if priority > 0, SCHED_FIFO. Pins the thread even when not
+ * in low-latency mode if a CPU was given with -c.
+ */
+void configureThread(const char *name, int cpu, int priority) {
+    if (cpu >= 0) {
+        int err = pinThread(name, cpu);
+        if (lowLatency) {
+            recordCheck(err, "%s thread pinned to CPU %d", name, cpu);
+        }
+    }
+    if (!lowLatency) {
+        return;
+    }
+    prefaultStack();
+
+    if (priority > 0) {
+        struct sched_param param;
+        int policy;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (0 == err) {
+            err = pthread_getschedparam(pthread_self(), &policy, &param);
+            if (0 == err && (policy != SCHED_FIFO || param.sched_priority != priority)) {
+                err = EPERM;
+            }
+        }
+        recordCheck(err, "%s thread SCHED_FIFO priority %d", name, priority);
+    }
+}
+
+
+/*
+ * Waits until the detector and actuator threads have configured themselves,
+ * so their self-check results are in.
+ */
+void waitForPipelineThreads() {
+    while (atomic_load(&configuredThreads) < 2) {
+        sched_yield();
+    }
+}
+
+
+/*
+ * Hands a scroll event from ingest group to the detector. Never blocks.
+ */
+void ingestScroll(int group, uint64_t now, int64_t scrollX, int64_t scrollY) {
+    struct scrollEvent event = { now, scrollX, scrollY };
+    ringPush(&ingestRings[group], &event);
+    recordLatency(&ingestStats, nowNs() - now);
+}
+
+
+/*
+ * Runs the main detector on one pipeline event, in time order, and sends
+ * the actuator a dim if it calls for one. Runs on the detector thread.
+ */
+void detectPipelineEvent(void *context, const struct mergeEvent *event) {
+    struct brightnessCommand command;
+    int64_t scrollDiff = 1 + llabs(event->scrollX) + llabs(event->scrollY);
+
+    if (detectScroll(&mainDetector, event->time, scrollDiff,
+            (event->scrollY > 0) - (event->scrollY < 0), &command.firstDim)) {
+        command.eventTime = event->time;
+        command.op = kCommandDim;
+        command.scrollDiff = scrollDiff;
+
+        // Dims are dropped if the actuator is behind; a later dim or the
+        // restore will catch the display up
+
+        ringPush(&commandRing, &command);
+    }
+    recordLatency(&detectStats, nowNs() - event->time);
+    atomic_fetch_add_explicit(&processedEvents, 1, memory_order_release);
+}
+
+
+/*
+ * Detector thread. Drains the ingest rings, tracks recentScrollTotal and the
+ * penalty deadline, and sends dim/restore commands to the actuator. With
+ * several ingest groups their events are merged into time order first.
+ */
+void *detectorThread(void *arg) {
+    struct scrollEvent event;
+    struct brightnessCommand command;
+
+    configureThread("detector", cpuDetector, 0);
+    atomic_fetch_add(&configuredThreads, 1);
+    historyProducer = 1;
+    for (;;) {
+        bool busy = false;
+        beginBatch();
+
+
+        // Drain ingest rings, a batch at a time so no group starves another
+
+        for (int i = 0; i < numIngestGroups; i++) {
+            for (int n = 0; n < 64 && ringPop(&ingestRings[i], &event); n++) {
+                struct mergeEvent merged = { event.time, event.scrollX, event.scrollY, false };
+                busy = true;
+                mergePush(&pipelineMerge, i, &merged);
+            }
+        }
+        uint64_t now = nowNs();
+        mergeRelease(&pipelineMerge, now, false);
+
+
+        // Restore brightness once the penalty deadline passes. Restores
+        // must not be dropped, so wait for the actuator to make room.
+
+        if (expirePenalty(&mainDetector, now)) {
+            command.eventTime = now;
+            command.op = kCommandRestore;
+            while (!ringPush(&commandRing, &command)) {
+                sched_yield();
+            }
+        }
+
+        endBatch();
+        if (!busy) {
+            uint64_t deadline = detectorDeadline(&mainDetector);
+            uint64_t merge = mergeDeadline(&pipelineMerge);
+            if (merge && (0 == deadline || merge < deadline)) {
+                deadline = merge;
+            }
+            waitForRings(&detectorWaiter, detectorRings, numIngestGroups, deadline);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Actuator thread. Applies dim/restore commands to the display.
+ */
+void *actuatorThread(void *arg) {
+    struct ring *rings[1] = { &commandRing };
+    struct brightnessCommand command;
+
+    configureThread("actuator", cpuActuator, 0);
+    atomic_fetch_add(&configuredThreads, 1);
+    for (;;) {
+        while (ringPop(&commandRing, &command)) {
+            if (kCommandDim == command.op) {
+                dimBrightness(command.firstDim, command.scrollDiff);
+            } else {
+                restoreBrightness();
+            }
+            recordLatency(&actuateStats, nowNs() - command.eventTime);
+        }
+        waitForRings(&actuatorWaiter, rings, 1, 0);
+    }
+    return NULL;
+}
+
+
+/*
+ * Allocates the rings and starts the detector and actuator threads.
+ */
+void startPipeline() {
+    pthread_t thread;
+
+    initWaiter(&detectorWaiter);
+    initWaiter(&actuatorWaiter);
+    pipelineMerge.handler = &detectPipelineEvent;
+    for (int i = 0; i < numIngestGroups; i++) {
+        initRing(&ingestRings[i], sizeof(struct scrollEvent), &detectorWaiter);
+        detectorRings[i] = &ingestRings[i];
+        if (i != mergeAddSource(&pipelineMerge)) {
+            fprintf(stderr, "Error allocating merge queue; bailing\n");
+            exit(-1);
+        }
+    }
+    initRing(&commandRing, sizeof(struct brightnessCommand), &actuatorWaiter);
+
+
+    // Fault the ring pages in now rather than on the first burst
+
+    if (lowLatency) {
+        size_t bytes = kRingSlots * sizeof(struct brightnessCommand);
+        memset(commandRing.slots, 0, bytes);
+        for (int i = 0; i < numIngestGroups; i++) {
+            memset(ingestRings[i].slots, 0, kRingSlots * sizeof(struct scrollEvent));
+            bytes += kRingSlots * sizeof(struct scrollEvent);
+        }
+        recordCheck(0, "%zu KB of rings preallocated", bytes / 1024);
+    }
+
+    if (0 != pthread_create(&thread, NULL, &detectorThread, NULL) ||
+        0 != pthread_create(&thread, NULL, &actuatorThread, NULL)) {
+        fprintf(stderr, "Error starting pipeline threads; bailing\n");
+        exit(-1);
+    }
+    pipelineMode = true;
+}
+
+
+#ifdef __linux__
+/*
+ * Linux input
+ *
+ * Scroll wheels are read straight from evdev (/dev/input/event*). REL_WHEEL
+ * and REL_HWHEEL values are summed until SYN_REPORT, so one wheel frame is
+ * one scroll event, like an OSX scroll wheel event. Events carry the
+ * kernel's CLOCK_BOOTTIME timestamp, the clock nowNs() reads.
+ *
+ * A stuck or broken wheel can send tens of thousands of frames a second.
+ * An input sending more than eventBudget frames a second is switched to
+ * aggregated mode: its frames are summed over kOverloadIntervalNs and the
+ * handler gets one frame per interval. It switches back once it has stayed
+ * under half the budget for kCalmIntervals intervals in a row.
+ */
+#define kMaxSeatInputs 8                // Input devices per seat
+const uint64_t kOverloadIntervalNs = 100 * 1000 * 1000;
+#define kCalmIntervals 5
+#define kSourceUnclaimed -2             // Ingestion socket with no merge source yet
+#define kInputBatch 64                  // input_events per read()
+
+typedef void (*scrollHandler)(void *context, uint64_t time, int64_t scrollX, int64_t scrollY);
+typedef void (*keyHandler)(void *context, uint64_t time);
+
+struct overload {
+    uint64_t intervalStart;             // Start of the current interval (ns)
+    uint32_t frames;                    // Frames in it
+    uint32_t calm;                      // Intervals in a row under half the budget
+    bool aggregated;                    // Frames are summed per interval
+    int64_t sumX;                       // Frames summed this interval
+    int64_t sumY;
+    uint32_t summed;
+    uint64_t lastTime;                  // Time of the newest of them
+    uint64_t since;                     // When aggregation started
+    uint64_t folded;                    // Frames summed since then
+    uint64_t updates;                   // Summed frames handed on since then
+    uint64_t handled;                   // Frames handed on one at a time
+    uint64_t frameNs;                   // Their average handler time, sampled
+    struct inputDevice *next;           // This thread's other aggregated inputs
+};
+
+enum { kInputEvdev, kInputSocket, kInputListener, kInputTimer, kInputBacklight };
+
+struct inputDevice {
+    int fd;
+    int kind;                           // kInput*; seat devices are evdev
+    int64_t frameX;                     // Wheel motion since last SYN_REPORT
+    int64_t frameY;
+    scrollHandler handler;              // Called once per wheel frame
+    keyHandler navigate;                // Called per navigation key press or repeat, or NULL
+    void *context;
+    struct seat *seat;                  // Seat inputs: the seat whose merge this feeds
+    int source;                         // ... and which merge source, or kSourceUnclaimed
+    const char *name;                   // For messages: the seat, or "pipeline"
+    struct overload overload;
+};
+
+
+/*
+ * Opens an evdev device and asks for CLOCK_BOOTTIME timestamps. If
+ * wheelsOnly is set, devices without a scroll wheel are skipped. Returns the
+ * fd or -1.
+ */
+int openInputDevice(const char *path, bool wheelsOnly) {
+    unsigned long relBits = 0;
+    int clock = CLOCK_BOOTTIME;
+
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (-1 == fd) {
+        fprintf(stderr, "cannot open input device %s (error %d)\n", path, errno);
+        return -1;
+    }
+    if (wheelsOnly) {
+        if (-1 == ioctl(fd, EVIOCGBIT(EV_REL, sizeof(relBits)), &relBits) ||
+            !(relBits & ((1UL << REL_WHEEL) | (1UL << REL_HWHEEL)))) {
+            close(fd);
+            return -1;
+        }
+    }
+    ioctl(fd, EVIOCSCLOCKID, &clock);
+    return fd;
+}
+
+
+/*
+ * Returns true for the keys used to page through text: space, page up and
+ * down, and the up and down arrows.
+ */
+bool isNavigationKey(int code) {
+    return KEY_SPACE == code || KEY_PAGEUP == code || KEY_PAGEDOWN == code || KEY_UP == code ||
+        KEY_DOWN == code;
+}
+
+
+/*
+ * Overload totals for the stats, over every input
+ */
+_Atomic uint64_t overloadStorms;        // Switches to aggregated mode
+_Atomic uint64_t overloadFolded;        // Frames summed instead of handled
+_Atomic uint64_t overloadSavedNs;       // Estimated handler time that saved
+__thread struct inputDevice *aggregatedInputs; // This thread's inputs in aggregated mode
+
+
+/*
+ * Hands an aggregated input's summed frames to its handler.
+ */
+void flushOverload(struct inputDevice *dev) {
+    struct overload *o = &dev->overload;
+
+    if (0 == o->summed) {
+        return;
+    }
+    dev->handler(dev->context, o->lastTime, o->sumX, o->sumY);
+    o->updates++;
+    o->folded += o->summed;
+    o->sumX = 0;
+    o->sumY = 0;
+    o->summed = 0;
+}
+
+
+/*
+ * Takes dev out of aggregated mode and reports how much handler time it
+ * saved: the frames it summed, less the updates handed on, at the average
+ * cost of a frame handled on its own. Called on dev's thread.
+ */
+void endOverload(struct inputDevice *dev, uint64_t now) {
+    struct overload *o = &dev->overload;
+
+    if (!o->aggregated) {
+        return;
+    }
+    flushOverload(dev);
+    for (struct inputDevice **p = &aggregatedInputs; *p; p = &(*p)->overload.next) {
+        if (*p == dev) {
+            *p = o->next;
+            break;
+        }
+    }
+    uint64_t saved = (o->folded - o->updates) * o->frameNs;
+    atomic_fetch_add_explicit(&overloadFolded, o->folded, memory_order_relaxed);
+    atomic_fetch_add_explicit(&overloadSavedNs, saved, memory_order_relaxed);
+    o->aggregated = false;
+    if (0 == o->folded) {
+        return;
+    }
+    printf("%s: input back to one update per frame after %.1f s; %llu frames summed into %llu "
+        "updates, about %.1f ms of CPU saved\n", dev->name, (double)(now - o->since) / kNsecPerSec,
+        (unsigned long long)o->folded, (unsigned long long)o->updates,
+        (double)saved / (kNsecPerSec / 1000));
+}
+
+
+/*
+ * Ends dev's current overload interval at now: hands on what was summed
+ * and, in aggregated mode, switches back after kCalmIntervals quiet ones.
+ */
+void endOverloadInterval(struct inputDevice *dev, uint64_t now) {
+    struct overload *o = &dev->overload;
+
+    if (o->aggregated) {
+        uint64_t budget = (uint64_t)config->eventBudget * kOverloadIntervalNs / kNsecPerSec;
+        flushOverload(dev);
+        o->calm = 2 * o->frames < budget ? o->calm + 1 : 0;
+        if (o->calm >= kCalmIntervals || 0 == budget) {
+            endOverload(dev, now);
+        }
+    }
+    o->intervalStart = now;
+    o->frames = 0;
+}
+
+
+/*
+ * Puts dev in aggregated mode from time on. Called on dev's thread.
+ */
+void startOverload(struct inputDevice *dev, uint64_t time) {
+    struct overload *o = &dev->overload;
+
+    if (o->aggregated) {
+        return;
+    }
+    o->aggregated = true;
+    o->calm = 0;
+    o->since = time;
+    o->folded = 0;
+    o->updates = 0;
+    o->next = aggregatedInputs;
+    aggregatedInputs = dev;
+}
+
+
+/*
+ * Starts dev off aggregated after a suspend, so whatever it queued around
+ * the suspend is summed rather than arriving as one stale burst of frames.
+ */
+void resumeInput(struct inputDevice *dev, uint64_t now) {
+    endOverload(dev, now);
+    endOverloadInterval(dev, now);
+    startOverload(dev, now);
+}
+
+
+/*
+ * Hands a wheel frame to dev's handler, or in aggregated mode adds it to
+ * the interval's sum. Switches to aggregated mode when the frames this
+ * interval pass the budget. Must be called inside a batch.
+ */
+void handleFrame(struct inputDevice *dev, uint64_t time, int64_t scrollX, int64_t scrollY) {
+    struct overload *o = &dev->overload;
+
+    if (time < o->intervalStart || time - o->intervalStart >= kOverloadIntervalNs) {
+        endOverloadInterval(dev, time);
+    }
+    o->frames++;
+    if (!o->aggregated && config->eventBudget &&
+        o->frames > (uint64_t)config->eventBudget * kOverloadIntervalNs / kNsecPerSec) {
+        startOverload(dev, time);
+        atomic_fetch_add_explicit(&overloadStorms, 1, memory_order_relaxed);
+        printf("%s: input over %d frames/s; summing its frames every %llu ms\n", dev->name,
+            config->eventBudget, (unsigned long long)(kOverloadIntervalNs / 1000000));
+    }
+    if (o->aggregated) {
+        o->sumX += scrollX;
+        o->sumY += scrollY;
+        o->summed++;
+        o->lastTime = time;
+        return;
+    }
+
+
+    // Time one frame in 64 so a switch can say what it saved
+
+    if (0 == (o->handled++ & 63)) {
+        uint64_t start = nowNs();
+        dev->handler(dev->context, time, scrollX, scrollY);
+        uint64_t cost = nowNs() - start;
+        o->frameNs = o->frameNs ? (7 * o->frameNs + cost) / 8 : cost;
+    } else {
+        dev->handler(dev->context, time, scrollX, scrollY);
+    }
+}
+
+
+/*
+ * Ends the intervals of this thread's aggregated inputs that are over, so
+ * their sums are handed on even when the input goes quiet. Returns when
+ * the next one ends, 0 if none is aggregated. Must be called inside a
+ * batch.
+ */
+uint64_t expireOverloads(uint64_t now) {
+    uint64_t deadline = 0;
+
+    for (struct inputDevice *dev = aggregatedInputs, *next; dev; dev = next) {
+        next = dev->overload.next;
+        if (now - dev->overload.intervalStart >= kOverloadIntervalNs) {
+            endOverloadInterval(dev, now);
+        }
+        if (dev->overload.aggregated) {
+            uint64_t end = dev->overload.intervalStart + kOverloadIntervalNs;
+            if (0 == deadline || end < deadline) {
+                deadline = end;
+            }
+        }
+    }
+    return deadline;
+}
+
+
+/*
+ * Returns an evdev event's timestamp on the nowNs() clock.
+ */
+static inline uint64_t inputEventTime(const struct input_event *ev) {
+    return (uint64_t)ev->input_event_sec * kNsecPerSec + ev->input_event_usec * kNsecPerUsec +
+        atomic_load_explicit(&sleepOffsetNs, memory_order_relaxed);
+}
+
+
+/*
+ * Handles count events read from an evdev device, calling its handler
+ * once per wheel frame.
+ */
+void handleInputEvents(struct inputDevice *dev, struct input_event *events, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        struct input_event *ev = &events[i];
+        if (EV_REL == ev->type && REL_WHEEL == ev->code) {
+            dev->frameY += ev->value;
+        } else if (EV_REL == ev->type && REL_HWHEEL == ev->code) {
+            dev->frameX += ev->value;
+        } else if (EV_KEY == ev->type && ev->value && dev->navigate && isNavigationKey(ev->code)) {
+            dev->navigate(dev->context, inputEventTime(ev));
+        } else if (EV_SYN == ev->type && SYN_REPORT == ev->code &&
+            (dev->frameX || dev->frameY)) {
+            handleFrame(dev, inputEventTime(ev), dev->frameX, dev->frameY);
+            dev->frameX = 0;
+            dev->frameY = 0;
+        }
+    }
+}
+
+
+/*
+ * Reads everything pending on an input device and hands each wheel frame to
+ * its handler, and navigation keys to its key handler. Returns false if the
+ * device is gone.
+ */
+bool readInputDevice(struct inputDevice *dev) {
+    struct input_event events[kInputBatch];
+
+    for (;;) {
+        threadSyscalls++;
+        ssize_t len = read(dev->fd, events, sizeof(events));
+        if (len < 0) {
+            return errno == EAGAIN || errno == EINTR;
+        } else if (len == 0) {
+            return false;
+        }
+        handleInputEvents(dev, events, len / sizeof(struct input_event));
+        if ((size_t)len < sizeof(events)) {
+            return true;
+        }
+    }
+}
+
+
+#ifdef WITH_WAYLAND
+/*
+ * Wayland gamma (WITH_WAYLAND)
+ *
+ * Wayland desktops often have no backlight we can write, and no RandR.
+ * There a seat can be dimmed by scaling its outputs' gamma through
+ * wlr-gamma-control-unstable-v1, which wlroots compositors (sway, river,
+ * labwc, ...) implement. The scale is quantized to kGammaLevels levels, and
+ * the table for every level and every ramp size in use is computed once
+ * into its own sealed memfd of exactly the table's size, which is what the
+ * compositor expects. A dim step is then an lseek back to the start and a
+ * set_gamma request with that level's memfd. The compositor read()s the
+ * table, moving the offset every descriptor of the memfd shares, so a memfd
+ * isn't sent again before a roundtrip says the last send was read.
+ *
+ * We only hold an output's gamma while dimming it: the restore destroys
+ * the controls, and the compositor puts back the gamma it had, night light
+ * tools' included. It does the same if we die, so there is nothing to
+ * clean up after a crash.
+ *
+ * The protocol is small enough that its interfaces are written out here
+ * rather than generated by wayland-scanner.
+ */
+#define kGammaLevels 64                 // Dim steps, from kGammaFloor to full
+#define kMaxGammaOutputs 8
+const float kGammaFloor = 0.1;          // Scale at the lowest level, so the screen stays readable
+
+extern const struct wl_interface zwlr_gamma_control_v1_interface;
+static const struct wl_interface *gammaTypes[] = {
+    NULL,
+    &zwlr_gamma_control_v1_interface,
+    &wl_output_interface,
+};
+static const struct wl_message gammaManagerRequests[] = {
+    { "get_gamma_control", "no", gammaTypes + 1 },
+    { "destroy", "", gammaTypes },
+};
+const struct wl_interface zwlr_gamma_control_manager_v1_interface = {
+    "zwlr_gamma_control_manager_v1", 1, 2, gammaManagerRequests, 0, NULL,
+};
+static const struct wl_message gammaControlRequests[] = {
+    { "set_gamma", "h", gammaTypes },
+    { "destroy", "", gammaTypes },
+};
+static const struct wl_message gammaControlEvents[] = {
+    { "gamma_size", "u", gammaTypes },
+    { "failed", "", gammaTypes },
+};
+const struct wl_interface zwlr_gamma_control_v1_interface = {
+    "zwlr_gamma_control_v1", 1, 2, gammaControlRequests, 2, gammaControlEvents,
+};
+#define kGammaGetControl 0              // Manager request
+#define kGammaSet 0                     // Control requests
+#define kGammaDestroy 1
+
+struct gammaRamp {
+    uint32_t size;                      // Entries per channel
+    int fds[kGammaLevels];              // Each level's table in a sealed memfd, or -1
+    unsigned sent[kGammaLevels];        // Round each was last sent in, 0 if never
+};
+
+struct gammaOutput {
+    struct gamma *gamma;
+    struct wl_output *output;
+    uint32_t name;                      // Registry name
+    struct wl_proxy *control;           // zwlr_gamma_control_v1 while dimmed, else NULL
+    uint32_t rampSize;                  // Entries per channel, 0 until the compositor says
+    int ramp;                           // Index of rampSize's tables in gamma->ramps, or -1
+    int level;                          // Level last sent, or -1
+    bool refused;                       // Another client holds the gamma
+};
+
+struct gamma {
+    struct wl_display *display;         // NULL if the seat isn't dimmed through gamma
+    struct wl_registry *registry;
+    struct wl_proxy *manager;           // zwlr_gamma_control_manager_v1
+    struct gammaOutput outputs[kMaxGammaOutputs];
+    int numOutputs;
+    struct gammaRamp ramps[kMaxGammaOutputs];
+    int numRamps;
+    unsigned round;                     // Roundtrips so far, plus 1
+    float brightness;                   // The level dimmed to, as a fraction
+    bool dimmed;
+};
+
+
+/*
+ * Returns the gamma scale of level.
+ */
+static inline float gammaScale(int level) {
+    return kGammaFloor + (1 - kGammaFloor) * level / (kGammaLevels - 1);
+}
+
+
+/*
+ * Returns the level nearest brightness.
+ */
+static inline int gammaLevel(float brightness) {
+    int level = (int)(brightness * (kGammaLevels - 1) + 0.5);
+    return level < 0 ? 0 : (level >= kGammaLevels ? kGammaLevels - 1 : level);
+}
+
+
+/*
+ * gamma_size event: the output's ramp size.
+ */
+void handleGammaSize(void *data, struct wl_proxy *control, uint32_t size) {
+    struct gammaOutput *o = data;
+    if (size != o->rampSize) {
+        o->rampSize = size;
+        o->ramp = -1;
+    }
+}
+
+
+/*
+ * failed event: another client has the output's gamma, or the output went.
+ * The control is dead; a later dim tries again.
+ */
+void handleGammaFailed(void *data, struct wl_proxy *control) {
+    struct gammaOutput *o = data;
+    if (!o->refused) {
+        fprintf(stderr, "gamma control of output %u refused by the compositor\n", o->name);
+    }
+    o->refused = true;
+    wl_proxy_marshal_flags(o->control, kGammaDestroy, NULL, 1, WL_MARSHAL_FLAG_DESTROY);
+    o->control = NULL;
+    o->level = -1;
+}
+
+static const struct {
+    void (*gammaSize)(void *data, struct wl_proxy *control, uint32_t size);
+    void (*failed)(void *data, struct wl_proxy *control);
+} gammaControlListener = { &handleGammaSize, &handleGammaFailed };
+
+
+/*
+ * Creates o's gamma control if it has none. Returns false if the
+ * compositor has already refused it.
+ */
+bool takeGammaControl(struct gammaOutput *o) {
+    if (o->control) {
+        return true;
+    }
+    o->control = wl_proxy_marshal_flags(o->gamma->manager, kGammaGetControl,
+        &zwlr_gamma_control_v1_interface, 1, 0, NULL, o->output);
+    if (NULL == o->control) {
+        return false;
+    }
+    o->level = -1;
+    wl_proxy_add_listener(o->control, (void (**)(void))&gammaControlListener, o);
+    if (0 == o->rampSize) {
+        wl_display_roundtrip(o->gamma->display);
+        o->gamma->round++;
+    }
+    return NULL != o->control && o->rampSize > 0;
+}
+
+
+/*
+ * Gives o's gamma back to the compositor, which restores what it had.
+ */
+void releaseGammaControl(struct gammaOutput *o) {
+    if (o->control) {
+        wl_proxy_marshal_flags(o->control, kGammaDestroy, NULL, 1, WL_MARSHAL_FLAG_DESTROY);
+        o->control = NULL;
+    }
+    o->level = -1;
+}
+
+
+/*
+ * Closes g's tables.
+ */
+void closeGammaTables(struct gamma *g) {
+    for (int i = 0; i < g->numRamps; i++) {
+        for (int level = 0; level < kGammaLevels; level++) {
+            if (-1 != g->ramps[i].fds[level]) {
+                close(g->ramps[i].fds[level]);
+            }
+        }
+    }
+    g->numRamps = 0;
+}
+
+
+/*
+ * (Re)builds g's tables: a memfd per level for each ramp size its outputs
+ * have. Returns false if it couldn't.
+ */
+bool buildGammaTables(struct gamma *g) {
+    closeGammaTables(g);
+    for (int i = 0; i < g->numOutputs; i++) {
+        struct gammaOutput *o = &g->outputs[i];
+        o->ramp = -1;
+        if (0 == o->rampSize) {
+            continue;
+        }
+        for (int j = 0; j < g->numRamps && -1 == o->ramp; j++) {
+            if (g->ramps[j].size == o->rampSize) {
+                o->ramp = j;
+            }
+        }
+        if (-1 != o->ramp) {
+            continue;
+        }
+
+        struct gammaRamp *r = &g->ramps[g->numRamps++];
+        r->size = o->rampSize;
+        for (int level = 0; level < kGammaLevels; level++) {
+            r->fds[level] = -1;
+            r->sent[level] = 0;
+        }
+
+
+        // One table is the red, green and blue ramps, and fills its memfd
+
+        size_t tableSize = 3 * o->rampSize * sizeof(uint16_t);
+        uint16_t *table = malloc(tableSize);
+        if (NULL == table) {
+            return false;
+        }
+        for (int level = 0; level < kGammaLevels; level++) {
+            float scale = gammaScale(level);
+            for (uint32_t k = 0; k < o->rampSize; k++) {
+                float value = 65535.0f * k / (o->rampSize > 1 ? o->rampSize - 1 : 1) * scale;
+                table[k] = table[o->rampSize + k] = table[2 * o->rampSize + k] =
+                    (uint16_t)(value + 0.5f);
+            }
+            r->fds[level] = memfd_create("brainthrottle-gamma", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            if (-1 == r->fds[level] || (ssize_t)tableSize != write(r->fds[level], table, tableSize)) {
+                free(table);
+                fprintf(stderr, "cannot write gamma tables (error %d)\n", errno);
+                return false;
+            }
+            fcntl(r->fds[level], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+        }
+        free(table);
+        o->ramp = g->numRamps - 1;
+    }
+    return true;
+}
+
+
+/*
+ * Registry global event: binds outputs and the gamma control manager.
+ */
+void handleGammaGlobal(void *data, struct wl_registry *registry, uint32_t name,
+    const char *interface, uint32_t version) {
+    struct gamma *g = data;
+
+    if (0 == strcmp(interface, zwlr_gamma_control_manager_v1_interface.name)) {
+        g->manager = wl_registry_bind(registry, name, &zwlr_gamma_control_manager_v1_interface, 1);
+    } else if (0 == strcmp(interface, wl_output_interface.name) && g->numOutputs < kMaxGammaOutputs) {
+        struct gammaOutput *o = &g->outputs[g->numOutputs++];
+        memset(o, 0, sizeof(*o));
+        o->gamma = g;
+        o->name = name;
+        o->output = wl_registry_bind(registry, name, &wl_output_interface, 1);
+        o->ramp = -1;
+        o->level = -1;
+    }
+}
+
+
+/*
+ * Registry global_remove event: forgets an unplugged output.
+ */
+void handleGammaGlobalRemove(void *data, struct wl_registry *registry, uint32_t name) {
+    struct gamma *g = data;
+
+    for (int i = 0; i < g->numOutputs; i++) {
+        struct gammaOutput *o = &g->outputs[i];
+        if (o->name != name) {
+            continue;
+        }
+        releaseGammaControl(o);
+        wl_output_destroy(o->output);
+        *o = g->outputs[--g->numOutputs];
+        if (o->control) {
+            wl_proxy_set_user_data(o->control, o);
+        }
+        return;
+    }
+}
+
+static const struct wl_registry_listener gammaRegistryListener = {
+    &handleGammaGlobal, &handleGammaGlobalRemove,
+};
+
+
+/*
+ * Handles whatever the compositor has sent g without blocking: refusals,
+ * ramp sizes and hotplugged outputs.
+ */
+void pumpGamma(struct gamma *g) {
+    struct pollfd p = { wl_display_get_fd(g->display), POLLIN, 0 };
+
+    while (0 != wl_display_prepare_read(g->display)) {
+        wl_display_dispatch_pending(g->display);
+    }
+    if (poll(&p, 1, 0) > 0) {
+        wl_display_read_events(g->display);
+    } else {
+        wl_display_cancel_read(g->display);
+    }
+    wl_display_dispatch_pending(g->display);
+}
+
+
+/*
+ * Disconnects g, which restores every output's gamma.
+ */
+void closeGamma(struct gamma *g) {
+    if (NULL == g->display) {
+        return;
+    }
+    closeGammaTables(g);
+    wl_display_disconnect(g->display);
+    g->display = NULL;
+    g->numOutputs = 0;
+}
+
+
+/*
+ * Connects to the Wayland display called display (NULL for
+ * $WAYLAND_DISPLAY), learns its outputs' ramp sizes and builds the tables.
+ * The controls are released again until the first dim. Returns false if the
+ * compositor has no gamma control.
+ */
+bool openGamma(struct gamma *g, const char *display) {
+    memset(g, 0, sizeof(*g));
+    g->round = 1;
+    g->brightness = 1;
+    g->display = wl_display_connect(display);
+    if (NULL == g->display) {
+        fprintf(stderr, "cannot connect to Wayland display %s (error %d)\n",
+            display ? display : "$WAYLAND_DISPLAY", errno);
+        return false;
+    }
+    g->registry = wl_display_get_registry(g->display);
+    wl_registry_add_listener(g->registry, &gammaRegistryListener, g);
+    wl_display_roundtrip(g->display);
+    if (NULL == g->manager || 0 == g->numOutputs) {
+        fprintf(stderr, "Wayland display %s has %s\n", display ? display : "$WAYLAND_DISPLAY",
+            g->manager ? "no outputs" : "no wlr-gamma-control");
+        closeGamma(g);
+        return false;
+    }
+    for (int i = 0; i < g->numOutputs; i++) {
+        takeGammaControl(&g->outputs[i]);
+    }
+    wl_display_roundtrip(g->display);
+    for (int i = 0; i < g->numOutputs; i++) {
+        releaseGammaControl(&g->outputs[i]);
+    }
+    wl_display_flush(g->display);
+    if (!buildGammaTables(g)) {
+        closeGamma(g);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Sends level to each of g's outputs not already at it. The compositor
+ * reads the table from the memfd's offset when it handles the request, so
+ * a memfd sent since the last roundtrip is waited for before being rewound.
+ * Returns false if no output could be set.
+ */
+bool setGammaLevel(struct gamma *g, int level) {
+    bool rebuild = false;
+    int set = 0;
+
+    pumpGamma(g);
+    for (int i = 0; i < g->numOutputs; i++) {
+        struct gammaOutput *o = &g->outputs[i];
+        if (takeGammaControl(o) && -1 == o->ramp) {
+            rebuild = true;
+        }
+    }
+    if (rebuild && !buildGammaTables(g)) {
+        return false;
+    }
+    for (int i = 0; i < g->numOutputs; i++) {
+        struct gammaOutput *o = &g->outputs[i];
+        if (NULL == o->control || -1 == o->ramp) {
+            continue;
+        }
+        set++;
+        if (o->level == level) {
+            continue;
+        }
+        struct gammaRamp *r = &g->ramps[o->ramp];
+        if (r->sent[level] == g->round) {
+            wl_display_roundtrip(g->display);
+            g->round++;
+            if (NULL == o->control) {
+                set--;
+                continue;
+            }
+        }
+        lseek(r->fds[level], 0, SEEK_SET);
+        wl_proxy_marshal_flags(o->control, kGammaSet, NULL, 1, 0, r->fds[level]);
+        r->sent[level] = g->round;
+        o->level = level;
+    }
+    threadSyscalls += 2 + 2 * set;
+    wl_display_flush(g->display);
+    return set > 0;
+}
+
+
+/*
+ * Dims g's outputs in proportion to scrollDiff, from full brightness if
+ * this starts a penalty. Returns the brightness dimmed to, or -1.
+ */
+float dimGamma(struct gamma *g, bool firstDim, int64_t scrollDiff) {
+    if (firstDim || !g->dimmed) {
+        g->brightness = 1;
+        g->dimmed = true;
+    }
+    int level = gammaLevel(dimmedBrightness(g->brightness, scrollDiff));
+    g->brightness = (float)level / (kGammaLevels - 1);
+    return setGammaLevel(g, level) ? g->brightness : -1;
+}
+
+
+/*
+ * Ends a gamma dim, handing every output's gamma back to the compositor.
+ */
+void restoreGamma(struct gamma *g) {
+    pumpGamma(g);
+    for (int i = 0; i < g->numOutputs; i++) {
+        releaseGammaControl(&g->outputs[i]);
+    }
+    wl_display_flush(g->display);
+    g->dimmed = false;
+    g->brightness = 1;
+}
+#endif
+
+
+#ifdef WITH_X11
+/*
+ * X11 overlay (WITH_X11)
+ *
+ * Where there is neither a backlight nor gamma control (nested X, VNC,
+ * VMs), a seat can be dimmed with a black, click-through, override-redirect
+ * window over its output, made translucent by the compositing manager
+ * through _NET_WM_WINDOW_OPACITY. Its background is painted by the server,
+ * so we never draw: a dim step is a single ChangeProperty request, and none
+ * is sent while the opacity stays the same. The window has a 32-bit ARGB
+ * visual and an empty input shape, and is only mapped during a penalty.
+ * Without a compositing manager the window would be opaque, so it isn't
+ * used at all.
+ */
+#define kOverlayLevels 64               // Dim steps, from kOverlayMaxOpacity to clear
+const float kOverlayMaxOpacity = 0.9;   // Opacity at the lowest level, so the screen stays readable
+
+struct overlay {
+    Display *display;                   // NULL if the seat isn't dimmed with an overlay
+    Window window;
+    Atom opacityAtom;                   // _NET_WM_WINDOW_OPACITY
+    int level;                          // Level of the opacity property, or -1
+    bool mapped;
+    float brightness;                   // The level dimmed to, as a fraction
+    bool dimmed;
+};
+
+
+/*
+ * Reports X errors instead of letting Xlib exit. They are asynchronous, so
+ * all we can do is say so; a lost overlay only costs the dim.
+ */
+int handleOverlayError(Display *display, XErrorEvent *error) {
+    char text[128];
+    XGetErrorText(display, error->error_code, text, sizeof(text));
+    fprintf(stderr, "X error on overlay: %s (request %d)\n", text, error->request_code);
+    return 0;
+}
+
+
+/*
+ * Closes o's display, which destroys the overlay.
+ */
+void closeOverlay(struct overlay *o) {
+    if (NULL == o->display) {
+        return;
+    }
+    XCloseDisplay(o->display);
+    o->display = NULL;
+}
+
+
+/*
+ * Opens an overlay on spec, "DISPLAY" or "DISPLAY,GEOMETRY" with an X
+ * geometry ("1920x1080+1920+0") to cover one output rather than the whole
+ * screen. An empty DISPLAY, or a NULL spec, means $DISPLAY. Returns false if
+ * the display has no compositing manager or ARGB visual.
+ */
+bool openOverlay(struct overlay *o, const char *spec) {
+    char name[256];
+    char atom[32];
+    XVisualInfo visual;
+    XSetWindowAttributes attributes;
+
+    memset(o, 0, sizeof(*o));
+    o->level = -1;
+    o->brightness = 1;
+    snprintf(name, sizeof(name), "%s", spec ? spec : "");
+    char *geometry = strchr(name, ',');
+    if (geometry) {
+        *geometry++ = 0;
+    }
+    XSetErrorHandler(&handleOverlayError);
+    o->display = XOpenDisplay(name[0] ? name : NULL);
+    if (NULL == o->display) {
+        fprintf(stderr, "cannot open X display %s\n", name[0] ? name : "$DISPLAY");
+        return false;
+    }
+
+    int screen = DefaultScreen(o->display);
+    Window root = RootWindow(o->display, screen);
+    snprintf(atom, sizeof(atom), "_NET_WM_CM_S%d", screen);
+    if (None == XGetSelectionOwner(o->display, XInternAtom(o->display, atom, False))) {
+        fprintf(stderr, "X display %s has no compositing manager; an overlay would be opaque\n",
+            DisplayString(o->display));
+        closeOverlay(o);
+        return false;
+    }
+    if (!XMatchVisualInfo(o->display, screen, 32, TrueColor, &visual)) {
+        fprintf(stderr, "X display %s has no ARGB visual\n", DisplayString(o->display));
+        closeOverlay(o);
+        return false;
+    }
+
+
+    // The whole screen, or the output geometry names
+
+    int x = 0;
+    int y = 0;
+    unsigned int width = DisplayWidth(o->display, screen);
+    unsigned int height = DisplayHeight(o->display, screen);
+    if (geometry) {
+        XParseGeometry(geometry, &x, &y, &width, &height);
+    }
+
+    attributes.override_redirect = True;
+    attributes.colormap = XCreateColormap(o->display, root, visual.visual, AllocNone);
+    attributes.background_pixel = 0xff000000;
+    attributes.border_pixel = 0;
+    o->window = XCreateWindow(o->display, root, x, y, width, height, 0, 32, InputOutput,
+        visual.visual, CWOverrideRedirect | CWColormap | CWBackPixel | CWBorderPixel, &attributes);
+    XShapeCombineRectangles(o->display, o->window, ShapeInput, 0, 0, NULL, 0, ShapeSet, Unsorted);
+    XStoreName(o->display, o->window, "brainthrottle");
+    o->opacityAtom = XInternAtom(o->display, "_NET_WM_WINDOW_OPACITY", False);
+    XSync(o->display, False);
+    return true;
+}
+
+
+/*
+ * Sets o's opacity to level's, mapping it if it isn't. Sends nothing if
+ * it's already there.
+ */
+void setOverlayLevel(struct overlay *o, int level) {
+    if (level == o->level && o->mapped) {
+        return;
+    }
+    if (level != o->level) {
+        long opacity = (long)(kOverlayMaxOpacity * (kOverlayLevels - 1 - level) /
+            (kOverlayLevels - 1) * 0xffffffffu);
+        XChangeProperty(o->display, o->window, o->opacityAtom, XA_CARDINAL, 32, PropModeReplace,
+            (unsigned char *)&opacity, 1);
+        o->level = level;
+    }
+    if (!o->mapped) {
+        XMapRaised(o->display, o->window);
+        o->mapped = true;
+    }
+    threadSyscalls++;
+    XFlush(o->display);
+}
+
+
+/*
+ * Dims o in proportion to scrollDiff, from full brightness if this starts
+ * a penalty. Returns the brightness dimmed to.
+ */
+float dimOverlay(struct overlay *o, bool firstDim, int64_t scrollDiff) {
+    if (firstDim || !o->dimmed) {
+        o->brightness = 1;
+        o->dimmed = true;
+    }
+    int level = (int)(dimmedBrightness(o->brightness, scrollDiff) * (kOverlayLevels - 1) + 0.5);
+    o->brightness = (float)level / (kOverlayLevels - 1);
+    setOverlayLevel(o, level);
+    return o->brightness;
+}
+
+
+/*
+ * Ends an overlay dim by unmapping it.
+ */
+void restoreOverlay(struct overlay *o) {
+    if (o->mapped) {
+        XUnmapWindow(o->display, o->window);
+        XFlush(o->display);
+        o->mapped = false;
+    }
+    o->dimmed = false;
+    o->brightness = 1;
+}
+#endif
+
+
+/*
+ * Timer wheel
+ *
+ * Seat workers keep their deadlines (penalty ends, activity rollups, merge
+ * releases) in a hierarchical timing wheel: kWheelLevels levels of 64
+ * slots, where a level k slot is 64^k ticks wide. A timer sits in the
+ * lowest level whose slot range separates it from the wheel's current
+ * tick. Arming, re-arming and cancelling are a few pointer moves, and
+ * re-arming within the same slot (a penalty extended by the next scroll)
+ * only stores the new tick. When the wheel reaches the start of a higher
+ * slot, that slot's timers move down a level. An occupancy bitmap per
+ * level finds the next slot with work without scanning, so the worker's
+ * one timerfd is set from it, and a long suspend is crossed in a few steps
+ * instead of tick by tick. A timer in a higher level can wake the worker
+ * early, at most once per level, to move down.
+ */
+#define kWheelLevels 6                  // 64^6 ticks: over two years
+#define kWheelSlots 64
+const uint64_t kWheelTickNs = 1000 * 1000;
+
+struct timer;
+typedef void (*timerHandler)(struct timer *t, uint64_t now);
+
+struct timer {
+    uint64_t tick;                      // When it fires, in ticks rounded up
+    struct timer *next;                 // In its slot
+    struct timer **prev;                // What points to it, NULL if not armed
+    int slot;                           // level * kWheelSlots + slot
+    timerHandler fire;                  // Called once the tick has passed; may re-arm
+    void *context;
+};
+
+struct timerWheel {
+    uint64_t current;                   // Tick the wheel has run to
+    uint64_t occupied[kWheelLevels];    // A bit per non-empty slot
+    struct timer *slots[kWheelLevels * kWheelSlots];
+    int count;                          // Timers armed
+};
+
+
+/*
+ * Starts an empty wheel at time now.
+ */
+void initWheel(struct timerWheel *tw, uint64_t now) {
+    memset(tw, 0, sizeof(*tw));
+    tw->current = now / kWheelTickNs;
+}
+
+
+/*
+ * Returns the slot for a timer firing at tick. Ticks already passed go in
+ * the current level 0 slot, to fire on the next run.
+ */
+static inline int wheelSlot(const struct timerWheel *tw, uint64_t tick) {
+    const uint64_t span = (1ULL << (6 * kWheelLevels)) - 1;
+
+    if (tick > tw->current && (tick ^ tw->current) > span) {
+        tick = tw->current | span;      // Beyond the wheel: wait at its end
+    }
+    if (tick <= tw->current) {
+        return (int)(tw->current % kWheelSlots);
+    }
+    int level = (63 - __builtin_clzll(tick ^ tw->current)) / 6;
+    return level * kWheelSlots + (int)((tick >> (6 * level)) % kWheelSlots);
+}
+
+
+/*
+ * Puts t at the head of slot.
+ */
+static inline void wheelLink(struct timerWheel *tw, struct timer *t, int slot) {
+    t->slot = slot;
+    t->next = tw->slots[slot];
+    if (t->next) {
+        t->next->prev = &t->next;
+    }
+    tw->slots[slot] = t;
+    t->prev = &tw->slots[slot];
+    tw->occupied[slot / kWheelSlots] |= 1ULL << (slot % kWheelSlots);
+}
+
+
+/*
+ * Takes t out of its slot.
+ */
+static inline void wheelUnlink(struct timerWheel *tw, struct timer *t) {
+    *t->prev = t->next;
+    if (t->next) {
+        t->next->prev = t->prev;
+    }
+    if (NULL == tw->slots[t->slot]) {
+        tw->occupied[t->slot / kWheelSlots] &= ~(1ULL << (t->slot % kWheelSlots));
+    }
+    t->prev = NULL;
+}
+
+
+/*
+ * Arms t to fire at deadline (nowNs() time), moving it if it is already
+ * armed, or cancels it if deadline is 0.
+ */
+void armTimer(struct timerWheel *tw, struct timer *t, uint64_t deadline) {
+    if (0 == deadline) {
+        if (t->prev) {
+            wheelUnlink(tw, t);
+            tw->count--;
+        }
+        return;
+    }
+
+    uint64_t tick = (deadline + kWheelTickNs - 1) / kWheelTickNs;
+    int slot = wheelSlot(tw, tick);
+    t->tick = tick;
+    if (t->prev) {
+        if (slot == t->slot) {
+            return;
+        }
+        wheelUnlink(tw, t);
+    } else {
+        tw->count++;
+    }
+    wheelLink(tw, t, slot);
+}
+
+
+/*
+ * Returns the first tick after the current one, up to limit, at which the
+ * wheel has a level 0 slot to fire or a higher slot to move down.
+ */
+uint64_t nextWheelTick(const struct timerWheel *tw, uint64_t limit) {
+    uint64_t next = limit;
+
+    for (int level = 0; level < kWheelLevels; level++) {
+        int shift = 6 * level;
+        int index = (int)((tw->current >> shift) % kWheelSlots);
+        uint64_t later = index == kWheelSlots - 1 ? 0 : tw->occupied[level] & (~0ULL << (index + 1));
+        if (later) {
+            uint64_t round = tw->current >> (shift + 6) << (shift + 6);
+            uint64_t tick = round | ((uint64_t)__builtin_ctzll(later) << shift);
+            if (tick < next) {
+                next = tick;
+            }
+        }
+    }
+    return next;
+}
+
+
+/*
+ * Returns when the wheel next needs running (nowNs() time), or 0 if no
+ * timer is armed.
+ */
+uint64_t wheelDeadline(const struct timerWheel *tw) {
+    if (0 == tw->count) {
+        return 0;
+    } else if (tw->occupied[0] & (1ULL << (tw->current % kWheelSlots))) {
+        return tw->current * kWheelTickNs;
+    }
+    uint64_t tick = nextWheelTick(tw, UINT64_MAX);
+    return UINT64_MAX == tick ? 0 : tick * kWheelTickNs;
+}
+
+
+/*
+ * Runs the wheel up to now: moves down the higher slots it reaches and
+ * fires every timer whose tick has passed, in tick order.
+ */
+void runTimers(struct timerWheel *tw, uint64_t now) {
+    uint64_t target = now / kWheelTickNs;
+
+    for (;;) {
+        for (int level = kWheelLevels - 1; level > 0; level--) {
+            if (tw->current & ((1ULL << (6 * level)) - 1)) {
+                continue;
+            }
+            int slot = level * kWheelSlots + (int)((tw->current >> (6 * level)) % kWheelSlots);
+            struct timer *t = tw->slots[slot];
+            tw->slots[slot] = NULL;
+            tw->occupied[level] &= ~(1ULL << (slot % kWheelSlots));
+            while (t) {
+                struct timer *next = t->next;
+                wheelLink(tw, t, wheelSlot(tw, t->tick));
+                t = next;
+            }
+        }
+
+        struct timer *t;
+        int slot = (int)(tw->current % kWheelSlots);
+        while ((t = tw->slots[slot]) && t->tick <= target) {
+            wheelUnlink(tw, t);
+            tw->count--;
+            t->fire(t, now);
+        }
+
+        if (tw->current >= target) {
+            return;
+        }
+        tw->current = nextWheelTick(tw, target);
+    }
+}
+
+
+/*
+ * Seats
+ *
+ * In daemon mode (-d) every seat gets its own detector, input devices and
+ * backlight. Seats come from logind (/run/systemd/seats, with devices
+ * assigned by udev's ID_SEAT) or from a config file (-f). Seats are sharded
+ * across a fixed pool of worker threads; a seat is only ever touched by its
+ * worker, so there is no locking between shards.
+ */
+#define kSeatNameLength 32
+#define kMaxWorkers 64
+#define kWorkerEvents 64                // epoll_events per epoll_wait()
+#define kParkWorkersMs 500              // How long exit waits for workers to park
+const uint64_t kMinSuspendNs = 10 * 1000 * 1000; // Smaller jumps in sleptNs() are clock noise
+
+struct seat {
+    char name[kSeatNameLength];
+    int index;                          // Position in seats
+    struct detector detector;
+    struct backlight backlight;
+    struct inputDevice inputs[kMaxSeatInputs];
+    int numInputs;
+    struct merge merge;                 // Inputs and ingestion sockets in time order
+    struct inputDevice backlightWatch;  // The backlight's notifyFd, if watched
+#ifdef WITH_WAYLAND
+    struct gamma gamma;                 // Dims outputs' gamma instead, if connected
+#endif
+#ifdef WITH_X11
+    struct overlay overlay;             // Dims with an overlay window instead, if open
+#endif
+    struct worker *worker;
+    struct timer timer;                 // The detector's deadline, see detectorDeadline
+    struct timer mergeTimer;            // The merge's deadline
+    bool touched;                       // Had events in the worker's current batch
+    uint32_t uid;                       // The seat's session user, for telemetry's sender only
+    uint64_t uidFlush;                  // ... as of this telemetry flush, 0 if never read
+};
+
+struct worker {
+    pthread_t thread;
+    int index;
+    int epollFd;
+    struct seat **seats;                // Seats in this shard
+    int numSeats;
+    struct stageStats detectStats;      // Kernel timestamp until dimmed
+    _Atomic uint64_t wakeups;           // epoll_wait returns
+    _Atomic uint64_t dims;
+    struct inputDevice timer;           // timerfd on CLOCK_BOOTTIME for the next deadline
+    uint64_t armed;                     // nowNs() deadline it is set for, 0 if none
+    uint64_t slept;                     // sleptNs() when last woken
+    struct uring ring;                  // -i uring: fd -1 if the worker uses plain epoll
+    bool epollPending;                  // ... epoll has events left over from the last batch
+    bool noMultishot;                   // ... the kernel can't do multishot reads
+    _Atomic uint64_t syscalls;          // On the event path, see threadSyscalls
+    struct timerWheel wheel;            // Seats' deadlines
+    struct seat **touched;              // Seats with events in the current batch
+    int numTouched;
+};
+
+struct seat **seats;
+int numSeats = 0;
+struct worker workers[kMaxWorkers];
+int numWorkers = 0;
+_Atomic bool workersExiting;            // Set at exit: workers park
+_Atomic int workersRunning;             // Workers started
+_Atomic int workersParked;              // ... and since parked for exit
+int ingestFd = -1;                      // Ingestion socket listener, or -1
+uint64_t reportWakeups;                 // countWakeups() at the last report
+uint64_t reportTime;                    // When that was
+struct inputDevice ingestListener = { .fd = -1, .kind = kInputListener };
+
+
+/*
+ * Returns the user of the active session on seat name according to logind,
+ * or our own if there is none.
+ */
+uint32_t seatUser(const char *name) {
+    char path[PATH_MAX];
+    char line[256];
+    uint32_t uid = getuid();
+
+    snprintf(path, sizeof(path), "/run/systemd/seats/%s", name);
+    FILE *f = fopen(path, "re");
+    while (f && fgets(line, sizeof(line), f)) {
+        if (0 == strncmp(line, "ACTIVE_UID=", 11) && line[11] != '\n') {
+            uid = (uint32_t)strtoul(line + 11, NULL, 10);
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    return uid;
+}
+
+
+/*
+ * Returns the seat called name, creating it if create is set.
+ */
+struct seat *findSeat(const char *name, bool create) {
+    for (int i = 0; i < numSeats; i++) {
+        if (0 == strcmp(seats[i]->name, name)) {
+            return seats[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    struct seat *seat = calloc(1, sizeof(struct seat));
+    struct seat **grown = realloc(seats, (numSeats + 1) * sizeof(struct seat *));
+    if (NULL == seat || NULL == grown) {
+        fprintf(stderr, "Error allocating seat; bailing\n");
+        exit(-1);
+    }
+    seats = grown;
+    snprintf(seat->name, sizeof(seat->name), "%s", name);
+    seat->detector.name = seat->name;
+    seat->backlight.fd = -1;
+    seat->backlight.watchFd = -1;
+    seat->backlight.notifyFd = -1;
+    seat->index = numSeats;
+    seat->detector.id = numSeats;
+    seat->detector.sketches = newSketches();
+    seats[numSeats++] = seat;
+    return seat;
+}
+
+
+/*
+ * Adds the input device at path to seat.
+ */
+void addSeatInput(struct seat *seat, const char *path, bool wheelsOnly) {
+    if (seat->numInputs >= kMaxSeatInputs) {
+        fprintf(stderr, "%s: too many input devices, ignoring %s\n", seat->name, path);
+        return;
+    }
+    int fd = openInputDevice(path, wheelsOnly);
+    if (-1 != fd) {
+        seat->inputs[seat->numInputs++].fd = fd;
+    }
+}
+
+
+/*
+ * Looks up the seat udev assigned to a device (ID_SEAT), defaulting to
+ * seat0 like logind does.
+ */
+void udevSeat(const char *deviceId, char *seatName, size_t size) {
+    char path[PATH_MAX];
+    char line[256];
+
+    snprintf(seatName, size, "seat0");
+    snprintf(path, sizeof(path), "/run/udev/data/%s", deviceId);
+    FILE *f = fopen(path, "re");
+    if (NULL == f) {
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (0 == strncmp(line, "E:ID_SEAT=", 10)) {
+            line[strcspn(line, "\n")] = 0;
+            snprintf(seatName, size, "%s", line + 10);
+        }
+    }
+    fclose(f);
+}
+
+
+/*
+ * Creates seats from logind. If only is set, just that seat is used;
+ * otherwise every seat with an active session. Then hands each scroll
+ * wheel and backlight to its seat.
+ */
+void discoverSeats(const char *only) {
+    char path[PATH_MAX];
+    char line[256];
+    char seatName[kSeatNameLength];
+    struct dirent *entry;
+    struct stat st;
+
+
+    // Seats. Without logind there is just seat0.
+
+    DIR *dir = opendir("/run/systemd/seats");
+    if (NULL == dir || only) {
+        findSeat(only ? only : "seat0", true);
+    }
+    while (dir && !only && (entry = readdir(dir))) {
+        if ('.' == entry->d_name[0]) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/run/systemd/seats/%s", entry->d_name);
+        FILE *f = fopen(path, "re");
+        bool active = false;
+        while (f && fgets(line, sizeof(line), f)) {
+            active |= (0 == strncmp(line, "ACTIVE=", 7) && line[7] != '\n');
+        }
+        if (f) {
+            fclose(f);
+        }
+        if (active) {
+            findSeat(entry->d_name, true);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+
+
+    // Scroll wheels
+
+    dir = opendir("/dev/input");
+    while (dir && (entry = readdir(dir))) {
+        if (0 != strncmp(entry->d_name, "event", 5)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/dev/input/%s", entry->d_name);
+        if (-1 == stat(path, &st)) {
+            continue;
+        }
+        char deviceId[32];
+        snprintf(deviceId, sizeof(deviceId), "c%u:%u", major(st.st_rdev), minor(st.st_rdev));
+        udevSeat(deviceId, seatName, sizeof(seatName));
+        struct seat *seat = findSeat(seatName, false);
+        if (seat) {
+            addSeatInput(seat, path, true);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+
+
+    // Backlights, first one per seat
+
+    dir = opendir("/sys/class/backlight");
+    while (dir && (entry = readdir(dir))) {
+        if ('.' == entry->d_name[0]) {
+            continue;
+        }
+        char deviceId[300];
+        snprintf(deviceId, sizeof(deviceId), "+backlight:%s", entry->d_name);
+        udevSeat(deviceId, seatName, sizeof(seatName));
+        struct seat *seat = findSeat(seatName, false);
+        if (seat && -1 == seat->backlight.fd) {
+            snprintf(path, sizeof(path), "/sys/class/backlight/%s", entry->d_name);
+            openBacklight(&seat->backlight, path);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+}
+
+
+/*
+ * Creates seats from a config file instead of logind. Format, one
+ * directive per line, '#' starts a comment:
+ *
+ *   seat NAME          Start a seat
+ *   input PATH         Add an evdev device to the current seat
+ *   backlight DIR      Set the current seat's backlight directory
+ *   gamma DISPLAY      Dim the current seat through a Wayland display's
+ *                      gamma instead (WITH_WAYLAND)
+ *   overlay DISPLAY[,GEOMETRY]
+ *                      Dim the current seat with an X overlay window instead
+ *                      (WITH_X11)
+ */
+void loadSeatConfig(const char *path) {
+    char line[PATH_MAX + 32];
+    char key[16];
+    char value[PATH_MAX];
+    struct seat *seat = NULL;
+    int lineNumber = 0;
+
+    FILE *f = fopen(path, "re");
+    if (NULL == f) {
+        fprintf(stderr, "cannot open config %s (error %d); bailing\n", path, errno);
+        exit(-1);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        lineNumber++;
+        line[strcspn(line, "#\n")] = 0;
+        if (2 != sscanf(line, "%15s %4095s", key, value)) {
+            continue;
+        }
+        if (0 == strcmp(key, "seat")) {
+            seat = findSeat(value, true);
+        } else if (NULL == seat) {
+            fprintf(stderr, "%s:%d: %s before any seat\n", path, lineNumber, key);
+        } else if (0 == strcmp(key, "input")) {
+            addSeatInput(seat, value, false);
+        } else if (0 == strcmp(key, "backlight")) {
+            openBacklight(&seat->backlight, value);
+#ifdef WITH_WAYLAND
+        } else if (0 == strcmp(key, "gamma")) {
+            openGamma(&seat->gamma, value);
+#endif
+#ifdef WITH_X11
+        } else if (0 == strcmp(key, "overlay")) {
+            openOverlay(&seat->overlay, value);
+#endif
+        } else {
+            fprintf(stderr, "%s:%d: unknown directive %s\n", path, lineNumber, key);
+        }
+    }
+    fclose(f);
+}
+
+
+/*
+ * Dims a seat's backlight in proportion to scrollDiff, saving the current
+ * brightness first if this starts a penalty.
+ */
+void dimSeat(struct seat *seat, bool firstDim, int64_t scrollDiff) {
+    struct backlight *b = &seat->backlight;
+#ifdef WITH_WAYLAND
+    if (seat->gamma.display) {
+        float target = dimGamma(&seat->gamma, firstDim, scrollDiff);
+        publishBrightness(seat->detector.status, target, target < 0 ? 1 : target, 1);
+        return;
+    }
+#endif
+#ifdef WITH_X11
+    if (seat->overlay.display) {
+        float target = dimOverlay(&seat->overlay, firstDim, scrollDiff);
+        publishBrightness(seat->detector.status, target, target, 1);
+        return;
+    }
+#endif
+    float brightness = shadowBacklight(b);
+    if (firstDim) {
+        b->prevBrightness = brightness;
+        b->dimmed = true;
+        b->overridden = false;
+    }
+    if (b->overridden) {
+        return;
+    }
+    float target = dimmedBrightness(brightness, scrollDiff);
+    bool written = writeBacklight(b, target);
+    publishBrightness(seat->detector.status, target, written ? target : brightness,
+        b->prevBrightness);
+}
+
+
+/*
+ * Puts a seat's backlight back to its brightness before the penalty, unless
+ * it is already there.
+ */
+void restoreSeat(struct seat *seat) {
+    struct backlight *b = &seat->backlight;
+#ifdef WITH_WAYLAND
+    if (seat->gamma.display) {
+        restoreGamma(&seat->gamma);
+        publishBrightness(seat->detector.status, 1, 1, -1);
+        return;
+    }
+#endif
+#ifdef WITH_X11
+    if (seat->overlay.display) {
+        restoreOverlay(&seat->overlay);
+        publishBrightness(seat->detector.status, 1, 1, -1);
+        return;
+    }
+#endif
+    float target = b->prevBrightness;
+    bool written = (-1 != b->notifyFd && b->current == (int)(target * b->maxBrightness + 0.5)) ||
+        writeBacklight(b, target);
+    b->dimmed = false;
+    b->overridden = false;
+    publishBrightness(seat->detector.status, target, written ? target : -1, -1);
+}
+
+
+/*
+ * Takes raw, a brightness someone else set on seat's backlight, as its new
+ * baseline instead of overwriting it. During a penalty it becomes what the
+ * restore goes back to, and the penalty stops dimming: the user or the power
+ * daemon has taken the display back. The value we last wrote is ignored, as
+ * it is our own change or a daemon putting back what it saw.
+ */
+void adoptBrightness(struct seat *seat, int64_t raw) {
+    struct backlight *b = &seat->backlight;
+    if (raw < 0 || raw > b->maxBrightness || raw == b->current || raw == b->written) {
+        return;
+    }
+
+    float brightness = (float)raw / b->maxBrightness;
+    b->current = (int)raw;
+    if (b->dimmed) {
+        b->prevBrightness = brightness;
+        b->overridden = true;
+        printf("%s: brightness set to %.2f elsewhere; keeping it\n", seat->name, brightness);
+    }
+    publishBrightness(seat->detector.status, brightness, brightness,
+        b->dimmed ? b->prevBrightness : -1);
+}
+
+
+/*
+ * Privilege-separated actuator helper (-u)
+ *
+ * With -u USER, brainthrottle opens every device as root and then forks.
+ * The parent stays privileged as a tiny helper that owns the backlights;
+ * the child drops to USER and runs the detectors. They share an anonymous
+ * MAP_SHARED page set up before the fork: one SPSC command ring per worker
+ * plus a futex doorbell. A worker only rings the doorbell if the helper is
+ * asleep, so a burst of commands costs a few stores each. The helper
+ * validates every command and, when the detector process dies, restores
+ * every seat it has dimmed before exiting.
+ */
+#define kHelperSlots 256                // Commands per worker ring
+#define kHelperSpinUsec 50              // Helper polls this long before sleeping
+#define kMaxScrollDiff 1000000          // Larger dims are rejected
+
+struct helperRing {
+    _Atomic uint32_t head;              // Next slot to fill (worker)
+    char headPad[60];
+    _Atomic uint32_t tail;              // Next slot to drain (helper)
+    char tailPad[60];
+    struct brightnessCommand slots[kHelperSlots];
+};
+
+struct helperShared {
+    _Atomic uint32_t doorbell;          // futex word, bumped to wake the helper
+    _Atomic uint32_t sleeping;          // Helper is (about to be) in FUTEX_WAIT
+    char pad[56];
+    struct helperRing rings[kMaxWorkers];
+};
+
+struct helperShared *helper;            // Non-NULL if running with -u
+pid_t detectorPid;                      // Helper side: the detector process
+
+
+/*
+ * Rings the helper's doorbell if it is asleep. Also safe from a signal
+ * handler.
+ */
+void wakeHelper() {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&helper->sleeping, memory_order_relaxed)) {
+        atomic_fetch_add(&helper->doorbell, 1);
+        syscall(SYS_futex, &helper->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+
+/*
+ * Sends a command to the helper on worker's ring. Dims are dropped if the
+ * ring is full; restores wait for room. Worker side only.
+ */
+void sendHelper(int worker, struct brightnessCommand *command) {
+    struct helperRing *r = &helper->rings[worker];
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    while (head - atomic_load_explicit(&r->tail, memory_order_acquire) >= kHelperSlots) {
+        if (kCommandDim == command->op) {
+            return;
+        }
+        sched_yield();
+    }
+    r->slots[head % kHelperSlots] = *command;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    wakeHelper();
+}
+
+
+/*
+ * Helper side: checks and applies one command. Returns false if rejected.
+ */
+bool applyHelperCommand(int worker, struct brightnessCommand *command, bool *dimmed) {
+    if (command->seat < 0 || command->seat >= numSeats ||
+        seats[command->seat]->worker != &workers[worker]) {
+        return false;
+    }
+
+    struct seat *seat = seats[command->seat];
+    if (kCommandDim == command->op) {
+        if (command->scrollDiff < 1 || command->scrollDiff > kMaxScrollDiff) {
+            return false;
+        }
+        dimSeat(seat, !dimmed[command->seat], command->scrollDiff);
+        dimmed[command->seat] = true;
+    } else if (kCommandRestore == command->op) {
+        if (dimmed[command->seat]) {
+            restoreSeat(seat);
+            dimmed[command->seat] = false;
+        }
+    } else if (kCommandChanged == command->op) {
+        adoptBrightness(seat, command->scrollDiff);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Helper side: SIGCHLD/SIGTERM/SIGINT handler. Wakes the helper loop so it
+ * can notice the detector has gone; termination requests are passed on to
+ * the detector, whose death then triggers the restore.
+ */
+void handleHelperSignal(int signo) {
+    if (signo != SIGCHLD) {
+        kill(detectorPid, signo);
+    }
+    atomic_fetch_add(&helper->doorbell, 1);
+    syscall(SYS_futex, &helper->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+
+/*
+ * Helper process main loop. Applies commands until the detector exits, then
+ * restores every dimmed seat and exits with the detector's status.
+ */
+void runHelper() {
+    bool *dimmed = calloc(numSeats, sizeof(bool));
+    uint64_t applied = 0;
+    uint64_t rejected = 0;
+    int status = 0;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &handleHelperSignal;
+    sigaction(SIGCHLD, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    signal(SIGUSR1, SIG_IGN);
+
+
+    // Seats a snapshot says are still dimmed are ours to restore
+
+    for (int i = 0; i < numSeats; i++) {
+        dimmed[i] = seats[i]->detector.dimmed;
+    }
+
+    for (;;) {
+        bool busy = false;
+
+
+        // Drain every worker's ring
+
+        for (int i = 0; i < numWorkers; i++) {
+            struct helperRing *r = &helper->rings[i];
+            uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            while (tail != atomic_load_explicit(&r->head, memory_order_acquire)) {
+                struct brightnessCommand command = r->slots[tail % kHelperSlots];
+                atomic_store_explicit(&r->tail, ++tail, memory_order_release);
+                if (applyHelperCommand(i, &command, dimmed)) {
+                    applied++;
+                } else if (0 == rejected++ % 1000) {
+                    fprintf(stderr, "helper: rejected command (op %d, seat %d) from worker %d\n",
+                        command.op, command.seat, i);
+                }
+                busy = true;
+            }
+        }
+        if (busy) {
+            continue;
+        }
+
+
+        // Detector gone: put every backlight back and follow it out
+
+        if (detectorPid == waitpid(detectorPid, &status, WNOHANG)) {
+            for (int i = 0; i < numSeats; i++) {
+                if (dimmed[i]) {
+                    restoreSeat(seats[i]);
+                }
+            }
+            printf("helper: detector exited, %llu commands applied, %llu rejected\n",
+                (unsigned long long)applied, (unsigned long long)rejected);
+            exit(WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        }
+
+
+        // Spin briefly for the rest of a burst, then sleep on the doorbell
+
+        uint32_t ring = atomic_load(&helper->doorbell);
+        uint64_t spinUntil = nowNs() + kHelperSpinUsec * kNsecPerUsec;
+        while (nowNs() < spinUntil && ring == atomic_load(&helper->doorbell)) {
+            for (int i = 0; i < numWorkers && !busy; i++) {
+                busy = atomic_load_explicit(&helper->rings[i].head, memory_order_acquire) !=
+                    atomic_load_explicit(&helper->rings[i].tail, memory_order_relaxed);
+            }
+            if (busy) {
+                break;
+            }
+        }
+        if (busy) {
+            continue;
+        }
+
+        atomic_store(&helper->sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        ring = atomic_load(&helper->doorbell);
+        for (int i = 0; i < numWorkers && !busy; i++) {
+            busy = atomic_load(&helper->rings[i].head) != atomic_load(&helper->rings[i].tail);
+        }
+        if (!busy) {
+            syscall(SYS_futex, &helper->doorbell, FUTEX_WAIT, ring, NULL, NULL, 0);
+        }
+        atomic_store(&helper->sleeping, 0);
+    }
+}
+
+
+/*
+ * Maps the shared command rings and forks. The parent becomes the helper
+ * and never returns; the child closes the backlights, drops to user (if
+ * given) and returns to run the detectors.
+ */
+void startHelper(const char *user) {
+    struct passwd *pw = NULL;
+
+    if (user && NULL == (pw = getpwnam(user))) {
+        fprintf(stderr, "unknown user %s; bailing\n", user);
+        exit(-1);
+    }
+    helper = mmap(NULL, sizeof(struct helperShared), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == helper) {
+        fprintf(stderr, "Error mapping helper rings; bailing\n");
+        exit(-1);
+    }
+
+    fflush(stdout);
+    detectorPid = fork();
+    if (-1 == detectorPid) {
+        fprintf(stderr, "Error forking helper; bailing\n");
+        exit(-1);
+    } else if (detectorPid > 0) {
+        if (-1 != controlFd) {
+            close(controlFd);
+        }
+        if (-1 != ingestFd) {
+            close(ingestFd);
+        }
+        for (int i = 0; i < numSeats; i++) {
+            for (int j = 0; j < seats[i]->numInputs; j++) {
+                close(seats[i]->inputs[j].fd);
+            }
+        }
+        runHelper();
+    }
+
+    for (int i = 0; i < numSeats; i++) {
+        if (-1 != seats[i]->backlight.fd) {
+            close(seats[i]->backlight.fd);
+            seats[i]->backlight.fd = -1;
+        }
+#ifdef WITH_WAYLAND
+        closeGamma(&seats[i]->gamma);
+#endif
+#ifdef WITH_X11
+        if (seats[i]->overlay.display) {
+            close(ConnectionNumber(seats[i]->overlay.display));     // XCloseDisplay would talk to the server
+            seats[i]->overlay.display = NULL;
+        }
+#endif
+    }
+    if (pw) {
+        if (-1 == setgroups(0, NULL) || -1 == setgid(pw->pw_gid) || -1 == setuid(pw->pw_uid) ||
+            -1 != setuid(0)) {
+            fprintf(stderr, "Error dropping privileges to %s; bailing\n", user);
+            exit(-1);
+        }
+    }
+    startExitThread();
+}
+
+
+/*
+ * Starts a dim of seat's backlight, through the helper if there is one.
+ */
+void actuateDim(struct seat *seat, bool firstDim, int64_t scrollDiff) {
+    if (helper) {
+        struct brightnessCommand command = { nowNs(), kCommandDim, firstDim, scrollDiff, seat->index };
+        sendHelper(seat->worker->index, &command);
+    } else {
+        dimSeat(seat, firstDim, scrollDiff);
+    }
+}
+
+
+/*
+ * Handles a change notification from seat's backlight: reads the new value
+ * and adopts it, through the helper if there is one, which owns the shadow.
+ * Returns false if the watch failed.
+ */
+bool readBacklightWatch(struct seat *seat) {
+    int raw = readBacklightChange(&seat->backlight);
+    if (raw < 0) {
+        fprintf(stderr, "%s: backlight watch failed (error %d)\n", seat->name, errno);
+        return false;
+    }
+    if (helper) {
+        struct brightnessCommand command = { nowNs(), kCommandChanged, false, raw, seat->index };
+        sendHelper(seat->worker->index, &command);
+    } else {
+        adoptBrightness(seat, raw);
+    }
+    return true;
+}
+
+
+/*
+ * Restores seat's backlight, through the helper if there is one.
+ */
+void actuateRestore(struct seat *seat) {
+    if (helper) {
+        struct brightnessCommand command = { nowNs(), kCommandRestore, false, 0, seat->index };
+        sendHelper(seat->worker->index, &command);
+    } else {
+        restoreSeat(seat);
+    }
+}
+
+
+/*
+ * Sets seat's timers for its detector's and merge's deadlines.
+ */
+void armSeatTimers(struct seat *seat) {
+    struct timerWheel *tw = &seat->worker->wheel;
+    armTimer(tw, &seat->timer, detectorDeadline(&seat->detector));
+    armTimer(tw, &seat->mergeTimer, mergeDeadline(&seat->merge));
+}
+
+
+/*
+ * Notes that seat had events in this batch, so its merge is released and
+ * its timers set once the batch is read.
+ */
+void touchSeat(struct seat *seat) {
+    if (!seat->touched) {
+        seat->touched = true;
+        seat->worker->touched[seat->worker->numTouched++] = seat;
+    }
+}
+
+
+/*
+ * Timer handler for a seat's detector deadline: ends the penalty, or rolls
+ * up the last minute's activity.
+ */
+void fireSeatTimer(struct timer *t, uint64_t now) {
+    struct seat *seat = t->context;
+    if (expirePenalty(&seat->detector, now)) {
+        actuateRestore(seat);
+    }
+    armSeatTimers(seat);
+}
+
+
+/*
+ * Timer handler for a seat's merge deadline: releases the events that have
+ * waited out the reorder window.
+ */
+void fireMergeTimer(struct timer *t, uint64_t now) {
+    struct seat *seat = t->context;
+    mergeRelease(&seat->merge, now, false);
+    armSeatTimers(seat);
+}
+
+
+/*
+ * Wheel frame handler for seat inputs. Runs on the seat's worker.
+ */
+void handleSeatScroll(void *context, uint64_t time, int64_t scrollX, int64_t scrollY) {
+    struct seat *seat = context;
+    int64_t scrollDiff = 1 + llabs(scrollX) + llabs(scrollY);
+    bool firstDim;
+
+    if (detectScroll(&seat->detector, time, scrollDiff, (scrollY > 0) - (scrollY < 0), &firstDim)) {
+        actuateDim(seat, firstDim, scrollDiff);
+        atomic_fetch_add_explicit(&seat->worker->dims, 1, memory_order_relaxed);
+    }
+    recordLatency(&seat->worker->detectStats, nowNs() - time);
+}
+
+
+/*
+ * Navigation key handler for seat inputs. Runs on the seat's worker.
+ */
+void handleSeatKey(void *context, uint64_t time) {
+    struct seat *seat = context;
+
+    detectKey(&seat->detector, time);
+}
+
+
+/*
+ * Hands an event released by a seat's merge to its detector.
+ */
+void deliverSeatEvent(void *context, const struct mergeEvent *event) {
+    if (event->key) {
+        handleSeatKey(context, event->time);
+    } else {
+        handleSeatScroll(context, event->time, event->scrollX, event->scrollY);
+    }
+}
+
+
+/*
+ * Wheel frame handler for seat input devices and ingestion sockets.
+ * Queues the frame in the seat's merge. context is the device.
+ */
+void queueSeatScroll(void *context, uint64_t time, int64_t scrollX, int64_t scrollY) {
+    struct inputDevice *dev = context;
+    struct mergeEvent event = { time, scrollX, scrollY, false };
+
+    mergePush(&dev->seat->merge, dev->source, &event);
+    touchSeat(dev->seat);
+}
+
+
+/*
+ * Navigation key handler for seat input devices. context is the device.
+ */
+void queueSeatKey(void *context, uint64_t time) {
+    struct inputDevice *dev = context;
+    struct mergeEvent event = { time, 0, 0, true };
+
+    mergePush(&dev->seat->merge, dev->source, &event);
+    touchSeat(dev->seat);
+}
+
+
+/*
+ * Accepts pending ingestion socket connections onto worker 0, where they
+ * wait for the packet naming their seat.
+ */
+bool acceptIngest() {
+    int fd;
+
+    while (-1 != (fd = accept4(ingestFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))) {
+        struct inputDevice *dev = calloc(1, sizeof(struct inputDevice));
+        if (NULL == dev) {
+            close(fd);
+            continue;
+        }
+        dev->fd = fd;
+        dev->kind = kInputSocket;
+        dev->source = kSourceUnclaimed;
+        struct epoll_event event = { EPOLLIN, { .ptr = dev } };
+        epoll_ctl(workers[0].epollFd, EPOLL_CTL_ADD, fd, &event);
+    }
+    return true;
+}
+
+
+/*
+ * Attaches an ingestion connection to the seat named by its first packet
+ * and hands it to that seat's worker. Returns false if there's no such seat.
+ */
+bool attachIngestSocket(struct inputDevice *dev, const char *packet, size_t len) {
+    char name[kSeatNameLength];
+
+    snprintf(name, sizeof(name), "%.*s", (int)len, packet);
+    name[strcspn(name, "\n")] = '\0';
+    struct seat *seat = name[0] ? findSeat(name, false) : seats[0];
+    if (NULL == seat) {
+        fprintf(stderr, "ingest: unknown seat %s\n", name);
+        return false;
+    }
+    dev->handler = &queueSeatScroll;
+    dev->context = dev;
+    dev->seat = seat;
+    dev->name = seat->name;
+    struct epoll_event event = { EPOLLIN, { .ptr = dev } };
+    epoll_ctl(workers[0].epollFd, EPOLL_CTL_DEL, dev->fd, NULL);
+    epoll_ctl(seat->worker->epollFd, EPOLL_CTL_ADD, dev->fd, &event);
+    return true;
+}
+
+
+/*
+ * Reads everything pending on an ingestion connection. Returns false once
+ * the connection is closed or unusable.
+ */
+bool readIngestSocket(struct inputDevice *dev) {
+    struct btScroll records[kInputBatch];
+
+    for (;;) {
+        ssize_t len = recv(dev->fd, records, sizeof(records), 0);
+        if (len < 0) {
+            return errno == EAGAIN || errno == EINTR;
+        } else if (len == 0) {
+            return false;
+        } else if (NULL == dev->context) {
+            return attachIngestSocket(dev, (const char *)records, len);
+        }
+
+
+        // The seat's merge belongs to its worker, so the connection takes
+        // a source there rather than on worker 0 when it attaches
+
+        if (kSourceUnclaimed == dev->source) {
+            dev->source = mergeAddSource(&dev->seat->merge);
+        }
+
+
+        // Clients stamp records with CLOCK_MONOTONIC, which stops while
+        // suspended; shift them onto the nowNs() clock
+
+        uint64_t now = nowNs();
+        uint64_t slept = sleptNs();
+        for (size_t i = 0; i < len / sizeof(struct btScroll); i++) {
+            uint64_t time = records[i].time ? records[i].time + slept : 0;
+            if (time > now || now - time > kNsecPerSec) {
+                time = now;
+            }
+            if (records[i].scrollX || records[i].scrollY) {
+                handleFrame(dev, time, records[i].scrollX, records[i].scrollY);
+            }
+        }
+    }
+}
+
+
+/*
+ * Returns when the worker's timer wheel next needs running, or
+ * overloadDeadline (0 = none) if that is sooner; 0 if there are none.
+ */
+uint64_t nextDeadline(struct worker *w, uint64_t overloadDeadline) {
+    uint64_t deadline = wheelDeadline(&w->wheel);
+
+    if (overloadDeadline && (0 == deadline || overloadDeadline < deadline)) {
+        deadline = overloadDeadline;
+    }
+    return deadline;
+}
+
+
+/*
+ * Sets the worker's timer for deadline (0 = none) if that is sooner than
+ * it is already set for. A later deadline waits until the timer fires, so
+ * extending a penalty costs no syscall. The timer is absolute on
+ * CLOCK_BOOTTIME, so a deadline that passes while the machine is
+ * suspended fires as soon as it resumes.
+ */
+void armWorkerTimer(struct worker *w, uint64_t deadline) {
+    if (0 == deadline || (w->armed && w->armed <= deadline)) {
+        return;
+    }
+    uint64_t offset = atomic_load_explicit(&sleepOffsetNs, memory_order_relaxed);
+    uint64_t kernel = deadline > offset ? deadline - offset : 1;
+    struct itimerspec spec = { { 0, 0 }, { kernel / kNsecPerSec, kernel % kNsecPerSec } };
+    if (-1 == timerfd_settime(w->timer.fd, TFD_TIMER_ABSTIME, &spec, NULL)) {
+        fprintf(stderr, "worker%d: cannot set timer (error %d)\n", w->index, errno);
+        return;
+    }
+    w->armed = deadline;
+}
+
+
+/*
+ * Called when a worker wakes to find the machine has been suspended for
+ * slept ns. Deadlines that ran out meanwhile are handled by the rest of
+ * the loop as usual: the suspended time counts, so a penalty that ended
+ * while suspended restores the backlight now, and a suspend longer than
+ * restoreTimeoutSec starts the scroll count over. The seats' input devices
+ * start out aggregated.
+ */
+void resumeWorker(struct worker *w, uint64_t now, uint64_t slept) {
+    printf("worker%d: resumed after %.1f s suspended\n", w->index, (double)slept / kNsecPerSec);
+    for (int i = 0; i < w->numSeats; i++) {
+        for (int j = 0; j < w->seats[i]->numInputs; j++) {
+            resumeInput(&w->seats[i]->inputs[j], now);
+        }
+    }
+}
+
+
+/*
+ * Removes an input that has gone away from its worker and seat.
+ */
+void dropInput(struct worker *w, struct inputDevice *dev) {
+    if (kInputEvdev == dev->kind) {
+        fprintf(stderr, "input device gone (error %d)\n", errno);
+    }
+    epoll_ctl(w->epollFd, EPOLL_CTL_DEL, dev->fd, NULL);
+    close(dev->fd);
+    endOverload(dev, nowNs());
+    if (dev->seat) {
+        mergeRemoveSource(&dev->seat->merge, dev->source);
+    }
+    if (kInputSocket == dev->kind) {
+        free(dev);
+    }
+}
+
+
+/*
+ * Queues a multishot read of dev into the worker's provided buffers.
+ */
+void armInputRead(struct worker *w, struct inputDevice *dev) {
+    struct io_uring_sqe *sqe = uringSqe(&w->ring);
+    sqe->opcode = IORING_OP_READ_MULTISHOT;
+    sqe->fd = dev->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (uint64_t)(uintptr_t)dev | kUringRead;
+}
+
+
+/*
+ * Queues a multishot poll of the worker's epoll set.
+ */
+void armEpollPoll(struct worker *w) {
+    struct io_uring_sqe *sqe = uringSqe(&w->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = w->epollFd;
+    sqe->poll32_events = EPOLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = kUringPoll;
+}
+
+
+/*
+ * Switches worker w to the io_uring engine: evdev inputs move from epoll to
+ * multishot reads, and the epoll set is polled through the ring. Stays on
+ * epoll if the kernel can't do this. Worker thread only.
+ */
+void startUring(struct worker *w) {
+    if (!openUring(&w->ring, kUringEntries, true) ||
+        !uringProvideBuffers(&w->ring, kUringBufferEvents * sizeof(struct input_event))) {
+        fprintf(stderr, "worker%d: io_uring unavailable (error %d), using epoll\n", w->index, errno);
+        if (-1 != w->ring.fd) {
+            close(w->ring.fd);
+            w->ring.fd = -1;
+        }
+        return;
+    }
+    for (int i = 0; i < w->numSeats; i++) {
+        struct seat *seat = w->seats[i];
+        for (int j = 0; j < seat->numInputs; j++) {
+            epoll_ctl(w->epollFd, EPOLL_CTL_DEL, seat->inputs[j].fd, NULL);
+            armInputRead(w, &seat->inputs[j]);
+        }
+    }
+    armEpollPoll(w);
+    threadUring = &w->ring;
+}
+
+
+/*
+ * Handles the completions on worker w's ring: input data goes straight to
+ * the inputs' handlers, and finished reads are re-armed. If the epoll set
+ * has become ready, its events are put in events for the caller to handle.
+ * Returns how many.
+ */
+int reapWorkerRing(struct worker *w, struct epoll_event *events) {
+    struct io_uring_cqe cqe;
+    bool pollEpoll = w->epollPending;
+
+    while (uringCompletion(&w->ring, &cqe)) {
+        int kind = (int)(cqe.user_data & 3);
+        void *ptr = (void *)(uintptr_t)(cqe.user_data & ~(uint64_t)3);
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+
+        if (kUringWrite == kind) {
+            completeBacklightWrite(ptr, cqe.res);
+        } else if (kUringPoll == kind) {
+            pollEpoll = true;
+            if (!more) {
+                armEpollPoll(w);
+            }
+        } else {
+            struct inputDevice *dev = ptr;
+            if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+                uint16_t bid = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                handleInputEvents(dev, (struct input_event *)(w->ring.buffers + bid * w->ring.bufferSize),
+                    cqe.res / sizeof(struct input_event));
+                uringRecycle(&w->ring, bid);
+            }
+            if (more) {
+                continue;
+            }
+
+
+            // Running out of buffers just ends the read. Without multishot
+            // reads, or at end of file (a pipe with no writer yet), the
+            // device goes back to epoll, which waits for it properly
+
+            if (cqe.res > 0 || -ENOBUFS == cqe.res) {
+                armInputRead(w, dev);
+            } else if (0 == cqe.res || -EINVAL == cqe.res || -EOPNOTSUPP == cqe.res) {
+                struct epoll_event event = { EPOLLIN, { .ptr = dev } };
+                epoll_ctl(w->epollFd, EPOLL_CTL_ADD, dev->fd, &event);
+                w->noMultishot |= 0 != cqe.res;
+            } else {
+                errno = -cqe.res;
+                dropInput(w, dev);
+            }
+        }
+    }
+
+    int n = 0;
+    if (pollEpoll) {
+        threadSyscalls++;
+        n = epoll_wait(w->epollFd, events, kWorkerEvents, 0);
+        n = n < 0 ? 0 : n;
+    }
+    w->epollPending = kWorkerEvents == n;
+    return n;
+}
+
+
+/*
+ * Returns whether any of worker w's backlight writes is queued on its ring
+ * or in flight.
+ */
+bool workerWriting(struct worker *w) {
+    for (int i = 0; i < w->numSeats; i++) {
+        if (w->seats[i]->backlight.ringBusy) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*
+ * Parks worker w for exit. Its ring's backlight writes are finished first,
+ * so none can land after the exit thread's restore. Worker thread only;
+ * never returns.
+ */
+void parkWorker(struct worker *w) {
+    struct io_uring_cqe cqe;
+
+    while (-1 != w->ring.fd && workerWriting(w)) {
+        uringEnter(&w->ring, 1);
+        while (uringCompletion(&w->ring, &cqe)) {
+            void *ptr = (void *)(uintptr_t)(cqe.user_data & ~(uint64_t)3);
+            if (kUringWrite == (int)(cqe.user_data & 3)) {
+                completeBacklightWrite(ptr, cqe.res);
+            } else if (cqe.flags & IORING_CQE_F_BUFFER) {
+                uringRecycle(&w->ring, (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+            }
+        }
+    }
+    threadUring = NULL;
+    atomic_fetch_add(&workersParked, 1);
+    for (;;) {
+        pause();
+    }
+}
+
+
+/*
+ * Seat worker. Waits on its shard's input devices and penalty deadlines.
+ */
+void *seatWorker(void *arg) {
+    struct worker *w = arg;
+    struct epoll_event events[kWorkerEvents];
+    char name[16];
+    uint64_t overloadDeadline = 0;
+
+    snprintf(name, sizeof(name), "worker%d", w->index);
+    configureThread(name, -1, 0);
+    historyProducer = w->index + 1;
+    w->slept = sleptNs();
+    initWheel(&w->wheel, nowNs());
+    for (int i = 0; i < w->numSeats; i++) {
+        w->seats[i]->timer.fire = &fireSeatTimer;
+        w->seats[i]->timer.context = w->seats[i];
+        w->seats[i]->mergeTimer.fire = &fireMergeTimer;
+        w->seats[i]->mergeTimer.context = w->seats[i];
+        armSeatTimers(w->seats[i]);
+    }
+    w->ring.fd = -1;
+    if (useUring) {
+        startUring(w);
+    }
+    atomic_fetch_add(&workersRunning, 1);
+    for (;;) {
+        int n = 0;
+        if (-1 != w->ring.fd) {
+            uringEnter(&w->ring, w->epollPending ? 0 : 1);
+        } else {
+            threadSyscalls++;
+            n = epoll_wait(w->epollFd, events, kWorkerEvents, -1);
+        }
+        if (atomic_load_explicit(&workersExiting, memory_order_relaxed)) {
+            parkWorker(w);
+        }
+        atomic_fetch_add_explicit(&w->wakeups, 1, memory_order_relaxed);
+        beginBatch();
+
+
+        // Check for a resume before reading what was queued during it
+
+        uint64_t slept = sleptNs();
+        if (slept >= w->slept + kMinSuspendNs) {
+            resumeWorker(w, nowNs(), slept - w->slept);
+        }
+        w->slept = slept;
+        if (-1 != w->ring.fd) {
+            n = reapWorkerRing(w, events);
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct inputDevice *dev = events[i].data.ptr;
+            bool alive;
+            if (kInputEvdev == dev->kind) {
+                alive = readInputDevice(dev);
+                if (alive && -1 != w->ring.fd && !w->noMultishot) {
+                    epoll_ctl(w->epollFd, EPOLL_CTL_DEL, dev->fd, NULL);
+                    armInputRead(w, dev);
+                }
+            } else if (kInputSocket == dev->kind) {
+                alive = readIngestSocket(dev);
+            } else if (kInputTimer == dev->kind) {
+                uint64_t expirations;
+                alive = true;
+                w->armed = 0;
+                threadSyscalls++;
+                if (-1 == read(dev->fd, &expirations, sizeof(expirations)) && EAGAIN != errno) {
+                    fprintf(stderr, "worker%d: timer read failed (error %d)\n", w->index, errno);
+                }
+            } else if (kInputBacklight == dev->kind) {
+                alive = readBacklightWatch(dev->context);
+                if (!alive) {
+                    epoll_ctl(w->epollFd, EPOLL_CTL_DEL, dev->fd, NULL);
+                    continue;
+                }
+            } else {
+                alive = acceptIngest();
+            }
+            if (!alive) {
+                dropInput(w, dev);
+            }
+        }
+
+        uint64_t now = nowNs();
+        overloadDeadline = expireOverloads(now);
+        for (int i = 0; i < w->numTouched; i++) {
+            struct seat *seat = w->touched[i];
+            seat->touched = false;
+            mergeRelease(&seat->merge, now, false);
+            armSeatTimers(seat);
+        }
+        w->numTouched = 0;
+        runTimers(&w->wheel, now);
+        armWorkerTimer(w, nextDeadline(w, overloadDeadline));
+        atomic_store_explicit(&w->syscalls, threadSyscalls, memory_order_relaxed);
+        endBatch();
+    }
+    return NULL;
+}
+
+
+/*
+ * Raises the open file limit so hundreds of seats' devices fit.
+ */
+void raiseFileLimit() {
+    struct rlimit limit;
+    if (0 == getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+
+/*
+ * Picks up sockets passed by systemd socket activation: the control
+ * socket and the ingestion socket, told apart by FileDescriptorName=
+ * ("control", "ingest") or else by socket type.
+ */
+void takeListenFds() {
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    const char *names = getenv("LISTEN_FDNAMES");
+    int type;
+    socklen_t len = sizeof(type);
+
+    if (NULL == pid || NULL == fds || getpid() != atoi(pid)) {
+        return;
+    }
+    int count = atoi(fds);
+    for (int i = 0; i < count; i++) {
+        int fd = 3 + i;
+        size_t nameLen = names ? strcspn(names, ":") : 0;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if ((nameLen == 7 && 0 == strncmp(names, "control", 7)) ||
+            (0 == nameLen && 0 == getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) &&
+             SOCK_STREAM == type)) {
+            controlFd = fd;
+        } else if ((nameLen == 6 && 0 == strncmp(names, "ingest", 6)) ||
+            (0 == nameLen && 0 == getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) &&
+             SOCK_SEQPACKET == type)) {
+            ingestFd = fd;
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        } else {
+            fprintf(stderr, "ignoring unexpected socket-activated fd %d\n", fd);
+        }
+        if (names) {
+            names = names[nameLen] ? names + nameLen + 1 : NULL;
+        }
+    }
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+}
+
+
+/*
+ * Sends state (e.g. "READY=1") to systemd if it started us with
+ * NOTIFY_SOCKET. Same protocol as sd_notify, without libsystemd.
+ */
+void notifySystemd(const char *state) {
+    struct sockaddr_un addr;
+    const char *path = getenv("NOTIFY_SOCKET");
+
+    if (NULL == path || ('/' != path[0] && '@' != path[0]) || strlen(path) >= sizeof(addr.sun_path)) {
+        return;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ('@' == path[0]) {
+        addr.sun_path[0] = '\0';
+    }
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (-1 != fd) {
+        sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr,
+            offsetof(struct sockaddr_un, sun_path) + strlen(path));
+        close(fd);
+    }
+}
+
+
+/*
+ * Shards seats across count workers (capped at the number of seats) and
+ * sets up each worker's epoll set. No threads are started yet.
+ */
+void assignWorkers(int count) {
+    if (count > numSeats) {
+        count = numSeats;
+    }
+    if (count > kMaxWorkers) {
+        count = kMaxWorkers;
+    }
+    if (count < 1) {
+        fprintf(stderr, "No seats found; bailing\n");
+        exit(-1);
+    }
+    numWorkers = count;
+
+    for (int i = 0; i < count; i++) {
+        workers[i].index = i;
+        workers[i].epollFd = epoll_create1(EPOLL_CLOEXEC);
+        workers[i].seats = calloc(numSeats / count + 1, sizeof(struct seat *));
+        workers[i].touched = calloc(numSeats / count + 1, sizeof(struct seat *));
+        workers[i].timer.fd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+        workers[i].timer.kind = kInputTimer;
+        struct epoll_event event = { EPOLLIN, { .ptr = &workers[i].timer } };
+        if (-1 == workers[i].epollFd || NULL == workers[i].seats || NULL == workers[i].touched ||
+            -1 == workers[i].timer.fd ||
+            -1 == epoll_ctl(workers[i].epollFd, EPOLL_CTL_ADD, workers[i].timer.fd, &event)) {
+            fprintf(stderr, "Error creating worker; bailing\n");
+            exit(-1);
+        }
+    }
+    for (int i = 0; i < numSeats; i++) {
+        struct worker *w = &workers[i % count];
+        struct seat *seat = seats[i];
+        seat->worker = w;
+        w->seats[w->numSeats++] = seat;
+        seat->merge.handler = &deliverSeatEvent;
+        seat->merge.context = seat;
+        for (int j = 0; j < seat->numInputs; j++) {
+            struct inputDevice *dev = &seat->inputs[j];
+            struct epoll_event event = { EPOLLIN, { .ptr = dev } };
+            dev->handler = &queueSeatScroll;
+            dev->navigate = &queueSeatKey;
+            dev->context = dev;
+            dev->seat = seat;
+            dev->name = seat->name;
+            dev->source = mergeAddSource(&seat->merge);
+            epoll_ctl(w->epollFd, EPOLL_CTL_ADD, dev->fd, &event);
+        }
+        if (-1 != seat->backlight.notifyFd) {
+            struct inputDevice *dev = &seat->backlightWatch;
+            struct epoll_event event = { seat->backlight.regularFile ? EPOLLIN : EPOLLPRI,
+                { .ptr = dev } };
+            dev->fd = seat->backlight.notifyFd;
+            dev->kind = kInputBacklight;
+            dev->context = seat;
+            epoll_ctl(w->epollFd, EPOLL_CTL_ADD, dev->fd, &event);
+        }
+        const char *actuator = -1 == seat->backlight.fd ? "no backlight" : "backlight";
+#ifdef WITH_WAYLAND
+        if (seat->gamma.display) {
+            actuator = "gamma";
+        }
+#endif
+#ifdef WITH_X11
+        if (seat->overlay.display) {
+            actuator = "overlay";
+        }
+#endif
+        if (!simulateDisplay) {
+            printf("%s: %d input device(s), %s, worker %d\n", seat->name, seat->numInputs,
+                actuator, w->index);
+        }
+    }
+    if (-1 != ingestFd) {
+        struct epoll_event event = { EPOLLIN, { .ptr = &ingestListener } };
+        ingestListener.fd = ingestFd;
+        epoll_ctl(workers[0].epollFd, EPOLL_CTL_ADD, ingestFd, &event);
+    }
+}
+
+
+/*
+ * Returns how many times this process's threads have been switched in,
+ * i.e. woken up, from /proc.
+ */
+uint64_t countWakeups() {
+    char path[PATH_MAX];
+    char line[128];
+    unsigned long long count;
+    uint64_t total = 0;
+    struct dirent *entry;
+
+    DIR *dir = opendir("/proc/self/task");
+    while (dir && NULL != (entry = readdir(dir))) {
+        snprintf(path, sizeof(path), "/proc/self/task/%s/status", entry->d_name);
+        FILE *file = fopen(path, "r");
+        while (file && fgets(line, sizeof(line), file)) {
+            if (1 == sscanf(line, "voluntary_ctxt_switches: %llu", &count) ||
+                1 == sscanf(line, "nonvoluntary_ctxt_switches: %llu", &count)) {
+                total += count;
+            }
+        }
+        if (file) {
+            fclose(file);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return total;
+}
+
+
+/*
+ * Starts the workers set up by assignWorkers. Worker 0 runs on the calling
+ * thread if runFirst is set (this call then never returns).
+ */
+void startWorkers(bool runFirst) {
+    char state[64];
+
+    reportWakeups = countWakeups();
+    reportTime = nowNs();
+    for (int i = runFirst ? 1 : 0; i < numWorkers; i++) {
+        if (0 != pthread_create(&workers[i].thread, NULL, &seatWorker, &workers[i])) {
+            fprintf(stderr, "Error starting worker; bailing\n");
+            exit(-1);
+        }
+    }
+    if (!simulateDisplay) {
+        snprintf(state, sizeof(state), "READY=1\nSTATUS=Watching %d seat(s)", numSeats);
+        notifySystemd(state);
+    }
+    if (runFirst) {
+        workers[0].thread = pthread_self();
+        seatWorker(&workers[0]);
+    }
+}
+
+
+/*
+ * Stops the seat workers at exit: wakes each through its timer and waits,
+ * for up to kParkWorkersMs, for them to park.
+ */
+void stopWorkers() {
+    struct itimerspec spec = { { 0, 0 }, { 0, 1 } };
+
+    atomic_store(&workersExiting, true);
+    for (int i = 0; i < numWorkers; i++) {
+        timerfd_settime(workers[i].timer.fd, 0, &spec, NULL);
+    }
+    for (int waited = 0; atomic_load(&workersParked) < atomic_load(&workersRunning); waited++) {
+        if (waited == kParkWorkersMs) {
+            fprintf(stderr, "%d worker(s) didn't stop; restoring anyway\n",
+                atomic_load(&workersRunning) - atomic_load(&workersParked));
+            break;
+        }
+        usleep(1000);
+    }
+}
+
+
+/*
+ * Restores every penalized seat and ends its penalty, so a snapshot taken
+ * after doesn't dim it again. Called at exit. With a helper, the helper
+ * restores the backlights when it sees us exit.
+ */
+void restoreSeats() {
+    for (int i = 0; i < numSeats; i++) {
+        struct detector *d = &seats[i]->detector;
+        if (d->dimmed && !helper) {
+            restoreSeat(seats[i]);
+        }
+        if (d->penalized) {
+            d->penalized = false;
+            d->dimmed = false;
+            publishDetector(d);
+        }
+    }
+}
+
+
+/*
+ * Prints per-worker wakeups, dims and detection latency, and the whole
+ * process's wakeups per second since the last report.
+ */
+void printSeatStats() {
+    char name[16];
+
+    uint64_t now = nowNs();
+    uint64_t wakeups = countWakeups();
+    printf("Process: %.2f wakeups/s over the last %.1f s\n",
+        (wakeups - reportWakeups) * (double)kNsecPerSec / (now - reportTime),
+        (double)(now - reportTime) / kNsecPerSec);
+    reportWakeups = wakeups;
+    reportTime = now;
+
+    printf("Seat stats: %d seat(s) on %d worker(s)\n", numSeats, numWorkers);
+    for (int i = 0; i < numWorkers; i++) {
+        snprintf(name, sizeof(name), "worker%d", i);
+        printf("  %-8s %4d seats  %10llu wakeups  %10llu syscalls  %8llu dims\n", name,
+            workers[i].numSeats, (unsigned long long)atomic_load(&workers[i].wakeups),
+            (unsigned long long)atomic_load(&workers[i].syscalls),
+            (unsigned long long)atomic_load(&workers[i].dims));
+        printStage(name, &workers[i].detectStats);
+    }
+    for (int i = 0; i < numSeats; i++) {
+        uint64_t reordered = atomic_load(&seats[i]->merge.reordered);
+        if (reordered) {
+            printf("  %-8s %llu events reordered, %llu late\n", seats[i]->name,
+                (unsigned long long)reordered,
+                (unsigned long long)atomic_load(&seats[i]->merge.late));
+        }
+    }
+    fflush(stdout);
+}
+
+
+/*
+ * Prints how often inputs have been switched to aggregated mode and what
+ * that saved, if they ever have. Inputs still aggregating aren't counted
+ * until they switch back.
+ */
+void printOverloadStats() {
+    uint64_t storms = atomic_load(&overloadStorms);
+
+    if (storms) {
+        printf("Overload: %llu switch(es) to aggregated mode, %llu frames summed, about %.1f ms of "
+            "CPU saved\n", (unsigned long long)storms, (unsigned long long)atomic_load(&overloadFolded),
+            (double)atomic_load(&overloadSavedNs) / (kNsecPerSec / 1000));
+        fflush(stdout);
+    }
+}
+
+
+#endif
+
+
+/*
+ * State snapshots
+ *
+ * With -P, every slot of the status page plus the config is saved to a
+ * flat file: a header followed by one fixed-size record per seat, so a
+ * restart maps it and copies records straight into the detectors. The
+ * snapshot thread sleeps until state changes, waits kSnapshotIntervalSec
+ * to batch further changes, and writes a new file beside the old one
+ * before renaming it into place. A final snapshot is written at exit.
+ */
+#define kSnapshotMagic 0x50534842       // "BHSP"
+#define kSnapshotVersion 2
+const int kSnapshotIntervalSec = 10;
+
+struct snapshotSeat {
+    char name[48];                      // Status page slot name
+    int64_t recentScrollTotal;
+    uint64_t lastScrollTime;
+    uint64_t penaltyDeadline;
+    uint32_t penalized;
+    float restoreBrightness;            // -1 unless the seat is dimmed
+    struct btSketch gaps;               // The detector's sketches, kept across boots
+    struct btSketch bursts;
+};
+
+struct snapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numSeats;
+    uint32_t seatSize;                  // sizeof(struct snapshotSeat)
+    uint32_t configSize;                // sizeof(struct config), 0 if not saved
+    uint32_t reserved;
+    uint64_t checksum;                  // FNV-1a of everything after this field
+    uint64_t savedAt;                   // nowNs() when written
+    char bootId[40];                    // Times are only valid within one boot
+    struct config config;
+    struct snapshotSeat seats[];
+};
+
+
+/*
+ * Gets an id for the current boot, so monotonic times from an earlier boot
+ * are not mistaken for recent ones.
+ */
+void getBootId(char *id, size_t size) {
+    memset(id, 0, size);
+#ifdef __APPLE__
+    struct timeval boot;
+    size_t len = sizeof(boot);
+    if (0 == sysctlbyname("kern.boottime", &boot, &len, NULL, 0)) {
+        snprintf(id, size, "%ld.%06d", (long)boot.tv_sec, (int)boot.tv_usec);
+    }
+#else
+    FILE *file = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (file) {
+        if (fgets(id, size, file)) {
+            id[strcspn(id, "\n")] = '\0';
+        }
+        fclose(file);
+    }
+#endif
+}
+
+
+/*
+ * FNV-1a over len bytes.
+ */
+uint64_t checksum(const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+/*
+ * Returns the detector publishing to status page slot i, or NULL.
+ */
+struct detector *slotDetector(uint32_t i) {
+    if (mainDetector.status) {
+        return 0 == i ? &mainDetector : NULL;
+    }
+#ifdef __linux__
+    if (i < (uint32_t)numSeats) {
+        return &seats[i]->detector;
+    }
+#endif
+    return NULL;
+}
+
+
+/*
+ * Writes the status page and config to snapshotPath, atomically replacing
+ * the previous snapshot. Returns false if it couldn't.
+ */
+bool writeSnapshot() {
+    static atomic_int writes;
+    struct btStatusSeat slot;
+    char tmpPath[PATH_MAX];
+
+    if (NULL == snapshotPath || NULL == statusPage) {
+        return false;
+    }
+    size_t size = sizeof(struct snapshotHeader) + statusPage->numSeats * sizeof(struct snapshotSeat);
+    struct snapshotHeader *h = calloc(1, size);
+    if (NULL == h) {
+        return false;
+    }
+    h->magic = kSnapshotMagic;
+    h->version = kSnapshotVersion;
+    h->numSeats = statusPage->numSeats;
+    h->seatSize = sizeof(struct snapshotSeat);
+    h->savedAt = nowNs();
+    getBootId(h->bootId, sizeof(h->bootId));
+
+
+    // The config can only be freed under configLock. Don't wait for it: a
+    // change in progress marks us dirty again.
+
+    if (0 == pthread_mutex_trylock(&configLock)) {
+        h->config = *atomic_load(&currentConfig);
+        h->configSize = sizeof(struct config);
+        pthread_mutex_unlock(&configLock);
+    }
+    for (uint32_t i = 0; i < h->numSeats; i++) {
+        struct snapshotSeat *r = &h->seats[i];
+        btStatusRead(&statusPage->seats[i], &slot);
+        memcpy(r->name, slot.actuator.name, sizeof(r->name));
+        r->recentScrollTotal = slot.detector.recentScrollTotal;
+        r->lastScrollTime = slot.detector.lastScrollTime;
+        r->penaltyDeadline = slot.detector.penaltyDeadline;
+        r->penalized = slot.detector.penalized;
+        r->restoreBrightness = slot.actuator.restoreBrightness;
+        struct detector *d = slotDetector(i);
+        if (d && d->sketches) {
+            btSketchMerge(&r->gaps, &d->sketches->gaps);
+            btSketchMerge(&r->bursts, &d->sketches->bursts);
+        }
+    }
+    h->checksum = checksum((char *)h + offsetof(struct snapshotHeader, savedAt),
+        size - offsetof(struct snapshotHeader, savedAt));
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d.%d", snapshotPath, (int)getpid(),
+        atomic_fetch_add(&writes, 1));
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = -1 != fd && (ssize_t)size == write(fd, h, size) && 0 == fsync(fd);
+    if (-1 != fd) {
+        close(fd);
+    }
+    if (!written || -1 == rename(tmpPath, snapshotPath)) {
+        fprintf(stderr, "cannot write snapshot %s (error %d)\n", snapshotPath, errno);
+        unlink(tmpPath);
+        written = false;
+    }
+    free(h);
+    return written;
+}
+
+
+/*
+ * Snapshot thread. Sleeps until markDirty wakes it, so an idle
+ * brainthrottle never wakes up for snapshots.
+ */
+void *snapshotThread(void *arg) {
+    char wake[16];
+
+    for (;;) {
+        if (read(snapshotPipe[0], wake, sizeof(wake)) <= 0 && EINTR != errno) {
+            return NULL;
+        }
+        sleep(kSnapshotIntervalSec);
+        atomic_store(&snapshotDirty, false);
+        writeSnapshot();
+    }
+}
+
+
+/*
+ * Starts the snapshot thread if there is a snapshot path.
+ */
+void startSnapshots() {
+    pthread_t thread;
+
+    if (NULL == snapshotPath) {
+        return;
+    }
+    if (-1 == pipe(snapshotPipe) || 0 != pthread_create(&thread, NULL, &snapshotThread, NULL)) {
+        fprintf(stderr, "Error starting snapshot thread; bailing\n");
+        exit(-1);
+    }
+    fcntl(snapshotPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(snapshotPipe[1], F_SETFD, FD_CLOEXEC);
+}
+
+
+/*
+ * Copies a snapshot record into a detector. Penalty timing is only kept
+ * within the same boot; the sketches are kept regardless. Returns true if the screen was left dimmed and
+ * the caller should restore restoreBrightness now.
+ */
+bool restoreDetector(struct detector *d, const struct snapshotSeat *r, bool sameBoot) {
+    bool dimmed = r->restoreBrightness >= 0;
+
+    if (d->sketches) {
+        d->sketches->gaps = r->gaps;
+        d->sketches->bursts = r->bursts;
+    }
+    if (sameBoot) {
+        d->recentScrollTotal = r->recentScrollTotal;
+        d->lastScrollTime = r->lastScrollTime;
+        d->penaltyDeadline = r->penaltyDeadline;
+        d->penalized = r->penalized;
+        d->dimmed = d->penalized && dimmed;
+        d->penaltyStart = d->penalized ? nowNs() : 0;
+    }
+    publishDetector(d);
+    return dimmed && !d->dimmed;
+}
+
+
+/*
+ * Maps the snapshot at path and checks it. Returns NULL, after saying why
+ * unless the file doesn't exist, if it can't be used; otherwise the caller
+ * unmaps *size bytes.
+ */
+const struct snapshotHeader *mapSnapshot(const char *path, size_t *size) {
+    struct stat st;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (-1 == fd) {
+        if (ENOENT != errno) {
+            fprintf(stderr, "ignoring unreadable snapshot %s\n", path);
+        }
+        return NULL;
+    }
+    const struct snapshotHeader *h = MAP_FAILED;
+    if (0 == fstat(fd, &st) && (size_t)st.st_size >= sizeof(struct snapshotHeader)) {
+        h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (MAP_FAILED == h) {
+        fprintf(stderr, "ignoring unreadable snapshot %s\n", path);
+        return NULL;
+    }
+    if (kSnapshotMagic != h->magic || kSnapshotVersion != h->version ||
+        sizeof(struct snapshotSeat) != h->seatSize ||
+        (size_t)st.st_size != sizeof(struct snapshotHeader) + h->numSeats * sizeof(struct snapshotSeat) ||
+        h->checksum != checksum((char *)h + offsetof(struct snapshotHeader, savedAt),
+            st.st_size - offsetof(struct snapshotHeader, savedAt))) {
+        fprintf(stderr, "ignoring corrupt snapshot %s\n", path);
+        munmap((void *)h, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return h;
+}
+
+
+/*
+ * Loads detector and actuator state from snapshotPath, if it exists and is
+ * intact: maps it, checks it and copies each record to the seat with the
+ * same name. The saved config is used too unless -o was given. Must run
+ * before workers, the pipeline or the helper start. Returns the number of
+ * seats restored.
+ */
+int loadSnapshot() {
+    char bootId[40];
+    int restored = 0;
+    size_t size;
+
+    const struct snapshotHeader *h = snapshotPath ? mapSnapshot(snapshotPath, &size) : NULL;
+    if (NULL == h) {
+        return 0;
+    }
+
+    getBootId(bootId, sizeof(bootId));
+    bool sameBoot = bootId[0] && 0 == strncmp(bootId, h->bootId, sizeof(bootId)) &&
+        h->savedAt <= nowNs();
+    if (snapshotConfig && sizeof(struct config) == h->configSize) {
+        struct config *saved = malloc(sizeof(struct config));
+        if (saved) {
+            *saved = h->config;
+            if (saved->detector < 0 || saved->detector >= (int)(sizeof(detectorNames) / sizeof(*detectorNames)) ||
+                saved->actuator < 0 || saved->actuator >= (int)(sizeof(actuatorNames) / sizeof(*actuatorNames))) {
+                free(saved);
+            } else {
+                atomic_store(&currentConfig, saved);
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < h->numSeats; i++) {
+        const struct snapshotSeat *r = &h->seats[i];
+        char name[sizeof(r->name) + 1];
+        snprintf(name, sizeof(name), "%.*s", (int)sizeof(r->name), r->name);
+#ifdef __linux__
+        struct seat *seat = mainDetector.status ? NULL : findSeat(name, false);
+        if (seat) {
+            if (r->restoreBrightness >= 0) {
+                seat->backlight.prevBrightness = r->restoreBrightness;
+            }
+            if (restoreDetector(&seat->detector, r, sameBoot)) {
+                restoreSeat(seat);
+            } else {
+                seat->backlight.dimmed = seat->detector.dimmed;
+                publishBrightness(seat->detector.status, -1, readBacklight(&seat->backlight),
+                    seat->detector.dimmed ? seat->backlight.prevBrightness : -1);
+            }
+            restored++;
+            continue;
+        }
+#endif
+        if (0 == strcmp(name, "main") && mainDetector.status) {
+            if (r->restoreBrightness >= 0) {
+                prevBrightness = r->restoreBrightness;
+            }
+            if (restoreDetector(&mainDetector, r, sameBoot)) {
+                restoreBrightness();
+            } else if (mainDetector.dimmed) {
+                publishBrightness(mainDetector.status, -1, getBrightness(), prevBrightness);
+            }
+            restored++;
+        }
+    }
+    munmap((void *)h, size);
+    return restored;
+}
+
+
+/*
+ * Prints how many gaps and bursts were counted and their median, 90th and
+ * 99th percentiles.
+ */
+void printSketch(const char *name, const struct btSketch *gaps, const struct btSketch *bursts) {
+    printf("  %-8s gaps %8llu  p50/p90/p99 %8.1f %8.1f %8.1f ms  bursts %6llu  p50/p90/p99 %6llu %6llu %6llu\n",
+        name, (unsigned long long)gaps->count,
+        btSketchQuantile(gaps, 0.5) / 1000.0, btSketchQuantile(gaps, 0.9) / 1000.0,
+        btSketchQuantile(gaps, 0.99) / 1000.0, (unsigned long long)bursts->count,
+        (unsigned long long)btSketchQuantile(bursts, 0.5),
+        (unsigned long long)btSketchQuantile(bursts, 0.9),
+        (unsigned long long)btSketchQuantile(bursts, 0.99));
+}
+
+
+/*
+ * Prints every detector's sketches.
+ */
+void printSketches() {
+    printf("Sketches:\n");
+    if (mainDetector.status || mainDetector.sketches->gaps.count) {
+        printSketch("main", &mainDetector.sketches->gaps, &mainDetector.sketches->bursts);
+    }
+#ifdef __linux__
+    for (int i = 0; i < numSeats; i++) {
+        printSketch(seats[i]->name, &seats[i]->detector.sketches->gaps,
+            &seats[i]->detector.sketches->bursts);
+    }
+#endif
+    fflush(stdout);
+}
+
+
+/*
+ * Merges the sketches in the snapshots at paths, from any number of
+ * machines, and prints the gap and burst quantiles of each seat name and of
+ * all seats together. Returns the number of snapshots read.
+ */
+int mergeSnapshots(int count, char **paths) {
+    struct merged {
+        char name[sizeof(((struct snapshotSeat *)0)->name) + 1];
+        struct btSketch gaps;
+        struct btSketch bursts;
+    } *merged = calloc(1, sizeof(struct merged));
+    int numMerged = 1;
+    int read = 0;
+    size_t size;
+
+    if (NULL == merged) {
+        fprintf(stderr, "Error allocating sketches; bailing\n");
+        exit(-1);
+    }
+    snprintf(merged[0].name, sizeof(merged[0].name), "all");
+    for (int i = 0; i < count; i++) {
+        const struct snapshotHeader *h = mapSnapshot(paths[i], &size);
+        if (NULL == h) {
+            fprintf(stderr, "cannot read snapshot %s\n", paths[i]);
+            continue;
+        }
+        for (uint32_t j = 0; j < h->numSeats; j++) {
+            const struct snapshotSeat *r = &h->seats[j];
+            char name[sizeof(merged[0].name)];
+            snprintf(name, sizeof(name), "%.*s", (int)sizeof(r->name), r->name);
+
+            int m = 1;
+            while (m < numMerged && strcmp(merged[m].name, name)) {
+                m++;
+            }
+            if (m == numMerged) {
+                struct merged *grown = realloc(merged, (numMerged + 1) * sizeof(struct merged));
+                if (NULL == grown) {
+                    fprintf(stderr, "Error allocating sketches; bailing\n");
+                    exit(-1);
+                }
+                merged = grown;
+                memset(&merged[m], 0, sizeof(struct merged));
+                memcpy(merged[m].name, name, sizeof(name));
+                numMerged++;
+            }
+            btSketchMerge(&merged[m].gaps, &r->gaps);
+            btSketchMerge(&merged[m].bursts, &r->bursts);
+            btSketchMerge(&merged[0].gaps, &r->gaps);
+            btSketchMerge(&merged[0].bursts, &r->bursts);
+        }
+        munmap((void *)h, size);
+        read++;
+    }
+
+    printf("Sketches from %d snapshot(s):\n", read);
+    for (int m = 1; m < numMerged; m++) {
+        printSketch(merged[m].name, &merged[m].gaps, &merged[m].bursts);
+    }
+    printSketch(merged[0].name, &merged[0].gaps, &merged[0].bursts);
+    free(merged);
+    return read;
+}
+
+
+/*
+ * Reports how long startup took, for comparing starts with and without a
+ * snapshot.
+ */
+void printReady(int restored) {
+    if (snapshotPath) {
+        printf("Restored %d seat(s) from %s; ready in %.2f ms\n", restored, snapshotPath,
+            (double)(nowNs() - processStart) / kNsecPerUsec / 1000);
+        fflush(stdout);
+    }
+}
+
+
+/*
+ * Session history
+ *
+ * With -R DIR every penalty is appended to an on-disk history when it ends,
+ * so skimming can be looked at over weeks and months. Detectors never touch
+ * the disk: they push a fixed-size episode record onto their own SPSC ring
+ * and an appender thread, asleep until one arrives, writes it out.
+ *
+ * The history is a series of segment files (00000000.seg, ...) of
+ * kHistoryBlocks blocks each. A block holds records in end-time order,
+ * each stored as varints of its distance from the previous record, so a
+ * typical record takes about 10 bytes. Beside each segment, an index file
+ * (00000000.idx) holds the first and last end time of every block, so a
+ * query maps the index and binary searches it instead of reading blocks
+ * outside its range. Files are only ever appended to; the current block is
+ * rewritten in place until it fills.
+ */
+#define kHistoryMagic 0x53484842        // "BHHS"
+#define kHistoryVersion 1
+#define kHistoryBlockSize 4096          // Bytes per block, header included
+#define kHistoryBlocks 256              // Blocks per segment file
+#define kHistoryRecordMax 50            // Longest encoded record (5 varints)
+
+struct episode {
+    uint64_t end;                       // When the penalty ended (Unix ms)
+    uint32_t duration;                  // How long it lasted (ms)
+    uint32_t seat;                      // Detector id
+    uint64_t peakScore;                 // Highest recentScrollTotal
+    uint32_t scrolls;                   // Scroll events that extended it
+    uint32_t reserved;
+};
+
+struct historySpan {                    // One index entry per block
+    uint64_t firstTime;                 // End time of the block's first record
+    uint64_t lastTime;                  // ... and of its last
+};
+
+struct historyBlock {                   // Starts each block
+    struct historySpan span;
+    uint32_t count;                     // Records in the block
+    uint32_t bytes;                     // Encoded bytes after the header
+};
+
+struct historyFile {                    // Starts each segment; blocks follow at kHistoryBlockSize
+    uint32_t magic;
+    uint32_t version;
+    uint32_t blockSize;
+    uint32_t blocks;
+};
+
+struct historyWriter {
+    const char *dir;
+    uint32_t segment;                   // Current segment number
+    int segmentFd;
+    int indexFd;
+    uint32_t block;                     // Current block within the segment
+    bool dirty;                         // Current block not yet written
+    uint64_t lastTime;                  // End time of the last record
+    uint8_t buffer[kHistoryBlockSize];  // Current block
+#ifdef __linux__
+    struct uring ring;                  // -i uring: flushes in one submission, fd -1 if not
+#endif
+};
+
+struct historySegment {
+    const uint8_t *data;                // Mapped segment file
+    size_t size;
+    const struct historySpan *index;    // Mapped index file
+    size_t indexSize;
+    uint32_t blocks;
+};
+
+struct historyReader {
+    struct historySegment *segments;
+    int count;
+};
+
+typedef void (*episodeHandler)(void *context, const struct episode *e);
+
+struct historyWriter history;           // Owned by the appender thread
+struct ring *historyRings;              // One per producer thread, or NULL
+int numHistoryRings;
+struct waiter historyWaiter;
+pthread_mutex_t historyLock = PTHREAD_MUTEX_INITIALIZER; // Held while appending
+
+
+/*
+ * Converts a nowNs() timestamp to Unix time in milliseconds.
+ */
+uint64_t unixMs(uint64_t time) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t wall = (uint64_t)tv.tv_sec * kNsecPerSec + tv.tv_usec * kNsecPerUsec;
+    uint64_t age = nowNs() - time;
+    return (wall > age ? wall - age : 0) / (kNsecPerSec / 1000);
+}
+
+
+/*
+ * Appends v as a varint (7 bits per byte, low bits first). Returns the
+ * number of bytes written.
+ */
+int putVarint(uint8_t *p, uint64_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+
+/*
+ * Reads a varint from p, which must stop before end. Returns the byte after
+ * it, or NULL if it runs past end or is too long.
+ */
+const uint8_t *getVarint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t byte = *p++;
+        *v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Encodes e after a record ending at prevTime. Returns its length.
+ */
+int encodeEpisode(uint8_t *p, const struct episode *e, uint64_t prevTime) {
+    int n = putVarint(p, e->end - prevTime);
+    n += putVarint(p + n, e->duration);
+    n += putVarint(p + n, e->seat);
+    n += putVarint(p + n, e->peakScore);
+    n += putVarint(p + n, e->scrolls);
+    return n;
+}
+
+
+/*
+ * Decodes the record at p ending before end. Returns the byte after it, or
+ * NULL if the block is damaged.
+ */
+const uint8_t *decodeEpisode(const uint8_t *p, const uint8_t *end, struct episode *e, uint64_t prevTime) {
+    uint64_t delta, duration, seat, peak, scrolls;
+
+    if (!(p = getVarint(p, end, &delta)) || !(p = getVarint(p, end, &duration)) ||
+        !(p = getVarint(p, end, &seat)) || !(p = getVarint(p, end, &peak)) ||
+        !(p = getVarint(p, end, &scrolls))) {
+        return NULL;
+    }
+    e->end = prevTime + delta;
+    e->duration = (uint32_t)duration;
+    e->seat = (uint32_t)seat;
+    e->peakScore = peak;
+    e->scrolls = (uint32_t)scrolls;
+    e->reserved = 0;
+    return p;
+}
+
+
+/*
+ * Opens segment number of the history in dir, creating it if needed. Puts
+ * the segment and index fds in h. Returns the number of blocks already in
+ * the index, or -1.
+ */
+int openHistorySegment(struct historyWriter *h, uint32_t segment) {
+    char path[PATH_MAX];
+    struct historyFile header = { kHistoryMagic, kHistoryVersion, kHistoryBlockSize, kHistoryBlocks };
+    struct stat st;
+
+    if (h->segmentFd != -1) {
+        close(h->segmentFd);
+        close(h->indexFd);
+    }
+    snprintf(path, sizeof(path), "%s/%08u.seg", h->dir, segment);
+    h->segmentFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    snprintf(path, sizeof(path), "%s/%08u.idx", h->dir, segment);
+    h->indexFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (-1 == h->segmentFd || -1 == h->indexFd || -1 == fstat(h->indexFd, &st) ||
+        sizeof(header) != pwrite(h->segmentFd, &header, sizeof(header), 0)) {
+        return -1;
+    }
+    h->segment = segment;
+    h->block = (uint32_t)(st.st_size / sizeof(struct historySpan));
+    h->dirty = false;
+    memset(h->buffer, 0, sizeof(h->buffer));
+    return (int)h->block;
+}
+
+
+/*
+ * Opens the history in dir for appending. New records go into a fresh
+ * block after whatever is there, in the last segment if it has room.
+ * Returns 0, or -1 with errno set.
+ */
+int openHistory(struct historyWriter *h, const char *dir) {
+    struct historySpan last;
+    int blocks;
+
+    memset(h, 0, sizeof(*h));
+    h->dir = dir;
+    h->segmentFd = -1;
+    h->indexFd = -1;
+#ifdef __linux__
+    h->ring.fd = -1;
+    if (useUring) {
+        openUring(&h->ring, 4, false);
+    }
+#endif
+    if (-1 == mkdir(dir, 0755) && EEXIST != errno) {
+        return -1;
+    }
+
+
+    // Continue after the last segment
+
+    DIR *d = opendir(dir);
+    if (NULL == d) {
+        return -1;
+    }
+    struct dirent *entry;
+    uint32_t segment = 0;
+    while ((entry = readdir(d))) {
+        unsigned int n;
+        char suffix[8];
+        if (2 == sscanf(entry->d_name, "%8u.%3s", &n, suffix) && 0 == strcmp(suffix, "seg") &&
+            n > segment) {
+            segment = n;
+        }
+    }
+    closedir(d);
+    if (-1 == (blocks = openHistorySegment(h, segment))) {
+        return -1;
+    }
+    if (blocks > 0 && sizeof(last) == pread(h->indexFd, &last, sizeof(last),
+        (off_t)(blocks - 1) * sizeof(last))) {
+        h->lastTime = last.lastTime;
+    }
+    if (blocks >= kHistoryBlocks && -1 == openHistorySegment(h, segment + 1)) {
+        return -1;
+    }
+    return 0;
+}
+
+
+#ifdef __linux__
+/*
+ * flushHistory() through the ring: both writes go in one submission, linked
+ * so the index entry is only written once the block is.
+ */
+void flushHistoryRing(struct historyWriter *h, size_t used, off_t offset) {
+    struct historyBlock *block = (struct historyBlock *)h->buffer;
+    struct io_uring_cqe cqe;
+    int failed = 0;
+
+    struct io_uring_sqe *sqe = uringSqe(&h->ring);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = h->segmentFd;
+    sqe->addr = (uint64_t)(uintptr_t)h->buffer;
+    sqe->len = (uint32_t)used;
+    sqe->off = offset;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = used;
+    sqe = uringSqe(&h->ring);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = h->indexFd;
+    sqe->addr = (uint64_t)(uintptr_t)&block->span;
+    sqe->len = sizeof(block->span);
+    sqe->off = (off_t)h->block * sizeof(block->span);
+    sqe->user_data = sizeof(block->span);
+
+    for (int reaped = 0; reaped < 2; ) {
+        if (!uringCompletion(&h->ring, &cqe)) {
+            if (!uringEnter(&h->ring, 2 - reaped)) {
+                failed = errno;
+                break;
+            }
+            continue;
+        }
+        if (cqe.res != (int)cqe.user_data && !failed) {
+            failed = cqe.res < 0 ? -cqe.res : EIO;
+        }
+        reaped++;
+    }
+    if (failed) {
+        fprintf(stderr, "Error writing history in %s: %s\n", h->dir, strerror(failed));
+    }
+}
+#endif
+
+
+/*
+ * Writes the current block and its index entry. The block goes first, so
+ * the index never covers records that are not on disk.
+ */
+void flushHistory(struct historyWriter *h) {
+    struct historyBlock *block = (struct historyBlock *)h->buffer;
+    off_t offset = (off_t)(h->block + 1) * kHistoryBlockSize;
+    size_t used = sizeof(*block) + block->bytes;
+
+    if (!h->dirty) {
+        return;
+    }
+    h->dirty = false;
+#ifdef __linux__
+    if (-1 != h->ring.fd) {
+        flushHistoryRing(h, used, offset);
+        return;
+    }
+#endif
+    if ((ssize_t)used != pwrite(h->segmentFd, h->buffer, used, offset) ||
+        sizeof(block->span) != pwrite(h->indexFd, &block->span, sizeof(block->span),
+            (off_t)h->block * sizeof(block->span))) {
+        fprintf(stderr, "Error writing history in %s: %s\n", h->dir, strerror(errno));
+    }
+}
+
+
+/*
+ * Appends an episode to the current block, moving to the next block (and
+ * segment) when it is full. End times never go backwards: one earlier than
+ * the last record (a clock step) is stored as the last record's time.
+ */
+void appendEpisode(struct historyWriter *h, struct episode *e) {
+    struct historyBlock *block = (struct historyBlock *)h->buffer;
+    uint8_t record[kHistoryRecordMax];
+
+    if (e->end < h->lastTime) {
+        e->end = h->lastTime;
+    }
+    int len = encodeEpisode(record, e, block->count ? h->lastTime : e->end);
+    if (block->count && sizeof(*block) + block->bytes + len > kHistoryBlockSize) {
+        flushHistory(h);
+        if (++h->block >= kHistoryBlocks && -1 == openHistorySegment(h, h->segment + 1)) {
+            fprintf(stderr, "Error opening history segment in %s: %s\n", h->dir, strerror(errno));
+        }
+        memset(h->buffer, 0, sizeof(h->buffer));
+        len = encodeEpisode(record, e, e->end);
+    }
+    if (0 == block->count) {
+        block->span.firstTime = e->end;
+    }
+    memcpy(h->buffer + sizeof(*block) + block->bytes, record, len);
+    block->bytes += len;
+    block->count++;
+    block->span.lastTime = e->end;
+    h->lastTime = e->end;
+    h->dirty = true;
+}
+
+
+/*
+ * Activity rollups
+ *
+ * Beside the history, the appender keeps running totals (scroll events,
+ * scroll volume, episodes, penalized time) per minute, hour and day in a
+ * fixed-size mapped file, dir/rollups. Each level is a ring of buckets
+ * indexed by bucket start time, so the file never grows: minutes cover a
+ * week, hours a year and days ten years. A range query reads one bucket
+ * per minute, hour or day in the range and never touches the history.
+ *
+ * Detectors count their own scroll events for the current minute and hand
+ * the counts over when it ends, so rollups cost nothing per event beyond
+ * two additions.
+ */
+#define kRollupMagic 0x52484842         // "BHHR"
+#define kRollupVersion 1
+#define kRollupLevels 3
+
+enum { kHistoryEpisode, kHistoryActivity };
+
+struct activity {
+    uint64_t minute;                    // Unix time of the minute (ms)
+    uint32_t events;                    // Scroll events in it
+    uint32_t reserved;
+    uint64_t volume;                    // Their summed scrollDiff
+};
+
+struct historyEntry {                   // Slot in the history rings
+    int kind;                           // kHistoryEpisode or kHistoryActivity
+    union {
+        struct episode episode;
+        struct activity activity;
+    };
+};
+
+struct rollupBucket {
+    uint64_t start;                     // Unix time the bucket covers from (ms); 0 if unused
+    uint32_t events;                    // Scroll events
+    uint32_t episodes;                  // Penalties ending in the bucket
+    uint64_t volume;                    // Summed scrollDiff
+    uint64_t penalizedMs;               // Time spent penalized within the bucket
+};
+
+const struct {
+    const char *name;
+    uint64_t ms;                        // Bucket width
+    uint32_t slots;                     // Buckets kept
+} rollupLevels[kRollupLevels] = {
+    { "minute", 60000ULL, 7 * 24 * 60 },
+    { "hour", 3600000ULL, 366 * 24 },
+    { "day", 86400000ULL, 3660 },
+};
+
+struct rollupFile {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t levels;
+    uint32_t bucketSize;
+    struct {
+        uint64_t ms;
+        uint32_t slots;
+        uint32_t first;                 // Index of the level's first bucket
+    } level[kRollupLevels];
+    uint64_t latest[kRollupLevels];     // Start of each level's newest bucket
+    struct rollupBucket buckets[];
+};
+
+struct rollupFile *rollups;             // Mapped by startHistory, or NULL
+
+
+/*
+ * Maps dir/rollups, creating it (or recreating it if its layout differs)
+ * when writable. Returns the mapping, or NULL with errno set.
+ */
+struct rollupFile *openRollups(const char *dir, bool writable, size_t *size) {
+    char path[PATH_MAX];
+    struct rollupFile layout;
+    struct stat st;
+    uint32_t buckets = 0;
+
+    memset(&layout, 0, sizeof(layout));
+    layout.magic = kRollupMagic;
+    layout.version = kRollupVersion;
+    layout.levels = kRollupLevels;
+    layout.bucketSize = sizeof(struct rollupBucket);
+    for (int i = 0; i < kRollupLevels; i++) {
+        layout.level[i].ms = rollupLevels[i].ms;
+        layout.level[i].slots = rollupLevels[i].slots;
+        layout.level[i].first = buckets;
+        buckets += rollupLevels[i].slots;
+    }
+    *size = sizeof(layout) + (size_t)buckets * sizeof(struct rollupBucket);
+
+    snprintf(path, sizeof(path), "%s/rollups", dir);
+    int fd = open(path, writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+    if (-1 == fd || -1 == fstat(fd, &st)) {
+        return NULL;
+    }
+    bool fresh = (size_t)st.st_size != *size;
+    if (fresh && (!writable || -1 == ftruncate(fd, 0) || -1 == ftruncate(fd, *size))) {
+        errno = writable ? errno : EINVAL;
+        close(fd);
+        return NULL;
+    }
+    struct rollupFile *r = mmap(NULL, *size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+        MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == r) {
+        return NULL;
+    }
+    if (memcmp(r, &layout, offsetof(struct rollupFile, latest))) {
+        if (!writable) {
+            munmap(r, *size);
+            errno = EINVAL;
+            return NULL;
+        }
+        memset(r, 0, *size);
+        memcpy(r, &layout, sizeof(layout));
+    }
+    return r;
+}
+
+
+/*
+ * Returns level's bucket for time (Unix ms). With reset, a bucket still
+ * holding an older period is cleared and claimed; without, NULL is
+ * returned for it.
+ */
+struct rollupBucket *findRollup(struct rollupFile *r, int level, uint64_t time, bool reset) {
+    uint64_t width = r->level[level].ms;
+    uint64_t start = time - time % width;
+    struct rollupBucket *b = &r->buckets[r->level[level].first + (start / width) % r->level[level].slots];
+
+    if (b->start != start) {
+        if (!reset || b->start > start) {
+            return NULL;
+        }
+        memset(b, 0, sizeof(*b));
+        b->start = start;
+        if (start > r->latest[level]) {
+            r->latest[level] = start;
+        }
+    }
+    return b;
+}
+
+
+/*
+ * Adds a minute of scroll activity to every level.
+ */
+void addActivityRollup(struct rollupFile *r, const struct activity *a) {
+    for (int level = 0; level < kRollupLevels; level++) {
+        struct rollupBucket *b = findRollup(r, level, a->minute, true);
+        if (b) {
+            b->events += a->events;
+            b->volume += a->volume;
+        }
+    }
+}
+
+
+/*
+ * Adds an episode to every level: it counts in the bucket where it ended,
+ * and its penalized time is split across the buckets it spans.
+ */
+void addEpisodeRollup(struct rollupFile *r, const struct episode *e) {
+    for (int level = 0; level < kRollupLevels; level++) {
+        struct rollupBucket *b = findRollup(r, level, e->end, true);
+        if (b) {
+            b->episodes++;
+        }
+
+        uint64_t width = r->level[level].ms;
+        for (uint64_t t = e->end - e->duration; t < e->end; ) {
+            uint64_t next = t - t % width + width;
+            uint64_t until = next < e->end ? next : e->end;
+            if ((b = findRollup(r, level, t, true))) {
+                b->penalizedMs += until - t;
+            }
+            t = until;
+        }
+    }
+}
+
+
+/*
+ * Calls handler for each of level's buckets between from and to (Unix ms)
+ * that has data, oldest first. Reads one bucket per period. Returns the
+ * number of buckets found.
+ */
+long queryRollups(struct rollupFile *r, int level, uint64_t from, uint64_t to,
+    void (*handler)(void *context, const struct rollupBucket *b), void *context) {
+    uint64_t width = r->level[level].ms;
+    uint64_t end = r->latest[level] + width;
+    uint64_t span = width * r->level[level].slots;
+    long found = 0;
+
+
+    // Only the last slots periods can still be in the file
+
+    if (0 == r->latest[level]) {
+        return 0;
+    }
+    if (end > span && from < end - span) {
+        from = end - span;
+    }
+    if (to >= end) {
+        to = end - 1;
+    }
+    for (uint64_t t = from - from % width; t <= to; t += width) {
+        struct rollupBucket *b = findRollup(r, level, t, false);
+        if (b) {
+            found++;
+            if (handler) {
+                handler(context, b);
+            }
+        }
+    }
+    return found;
+}
+
+
+/*
+ * Telemetry (-F)
+ *
+ * The episodes and per-minute activity the history gets are also pushed,
+ * per seat and with the seat's user, to a collector (btcollect; format in
+ * brainthrottle.h). Producers push records onto their own SPSC ring, as for
+ * the history. A sender thread sleeps on the rings' waiter while they are
+ * all empty, so an idle process never wakes for it. The first record wakes
+ * it; it then gives the producers kTelemetryFlushMs to add more, drains the
+ * rings into datagrams and sends them without blocking. Only that first
+ * push takes the waiter's lock: the sender isn't asleep on the waiter for
+ * the rest. A full ring, a full socket or a collector that isn't there
+ * loses records; they are counted, and the datagrams' sequence numbers tell
+ * the collector.
+ */
+#define kTelemetryFlushMs 250
+
+struct telemetryDatagram {
+    struct btTelemetryHeader header;
+    struct btTelemetryRecord records[BT_TELEMETRY_RECORDS];
+};
+
+#define kTelemetrySeatUid UINT32_MAX    // A record's uid until the sender reads its seat's user
+
+struct ring *telemetryRings;            // One per producer thread, or NULL
+int numTelemetryRings;
+struct waiter telemetryWaiter;          // The sender sleeps on it while the rings are empty
+pthread_mutex_t telemetryLock = PTHREAD_MUTEX_INITIALIZER; // Held while draining
+uint32_t processUid;                    // Our own user, for seats that aren't logind's
+struct sockaddr_storage telemetryAddr;  // The collector, from telemetryAddress
+socklen_t telemetryAddrLength;
+int telemetryFd = -1;                   // Connected to the collector, or -1
+bool telemetryReachable = true;         // The last connect worked
+uint64_t telemetryAgent;                // Header agent: pid and start time
+uint64_t telemetrySequence;             // Datagrams made so far
+uint64_t telemetryFlushes;              // Flushes so far
+uint64_t telemetrySent;                 // Records in datagrams sent
+uint64_t telemetryLost;                 // Records in datagrams that couldn't be
+
+
+/*
+ * Queues a record for the collector. Called by the thread that owns the
+ * detector.
+ */
+void queueTelemetry(struct detector *d, int type, uint64_t time, uint32_t events,
+    uint32_t duration, uint64_t volume) {
+    struct btTelemetryRecord r;
+
+    if (NULL == telemetryRings) {
+        return;
+    }
+    memset(&r, 0, sizeof(r));
+    r.time = time;
+    r.uid = processUid;
+#ifdef __linux__
+    if (d->id < numSeats && &seats[d->id]->detector == d) {
+        r.uid = kTelemetrySeatUid;
+    }
+#endif
+    r.seat = (uint16_t)d->id;
+    r.type = (uint8_t)type;
+    r.events = events;
+    r.duration = duration;
+    r.volume = volume;
+    ringPush(&telemetryRings[historyProducer < numTelemetryRings ? historyProducer : 0], &r);
+}
+
+
+/*
+ * Connects the telemetry socket if it isn't. Returns false if the collector
+ * can't be reached, saying so once per outage.
+ */
+bool connectTelemetry() {
+    if (-1 != telemetryFd) {
+        return true;
+    }
+    telemetryFd = socket(telemetryAddr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (-1 != telemetryFd &&
+        0 == connect(telemetryFd, (struct sockaddr *)&telemetryAddr, telemetryAddrLength)) {
+        telemetryReachable = true;
+        return true;
+    }
+    if (telemetryReachable) {
+        fprintf(stderr, "cannot reach telemetry collector %s (error %d); dropping records\n",
+            telemetryAddress, errno);
+    }
+    telemetryReachable = false;
+    if (-1 != telemetryFd) {
+        close(telemetryFd);
+    }
+    telemetryFd = -1;
+    return false;
+}
+
+
+/*
+ * Sends count records as one datagram, without waiting. A collector that
+ * has gone away is reconnected on the next send.
+ */
+void sendTelemetry(struct telemetryDatagram *datagram, int count) {
+    size_t len = sizeof(datagram->header) + count * sizeof(struct btTelemetryRecord);
+
+    datagram->header.magic = BT_TELEMETRY_MAGIC;
+    datagram->header.version = BT_TELEMETRY_VERSION;
+    datagram->header.count = (uint16_t)count;
+    datagram->header.agent = telemetryAgent;
+    datagram->header.sequence = telemetrySequence++;
+    if (connectTelemetry() &&
+        (ssize_t)len == send(telemetryFd, datagram, len, MSG_DONTWAIT | MSG_NOSIGNAL)) {
+        telemetrySent += count;
+        return;
+    }
+    telemetryLost += count;
+    if (-1 != telemetryFd && EAGAIN != errno && ENOBUFS != errno) {
+        close(telemetryFd);
+        telemetryFd = -1;
+    }
+}
+
+
+/*
+ * Fills in the user of a seat's record. Each seat's is read from logind at
+ * most once per flush, so records follow the seat's session as it changes.
+ * Called with telemetryLock.
+ */
+void resolveTelemetryUid(struct btTelemetryRecord *r) {
+#ifdef __linux__
+    if (kTelemetrySeatUid != r->uid) {
+        return;
+    }
+    struct seat *seat = seats[r->seat];
+    if (seat->uidFlush != telemetryFlushes) {
+        seat->uid = seatUser(seat->name);
+        seat->uidFlush = telemetryFlushes;
+    }
+    r->uid = seat->uid;
+#endif
+}
+
+
+/*
+ * Drains every telemetry ring into datagrams. Called with telemetryLock.
+ */
+void flushTelemetry() {
+    struct telemetryDatagram datagram;
+    int count = 0;
+
+    telemetryFlushes++;
+    for (int i = 0; i < numTelemetryRings; i++) {
+        while (ringPop(&telemetryRings[i], &datagram.records[count])) {
+            resolveTelemetryUid(&datagram.records[count]);
+            if (++count == BT_TELEMETRY_RECORDS) {
+                sendTelemetry(&datagram, count);
+                count = 0;
+            }
+        }
+    }
+    if (count > 0) {
+        sendTelemetry(&datagram, count);
+    }
+}
+
+
+/*
+ * Telemetry sender thread. Sleeps until a record is queued, then batches
+ * for kTelemetryFlushMs and flushes.
+ */
+void *telemetryThread(void *arg) {
+    struct ring *rings[numTelemetryRings];
+
+    for (int i = 0; i < numTelemetryRings; i++) {
+        rings[i] = &telemetryRings[i];
+    }
+    for (;;) {
+        waitForRings(&telemetryWaiter, rings, numTelemetryRings, 0);
+        usleep(kTelemetryFlushMs * 1000);
+        pthread_mutex_lock(&telemetryLock);
+        flushTelemetry();
+        pthread_mutex_unlock(&telemetryLock);
+    }
+    return NULL;
+}
+
+
+/*
+ * Starts the telemetry sender with one ring per producer thread, numbered
+ * as for startHistory.
+ */
+void startTelemetry(int producers) {
+    pthread_t thread;
+
+    if (NULL == telemetryAddress) {
+        return;
+    }
+    if (0 != btTelemetryAddress(telemetryAddress, &telemetryAddr, &telemetryAddrLength)) {
+        fprintf(stderr, "bad telemetry collector address %s; bailing\n", telemetryAddress);
+        exit(-1);
+    }
+    processUid = getuid();
+    telemetryAgent = (uint64_t)getpid() << 32 ^ unixMs(nowNs());
+    initWaiter(&telemetryWaiter);
+    struct ring *rings = calloc(producers, sizeof(struct ring));
+    if (NULL == rings) {
+        fprintf(stderr, "Error allocating telemetry rings; bailing\n");
+        exit(-1);
+    }
+    for (int i = 0; i < producers; i++) {
+        initRing(&rings[i], sizeof(struct btTelemetryRecord), &telemetryWaiter);
+    }
+    numTelemetryRings = producers;
+    telemetryRings = rings;
+    connectTelemetry();
+    if (0 != pthread_create(&thread, NULL, &telemetryThread, NULL)) {
+        fprintf(stderr, "Error starting telemetry thread; bailing\n");
+        exit(-1);
+    }
+}
+
+
+/*
+ * Sends what is queued, and the minute in progress, at exit. Keeps
+ * telemetryLock, so the sender stops too. Exit thread only: the sender may
+ * hold the lock for a flush.
+ */
+void stopTelemetry() {
+    if (NULL == telemetryRings) {
+        return;
+    }
+    pthread_mutex_lock(&telemetryLock);
+    historyProducer = 0;
+    if (mainDetector.activityEvents) {
+        queueTelemetry(&mainDetector, BT_TELEMETRY_ACTIVITY, mainDetector.activityMinute,
+            mainDetector.activityEvents, 0, mainDetector.activityVolume);
+    }
+#ifdef __linux__
+    for (int i = 0; i < numSeats; i++) {
+        struct detector *d = &seats[i]->detector;
+        if (ringOccupancy(&telemetryRings[0]) == kRingSlots) {
+            flushTelemetry();
+        }
+        if (d->activityEvents) {
+            queueTelemetry(d, BT_TELEMETRY_ACTIVITY, d->activityMinute, d->activityEvents, 0,
+                d->activityVolume);
+        }
+    }
+#endif
+    flushTelemetry();
+}
+
+
+/*
+ * Prints how many telemetry records were sent and lost.
+ */
+void printTelemetryStats() {
+    uint64_t dropped = 0;
+
+    if (NULL == telemetryRings) {
+        return;
+    }
+    for (int i = 0; i < numTelemetryRings; i++) {
+        dropped += atomic_load(&telemetryRings[i].dropped);
+    }
+    printf("telemetry: %llu records sent, %llu unsent, %llu dropped on full rings\n",
+        (unsigned long long)telemetrySent, (unsigned long long)telemetryLost,
+        (unsigned long long)dropped);
+}
+
+
+/*
+ * Queues a finished penalty for the history and telemetry. Called by the
+ * thread that owns the detector, just before it clears penalized.
+ */
+void recordEpisode(struct detector *d, uint64_t now) {
+    struct historyEntry entry;
+    struct episode *e = &entry.episode;
+
+    if (NULL == historyRings && NULL == telemetryRings) {
+        return;
+    }
+    uint64_t end = now < d->penaltyDeadline ? now : d->penaltyDeadline;
+    uint64_t start = d->penaltyStart && d->penaltyStart < end ? d->penaltyStart : end;
+    memset(&entry, 0, sizeof(entry));
+    entry.kind = kHistoryEpisode;
+    e->end = unixMs(end);
+    e->duration = (uint32_t)((end - start) / (kNsecPerSec / 1000));
+    e->seat = d->id;
+    e->peakScore = d->peakScrollTotal > 0 ? d->peakScrollTotal : 0;
+    e->scrolls = d->penaltyScrolls;
+    queueTelemetry(d, BT_TELEMETRY_EPISODE, e->end, e->scrolls, e->duration, e->peakScore);
+    if (historyRings) {
+        ringPush(&historyRings[historyProducer < numHistoryRings ? historyProducer : 0], &entry);
+    }
+}
+
+
+/*
+ * Queues the detector's scroll counts for the minute that has ended, if
+ * any, for the rollups and telemetry, and starts counting the minute that
+ * now falls in. Called by the thread that owns the detector.
+ */
+void recordActivity(struct detector *d, uint64_t now) {
+    struct historyEntry entry;
+
+    if (d->activityEvents) {
+        queueTelemetry(d, BT_TELEMETRY_ACTIVITY, d->activityMinute, d->activityEvents, 0,
+            d->activityVolume);
+    }
+    if (d->activityEvents && historyRings) {
+        memset(&entry, 0, sizeof(entry));
+        entry.kind = kHistoryActivity;
+        entry.activity.minute = d->activityMinute;
+        entry.activity.events = d->activityEvents;
+        entry.activity.volume = d->activityVolume;
+        ringPush(&historyRings[historyProducer < numHistoryRings ? historyProducer : 0], &entry);
+    }
+
+    uint64_t ms = unixMs(now);
+    d->activityMinute = ms - ms % 60000;
+    d->activityDeadline = now + (60000 - ms % 60000) * (kNsecPerSec / 1000);
+    d->activityEvents = 0;
+    d->activityVolume = 0;
+}
+
+
+/*
+ * Appends everything queued by the detectors. Must hold historyLock.
+ */
+bool drainHistory() {
+    struct historyEntry entry;
+    bool busy = false;
+
+    for (int i = 0; i < numHistoryRings; i++) {
+        while (ringPop(&historyRings[i], &entry)) {
+            if (kHistoryEpisode == entry.kind) {
+                appendEpisode(&history, &entry.episode);
+                if (rollups) {
+                    addEpisodeRollup(rollups, &entry.episode);
+                }
+            } else if (rollups) {
+                addActivityRollup(rollups, &entry.activity);
+            }
+            busy = true;
+        }
+    }
+    flushHistory(&history);
+    return busy;
+}
+
+
+/*
+ * Appender thread. Sleeps on the history rings with no timeout, so it only
+ * runs when a penalty ends or a minute with scrolling is over.
+ */
+void *historyThread(void *arg) {
+    struct ring *rings[numHistoryRings];
+
+    for (int i = 0; i < numHistoryRings; i++) {
+        rings[i] = &historyRings[i];
+    }
+    for (;;) {
+        pthread_mutex_lock(&historyLock);
+        drainHistory();
+        pthread_mutex_unlock(&historyLock);
+        waitForRings(&historyWaiter, rings, numHistoryRings, 0);
+    }
+    return NULL;
+}
+
+
+/*
+ * Opens the history and rollups in historyDir and starts the appender,
+ * with one ring per producer thread: the main thread is producer 0, seat
+ * workers and the pipeline detector set historyProducer to their own
+ * index. Must run before any of them start, and after privileges are
+ * dropped.
+ */
+void startHistory(int producers) {
+    pthread_t thread;
+
+    if (NULL == historyDir) {
+        return;
+    }
+    size_t size;
+    if (-1 == openHistory(&history, historyDir) ||
+        NULL == (rollups = openRollups(historyDir, true, &size))) {
+        fprintf(stderr, "Error opening history in %s: %s; bailing\n", historyDir, strerror(errno));
+        exit(-1);
+    }
+    initWaiter(&historyWaiter);
+    struct ring *rings = calloc(producers, sizeof(struct ring));
+    if (NULL == rings) {
+        fprintf(stderr, "Error allocating history rings; bailing\n");
+        exit(-1);
+    }
+    for (int i = 0; i < producers; i++) {
+        initRing(&rings[i], sizeof(struct historyEntry), &historyWaiter);
+    }
+    numHistoryRings = producers;
+    historyRings = rings;
+    if (0 != pthread_create(&thread, NULL, &historyThread, NULL)) {
+        fprintf(stderr, "Error starting history thread; bailing\n");
+        exit(-1);
+    }
+}
+
+
+/*
+ * Adds a detector's counts for the minute in progress to the rollups. Only
+ * for exit, when the detector's thread no longer matters.
+ */
+void finishActivity(struct detector *d) {
+    struct activity a;
+
+    if (d->activityEvents) {
+        memset(&a, 0, sizeof(a));
+        a.minute = d->activityMinute;
+        a.events = d->activityEvents;
+        a.volume = d->activityVolume;
+        addActivityRollup(rollups, &a);
+    }
+}
+
+
+/*
+ * Writes out queued episodes and the current minute's activity at exit.
+ * Keeps historyLock, so the appender stops too.
+ */
+void stopHistory() {
+    if (NULL == historyRings) {
+        return;
+    }
+    pthread_mutex_lock(&historyLock);
+    drainHistory();
+    finishActivity(&mainDetector);
+#ifdef __linux__
+    for (int i = 0; i < numSeats; i++) {
+        finishActivity(&seats[i]->detector);
+    }
+#endif
+}
+
+
+/*
+ * Maps every segment of the history in dir, in order. Returns 0, or -1
+ * with errno set.
+ */
+int openHistoryReader(struct historyReader *r, const char *dir) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    memset(r, 0, sizeof(*r));
+    for (uint32_t segment = 0; ; segment++) {
+        struct historySegment s;
+        memset(&s, 0, sizeof(s));
+
+        snprintf(path, sizeof(path), "%s/%08u.idx", dir, segment);
+        int indexFd = open(path, O_RDONLY | O_CLOEXEC);
+        snprintf(path, sizeof(path), "%s/%08u.seg", dir, segment);
+        int segmentFd = open(path, O_RDONLY | O_CLOEXEC);
+        if (-1 == indexFd || -1 == segmentFd) {
+            if (-1 != indexFd) {
+                close(indexFd);
+            }
+            if (-1 != segmentFd) {
+                close(segmentFd);
+            }
+            break;
+        }
+        if (0 == fstat(indexFd, &st) && st.st_size >= (off_t)sizeof(struct historySpan)) {
+            s.indexSize = st.st_size;
+            s.index = mmap(NULL, s.indexSize, PROT_READ, MAP_SHARED, indexFd, 0);
+        }
+        if (0 == fstat(segmentFd, &st) && st.st_size >= (off_t)sizeof(struct historyFile)) {
+            s.size = st.st_size;
+            s.data = mmap(NULL, s.size, PROT_READ, MAP_SHARED, segmentFd, 0);
+        }
+        close(indexFd);
+        close(segmentFd);
+        if (MAP_FAILED == (void *)s.index || MAP_FAILED == (void *)s.data) {
+            return -1;
+        }
+
+
+        // Skip segments with nothing in them or from another version
+
+        const struct historyFile *header = (const struct historyFile *)s.data;
+        if (NULL == s.index || NULL == s.data || kHistoryMagic != header->magic ||
+            kHistoryVersion != header->version || kHistoryBlockSize != header->blockSize) {
+            if (s.index) {
+                munmap((void *)s.index, s.indexSize);
+            }
+            if (s.data) {
+                munmap((void *)s.data, s.size);
+            }
+            continue;
+        }
+        s.blocks = (uint32_t)(s.indexSize / sizeof(struct historySpan));
+        struct historySegment *grown = realloc(r->segments, (r->count + 1) * sizeof(*grown));
+        if (NULL == grown) {
+            return -1;
+        }
+        r->segments = grown;
+        r->segments[r->count++] = s;
+    }
+    return 0;
+}
+
+
+/*
+ * Unmaps a history.
+ */
+void closeHistoryReader(struct historyReader *r) {
+    for (int i = 0; i < r->count; i++) {
+        munmap((void *)r->segments[i].index, r->segments[i].indexSize);
+        munmap((void *)r->segments[i].data, r->segments[i].size);
+    }
+    free(r->segments);
+    memset(r, 0, sizeof(*r));
+}
+
+
+/*
+ * Returns the first block in s whose last record ends at or after from,
+ * or s->blocks if there is none.
+ */
+uint32_t findHistoryBlock(const struct historySegment *s, uint64_t from) {
+    uint32_t lo = 0, hi = s->blocks;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (s->index[mid].lastTime < from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+/*
+ * Calls handler for every episode ending in [from, to] (Unix ms), oldest
+ * first. Only blocks whose index span overlaps the range are decoded.
+ * Returns the number of episodes; blocksRead, if given, gets the number of
+ * blocks decoded.
+ */
+long queryHistory(const struct historyReader *r, uint64_t from, uint64_t to,
+    episodeHandler handler, void *context, long *blocksRead) {
+    long found = 0, blocks = 0;
+
+    for (int i = 0; i < r->count; i++) {
+        const struct historySegment *s = &r->segments[i];
+
+        if (s->index[s->blocks - 1].lastTime < from) {
+            continue;
+        }
+        if (s->index[0].firstTime > to) {
+            break;
+        }
+        for (uint32_t b = findHistoryBlock(s, from); b < s->blocks && s->index[b].firstTime <= to; b++) {
+            size_t offset = (size_t)(b + 1) * kHistoryBlockSize;
+            if (offset + sizeof(struct historyBlock) > s->size) {
+                break;
+            }
+
+
+            // Decode no further than the index entry says was written
+
+            const struct historyBlock *block = (const struct historyBlock *)(s->data + offset);
+            const uint8_t *p = (const uint8_t *)(block + 1);
+            const uint8_t *end = p + block->bytes;
+            if (block->bytes > kHistoryBlockSize - sizeof(*block) || end > s->data + s->size) {
+                continue;
+            }
+            uint64_t time = block->span.firstTime;
+            blocks++;
+            for (uint32_t n = 0; n < block->count && p; n++) {
+                struct episode e;
+                if (!(p = decodeEpisode(p, end, &e, time))) {
+                    break;
+                }
+                time = e.end;
+                if (time > s->index[b].lastTime || time > to) {
+                    break;
+                }
+                if (time >= from) {
+                    found++;
+                    if (handler) {
+                        handler(context, &e);
+                    }
+                }
+            }
+        }
+    }
+    if (blocksRead) {
+        *blocksRead = blocks;
+    }
+    return found;
+}
+
+
+/*
+ * Query handler for -Q. Prints one episode and adds it to the totals.
+ */
+void printEpisode(void *context, const struct episode *e) {
+    uint64_t *penalizedMs = context;
+    time_t seconds = (time_t)(e->end / 1000);
+    struct tm tm;
+    char when[32];
+
+    localtime_r(&seconds, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s  seat %-3u %7.1fs  peak %-8llu scrolls %u\n", when, e->seat,
+        e->duration / 1000.0, (unsigned long long)e->peakScore, e->scrolls);
+    *penalizedMs += e->duration;
+}
+
+
+/*
+ * Query handler for -Q with -U. Prints one rollup bucket and adds it to the
+ * totals.
+ */
+void printRollup(void *context, const struct rollupBucket *b) {
+    struct rollupBucket *total = context;
+    time_t seconds = (time_t)(b->start / 1000);
+    struct tm tm;
+    char when[32];
+
+    localtime_r(&seconds, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &tm);
+    printf("%s  events %-7u volume %-9llu episodes %-5u penalized %8.1fs\n", when, b->events,
+        (unsigned long long)b->volume, b->episodes, b->penalizedMs / 1000.0);
+    total->events += b->events;
+    total->volume += b->volume;
+    total->episodes += b->episodes;
+    total->penalizedMs += b->penalizedMs;
+}
+
+
+/*
+ * Prints the episodes in historyDir that ended between FROM and TO (Unix
+ * seconds, "FROM,TO"; either may be left out), or with level, that level's
+ * rollups over the range.
+ */
+int printHistory(const char *range, const char *level) {
+    struct historyReader reader;
+    uint64_t from = 0, to = UINT64_MAX, penalizedMs = 0;
+    long blocks;
+    char *comma;
+
+    if (NULL == historyDir) {
+        fprintf(stderr, "-Q needs the history directory (-R)\n");
+        return -1;
+    }
+    if (*range && ',' != *range) {
+        from = strtoull(range, NULL, 10) * 1000;
+    }
+    if ((comma = strchr(range, ',')) && comma[1]) {
+        to = strtoull(comma + 1, NULL, 10) * 1000 + 999;
+    }
+    if (level) {
+        struct rollupBucket total;
+        size_t size;
+        int i = 0;
+
+        while (i < kRollupLevels && strcmp(level, rollupLevels[i].name)) {
+            i++;
+        }
+        if (kRollupLevels == i) {
+            fprintf(stderr, "-U expects minute, hour or day\n");
+            return -1;
+        }
+        struct rollupFile *r = openRollups(historyDir, false, &size);
+        if (NULL == r) {
+            fprintf(stderr, "Error reading rollups in %s: %s\n", historyDir, strerror(errno));
+            return -1;
+        }
+        memset(&total, 0, sizeof(total));
+        long found = queryRollups(r, i, from, to, &printRollup, &total);
+        printf("%ld %s bucket(s): %u events, volume %llu, %u episodes, %.0f s penalized\n", found, level,
+            total.events, (unsigned long long)total.volume, total.episodes, total.penalizedMs / 1000.0);
+        munmap(r, size);
+        return 0;
+    }
+    if (-1 == openHistoryReader(&reader, historyDir)) {
+        fprintf(stderr, "Error reading history in %s: %s\n", historyDir, strerror(errno));
+        return -1;
+    }
+    long found = queryHistory(&reader, from, to, &printEpisode, &penalizedMs, &blocks);
+    printf("%ld episodes, %.0f s penalized (%ld blocks read)\n", found, penalizedMs / 1000.0, blocks);
+    closeHistoryReader(&reader);
+    return 0;
+}
+
+
+#ifdef __linux__
+/*
+ * Wheel frame handler for pipeline ingest threads. context is the group.
+ */
+void handleIngestScroll(void *context, uint64_t time, int64_t scrollX, int64_t scrollY) {
+    ingestScroll((int)(intptr_t)context, time, scrollX, scrollY);
+}
+
+
+/*
+ * Pipeline ingest thread for one group of input devices.
+ */
+void *ingestThread(void *arg) {
+    int group = (int)(intptr_t)arg;
+    struct seat *seat = seats[0];
+    struct epoll_event events[kWorkerEvents];
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+    for (int i = group; i < seat->numInputs; i += numIngestGroups) {
+        struct inputDevice *dev = &seat->inputs[i];
+        struct epoll_event event = { EPOLLIN, { .ptr = dev } };
+        dev->handler = &handleIngestScroll;
+        dev->context = arg;
+        dev->name = "pipeline";
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, dev->fd, &event);
+    }
+
+    configureThread("ingest", cpuIngest, realtimePriority);
+    uint64_t overloadDeadline = 0;
+    uint64_t slept = sleptNs();
+    for (;;) {
+        int timeout = -1;
+        if (overloadDeadline) {
+            uint64_t now = nowNs();
+            timeout = overloadDeadline > now ? (overloadDeadline - now + 999999) / 1000000 : 0;
+        }
+        int n = epoll_wait(epollFd, events, kWorkerEvents, timeout);
+        beginBatch();
+        uint64_t nowSlept = sleptNs();
+        if (nowSlept >= slept + kMinSuspendNs) {
+            for (int i = group; i < seat->numInputs; i += numIngestGroups) {
+                resumeInput(&seat->inputs[i], nowNs());
+            }
+        }
+        slept = nowSlept;
+        for (int i = 0; i < n; i++) {
+            struct inputDevice *dev = events[i].data.ptr;
+            if (!readInputDevice(dev)) {
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, dev->fd, NULL);
+                endOverload(dev, nowNs());
+            }
+        }
+        overloadDeadline = expireOverloads(nowNs());
+        endBatch();
+    }
+    return NULL;
+}
+
+
+/*
+ * Runs the pipeline on the first seat's devices and backlight, with one
+ * ingest thread per group of devices. Never returns.
+ */
+void runLinuxPipeline() {
+    pthread_t thread;
+    struct seat *seat = seats[0];
+
+    defaultBacklight = seat->backlight;
+    numIngestGroups = seat->numInputs < kMaxIngestGroups ? seat->numInputs : kMaxIngestGroups;
+    if (numIngestGroups < 1) {
+        fprintf(stderr, "No scroll wheels found; bailing\n");
+        exit(-1);
+    }
+    prevBrightness = getBrightness();
+    publishBrightness(mainDetector.status, prevBrightness, prevBrightness, -1);
+    int restored = loadSnapshot();
+    startHistory(2);
+    startTelemetry(2);
+    startPipeline();
+    waitForPipelineThreads();
+    startSnapshots();
+    for (int i = 0; i < numIngestGroups; i++) {
+        if (0 != pthread_create(&thread, NULL, &ingestThread, (void *)(intptr_t)i)) {
+            fprintf(stderr, "Error starting ingest thread; bailing\n");
+            exit(-1);
+        }
+    }
+    printReady(restored);
+    notifySystemd("READY=1\nSTATUS=Watching 1 seat (pipeline)");
+    if (lowLatency) {
+        sleep(1);
+        printSelfCheck();
+    }
+    for (;;) {
+        pause();
+    }
+}
+
+
+/*
+ * Creates a uinput scroll wheel for the virtual seat benchmark and stores
+ * its event node in eventPath. Returns the uinput fd or -1.
+ */
+int createVirtualWheel(int index, char *eventPath, size_t size) {
+    struct uinput_setup setup;
+    char sysname[64];
+    char path[PATH_MAX];
+    struct dirent *entry;
+
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (-1 == fd) {
+        fprintf(stderr, "cannot open /dev/uinput (error %d)\n", errno);
+        return -1;
+    }
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    snprintf(setup.name, sizeof(setup.name), "brainthrottle virtual seat %d", index);
+    if (-1 == ioctl(fd, UI_SET_EVBIT, EV_REL) ||
+        -1 == ioctl(fd, UI_SET_RELBIT, REL_WHEEL) ||
+        -1 == ioctl(fd, UI_SET_RELBIT, REL_HWHEEL) ||
+        -1 == ioctl(fd, UI_DEV_SETUP, &setup) ||
+        -1 == ioctl(fd, UI_DEV_CREATE) ||
+        -1 == ioctl(fd, UI_GET_SYSNAME(sizeof(sysname)), sysname)) {
+        fprintf(stderr, "cannot create uinput device (error %d)\n", errno);
+        close(fd);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s", sysname);
+    DIR *dir = opendir(path);
+    eventPath[0] = 0;
+    while (dir && (entry = readdir(dir))) {
+        if (0 == strncmp(entry->d_name, "event", 5)) {
+            snprintf(eventPath, size, "/dev/input/%s", entry->d_name);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return fd;
+}
+
+
+/*
+ * Creates a pipe standing in for a scroll wheel where uinput isn't
+ * available, and stores a path that opens its read end in eventPath.
+ * Frames written to it must carry their own timestamps. Returns the write
+ * end or -1.
+ */
+int createPipeWheel(char *eventPath, size_t size) {
+    int fds[2];
+
+    if (-1 == pipe2(fds, O_CLOEXEC)) {
+        fprintf(stderr, "cannot create pipe (error %d)\n", errno);
+        return -1;
+    }
+    snprintf(eventPath, size, "/proc/self/fd/%d", fds[0]);
+    return fds[1];
+}
+
+
+/*
+ * Creates a fake backlight (brightness and max_brightness files) in dir.
+ */
+void createFakeBacklight(const char *dir) {
+    char path[PATH_MAX];
+
+    mkdir(dir, 0755);
+    snprintf(path, sizeof(path), "%s/max_brightness", dir);
+    FILE *f = fopen(path, "w");
+    if (f) {
+        fprintf(f, "1000\n");
+        fclose(f);
+    }
+    snprintf(path, sizeof(path), "%s/brightness", dir);
+    f = fopen(path, "w");
+    if (f) {
+        fprintf(f, "1000\n");
+        fclose(f);
+    }
+}
+
+
+/*
+ * Measures the cost of sending commands to the helper: count commands
+ * back to back (the helper stays awake), then one at a time with the
+ * helper asleep in between (every command rings the futex).
+ */
+void runHelperBenchmark(long count) {
+    const int sparse = 1000;
+    uint64_t pushNs = 0;
+    uint64_t wakeNs = 0;
+
+    struct seat *seat = findSeat("bench", true);
+    assignWorkers(1);
+    startHelper(NULL);
+    struct helperRing *r = &helper->rings[0];
+    struct brightnessCommand command = { 0, kCommandDim, false, 10, seat->index };
+
+    uint64_t start = nowNs();
+    for (long i = 0; i < count; i++) {
+        while (atomic_load(&r->head) - atomic_load(&r->tail) >= kHelperSlots) {
+            sched_yield();
+        }
+        sendHelper(0, &command);
+    }
+    uint64_t pushed = nowNs();
+    while (atomic_load(&r->tail) != atomic_load(&r->head)) {
+        sched_yield();
+    }
+    uint64_t drained = nowNs();
+    printf("burst:  %8.1f ns to send, %8.1f ns per command end to end\n",
+        (double)(pushed - start) / count, (double)(drained - start) / count);
+
+    for (int i = 0; i < sparse; i++) {
+        while (!atomic_load(&helper->sleeping)) {
+            sched_yield();
+        }
+        uint64_t t = nowNs();
+        sendHelper(0, &command);
+        pushNs += nowNs() - t;
+        while (atomic_load(&r->tail) != atomic_load(&r->head)) {
+            sched_yield();
+        }
+        wakeNs += nowNs() - t;
+    }
+    printf("sparse: %8.1f ns to send (incl. futex wake), %8.1f ns until applied\n",
+        (double)pushNs / sparse, (double)wakeNs / sparse);
+}
+
+
+/*
+ * Timer handler for the wheel benchmark: counts timers fired late or
+ * early. context points at the deadline.
+ */
+uint64_t wheelBenchFired;
+uint64_t wheelBenchLate;                // More than a tick after the deadline, or early
+
+void fireBenchTimer(struct timer *t, uint64_t now) {
+    uint64_t deadline = *(uint64_t *)t->context;
+    wheelBenchFired++;
+    if (now < deadline || now - deadline > 2 * kWheelTickNs) {
+        wheelBenchLate++;
+    }
+}
+
+
+/*
+ * Measures the timer wheel with count timers, as count seats' penalties
+ * would use it, in simulated time: arming each 1-60 s out, re-arming them
+ * 30 s out as scrolls do while a penalty runs, cancelling, and running
+ * the wheel until every timer has fired. Compares finding the earliest
+ * deadline with scanning every seat, as workers did before.
+ */
+void runWheelBenchmark(long count) {
+    struct timerWheel *tw = malloc(sizeof(struct timerWheel));
+    struct timer *timers = calloc(count, sizeof(struct timer));
+    uint64_t *deadlines = calloc(count, sizeof(uint64_t));
+    const long rearms = count * 10 > 10000000 ? count * 10 : 10000000;
+    uint64_t seed = 1;
+    uint64_t now = 1000 * kNsecPerSec;
+
+    if (NULL == tw || NULL == timers || NULL == deadlines) {
+        fprintf(stderr, "cannot allocate %ld timers; bailing\n", count);
+        exit(-1);
+    }
+    initWheel(tw, now);
+    for (long i = 0; i < count; i++) {
+        timers[i].fire = &fireBenchTimer;
+        timers[i].context = &deadlines[i];
+    }
+
+    uint64_t start = nowNs();
+    for (long i = 0; i < count; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        deadlines[i] = now + kNsecPerSec + (seed >> 33) % (59 * kNsecPerSec);
+        armTimer(tw, &timers[i], deadlines[i]);
+    }
+    uint64_t armed = nowNs();
+    printf("%ld timers: arm      %8.1f ns each\n", count, (double)(armed - start) / count);
+
+
+    // Scrolls on random seats, 10 us apart, each pushing its penalty out
+
+    start = nowNs();
+    for (long i = 0; i < rearms; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        long index = (long)((seed >> 33) % count);
+        now += 10 * kNsecPerUsec;
+        deadlines[index] = now + 30 * kNsecPerSec;
+        armTimer(tw, &timers[index], deadlines[index]);
+    }
+    uint64_t rearmed = nowNs();
+    printf("%ld timers: re-arm   %8.1f ns each\n", count, (double)(rearmed - start) / rearms);
+
+    runTimers(tw, now);
+    start = nowNs();
+    uint64_t earliest = 0;
+    for (int round = 0; round < 100; round++) {
+        earliest = wheelDeadline(tw);
+    }
+    uint64_t wheeled = nowNs();
+    uint64_t scanned = UINT64_MAX;
+    for (int round = 0; round < 100; round++) {
+        for (long i = 0; i < count; i++) {
+            if (deadlines[i] < scanned) {
+                scanned = deadlines[i];
+            }
+        }
+    }
+    uint64_t scanEnd = nowNs();
+    printf("%ld timers: earliest %8.1f ns from the wheel (%.3f s out), %.1f ns by scanning (%.3f s out)\n",
+        count, (double)(wheeled - start) / 100, (double)(earliest - now) / kNsecPerSec,
+        (double)(scanEnd - wheeled) / 100, (double)(scanned - now) / kNsecPerSec);
+
+
+    // Run the wheel as a worker would: wake at its deadline, run it
+
+    long wakeups = 0;
+    start = nowNs();
+    while (tw->count > 0) {
+        now = wheelDeadline(tw);
+        runTimers(tw, now);
+        wakeups++;
+    }
+    uint64_t fired = nowNs();
+    printf("%ld timers: run      %8.1f ns per timer, %ld wakeups, %llu fired, %llu late or early\n",
+        count, (double)(fired - start) / count, wakeups, (unsigned long long)wheelBenchFired,
+        (unsigned long long)wheelBenchLate);
+
+    for (long i = 0; i < count; i++) {
+        armTimer(tw, &timers[i], now + kNsecPerSec + i % 1000 * kNsecPerSec);
+    }
+    start = nowNs();
+    for (long i = 0; i < count; i++) {
+        armTimer(tw, &timers[i], 0);
+    }
+    printf("%ld timers: cancel   %8.1f ns each, %d left\n", count,
+        (double)(nowNs() - start) / count, tw->count);
+}
+
+
+#ifdef WITH_WAYLAND
+/*
+ * Dims every output of display through each gamma level, down and back up
+ * ten times, timing the steps, then restores. Returns non-zero if the
+ * compositor refused any output, so it can run in CI against a headless
+ * compositor.
+ */
+int runGammaTest(const char *display) {
+    struct gamma g;
+    bool accepted = true;
+    int steps = 0;
+
+    if (!openGamma(&g, display)) {
+        return 1;
+    }
+    for (int i = 0; i < g.numOutputs; i++) {
+        printf("output %u: %u entries per ramp\n", g.outputs[i].name, g.outputs[i].rampSize);
+    }
+    uint64_t start = nowNs();
+    for (int pass = 0; pass < 10; pass++) {
+        for (int step = 0; step < 2 * kGammaLevels; step++) {
+            int level = step < kGammaLevels ? kGammaLevels - 1 - step : step - kGammaLevels;
+            accepted &= setGammaLevel(&g, level);
+            steps++;
+        }
+    }
+    uint64_t elapsed = nowNs() - start;
+    wl_display_roundtrip(g.display);
+    for (int i = 0; i < g.numOutputs; i++) {
+        accepted &= !g.outputs[i].refused && g.outputs[i].rampSize > 0;
+    }
+    restoreGamma(&g);
+    wl_display_roundtrip(g.display);
+    printf("%d steps on %d output(s): %.1f us each, %s\n", steps, g.numOutputs,
+        (double)elapsed / steps / kNsecPerUsec, accepted ? "all accepted" : "refused");
+    closeGamma(&g);
+    return accepted ? 0 : 1;
+}
+#endif
+
+
+#ifdef WITH_X11
+/*
+ * Returns this thread's CPU time in ns.
+ */
+uint64_t threadCpuNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * kNsecPerSec + ts.tv_nsec;
+}
+
+
+/*
+ * Benchmarks an overlay on spec: requests and CPU time per dim step, with
+ * the opacity changing every step and staying the same, and the round trip
+ * until the server has one. Returns non-zero if the overlay can't be used
+ * or the server's opacity doesn't match what was set, so it can run in CI
+ * under Xvfb with a compositing manager.
+ */
+int runOverlayBenchmark(const char *spec) {
+    const int steps = 100000;
+    const int roundTrips = 1000;
+    struct overlay o;
+    Atom type;
+    int format;
+    unsigned long count;
+    unsigned long left;
+    unsigned char *value = NULL;
+
+    if (!openOverlay(&o, spec)) {
+        return 1;
+    }
+    setOverlayLevel(&o, kOverlayLevels - 1);
+    XSync(o.display, False);
+
+    for (int changing = 1; changing >= 0; changing--) {
+        unsigned long firstRequest = NextRequest(o.display);
+        uint64_t cpu = threadCpuNs();
+        for (int i = 0; i < steps; i++) {
+            setOverlayLevel(&o, changing ? i % kOverlayLevels : 0);
+        }
+        cpu = threadCpuNs() - cpu;
+        unsigned long requests = NextRequest(o.display) - firstRequest;
+        XSync(o.display, False);
+        printf("%d steps, opacity %s: %.2f requests and %.2f us CPU each\n", steps,
+            changing ? "changing" : "unchanged", (double)requests / steps,
+            (double)cpu / steps / kNsecPerUsec);
+    }
+
+    uint64_t cpu = threadCpuNs();
+    uint64_t start = nowNs();
+    for (int i = 0; i < roundTrips; i++) {
+        setOverlayLevel(&o, i % kOverlayLevels);
+        XSync(o.display, False);
+    }
+    printf("%d steps with a round trip: %.1f us each, %.2f us CPU\n", roundTrips,
+        (double)(nowNs() - start) / roundTrips / kNsecPerUsec,
+        (double)(threadCpuNs() - cpu) / roundTrips / kNsecPerUsec);
+
+
+    // The server should have the opacity of the last step
+
+    long expected = (long)(kOverlayMaxOpacity * (kOverlayLevels - 1 - o.level) /
+        (kOverlayLevels - 1) * 0xffffffffu);
+    bool matches = Success == XGetWindowProperty(o.display, o.window, o.opacityAtom, 0, 1, False,
+        XA_CARDINAL, &type, &format, &count, &left, &value) && 1 == count &&
+        *(long *)value == expected;
+    if (value) {
+        XFree(value);
+    }
+    restoreOverlay(&o);
+    closeOverlay(&o);
+    printf("opacity %s\n", matches ? "matches" : "doesn't match");
+    return matches ? 0 : 1;
+}
+#endif
+
+
+/*
+ * Returns the process's resident set size in KB.
+ */
+long residentKb() {
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "re");
+    if (f) {
+        if (1 != fscanf(f, "%*s %ld", &pages)) {
+            pages = 0;
+        }
+        fclose(f);
+    }
+    return pages * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+
+/*
+ * Creates count virtual seats, each a uinput scroll wheel (a pipe without
+ * uinput) plus a fake backlight, runs them on the worker pool and scrolls
+ * every wheel at 100 frames/s for seconds seconds. Prints per-worker load,
+ * syscalls and latency from kernel timestamp to dim, plus memory and CPU
+ * use.
+ */
+void runSeatBenchmark(int count, int seconds) {
+    char dir[] = "/tmp/brainthrottle-seats.XXXXXX";
+    char name[kSeatNameLength];
+    char path[PATH_MAX];
+    char eventPath[PATH_MAX];
+    int *uinputFds = calloc(count, sizeof(int));
+
+    if (NULL == uinputFds || NULL == mkdtemp(dir)) {
+        fprintf(stderr, "cannot create benchmark directory; bailing\n");
+        exit(-1);
+    }
+    raiseFileLimit();
+    simulateDisplay = true;
+    long rssBefore = residentKb();
+    bool pipes = -1 == access("/dev/uinput", W_OK);
+    if (pipes) {
+        printf("No /dev/uinput; virtual wheels are pipes\n");
+    }
+
+    for (int i = 0; i < count; i++) {
+        uinputFds[i] = pipes ? createPipeWheel(eventPath, sizeof(eventPath)) :
+            createVirtualWheel(i, eventPath, sizeof(eventPath));
+        if (-1 == uinputFds[i] || 0 == eventPath[0]) {
+            fprintf(stderr, "virtual seat %d failed; bailing\n", i);
+            exit(-1);
+        }
+        snprintf(name, sizeof(name), "vseat%d", i);
+        struct seat *seat = findSeat(name, true);
+        addSeatInput(seat, eventPath, false);
+        if (pipes) {
+            close(atoi(eventPath + strlen("/proc/self/fd/")));
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        createFakeBacklight(path);
+        openBacklight(&seat->backlight, path);
+    }
+
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    assignWorkers(numWorkers > 0 ? numWorkers : cpus);
+    startWorkers(false);
+    printf("Scrolling %d virtual seats on %d worker(s) for %d s\n", count, numWorkers, seconds);
+
+    struct input_event frame[2];
+    memset(frame, 0, sizeof(frame));
+    frame[0].type = EV_REL;
+    frame[0].code = REL_WHEEL;
+    frame[0].value = 3;
+    frame[1].type = EV_SYN;
+    frame[1].code = SYN_REPORT;
+    uint64_t frames = 0;
+    uint64_t next = nowNs();
+    uint64_t end = next + seconds * kNsecPerSec;
+    struct rusage usageBefore;
+    getrusage(RUSAGE_SELF, &usageBefore);
+    while (next < end) {
+        if (pipes) {
+            struct timespec now;
+            clock_gettime(CLOCK_BOOTTIME, &now);
+            frame[0].input_event_sec = frame[1].input_event_sec = now.tv_sec;
+            frame[0].input_event_usec = frame[1].input_event_usec = now.tv_nsec / 1000;
+        }
+        for (int i = 0; i < count; i++) {
+            if (sizeof(frame) == write(uinputFds[i], frame, sizeof(frame))) {
+                frames++;
+            }
+        }
+        next += 10 * 1000 * kNsecPerUsec;
+        uint64_t now = nowNs();
+        if (next > now) {
+            struct timespec delay = { 0, (long)(next - now) };
+            nanosleep(&delay, NULL);
+        }
+    }
+    sleep(1);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpuUs = (usage.ru_utime.tv_sec - usageBefore.ru_utime.tv_sec +
+        usage.ru_stime.tv_sec - usageBefore.ru_stime.tv_sec) * 1e6 +
+        (usage.ru_utime.tv_usec - usageBefore.ru_utime.tv_usec) +
+        (usage.ru_stime.tv_usec - usageBefore.ru_stime.tv_usec);
+
+    printf("%llu frames written, %zu bytes per seat context, RSS grew %ld KB\n",
+        (unsigned long long)frames, sizeof(struct seat), residentKb() - rssBefore);
+    printf("%s engine: %.2f us of CPU per frame, writer included\n",
+        useUring ? "io_uring" : "epoll", frames ? cpuUs / frames : 0);
+    printSeatStats();
+
+    for (int i = 0; i < count; i++) {
+        if (!pipes) {
+            ioctl(uinputFds[i], UI_DEV_DESTROY);
+        }
+        close(uinputFds[i]);
+        snprintf(path, sizeof(path), "%s/vseat%d", dir, i);
+        char file[PATH_MAX + 32];
+        snprintf(file, sizeof(file), "%s/brightness", path);
+        unlink(file);
+        snprintf(file, sizeof(file), "%s/max_brightness", path);
+        unlink(file);
+        rmdir(path);
+    }
+    rmdir(dir);
+}
+#endif
+
+
+#ifdef __APPLE__
+/*
+ * Returns true for the keys used to page through text: space, page up and
+ * down, and the up and down arrows.
+ */
+bool isNavigationKey(int64_t keycode) {
+    return 49 == keycode || 116 == keycode || 121 == keycode || 125 == keycode || 126 == keycode;
+}
+
+
+/*
+ * Counts a navigation key press in the single-threaded loop.
+ */
+void processKey(uint64_t now) {
+    beginBatch();
+    detectKey(&mainDetector, now);
+    endBatch();
+}
+
+
+/*
+ * Called when the EventTap fires. Updates the scrolling global variables and
+ * controls screen dimming. 
+ */
+static CGEventRef handleScroll (
+    CGEventTapProxy proxy,
+    CGEventType type,
+    CGEventRef event,
+    void * refcon
+) {
+    int64_t scrollX, scrollY;
+
+
+
+    // If the event tap has timed out, reinstall it
+    // Also, if the event isn't a scroll, just return
+
+    if (type == kCGEventTapDisabledByTimeout) {
+        CGEventTapEnable(scrollEventTap, true);
+        return event;
+    } else if (type == kCGEventKeyDown) {
+        if (!pipelineMode && isNavigationKey(CGEventGetIntegerValueField(event, kCGKeyboardEventKeycode))) {
+            processKey(nowNs());
+        }
+        return event;
+    } else if (type != kCGEventScrollWheel) {
+        return event;
+    }
+
+
+    // Hand the scroll off to the pipeline or handle it here. Axis 1 is
+    // vertical.
+
+    scrollY = CGEventGetIntegerValueField(event, kCGScrollWheelEventDeltaAxis1);
+    scrollX = CGEventGetIntegerValueField(event, kCGScrollWheelEventDeltaAxis2);
+    if (pipelineMode) {
+        ingestScroll(0, nowNs(), scrollX, scrollY);
+    } else {
+        processScroll(nowNs(), scrollX, scrollY);
+    }
+
+    return event;
+}
+#endif
+
+
+/*
+ * Screen dim timeout handler. Resets screen brightness and disables timer,
+ * or re-arms it if the penalty was extended since it was set. On OSX it
+ * runs on the run loop (firePenaltyTimer, handlePower); elsewhere only the
+ * -b benchmark uses it, from SIGALRM, with no history or telemetry to
+ * record to.
+ */
+void handleTimeout(int signo)
+{
+
+    // A penalty extended since the timer was set runs on
+
+    uint64_t now = nowNs();
+    if (mainDetector.penalized && now < mainDetector.penaltyDeadline) {
+        setPenaltyTimer(now);
+        return;
+    }
+
+    // Restore brightness if screen has been dimmed
+
+    if (mainDetector.penalized) {
+        if (mainDetector.dimmed) {
+            restoreBrightness();
+        }
+        recordEpisode(&mainDetector, nowNs());
+        mainDetector.penalized = false;
+        mainDetector.dimmed = false;
+        publishEvent(BT_EVENT_RESTORE, mainDetector.id, nowNs(), 0);
+    }
+    mainDetector.lastScrollTime = 0; 
+    publishDetector(&mainDetector);
+
+
+    // Disable timer
+
+    clearPenaltyTimer();
+}
+
+
+#ifdef __APPLE__
+io_connect_t powerPort;                 // Root power domain, for acknowledging sleep
+uint64_t sleepStartedUs;                // Wall clock when the system went to sleep, or 0
+
+
+/*
+ * System power callback, on the run loop with the EventTap. Lets sleep go
+ * ahead, and on wake adds the time asleep to nowNs() (mach_absolute_time
+ * stops during sleep). The time asleep counts: a penalty that ran out
+ * during sleep ends now, and one that didn't gets its timer back for what
+ * is left. Pipeline mode's detector waits on the wall clock and catches up
+ * on its own.
+ */
+void handlePower(void *context, io_service_t service, natural_t type, void *argument) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    uint64_t wallUs = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    if (kIOMessageCanSystemSleep == type || kIOMessageSystemWillSleep == type) {
+        if (kIOMessageSystemWillSleep == type) {
+            sleepStartedUs = wallUs;
+        }
+        IOAllowPowerChange(powerPort, (long)argument);
+        return;
+    } else if (kIOMessageSystemHasPoweredOn != type || 0 == sleepStartedUs) {
+        return;
+    }
+
+    uint64_t slept = wallUs > sleepStartedUs ? (wallUs - sleepStartedUs) * kNsecPerUsec : 0;
+    sleepStartedUs = 0;
+    atomic_fetch_add(&sleepOffsetNs, slept);
+    printf("resumed after %.1f s asleep\n", (double)slept / kNsecPerSec);
+    if (pipelineMode || !mainDetector.penalized) {
+        return;
+    }
+
+    handleTimeout(SIGALRM);
+}
+#endif
+
+
+/*
+ * Exit
+ *
+ * SIGINT, SIGTERM and SIGUSR1 only write the signal number to a pipe. The
+ * exit thread reads it and either prints the stats (SIGUSR1) or restores
+ * the screen, writes out the history, telemetry and snapshot and exits,
+ * all of which takes locks, allocates or does I/O that isn't safe in a
+ * signal handler.
+ */
+int exitPipe[2] = { -1, -1 };           // Signal handler -> exit thread
+
+
+/*
+ * SIGINT/SIGTERM/SIGUSR1 handler. Wakes the exit thread.
+ */
+void handleExitRequest(int signo) {
+    char wake = (char)signo;
+    write(exitPipe[1], &wake, 1);
+}
+
+
+/*
+ * Dumps pipeline and seat stats and the sketches. Exit thread only.
+ */
+void printStats() {
+    if (pipelineMode) {
+        printPipelineStats();
+    }
+#ifdef __linux__
+    if (numWorkers > 0) {
+        printSeatStats();
+    }
+    printOverloadStats();
+#endif
+    printTelemetryStats();
+    printSketches();
+}
+
+
+/*
+ * Restores the screen, writes out what is queued and exits. Exit thread
+ * only.
+ */
+void exitBrainthrottle() {
+
+
+    // Disable the penalty timer, then restore brightness if the screen has
+    // been dimmed. The last snapshot comes after, so the next start doesn't
+    // dim it again.
+
+    clearPenaltyTimer();
+    if (mainDetector.penalized) {
+        if (mainDetector.dimmed) {
+            restoreBrightness();
+        }
+        recordEpisode(&mainDetector, nowNs());
+        mainDetector.penalized = false;
+        mainDetector.dimmed = false;
+        publishEvent(BT_EVENT_RESTORE, mainDetector.id, nowNs(), 0);
+    }
+    publishDetector(&mainDetector);
+#ifdef __linux__
+    notifySystemd("STOPPING=1");
+    stopWorkers();
+    restoreSeats();
+#endif
+    writeSnapshot();
+
+    stopHistory();
+    stopTelemetry();
+    printStats();
+    printf("Exiting\n");
+    exit(0);
+}
+
+
+/*
+ * Exit thread. Prints the stats on each SIGUSR1 until SIGINT or SIGTERM.
+ */
+void *exitThread(void *arg) {
+    char wake;
+
+    for (;;) {
+        if (read(exitPipe[0], &wake, 1) < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            break;
+        }
+        if (SIGUSR1 != wake) {
+            break;
+        }
+        printStats();
+        fflush(stdout);
+    }
+    exitBrainthrottle();
+    return NULL;
+}
+
+
+/*
+ * Starts the exit thread and sends SIGINT, SIGTERM and SIGUSR1 to it.
+ * Called again by a forked child, which only keeps the calling thread,
+ * with a pipe of its own.
+ */
+void startExitThread() {
+    struct sigaction action;
+    pthread_t thread;
+
+    if (-1 != exitPipe[0]) {
+        close(exitPipe[0]);
+        close(exitPipe[1]);
+    }
+    if (-1 == pipe(exitPipe)) {
+        fprintf(stderr, "Error creating exit pipe; bailing\n");
+        exit(-1);
+    }
+    fcntl(exitPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(exitPipe[1], F_SETFD, FD_CLOEXEC);
+    if (0 != pthread_create(&thread, NULL, &exitThread, NULL)) {
+        fprintf(stderr, "Error starting exit thread; bailing\n");
+        exit(-1);
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &handleExitRequest;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+
+#ifdef __APPLE__
+/*
+ * Penalty timer callback, on the run loop with the EventTap.
+ */
+void firePenaltyTimer(CFRunLoopTimerRef timer, void *info) {
+    handleTimeout(SIGALRM);
+}
+#endif
+
+
+/*
+ * Control socket
+ *
+ * A line protocol on a Unix stream socket (-C). Each command gets zero or
+ * more lines of output followed by "ok" or "error <reason>":
+ *
+ *   get [NAME]                   print one or every parameter
+ *   set NAME VALUE [NAME VALUE]  change parameters, all at once or none
+ *   detector NAME                same as set detector NAME
+ *   actuator NAME                same as set actuator NAME
+ *   pause, resume                stop or restart counting scrolls
+ *   dump                         print parameters and every seat's state
+ *   label LABEL [SEAT]           mark what the user is doing from now on (skim,
+ *                                read or none) on the event bus, for training
+ *                                the model detector from traces
+ *   suspend SECONDS              Linux: act as if the machine had just resumed
+ *                                from a suspend of SECONDS, for testing
+ */
+const int kControlLine = 512;         // Longest command accepted
+const int kControlTimeoutSec = 10;    // Idle clients are dropped after this
+
+
+/*
+ * Copies the current config, applies name/value pairs to the copy and
+ * swaps it in. Writes an error and changes nothing if any pair is bad.
+ */
+void updateConfig(int client, char **pairs, int count) {
+    struct config *next = malloc(sizeof(struct config));
+    if (NULL == next) {
+        dprintf(client, "error out of memory\n");
+        return;
+    }
+
+    pthread_mutex_lock(&configLock);
+    *next = *atomic_load(&currentConfig);
+    for (int i = 0; i + 1 < count; i += 2) {
+        const char *error = setConfigParam(next, pairs[i], pairs[i + 1]);
+        if (error) {
+            pthread_mutex_unlock(&configLock);
+            free(next);
+            dprintf(client, "error %s\n", error);
+            return;
+        }
+    }
+    swapConfig(next);
+    pthread_mutex_unlock(&configLock);
+    markDirty();
+    dprintf(client, "ok\n");
+}
+
+
+/*
+ * Writes every status page slot to client, one line per seat.
+ */
+void dumpSeats(int client) {
+    struct btStatusSeat seat;
+    uint64_t now = nowNs();
+
+    for (uint32_t i = 0; statusPage && i < statusPage->numSeats; i++) {
+        btStatusRead(&statusPage->seats[i], &seat);
+        struct btStatusDetector *d = &seat.detector;
+        bool live = now - d->lastScrollTime <= d->restoreTimeout;
+        dprintf(client, "seat %s penalized %u score %.2f left %.1f brightness %.2f target %.2f\n",
+            seat.actuator.name, d->penalized,
+            live ? (double)d->recentScrollTotal / d->scrollThreshold : 0.0,
+            d->penalized && d->penaltyDeadline > now ?
+                (double)(d->penaltyDeadline - now) / kNsecPerSec : 0.0,
+            seat.actuator.currentBrightness, seat.actuator.targetBrightness);
+    }
+}
+
+
+/*
+ * Publishes a label (skim, read or none) for one seat, or every seat if
+ * name is NULL, and replies to client.
+ */
+void labelSeats(int client, const char *label, const char *name) {
+    struct btStatusSeat seat;
+    int labeled = 0;
+
+    int value = 0 == strcmp(label, "skim") ? 1 : 0 == strcmp(label, "read") ? 0 :
+        0 == strcmp(label, "none") ? -1 : 2;
+    if (2 == value) {
+        dprintf(client, "error label must be skim, read or none\n");
+        return;
+    } else if (NULL == eventBus || NULL == statusPage) {
+        dprintf(client, "error labels need the event bus (-e)\n");
+        return;
+    }
+    uint64_t now = nowNs();
+    for (uint32_t i = 0; i < statusPage->numSeats; i++) {
+        btStatusRead(&statusPage->seats[i], &seat);
+        if (NULL == name || 0 == strncmp(name, seat.actuator.name, sizeof(seat.actuator.name))) {
+            publishEvent(BT_EVENT_LABEL, i, now, value);
+            labeled++;
+        }
+    }
+    if (0 == labeled) {
+        dprintf(client, "error unknown seat\n");
+    } else {
+        dprintf(client, "ok\n");
+    }
+}
+
+
+/*
+ * Simulates a suspend of seconds: moves nowNs() forward as a real suspend
+ * would and wakes the workers (or the pipeline detector) so they handle
+ * the resume. Input timestamps move with it.
+ */
+void simulateSuspend(int client, const char *seconds) {
+    char *end;
+    long value = strtol(seconds, &end, 10);
+
+    if (end == seconds || '\0' != *end || value < 1 || value > 7 * 24 * 3600) {
+        dprintf(client, "error suspend takes 1-604800 seconds\n");
+        return;
+    }
+#ifdef __linux__
+    struct itimerspec now = { { 0, 0 }, { 0, 1 } };
+    atomic_fetch_add(&sleepOffsetNs, (uint64_t)value * kNsecPerSec);
+    for (int i = 0; i < numWorkers; i++) {
+        timerfd_settime(workers[i].timer.fd, 0, &now, NULL);
+    }
+    if (pipelineMode) {
+        wakeWaiter(&detectorWaiter);
+    }
+    dprintf(client, "ok\n");
+#else
+    dprintf(client, "error suspend is only simulated on Linux\n");
+#endif
+}
+
+
+/*
+ * Runs one control command line and writes its reply to client.
+ */
+void runControlCommand(int client, char *line) {
+    char buf[512];
+    char *words[16];
+    char *save;
+    int count = 0;
+
+    for (char *word = strtok_r(line, " \t\r", &save); word && count < 16;
+            word = strtok_r(NULL, " \t\r", &save)) {
+        words[count++] = word;
+    }
+    if (0 == count) {
+        return;
+    }
+
+    if (0 == strcmp(words[0], "get") && count <= 2) {
+        formatConfig(atomic_load(&currentConfig), buf, sizeof(buf));
+        if (1 == count) {
+            dprintf(client, "%sok\n", buf);
+            return;
+        }
+        for (char *entry = strtok_r(buf, "\n", &save); entry; entry = strtok_r(NULL, "\n", &save)) {
+            size_t len = strlen(words[1]);
+            if (0 == strncmp(entry, words[1], len) && ' ' == entry[len]) {
+                dprintf(client, "%s\nok\n", entry);
+                return;
+            }
+        }
+        dprintf(client, "error unknown parameter\n");
+    } else if (0 == strcmp(words[0], "set") && count >= 3 && 1 == count % 2) {
+        updateConfig(client, words + 1, count - 1);
+    } else if ((0 == strcmp(words[0], "detector") || 0 == strcmp(words[0], "actuator")) &&
+            2 == count) {
+        updateConfig(client, words, count);
+    } else if ((0 == strcmp(words[0], "pause") || 0 == strcmp(words[0], "resume")) &&
+            1 == count) {
+        char *pairs[] = { "paused", 'p' == words[0][0] ? "1" : "0" };
+        updateConfig(client, pairs, 2);
+    } else if (0 == strcmp(words[0], "label") && (2 == count || 3 == count)) {
+        labelSeats(client, words[1], 3 == count ? words[2] : NULL);
+    } else if (0 == strcmp(words[0], "suspend") && 2 == count) {
+        simulateSuspend(client, words[1]);
+    } else if (0 == strcmp(words[0], "dump") && 1 == count) {
+        formatConfig(atomic_load(&currentConfig), buf, sizeof(buf));
+        dprintf(client, "%s", buf);
+        dumpSeats(client);
+        dprintf(client, "ok\n");
+    } else {
+        dprintf(client, "error unknown command\n");
+    }
+}
+
+
+/*
+ * Control thread. Serves one client at a time; commands are short and
+ * idle clients time out.
+ */
+void *controlThread(void *arg) {
+    char line[kControlLine];
+    struct timeval timeout = { kControlTimeoutSec, 0 };
+
+    for (;;) {
+        int client = accept(controlFd, NULL, NULL);
+        if (-1 == client) {
+            continue;
+        }
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        size_t len = 0;
+        ssize_t n;
+        while ((n = read(client, line + len, sizeof(line) - 1 - len)) > 0) {
+            char *end;
+            len += n;
+            while ((end = memchr(line, '\n', len))) {
+                *end = '\0';
+                runControlCommand(client, line);
+                len -= end + 1 - line;
+                memmove(line, end + 1, len);
+            }
+            if (len == sizeof(line) - 1) {
+                dprintf(client, "error line too long\n");
+                break;
+            }
+        }
+        close(client);
+    }
+    return NULL;
+}
+
+
+/*
+ * Fills addr with the Unix socket address for path.
+ */
+void controlAddress(struct sockaddr_un *addr, const char *path) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "control socket path too long; bailing\n");
+        exit(-1);
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+}
+
+
+/*
+ * Binds a Unix socket of type at path, owner-only, and listens on it.
+ * Called before dropping privileges so sockets can live under /run.
+ */
+int listenUnix(const char *path, int type) {
+    struct sockaddr_un addr;
+
+    controlAddress(&addr, path);
+    unlink(path);
+    int fd = socket(AF_UNIX, type, 0);
+    mode_t mask = umask(0077);
+    if (-1 == fd || -1 == bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        -1 == listen(fd, 16)) {
+        fprintf(stderr, "cannot listen on %s (error %d); bailing\n", path, errno);
+        exit(-1);
+    }
+    umask(mask);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+
+/*
+ * Starts the control thread if there is a control socket.
+ */
+void startControl() {
+    pthread_t thread;
+
+    if (-1 != controlFd && 0 != pthread_create(&thread, NULL, &controlThread, NULL)) {
+        fprintf(stderr, "Error starting control thread; bailing\n");
+        exit(-1);
+    }
+}
+
+
+/*
+ * Sends one command to the control socket at path and prints the reply.
+ * Returns 0 if the reply ended in "ok".
+ */
+int sendControl(const char *path, const char *command) {
+    struct sockaddr_un addr;
+    char reply[4096];
+    size_t len = 0;
+    ssize_t n;
+
+    controlAddress(&addr, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (-1 == fd || -1 == connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "cannot connect to %s (error %d)\n", path, errno);
+        return -1;
+    }
+    dprintf(fd, "%s\n", command);
+    shutdown(fd, SHUT_WR);
+    while (len < sizeof(reply) - 1 && (n = read(fd, reply + len, sizeof(reply) - 1 - len)) > 0) {
+        len += n;
+    }
+    close(fd);
+    reply[len] = '\0';
+    fputs(reply, stdout);
+    return len >= 3 && 0 == strcmp(reply + len - 3, "ok\n") ? 0 : -1;
+}
+
+
+/*
+ * Returns a pseudo-random scroll delta in [1, 10] for benchmarking.
+ */
+int64_t benchmarkDelta(uint64_t *seed) {
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return 1 + (*seed >> 33) % 10;
+}
+
+
+/*
+ * Runs count synthetic scroll events through the single-threaded loop and
+ * then through the pipeline, against a simulated display that takes
+ * kSimulatedDisplayUsec per call. Prints throughput and ingest latency.
+ */
+void runBenchmark(long count) {
+    uint64_t seed = 1;
+    uint64_t start, end, maxIngest;
+
+    simulateDisplay = true;
+    printf("Benchmarking %ld events, simulated display %d us per call\n",
+        count, kSimulatedDisplayUsec);
+
+
+    // Single-threaded: the display call happens inside the EventTap
+
+    maxIngest = 0;
+    start = nowNs();
+    for (long i = 0; i < count; i++) {
+        uint64_t t = nowNs();
+        processScroll(t, 0, benchmarkDelta(&seed));
+        if (nowNs() - t > maxIngest) {
+            maxIngest = nowNs() - t;
+        }
+    }
+    end = nowNs();
+    setitimer(ITIMER_REAL, NULL, NULL);
+    printf("single-threaded: %12.0f events/s  max ingest %8.1f us\n",
+        count * (double)kNsecPerSec / (end - start), (double)maxIngest / kNsecPerUsec);
+
+
+    // Pipeline: ingest only pays for the ring push. Wait for room rather
+    // than drop so every event reaches the detector.
+
+    memset(&mainDetector, 0, sizeof(mainDetector));
+    startPipeline();
+    seed = 1;
+    start = nowNs();
+    for (long i = 0; i < count; i++) {
+        while (ringOccupancy(&ingestRings[0]) >= kRingSlots) {
+            sched_yield();
+        }
+        ingestScroll(0, nowNs(), 0, benchmarkDelta(&seed));
+    }
+    while (atomic_load_explicit(&processedEvents, memory_order_acquire) < (uint64_t)count) {
+        sched_yield();
+    }
+    end = nowNs();
+    printf("pipeline:        %12.0f events/s  max ingest %8.1f us\n",
+        count * (double)kNsecPerSec / (end - start),
+        (double)atomic_load(&ingestStats.maxNs) / kNsecPerUsec);
+    printPipelineStats();
+}
+
+
+/*
+ * Feeds one synthetic scroll per millisecond through the pipeline for
+ * seconds seconds, as the input thread would, and reports how late the
+ * input thread woke up and how long each stage took. Meant to be run with
+ * and without -l while something like stress-ng loads the machine.
+ */
+void runJitterBenchmark(int seconds) {
+    const uint64_t period = 1000 * kNsecPerUsec;
+    uint64_t seed = 1;
+    uint64_t sent = 0;
+
+    simulateDisplay = true;
+    startPipeline();
+    configureThread("ingest", cpuIngest, realtimePriority);
+    waitForPipelineThreads();
+    if (lowLatency) {
+        printSelfCheck();
+    }
+    printf("Measuring jitter for %d s, one event per ms\n", seconds);
+
+    uint64_t next = nowNs() + period;
+    uint64_t end = next + seconds * kNsecPerSec;
+    while (next < end) {
+        uint64_t now = nowNs();
+        while (now < next) {
+            struct timespec delay = { 0, (long)(next - now) };
+            nanosleep(&delay, NULL);
+            now = nowNs();
+        }
+        recordLatency(&wakeupStats, now - next);
+        ingestScroll(0, now, 0, benchmarkDelta(&seed));
+        sent++;
+        next += period;
+    }
+    while (atomic_load_explicit(&processedEvents, memory_order_acquire) < sent) {
+        sched_yield();
+    }
+
+    printStage("wakeup", &wakeupStats);
+    printPipelineStats();
+}
+
+
+/*
+ * Consumer thread for the event bus benchmark. The last consumer is slow on
+ * purpose, sleeping after every event, to show it gets skipped rather than
+ * holding anyone up.
+ */
+void *busConsumerThread(void *arg) {
+    struct btEventConsumer *me = arg;
+    bool slow = me == &eventBus->consumers[kBusConsumers - 1];
+    struct btEvent event;
+
+    while (BT_LOAD(me->pid) != 0) {
+        if (!btEventsNext(eventBus, me, &event)) {
+            sched_yield();
+        } else if (slow) {
+            usleep(1000);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Publishes count events onto a private event bus with no consumers and
+ * then with kBusConsumers consumer threads attached, and reports what
+ * publishing costs and what each consumer saw.
+ */
+void runBusBenchmark(long count) {
+    pthread_t threads[kBusConsumers];
+    struct btEventConsumer *consumers[kBusConsumers];
+    uint64_t seed = 1;
+
+    eventsName = "/brainthrottle-events-benchmark";
+    createEventBus();
+    shm_unlink(eventsName);
+    if (NULL == eventBus) {
+        exit(-1);
+    }
+    printf("Benchmarking %ld events through a %u slot event bus\n", count, kEventSlots);
+
+    for (int attached = 0; attached <= kBusConsumers; attached += kBusConsumers) {
+        for (int i = 0; i < attached; i++) {
+            consumers[i] = btEventsAttach(eventBus, getpid());
+            pthread_create(&threads[i], NULL, &busConsumerThread, consumers[i]);
+        }
+
+        // Publish in batches of kBusBatch, yielding in between as the
+        // producer would while waiting for input; only publishing is timed
+
+        uint64_t elapsed = 0;
+        for (long i = 0; i < count; i += kBusBatch) {
+            uint64_t start = nowNs();
+            for (long j = i; j < i + kBusBatch && j < count; j++) {
+                publishEvent(BT_EVENT_SCROLL, 0, start, benchmarkDelta(&seed));
+            }
+            elapsed += nowNs() - start;
+            sched_yield();
+        }
+        printf("%d consumer(s): %6.1f ns per publish\n", attached, (double)elapsed / count);
+
+        usleep(100000);
+        for (int i = 0; i < attached; i++) {
+            struct btEventConsumer *c = consumers[i];
+            uint64_t behind = BT_LOAD(eventBus->head) - BT_LOAD(c->cursor);
+            btEventsDetach(c);
+            pthread_join(threads[i], NULL);
+            printf("  consumer %d: %10llu lost %6llu lagging %10llu behind%s\n", i,
+                (unsigned long long)c->lost, (unsigned long long)c->lagging,
+                (unsigned long long)behind, i == kBusConsumers - 1 ? " (slow)" : "");
+        }
+    }
+}
+
+
+/*
+ * Returns a pseudo-random number below range for the history benchmark.
+ */
+uint32_t benchmarkRandom(uint64_t *seed, uint32_t range) {
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32_t)((*seed >> 33) % range);
+}
+
+
+/*
+ * Query handlers for the history benchmark. Sum penalized time.
+ */
+void sumEpisode(void *context, const struct episode *e) {
+    *(uint64_t *)context += e->duration;
+}
+
+void sumRollup(void *context, const struct rollupBucket *b) {
+    *(uint64_t *)context += b->penalizedMs;
+}
+
+
+/*
+ * Writes a year of synthetic episodes, about one a minute, and per-minute
+ * scroll activity to historyDir (or a temporary directory that is removed
+ * afterwards). Times history queries over random hours, days, weeks,
+ * months and the whole year, then penalized time per day over the last
+ * quarter from the history and from the rollups.
+ */
+void runHistoryBenchmark() {
+    const struct { const char *name; uint64_t ms; int runs; } ranges[] = {
+        { "hour", 3600000ULL, 10000 },
+        { "day", 86400000ULL, 10000 },
+        { "week", 7 * 86400000ULL, 1000 },
+        { "month", 30 * 86400000ULL, 1000 },
+        { "year", 365 * 86400000ULL, 20 },
+    };
+    char temp[] = "/tmp/brainthrottle-history.XXXXXX";
+    struct historyWriter writer;
+    struct historyReader reader;
+    struct rollupFile *r;
+    struct episode e;
+    struct activity a;
+    size_t rollupSize;
+    uint64_t seed = 1;
+    long count = 0;
+    char path[PATH_MAX];
+    struct stat st;
+
+    const char *dir = historyDir ? historyDir : mkdtemp(temp);
+    if (NULL == dir || -1 == openHistory(&writer, dir) ||
+        NULL == (r = openRollups(dir, true, &rollupSize))) {
+        fprintf(stderr, "Error creating history benchmark directory: %s; bailing\n", strerror(errno));
+        exit(-1);
+    }
+
+
+    // A year of penalties, ending 30-90 s apart, with scrolling in every
+    // minute. Only the history is timed.
+
+    uint64_t end = writer.lastTime ? writer.lastTime : unixMs(nowNs()) - ranges[4].ms;
+    uint64_t first = end, elapsed = 0, start;
+    memset(&a, 0, sizeof(a));
+    while (end < first + ranges[4].ms) {
+        memset(&e, 0, sizeof(e));
+        end += 30000 + benchmarkRandom(&seed, 60000);
+        e.end = end;
+        e.duration = 5000 + benchmarkRandom(&seed, 20000);
+        e.seat = benchmarkRandom(&seed, 4);
+        e.peakScore = 1000 + benchmarkRandom(&seed, 5000);
+        e.scrolls = 1 + benchmarkRandom(&seed, 200);
+        start = nowNs();
+        appendEpisode(&writer, &e);
+        elapsed += nowNs() - start;
+        addEpisodeRollup(r, &e);
+        count++;
+
+        for (; a.minute + 60000 <= end; a.minute += 60000) {
+            if (a.minute) {
+                a.events = 10 + benchmarkRandom(&seed, 500);
+                a.volume = a.events * (1 + benchmarkRandom(&seed, 10));
+                addActivityRollup(r, &a);
+            } else {
+                a.minute = end - end % 60000 - 60000;
+            }
+        }
+    }
+    start = nowNs();
+    flushHistory(&writer);
+    elapsed += nowNs() - start;
+
+    off_t bytes = 0;
+    for (uint32_t i = 0; i <= writer.segment; i++) {
+        snprintf(path, sizeof(path), "%s/%08u.seg", dir, i);
+        bytes += 0 == stat(path, &st) ? st.st_size : 0;
+        snprintf(path, sizeof(path), "%s/%08u.idx", dir, i);
+        bytes += 0 == stat(path, &st) ? st.st_size : 0;
+    }
+    printf("Appended %ld episodes in %.1f ms (%.0f ns each), %u segment(s), %.1f bytes per episode\n",
+        count, (double)elapsed / 1000000, (double)elapsed / count, writer.segment + 1,
+        (double)bytes / count);
+
+
+    // Query random ranges inside the year through the mapped files
+
+    if (-1 == openHistoryReader(&reader, dir)) {
+        fprintf(stderr, "Error reading history benchmark: %s; bailing\n", strerror(errno));
+        exit(-1);
+    }
+    for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+        long found = 0, blocks = 0, read;
+        start = nowNs();
+        for (int run = 0; run < ranges[i].runs; run++) {
+            uint64_t span = end - first > ranges[i].ms ? end - first - ranges[i].ms : 0;
+            uint64_t from = first + (uint64_t)benchmarkRandom(&seed, (uint32_t)(span / 1000) + 1) * 1000;
+            found += queryHistory(&reader, from, from + ranges[i].ms, NULL, NULL, &read);
+            blocks += read;
+        }
+        elapsed = nowNs() - start;
+        printf("%-6s %9.2f us per query, %8.0f episodes, %6.1f blocks\n", ranges[i].name,
+            (double)elapsed / ranges[i].runs / 1000, (double)found / ranges[i].runs,
+            (double)blocks / ranges[i].runs);
+    }
+
+
+    // Penalized time per day over the last quarter: decode the quarter's
+    // episodes, or read 92 day buckets
+
+    uint64_t quarter = 92 * 86400000ULL, penalizedMs = 0;
+    long rollupBuckets = 0;
+    start = nowNs();
+    for (int run = 0; run < 100; run++) {
+        queryHistory(&reader, end - quarter, end, &sumEpisode, &penalizedMs, NULL);
+    }
+    elapsed = nowNs() - start;
+    printf("quarter by day, history  %9.2f us per query (%.0f s penalized)\n",
+        (double)elapsed / 100 / 1000, penalizedMs / 100 / 1000.0);
+    penalizedMs = 0;
+    start = nowNs();
+    for (int run = 0; run < 100000; run++) {
+        rollupBuckets += queryRollups(r, 2, end - quarter, end, &sumRollup, &penalizedMs);
+    }
+    elapsed = nowNs() - start;
+    printf("quarter by day, rollups  %9.2f us per query (%.0f s penalized, %ld buckets)\n",
+        (double)elapsed / 100000 / 1000, penalizedMs / 100000 / 1000.0, rollupBuckets / 100000);
+    closeHistoryReader(&reader);
+    munmap(r, rollupSize);
+
+
+    // Leave a history given with -R in place
+
+    close(writer.segmentFd);
+    close(writer.indexFd);
+    if (NULL == historyDir) {
+        for (uint32_t i = 0; i <= writer.segment; i++) {
+            snprintf(path, sizeof(path), "%s/%08u.seg", dir, i);
+            unlink(path);
+            snprintf(path, sizeof(path), "%s/%08u.idx", dir, i);
+            unlink(path);
+        }
+        snprintf(path, sizeof(path), "%s/rollups", dir);
+        unlink(path);
+        rmdir(dir);
+    }
+}
+
+
+/*
+ * Trace replay
+ *
+ * -Z replays a trace (brainthrottle -T, raw or columnar) through one
+ * detector per seat under the current settings (-o), and prints how many
+ * penalties they start next to how many the trace recorded: what a
+ * different scrollThreshold would have done. Scrolls are gathered per seat
+ * and counted kBatchEvents at a time by detectBatch.
+ */
+#define kReplaySeats 256                // Seats replayed; scrolls for others are skipped
+
+struct replaySeat {                     // Allocated when the seat first shows up
+    struct detector detector;
+    uint32_t count;                     // Scrolls gathered
+    uint64_t scrolls;
+    uint64_t penalties;                 // Started by the replay
+    uint64_t recorded;                  // Penalty events in the trace
+    bool reversed;                      // The next scroll reversed direction (model detector)
+    uint64_t times[kBatchEvents];
+    int32_t dx[kBatchEvents];
+    int32_t dy[kBatchEvents];
+    uint8_t decisions[kBatchEvents];
+};
+
+/*
+ * Counts the scrolls gathered for a seat.
+ */
+void flushReplay(struct replaySeat *seat) {
+    seat->penalties += detectBatch(&seat->detector, seat->times, seat->dx, seat->dy,
+        seat->count, seat->decisions);
+    seat->scrolls += seat->count;
+    seat->count = 0;
+}
+
+/*
+ * Counts one replayed scroll, reversal or key for the model detector,
+ * which can't be batched. As in detectScroll, scrolls and keys enter the
+ * seat's window and the classifier decides on scrolls; a reversal marks
+ * the scroll after it. Penalties end and start as in replayScroll.
+ */
+void replayModelInput(struct replaySeat *seat, const struct btTraceRecord *r) {
+    struct detector *d = &seat->detector;
+    int32_t features[BT_MODEL_FEATURES];
+
+    if (BT_EVENT_REVERSE == r->type) {
+        seat->reversed = true;
+        return;
+    }
+    if (BT_EVENT_KEY == r->type) {
+        btModelAdd(&d->window, r->time / kNsecPerUsec, 0, BT_MODEL_KEY);
+        return;
+    }
+    int64_t scrollDiff = r->value > 0 ? r->value : 1;
+    btModelAdd(&d->window, r->time / kNsecPerUsec, scrollDiff < INT32_MAX ? (uint32_t)scrollDiff : INT32_MAX,
+        seat->reversed ? BT_MODEL_REVERSE : 0);
+    seat->reversed = false;
+    seat->scrolls++;
+    if (config->paused) {
+        return;
+    }
+
+    if (d->penalized && r->time >= d->penaltyDeadline) {
+        d->penalized = false;
+        d->lastScrollTime = 0;
+    }
+    updateScrollTotal(d, r->time, scrollDiff);
+    if (!btModelFeatures(&d->window, features) || btModelScore(&config->model, features) <= 0) {
+        return;
+    }
+    d->penaltyDeadline = r->time + config->penaltyTimeoutSec * kNsecPerSec;
+    if (!d->penalized) {
+        d->penalized = true;
+        d->penaltyStart = r->time;
+        seat->penalties++;
+    }
+}
+
+/*
+ * Replays the trace at path. Returns 0, or -1 if it can't be read.
+ */
+int replayTrace(const char *path) {
+    struct replaySeat *seats[kReplaySeats] = { NULL };
+    struct btTraceRecord block[BT_COLUMN_BLOCK];
+    struct btColumnReader reader;
+    uint64_t skipped = 0, scrolls = 0, penalties = 0, recorded = 0;
+    struct stat st;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (-1 == fd || -1 == fstat(fd, &st) || st.st_size < (off_t)sizeof(struct btTraceHeader)) {
+        fprintf(stderr, "%s: %s\n", path, -1 == fd ? strerror(errno) : "not a brainthrottle trace");
+        return -1;
+    }
+    size_t size = st.st_size;
+    const struct btTraceHeader *header = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == header) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    bool columnar = 0 == btColumnReaderInit(&reader, header, size);
+    if (!columnar && (BT_TRACE_MAGIC != header->magic || BT_TRACE_VERSION != header->version ||
+        sizeof(struct btTraceRecord) != header->recordSize)) {
+        fprintf(stderr, "%s: not a brainthrottle trace (or another version)\n", path);
+        munmap((void *)header, size);
+        return -1;
+    }
+    madvise((void *)header, size, MADV_SEQUENTIAL);
+
+
+    // Gather each seat's scrolls, a raw trace in place or a columnar one
+    // a block at a time. The model detector takes each input as it comes.
+
+    simulateDisplay = true;
+    beginBatch();
+    bool model = kDetectorModel == config->detector;
+    uint64_t start = nowNs();
+    const struct btTraceRecord *r = (const struct btTraceRecord *)(header + 1);
+    size_t count = columnar ? 0 : (size - sizeof(*header)) / sizeof(*r);
+    for (;;) {
+        if (columnar) {
+            const struct btColumnBlock *b = btColumnNextBlock(&reader);
+            int n = b ? btColumnDecode(b, block) : -1;
+            if (n < 0) {
+                break;
+            }
+            r = block;
+            count = n;
+        }
+        for (size_t i = 0; i < count; i++) {
+            bool input = BT_EVENT_SCROLL == r[i].type ||
+                (model && (BT_EVENT_REVERSE == r[i].type || BT_EVENT_KEY == r[i].type));
+            if (r[i].seat >= kReplaySeats || (!input && BT_EVENT_PENALTY != r[i].type)) {
+                skipped += r[i].seat >= kReplaySeats;
+                continue;
+            }
+            struct replaySeat *seat = seats[r[i].seat];
+            if (NULL == seat && NULL == (seat = seats[r[i].seat] = calloc(1, sizeof(*seat)))) {
+                fprintf(stderr, "Error allocating replay seat; bailing\n");
+                exit(-1);
+            }
+            if (BT_EVENT_PENALTY == r[i].type) {
+                seat->recorded++;
+                continue;
+            }
+            if (model) {
+                replayModelInput(seat, &r[i]);
+                continue;
+            }
+            seat->times[seat->count] = r[i].time;
+            seat->dx[seat->count] = r[i].value > 0 ? r[i].value - 1 : 0;
+            seat->dy[seat->count] = 0;
+            if (kBatchEvents == ++seat->count) {
+                flushReplay(seat);
+            }
+        }
+        if (!columnar) {
+            break;
+        }
+    }
+    for (int i = 0; i < kReplaySeats; i++) {
+        if (seats[i]) {
+            flushReplay(seats[i]);
+        }
+    }
+    uint64_t elapsed = nowNs() - start;
+    endBatch();
+
+
+    // Per seat, then in total
+
+    printf("seat      scrolls  penalties  recorded\n");
+    for (int i = 0; i < kReplaySeats; i++) {
+        if (seats[i]) {
+            printf("%4d %12llu %10llu %9llu\n", i, (unsigned long long)seats[i]->scrolls,
+                (unsigned long long)seats[i]->penalties, (unsigned long long)seats[i]->recorded);
+            scrolls += seats[i]->scrolls;
+            penalties += seats[i]->penalties;
+            recorded += seats[i]->recorded;
+            free(seats[i]);
+        }
+    }
+    printf("all  %12llu %10llu %9llu\n", (unsigned long long)scrolls,
+        (unsigned long long)penalties, (unsigned long long)recorded);
+    if (skipped) {
+        printf("(%llu events for seats over %d skipped)\n", (unsigned long long)skipped, kReplaySeats - 1);
+    }
+    printf("Replayed in %.3f s (%.0f M scrolls/s)\n", (double)elapsed / kNsecPerSec,
+        elapsed ? scrolls * 1000.0 / elapsed : 0.0);
+    munmap((void *)header, size);
+    return 0;
+}
+
+
+/*
+ * Fills count scrolls for the batch benchmark: bursts of quick scrolls
+ * separated by pauses, some of them exactly restoreTimeoutSec or
+ * penaltyTimeoutSec long, with the odd extreme delta or time going
+ * backwards when rough is set.
+ */
+void fillBatchScrolls(uint64_t *seed, uint64_t *time, uint64_t *times, int32_t *dx, int32_t *dy,
+    size_t count, bool rough) {
+    uint64_t restore = config->restoreTimeoutSec * kNsecPerSec;
+    uint64_t penalty = config->penaltyTimeoutSec * kNsecPerSec;
+    uint64_t pauses[] = { restore, restore + 1, penalty, penalty - 1, 2 * kNsecPerSec, 30 * kNsecPerSec };
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t roll = benchmarkRandom(seed, 1000);
+        if (roll < 5) {
+            *time += pauses[benchmarkRandom(seed, 6)];
+        } else if (rough && roll < 7) {
+            *time -= benchmarkRandom(seed, 1000000);
+        } else {
+            *time += kNsecPerUsec * (1000 + benchmarkRandom(seed, 50000));
+        }
+        times[i] = *time;
+        dx[i] = benchmarkRandom(seed, 3);
+        dy[i] = 2 - (int32_t)benchmarkRandom(seed, 20);
+        if (rough && roll >= 990) {
+            dx[i] = roll & 1 ? INT32_MIN : INT32_MAX;
+        }
+    }
+}
+
+
+/*
+ * Collects the times a merge check's merge releases.
+ */
+struct mergeCheck {
+    uint64_t times[1024];
+    int count;
+};
+
+void collectMergeEvent(void *context, const struct mergeEvent *event) {
+    struct mergeCheck *c = context;
+    if (c->count < 1024) {
+        c->times[c->count] = event->time;
+    }
+    c->count++;
+}
+
+
+/*
+ * Pushes events timed 1 to count, each from one of three sources in runs
+ * of up to maxRun, through a merge and returns whether they came out once
+ * each and in order. A source whose queue fills while another source holds
+ * the oldest event must not lose any. With maxRun 0, source 0 sends the
+ * first event and source 1 all the rest.
+ */
+bool checkMerge(uint64_t seed, int count, int maxRun) {
+    struct merge m;
+    struct mergeCheck c = { .count = 0 };
+
+    memset(&m, 0, sizeof(m));
+    m.handler = &collectMergeEvent;
+    m.context = &c;
+    for (int i = 0; i < 3; i++) {
+        mergeAddSource(&m);
+    }
+    for (int time = 1, run = 0, source = 0; time <= count; time++, run--) {
+        if (0 == maxRun) {
+            source = time > 1;
+        } else if (run <= 0) {
+            source = benchmarkRandom(&seed, 3);
+            run = 1 + benchmarkRandom(&seed, maxRun);
+        }
+        struct mergeEvent event = { .time = (uint64_t)time };
+        mergePush(&m, source, &event);
+    }
+    mergeRelease(&m, 0, true);
+    for (int i = 0; i < 3; i++) {
+        free(m.sources[i]);
+    }
+    bool ok = c.count == count;
+    for (int i = 0; ok && i < count; i++) {
+        ok = c.times[i] == (uint64_t)i + 1;
+    }
+    return ok;
+}
+
+
+/*
+ * Checks detectBatch against replayScroll over synthetic scrolls under
+ * several settings, with and without AVX2 and cut into batches of several
+ * sizes, and the input merge over runs from each source, then times count
+ * scrolls through each detector.
+ */
+void runBatchBenchmark(long count) {
+    const struct config settings[] = {
+        { .penaltyTimeoutSec = 5, .restoreTimeoutSec = 10, .scrollThreshold = 1000 },
+        { .penaltyTimeoutSec = 10, .restoreTimeoutSec = 5, .scrollThreshold = 1000 },
+        { .penaltyTimeoutSec = 5, .restoreTimeoutSec = 5, .scrollThreshold = 1 },
+        { .penaltyTimeoutSec = 0, .restoreTimeoutSec = 0, .scrollThreshold = 50 },
+        { .penaltyTimeoutSec = 30, .restoreTimeoutSec = 60, .scrollThreshold = 100000 },
+    };
+    const size_t sizes[] = { kBatchEvents, 1, 3, 7, 64 };
+    const size_t n = 1 << 16;
+    uint64_t *times = malloc(n * sizeof(*times));
+    int32_t *dx = malloc(n * sizeof(*dx));
+    int32_t *dy = malloc(n * sizeof(*dy));
+    uint8_t *expected = malloc(n);
+    uint8_t *got = malloc(n);
+    struct detector reference, batch;
+    int failures = 0, checks = 0;
+
+    if (!times || !dx || !dy || !expected || !got) {
+        fprintf(stderr, "Error allocating batch benchmark; bailing\n");
+        exit(-1);
+    }
+    simulateDisplay = true;
+#ifdef __x86_64__
+    bool haveAvx2 = batchAvx2;
+#else
+    bool haveAvx2 = false;
+#endif
+    printf("Checking detectBatch against replayScroll (%s)\n", haveAvx2 ? "AVX2 and scalar" : "scalar only");
+
+
+    // Equivalence: the same decisions, penalties and final state. The
+    // settings are swapped in directly; nothing else is reading them.
+
+    for (size_t s = 0; s < sizeof(settings) / sizeof(settings[0]); s++) {
+        config = &settings[s];
+        uint64_t seed = s + 1, time = kNsecPerSec;
+        fillBatchScrolls(&seed, &time, times, dx, dy, n, true);
+        memset(&reference, 0, sizeof(reference));
+        uint32_t penalties = 0;
+        for (size_t i = 0; i < n; i++) {
+            expected[i] = replayScroll(&reference, times[i], 1 + llabs(dx[i]) + llabs(dy[i]), &penalties);
+        }
+        for (int simd = 0; simd <= haveAvx2; simd++) {
+#ifdef __x86_64__
+            batchAvx2 = simd;
+#endif
+            for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+                uint32_t batchPenalties = 0;
+                memset(&batch, 0, sizeof(batch));
+                for (size_t i = 0; i < n; i += sizes[z]) {
+                    size_t m = n - i < sizes[z] ? n - i : sizes[z];
+                    batchPenalties += detectBatch(&batch, &times[i], &dx[i], &dy[i], m, &got[i]);
+                }
+                checks++;
+                if (batchPenalties != penalties || 0 != memcmp(expected, got, n) ||
+                    0 != memcmp(&batch, &reference, sizeof(batch))) {
+                    printf("threshold %lld, penalty %d s, restore %d s, %s, batches of %zu: DIFFERS\n",
+                        (long long)settings[s].scrollThreshold, settings[s].penaltyTimeoutSec,
+                        settings[s].restoreTimeoutSec, simd ? "avx2" : "scalar", sizes[z]);
+                    failures++;
+                }
+            }
+        }
+    }
+
+
+    // The input merge: one event queued on a source and then more than a
+    // queue's worth on another, then runs of each length from all three
+
+    for (int run = 0; run <= 64; run = run ? 2 * run : 4) {
+        checks++;
+        if (!checkMerge(run + 1, 1000, run)) {
+            printf("merge, runs of up to %d: DIFFERS\n", run);
+            failures++;
+        }
+    }
+    printf("%d of %d runs match\n", checks - failures, checks);
+
+
+    // Throughput under the default settings: replayScroll one at a time,
+    // then detectBatch without and with AVX2, over a few batches' worth of
+    // scrolls that stay in cache, as a replaying seat's do
+
+    const size_t hot = 4 * kBatchEvents;
+    config = &defaultConfig;
+    uint64_t seed = 1, time = kNsecPerSec;
+    fillBatchScrolls(&seed, &time, times, dx, dy, hot, false);
+    for (int mode = 0; mode < 2 + haveAvx2; mode++) {
+        uint32_t penalties = 0;
+        memset(&batch, 0, sizeof(batch));
+#ifdef __x86_64__
+        batchAvx2 = 2 == mode;
+#endif
+        uint64_t start = nowNs();
+        for (long done = 0; done < count; done += hot) {
+            if (0 == mode) {
+                for (size_t i = 0; i < hot; i++) {
+                    got[i] = replayScroll(&batch, times[i], 1 + llabs(dx[i]) + llabs(dy[i]), &penalties);
+                }
+            } else {
+                for (size_t i = 0; i < hot; i += kBatchEvents) {
+                    penalties += detectBatch(&batch, &times[i], &dx[i], &dy[i], kBatchEvents, &got[i]);
+                }
+            }
+        }
+        uint64_t elapsed = nowNs() - start;
+        long done = (count + hot - 1) / hot * hot;
+        printf("%-20s %8.0f M scrolls/s, %5.2f ns per scroll (%u penalties)\n",
+            0 == mode ? "replayScroll" : 1 == mode ? "detectBatch scalar" : "detectBatch avx2",
+            done * 1000.0 / elapsed, (double)elapsed / done, penalties);
+    }
+#ifdef __x86_64__
+    batchAvx2 = haveAvx2;
+#endif
+    config = NULL;
+    free(times);
+    free(dx);
+    free(dy);
+    free(expected);
+    free(got);
+}
+
+
+/*
+ * Parses a comma-separated "ingest,detector,actuator" CPU list for -c.
+ * Trailing stages may be left out.
+ */
+void parseCpus(const char *list) {
+    if (sscanf(list, "%d,%d,%d", &cpuIngest, &cpuDetector, &cpuActuator) < 1) {
+        fprintf(stderr, "-c expects up to three CPU numbers, e.g. -c 1,2,3\n");
+        exit(-1);
+    }
+}
+
+
+/*
+ * Entry point for the program. Installs the scroll-handler EventTap and runs 
+ * event loop
+ */
+int main (
+    int argc,
+    char ** argv
+) {
+    bool usePipeline = false;
+    long benchmarkCount = 0;
+    int jitterSeconds = 0;
+    int workerCount = 0;
+    int virtualSeats = 0;
+    const char *configPath = NULL;
+    const char *privsepUser = NULL;
+    const char *ioEngine = NULL;
+    long helperCount = 0;
+    long wheelCount = 0;
+    const char *gammaDisplay = NULL;
+    const char *overlaySpec = NULL;
+    bool showStatus = false;
+    bool useEventBus = false;
+    bool showEvents = false;
+    const char *tracePath = NULL;
+    long busCount = 0;
+    const char *controlPath = NULL;
+    const char *controlCommand = NULL;
+    const char *ingestPath = NULL;
+    const char *historyRange = NULL;
+    const char *rollupLevel = NULL;
+    bool historyBenchmark = false;
+    const char *replayPath = NULL;
+    long batchCount = 0;
+    bool mergeSketches = false;
+    struct config *startConfig = NULL;
+    const char *error;
+    char *value;
+    int restored;
+    int opt;
+
+    processStart = nowNs();
+#ifdef __x86_64__
+    initBatchDetector();
+#endif
+    mainDetector.sketches = newSketches();
+    while ((opt = getopt(argc, argv, "pc:b:lr:j:df:w:V:u:i:H:W:G:O:F:s:SeEk:o:C:X:I:P:R:Q:U:YT:Z:B:M")) != -1) {
+        switch (opt) {
+        case 'p':
+            usePipeline = true;
+            break;
+        case 'c':
+            parseCpus(optarg);
+            break;
+        case 'b':
+            benchmarkCount = atol(optarg);
+            break;
+        case 'l':
+            lowLatency = true;
+            break;
+        case 'r':
+            realtimePriority = atoi(optarg);
+            break;
+        case 'j':
+            jitterSeconds = atoi(optarg);
+            break;
+        case 'd':
+            daemonMode = true;
+            break;
+        case 'f':
+            configPath = optarg;
+            break;
+        case 'w':
+            workerCount = atoi(optarg);
+            break;
+        case 'V':
+            virtualSeats = atoi(optarg);
+            break;
+        case 'u':
+            privsepUser = optarg;
+            break;
+        case 'i':
+            ioEngine = optarg;
+            break;
+        case 'H':
+            helperCount = atol(optarg);
+            break;
+        case 'W':
+            wheelCount = atol(optarg);
+            break;
+        case 'G':
+            gammaDisplay = optarg;
+            break;
+        case 'O':
+            overlaySpec = optarg;
+            break;
+        case 'F':
+            telemetryAddress = optarg;
+            break;
+        case 's':
+            statusName = optarg;
+            break;
+        case 'S':
+            showStatus = true;
+            break;
+        case 'e':
+            useEventBus = true;
+            break;
+        case 'E':
+            showEvents = true;
+            break;
+        case 'k':
+            busCount = atol(optarg);
+            break;
+        case 'o':
+            if (NULL == startConfig && NULL != (startConfig = malloc(sizeof(struct config)))) {
+                *startConfig = defaultConfig;
+            }
+            value = strchr(optarg, '=');
+            if (NULL == startConfig || NULL == value) {
+                fprintf(stderr, "-o expects name=value\n");
+                return -1;
+            }
+            *value++ = '\0';
+            if ((error = setConfigParam(startConfig, optarg, value))) {
+                fprintf(stderr, "-o %s: %s\n", optarg, error);
+                return -1;
+            }
+            break;
+        case 'C':
+            controlPath = optarg;
+            break;
+        case 'X':
+            controlCommand = optarg;
+            break;
+        case 'I':
+            ingestPath = optarg;
+            break;
+        case 'P':
+            snapshotPath = optarg;
+            break;
+        case 'R':
+            historyDir = optarg;
+            break;
+        case 'Q':
+            historyRange = optarg;
+            break;
+        case 'U':
+            rollupLevel = optarg;
+            break;
+        case 'Y':
+            historyBenchmark = true;
+            break;
+        case 'T':
+            tracePath = optarg;
+            break;
+        case 'Z':
+            replayPath = optarg;
+            break;
+        case 'B':
+            batchCount = atol(optarg);
+            break;
+        case 'M':
+            mergeSketches = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p] [-l] [-r priority] [-c ingest,detector,actuator] "
+                "[-b count] [-j seconds] [-d] [-f config] [-w workers] [-V seats] [-u user] [-i engine] "
+                "[-H count] [-W count] [-G display] [-O display] [-F collector] [-s status-name] [-S] [-e] [-E] [-k count] [-o name=value] "
+                "[-C control-socket] [-X command] [-I ingest-socket] [-P snapshot] "
+                "[-R history-dir] [-Q from,to] [-U level] [-Y] [-T trace] [-Z trace] [-B count] "
+                "[-M snapshot...]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (controlCommand) {
+        if (NULL == controlPath) {
+            fprintf(stderr, "-X needs the control socket path (-C)\n");
+            return -1;
+        }
+        return sendControl(controlPath, controlCommand);
+    }
+    if (startConfig) {
+        atomic_store(&currentConfig, startConfig);
+        snapshotConfig = false;
+    }
+    if (showStatus) {
+        return printStatus();
+    }
+    if (showEvents || tracePath) {
+        return tailEvents(tracePath);
+    }
+    if (busCount > 0) {
+        runBusBenchmark(busCount);
+        return 0;
+    }
+    if (historyRange) {
+        return printHistory(historyRange, rollupLevel);
+    }
+    if (historyBenchmark) {
+        runHistoryBenchmark();
+        return 0;
+    }
+    if (replayPath) {
+        return replayTrace(replayPath);
+    }
+    if (batchCount > 0) {
+        runBatchBenchmark(batchCount);
+        return 0;
+    }
+    if (mergeSketches) {
+        return mergeSnapshots(argc - optind, argv + optind) > 0 ? 0 : -1;
+    }
+#ifdef __APPLE__
+    if (daemonMode || configPath || workerCount || virtualSeats || privsepUser || helperCount ||
+        ingestPath || ioEngine || wheelCount || gammaDisplay ||
+        overlaySpec) {
+        fprintf(stderr, "Seats (-d, -f, -w, -V, -W, -G, -O, -I, -i) and the helper (-u, -H) are only supported on Linux\n");
+        return -1;
+    }
+#else
+    if (ioEngine && 0 != strcmp(ioEngine, "epoll") && 0 != strcmp(ioEngine, "uring")) {
+        fprintf(stderr, "unknown I/O engine %s (epoll or uring)\n", ioEngine);
+        return -1;
+    }
+    useUring = ioEngine && 0 == strcmp(ioEngine, "uring");
+#endif
+
+
+    // Add penalty timeout handler
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &handleTimeout;
+    action.sa_flags = SA_NODEFER;
+    sigaction(SIGALRM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    startExitThread();
+
+    if (lowLatency) {
+        lockMemory();
+    }
+    if (benchmarkCount > 0) {
+        runBenchmark(benchmarkCount);
+        return 0;
+    }
+    if (jitterSeconds > 0) {
+        runJitterBenchmark(jitterSeconds);
+        return 0;
+    }
+
+#ifdef __linux__
+    numWorkers = workerCount;
+    if (virtualSeats > 0) {
+        runSeatBenchmark(virtualSeats, kVirtualSeatSeconds);
+        return 0;
+    }
+    if (helperCount > 0) {
+        runHelperBenchmark(helperCount);
+        return 0;
+    }
+    if (wheelCount > 0) {
+        runWheelBenchmark(wheelCount);
+        return 0;
+    }
+    if (gammaDisplay) {
+#ifdef WITH_WAYLAND
+        return runGammaTest(gammaDisplay);
+#else
+        fprintf(stderr, "-G needs brainthrottle built with -DWITH_WAYLAND\n");
+        return -1;
+#endif
+    }
+    if (overlaySpec) {
+#ifdef WITH_X11
+        return runOverlayBenchmark(overlaySpec);
+#else
+        fprintf(stderr, "-O needs brainthrottle built with -DWITH_X11\n");
+        return -1;
+#endif
+    }
+
+
+    // Find seats: from the config file, every active logind seat (-d), or
+    // just our own
+
+    raiseFileLimit();
+    if (configPath) {
+        loadSeatConfig(configPath);
+    } else if (daemonMode) {
+        discoverSeats(NULL);
+    } else {
+        discoverSeats(getenv("XDG_SEAT") ? getenv("XDG_SEAT") : "seat0");
+    }
+    if (!daemonMode && !configPath && numSeats > 0) {
+        seats[0]->detector.name = NULL;
+        numSeats = 1;
+    }
+
+
+    // Without a backlight, our own seat falls back to gamma, then an overlay
+
+#if defined(WITH_WAYLAND) || defined(WITH_X11)
+    bool fallback = !configPath && !daemonMode && numSeats > 0 && -1 == seats[0]->backlight.fd;
+#endif
+#ifdef WITH_WAYLAND
+    if (fallback && getenv("WAYLAND_DISPLAY")) {
+        fallback = !openGamma(&seats[0]->gamma, NULL);
+    }
+#endif
+#ifdef WITH_X11
+    if (fallback && getenv("DISPLAY")) {
+        openOverlay(&seats[0]->overlay, NULL);
+    }
+#endif
+
+
+    // Publish per-seat status before forking the helper, so it inherits
+    // the mappings
+
+    if (useEventBus) {
+        createEventBus();
+    }
+    if (usePipeline) {
+        createStatusPage(1, NULL);
+        mainDetector.status = statusPage ? &statusPage->seats[0] : NULL;
+    } else {
+        const char *names[numSeats > 0 ? numSeats : 1];
+        for (int i = 0; i < numSeats; i++) {
+            names[i] = seats[i]->name;
+        }
+        createStatusPage(numSeats, names);
+        for (int i = 0; statusPage && i < numSeats; i++) {
+            seats[i]->detector.status = &statusPage->seats[i];
+            float brightness = readBacklight(&seats[i]->backlight);
+#ifdef WITH_WAYLAND
+            if (seats[i]->gamma.display) {
+                brightness = 1;
+            }
+#endif
+#ifdef WITH_X11
+            if (seats[i]->overlay.display) {
+                brightness = 1;
+            }
+#endif
+            publishBrightness(seats[i]->detector.status, -1, brightness, -1);
+        }
+    }
+    restored = usePipeline ? 0 : loadSnapshot();
+
+
+    // Sockets come from systemd if it started us, else from -C and -I
+
+    takeListenFds();
+    if (controlPath && -1 == controlFd) {
+        controlFd = listenUnix(controlPath, SOCK_STREAM);
+    }
+    if (ingestPath && -1 == ingestFd) {
+        ingestFd = listenUnix(ingestPath, SOCK_SEQPACKET);
+        fcntl(ingestFd, F_SETFL, fcntl(ingestFd, F_GETFL) | O_NONBLOCK);
+    }
+    if (usePipeline && privsepUser) {
+        fprintf(stderr, "-u is not supported with -p\n");
+        return -1;
+    } else if (usePipeline) {
+        if (-1 != ingestFd) {
+            fprintf(stderr, "The ingestion socket is not supported with -p; ignoring it\n");
+        }
+        startControl();
+        runLinuxPipeline();
+    }
+    if (0 == workerCount) {
+        workerCount = daemonMode || configPath ? (int)sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    }
+    assignWorkers(workerCount);
+    if (privsepUser) {
+        startHelper(privsepUser);
+    }
+    startControl();
+    startSnapshots();
+    startHistory(numWorkers + 1);
+    startTelemetry(numWorkers + 1);
+    printReady(restored);
+    startWorkers(true);
+    return 0;
+#endif
+
+    createStatusPage(1, NULL);
+    mainDetector.status = statusPage ? &statusPage->seats[0] : NULL;
+    if (useEventBus) {
+        createEventBus();
+    }
+    prevBrightness = getBrightness();
+    publishBrightness(mainDetector.status, prevBrightness, prevBrightness, -1);
+    restored = loadSnapshot();
+    startHistory(2);
+    startTelemetry(2);
+#ifdef __APPLE__
+
+    // The penalty timer fires on this thread's run loop, with the EventTap,
+    // so ending a penalty never runs in a signal handler
+
+    penaltyTimer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + kPenaltyTimerIdleSec,
+        kPenaltyTimerIdleSec, 0, 0, &firePenaltyTimer, NULL);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), penaltyTimer, kCFRunLoopDefaultMode);
+#endif
+    if (usePipeline) {
+        startPipeline();
+        waitForPipelineThreads();
+    } else if (mainDetector.penalized) {
+
+        // Pick up the restored penalty's timer where it left off
+
+        setPenaltyTimer(nowNs());
+    }
+    startSnapshots();
+    configureThread("ingest", cpuIngest, realtimePriority);
+    if (lowLatency) {
+        printSelfCheck();
+    }
+    if (controlPath) {
+        controlFd = listenUnix(controlPath, SOCK_STREAM);
+        startControl();
+    }
+
+
+#ifdef __APPLE__
+    // Create scroll event handler
+    
     CGEventMask emask;
     CFRunLoopSourceRef runLoopSource;
     emask = CGEventMaskBit(kCGEventKeyDown) |  
@@ -316,9 +9705,24 @@ int main (
     );
 
 
+    // Watch for sleep and wake, so time asleep counts toward penalties
+
+    IONotificationPortRef powerNotify;
+    io_object_t powerNotifier;
+    powerPort = IORegisterForSystemPower(NULL, &powerNotify, &handlePower, &powerNotifier);
+    if (0 == powerPort) {
+        fprintf(stderr, "cannot register for sleep notifications; penalties will not count time asleep\n");
+    } else {
+        CFRunLoopAddSource(CFRunLoopGetCurrent(), IONotificationPortGetRunLoopSource(powerNotify),
+            kCFRunLoopDefaultMode);
+    }
+
+
     // Run event loop
 
+    printReady(restored);
     CFRunLoopRun();
+#endif
 
     return 0;
 }
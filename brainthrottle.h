@@ -0,0 +1,527 @@
+/* brainthrottle.h **
+ *
+ * Shared-memory interfaces brainthrottle publishes for other programs.
+ * Everything here is plain C with GCC/clang __atomic builtins so it can be
+ * included from C or C++ status bars, tray icons and dashboards.
+ *
+ *
+ * Status page **
+ *
+ * brainthrottle keeps one status slot per seat (one slot, "main", on OSX)
+ * in a POSIX shared memory object, BT_STATUS_NAME by default. Map it
+ * read-only, check magic, version, seatSize and that numSeats slots fit in
+ * the object, and call btStatusRead on a slot; after the mmap no syscalls
+ * are needed. Each slot has two halves on separate cache lines, one written by
+ * the detector and one by whatever sets the brightness, each guarded by its
+ * own seqlock. Times are CLOCK_BOOTTIME nanoseconds, which keep counting
+ * while the machine is suspended (on OSX, mach_absolute_time nanoseconds
+ * plus the time brainthrottle has seen the machine asleep).
+ *
+ *   int fd = shm_open(BT_STATUS_NAME, O_RDONLY, 0);
+ *   struct stat st;
+ *   fstat(fd, &st);
+ *   const struct btStatusPage *page = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+ *   struct btStatusSeat seat;
+ *   btStatusRead(&page->seats[0], &seat);
+ *   double score = (double)seat.detector.recentScrollTotal / seat.detector.scrollThreshold;
+ *
+ *
+ * Event bus **
+ *
+ * With -e, brainthrottle also broadcasts every scroll it counts and every
+ * penalty start and end through a ring in BT_EVENTS_NAME, along with what
+ * the model detector (btmodel.h) learns from: scroll direction changes,
+ * navigation keys and labels. The producer
+ * never waits: consumers that fall a whole ring behind lose the oldest
+ * events and are skipped forward to the newest half of the ring. Consumers
+ * claim a cursor slot so the producer (and -E) can see who is lagging.
+ *
+ *   int fd = shm_open(BT_EVENTS_NAME, O_RDWR, 0);
+ *   struct btEventBus *bus = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+ *   struct btEventConsumer *me = btEventsAttach(bus, getpid());
+ *   struct btEvent event;
+ *   for (;;) {
+ *       while (btEventsNext(bus, me, &event)) {
+ *           ...
+ *       }
+ *       usleep(10000);
+ *   }
+ *
+ *
+ * Ingestion socket **
+ *
+ * Programs that see scrolling brainthrottle can't (a compositor, a remote
+ * desktop server) can feed it through the ingestion socket (-I, or socket
+ * activated), a Unix SOCK_SEQPACKET socket. The first packet on a
+ * connection names the seat ("" for brainthrottle's own seat); every later
+ * packet holds one or more struct btScroll.
+ *
+ *
+ * Traces **
+ *
+ * brainthrottle -T PATH records the event bus to a trace file for offline
+ * analysis (btanalyze): a struct btTraceHeader followed by fixed-size
+ * struct btTraceRecord, in the order the events were published. Records
+ * are 16 bytes and 16-byte aligned, so a mapped trace can be scanned in
+ * place, four to a cache line. bttrace.h reads and writes a compressed
+ * columnar form of the same records for long-term storage.
+ *
+ *
+ * Sketches **
+ *
+ * Each detector keeps two struct btSketch, of the gaps between scrolls
+ * (microseconds) and of burst sizes (recentScrollTotal when a gap longer
+ * than restoreTimeoutSec ends it), for tuning restoreTimeoutSec and
+ * scrollThreshold. They are saved in the -P snapshot. A sketch counts
+ * values in log-linear buckets, BT_SKETCH_SUB per power of two, so a
+ * quantile is within 1/(2 * BT_SKETCH_SUB), about 1.6%, of the true value
+ * whatever the number of values; and sketches merge exactly by adding
+ * bucket counts, so sketches from many machines can be combined into one.
+ *
+ *   struct btSketch fleet;
+ *   memset(&fleet, 0, sizeof(fleet));
+ *   btSketchMerge(&fleet, &machineA);
+ *   btSketchMerge(&fleet, &machineB);
+ *   uint64_t p99 = btSketchQuantile(&fleet, 0.99);
+ *
+ *
+ * Telemetry **
+ *
+ * With -F ADDRESS, brainthrottle pushes what its history records (each
+ * seat's scroll counts per minute, and each penalty when it ends) to a
+ * collector (btcollect) as datagrams: a struct btTelemetryHeader followed
+ * by up to BT_TELEMETRY_RECORDS struct btTelemetryRecord, in host byte
+ * order, so the collector must be on the same machine. ADDRESS is a Unix
+ * datagram socket path (anything with a '/') or a UDP port on the loopback
+ * address, "PORT" or "HOST:PORT"; btTelemetryAddress parses it. Agents never
+ * wait for the collector: records go through bounded queues and are sent
+ * without blocking, and whatever doesn't fit is dropped. Each agent numbers
+ * its datagrams, so the collector can count the ones it never got.
+ */
+
+#ifndef BRAINTHROTTLE_H
+#define BRAINTHROTTLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define BT_STATUS_NAME "/brainthrottle-status"
+#define BT_STATUS_MAGIC 0x54534842      /* "BHST" */
+#define BT_STATUS_VERSION 1
+
+
+/*
+ * Detector half of a status slot
+ */
+struct btStatusDetector {
+    uint32_t sequence;                  /* Odd while being written */
+    uint32_t penalized;                 /* 1 while the screen is dimmed */
+    int64_t recentScrollTotal;          /* Skim score is this / scrollThreshold */
+    int64_t scrollThreshold;
+    uint64_t lastScrollTime;            /* Score is stale restoreTimeout after this */
+    uint64_t restoreTimeout;
+    uint64_t penaltyDeadline;           /* When the penalty ends, if penalized */
+    uint64_t reserved;
+};
+
+
+/*
+ * Actuator half of a status slot
+ */
+struct btStatusActuator {
+    uint32_t sequence;                  /* Odd while being written */
+    float targetBrightness;             /* What brainthrottle last asked for */
+    float currentBrightness;            /* Last brightness seen on the display */
+    float restoreBrightness;            /* Brightness to restore, -1 unless dimmed */
+    char name[48];                      /* Seat name, set once at startup */
+};
+
+struct btStatusSeat {
+    struct btStatusDetector detector __attribute__((aligned(64)));
+    struct btStatusActuator actuator __attribute__((aligned(64)));
+};
+
+struct btStatusPage {
+    uint32_t magic;                     /* BT_STATUS_MAGIC */
+    uint32_t version;                   /* BT_STATUS_VERSION */
+    uint32_t numSeats;
+    uint32_t seatSize;                  /* sizeof(struct btStatusSeat) */
+    struct btStatusSeat seats[] __attribute__((aligned(64)));
+};
+
+
+/*
+ * Seqlock writer side. Only one thread or process may write each half.
+ */
+static inline void btSeqBegin(uint32_t *sequence) {
+    __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void btSeqEnd(uint32_t *sequence) {
+    __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE);
+}
+
+#define BT_STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define BT_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+
+/*
+ * Copies a consistent snapshot of each half of a status slot into out,
+ * retrying while a writer is mid-update.
+ */
+static inline void btStatusRead(const struct btStatusSeat *slot, struct btStatusSeat *out) {
+    const struct btStatusDetector *d = &slot->detector;
+    const struct btStatusActuator *a = &slot->actuator;
+    uint32_t before;
+    uint32_t after;
+
+    do {
+        before = __atomic_load_n(&d->sequence, __ATOMIC_ACQUIRE);
+        out->detector.penalized = BT_LOAD(d->penalized);
+        out->detector.recentScrollTotal = BT_LOAD(d->recentScrollTotal);
+        out->detector.scrollThreshold = BT_LOAD(d->scrollThreshold);
+        out->detector.lastScrollTime = BT_LOAD(d->lastScrollTime);
+        out->detector.restoreTimeout = BT_LOAD(d->restoreTimeout);
+        out->detector.penaltyDeadline = BT_LOAD(d->penaltyDeadline);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&d->sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+    out->detector.sequence = before;
+
+    do {
+        before = __atomic_load_n(&a->sequence, __ATOMIC_ACQUIRE);
+        __atomic_load(&a->targetBrightness, &out->actuator.targetBrightness, __ATOMIC_RELAXED);
+        __atomic_load(&a->currentBrightness, &out->actuator.currentBrightness, __ATOMIC_RELAXED);
+        __atomic_load(&a->restoreBrightness, &out->actuator.restoreBrightness, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&a->sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+    out->actuator.sequence = before;
+    for (unsigned i = 0; i < sizeof(out->actuator.name); i++) {
+        out->actuator.name[i] = a->name[i];
+    }
+}
+
+
+#define BT_EVENTS_NAME "/brainthrottle-events"
+#define BT_EVENTS_MAGIC 0x56454842      /* "BHEV" */
+#define BT_EVENTS_VERSION 1
+#define BT_EVENTS_CONSUMERS 16
+
+enum {
+    BT_EVENT_SCROLL = 1,                /* value is the scroll displacement */
+    BT_EVENT_PENALTY,                   /* value is recentScrollTotal */
+    BT_EVENT_RESTORE,                   /* value is 0 */
+    BT_EVENT_REVERSE,                   /* Precedes a scroll that changed vertical direction;
+                                           value is its sign, REL_WHEEL's on Linux */
+    BT_EVENT_KEY,                       /* A navigation key (page, space, arrows); value is 0 */
+    BT_EVENT_LABEL,                     /* From the label control command; value is 1 (skimming),
+                                           0 (reading) or -1 (unlabeled) */
+};
+
+struct btEvent {
+    uint64_t sequence;                  /* Ring position + 1 once written, 0 while writing */
+    uint64_t time;                      /* When the scroll happened */
+    int32_t type;                       /* BT_EVENT_* */
+    int32_t seat;                       /* Index of the seat's status slot */
+    int64_t value;
+};
+
+struct btEventConsumer {
+    int32_t pid;                        /* Owner, 0 if free */
+    uint32_t reserved;
+    uint64_t cursor;                    /* Next ring position to read */
+    uint64_t lost;                      /* Events overwritten before they were read */
+    uint64_t lagging;                   /* Times the producer saw this consumer a ring behind */
+} __attribute__((aligned(64)));
+
+struct btEventBus {
+    uint32_t magic;                     /* BT_EVENTS_MAGIC */
+    uint32_t version;                   /* BT_EVENTS_VERSION */
+    uint32_t slots;                     /* Ring size, a power of two */
+    uint32_t eventSize;                 /* sizeof(struct btEvent) */
+    uint64_t head __attribute__((aligned(64)));  /* Ring positions claimed so far */
+    struct btEventConsumer consumers[BT_EVENTS_CONSUMERS];
+    struct btEvent events[] __attribute__((aligned(64)));
+};
+
+
+/*
+ * Claims a consumer slot for pid, starting at the newest event. Slots left
+ * behind by processes that have exited are reused. Returns NULL if all are
+ * taken.
+ */
+static inline struct btEventConsumer *btEventsAttach(struct btEventBus *bus, int32_t pid) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < BT_EVENTS_CONSUMERS; i++) {
+            struct btEventConsumer *c = &bus->consumers[i];
+            int32_t owner = __atomic_load_n(&c->pid, __ATOMIC_RELAXED);
+            if (owner != 0 && (pass == 0 || kill(owner, 0) == 0 || errno != ESRCH)) {
+                continue;
+            }
+            if (__atomic_compare_exchange_n(&c->pid, &owner, pid, false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                BT_STORE(c->lost, 0);
+                BT_STORE(c->lagging, 0);
+                __atomic_store_n(&c->cursor, __atomic_load_n(&bus->head, __ATOMIC_ACQUIRE),
+                    __ATOMIC_RELEASE);
+                return c;
+            }
+        }
+    }
+    return NULL;
+}
+
+static inline void btEventsDetach(struct btEventConsumer *c) {
+    __atomic_store_n(&c->pid, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Copies the consumer's next event into out and advances its cursor.
+ * Returns 0 if there is nothing new yet. If the producer has lapped the
+ * consumer, skips to the newest half of the ring and counts what was lost.
+ */
+static inline int btEventsNext(const struct btEventBus *bus, struct btEventConsumer *c,
+        struct btEvent *out) {
+    uint64_t cursor = BT_LOAD(c->cursor);
+
+    for (;;) {
+        const struct btEvent *e = &bus->events[cursor & (bus->slots - 1)];
+        uint64_t sequence = __atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE);
+        if (sequence == cursor + 1) {
+            out->time = BT_LOAD(e->time);
+            out->type = BT_LOAD(e->type);
+            out->seat = BT_LOAD(e->seat);
+            out->value = BT_LOAD(e->value);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&e->sequence, __ATOMIC_RELAXED) == sequence) {
+                out->sequence = sequence;
+                __atomic_store_n(&c->cursor, cursor + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+
+        uint64_t head = __atomic_load_n(&bus->head, __ATOMIC_ACQUIRE);
+        if (head - cursor <= bus->slots && sequence <= cursor) {
+            return 0;               /* Not written yet */
+        }
+        uint64_t skipTo = head - bus->slots / 2;
+        if (skipTo <= cursor) {
+            return 0;
+        }
+        BT_STORE(c->lost, BT_LOAD(c->lost) + (skipTo - cursor));
+        cursor = skipTo;
+        __atomic_store_n(&c->cursor, cursor, __ATOMIC_RELEASE);
+    }
+}
+
+
+#define BT_TRACE_MAGIC 0x52544842       /* "BHTR" */
+#define BT_TRACE_VERSION 1
+
+struct btTraceHeader {
+    uint32_t magic;                     /* BT_TRACE_MAGIC */
+    uint32_t version;                   /* BT_TRACE_VERSION */
+    uint32_t recordSize;                /* sizeof(struct btTraceRecord) */
+    uint32_t reserved;
+};
+
+struct btTraceRecord {
+    uint64_t time;                      /* As in struct btEvent */
+    int32_t value;                      /* As in struct btEvent, clamped to 32 bits */
+    uint16_t seat;
+    uint8_t type;                       /* BT_EVENT_* */
+    uint8_t reserved;
+};
+
+
+#define BT_SKETCH_SUB 32                /* Buckets per power of two */
+#define BT_SKETCH_BUCKETS 1408          /* Covers values below 2^48 */
+
+struct btSketch {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;                       /* Only valid if count > 0 */
+    uint64_t max;
+    uint64_t buckets[BT_SKETCH_BUCKETS];
+};
+
+
+/*
+ * Returns the bucket for value: values below 2 * BT_SKETCH_SUB have their
+ * own, larger ones share with values that agree in their top six bits.
+ */
+static inline int btSketchBucket(uint64_t value) {
+    if (value < 2 * BT_SKETCH_SUB) {
+        return (int)value;
+    }
+    if (value >> 48) {
+        return BT_SKETCH_BUCKETS - 1;
+    }
+    int shift = 63 - __builtin_clzll(value) - 5;
+    return shift * BT_SKETCH_SUB + (int)(value >> shift);
+}
+
+/*
+ * Returns the middle of a bucket's range.
+ */
+static inline uint64_t btSketchValue(int bucket) {
+    if (bucket < 2 * BT_SKETCH_SUB) {
+        return (uint64_t)bucket;
+    }
+    int shift = bucket / BT_SKETCH_SUB - 1;
+    uint64_t low = (uint64_t)(bucket - shift * BT_SKETCH_SUB) << shift;
+    return low + (1ULL << shift) / 2;
+}
+
+/*
+ * Counts value. Single writer; readers may copy the sketch concurrently
+ * and see some counts of the value and not others.
+ */
+static inline void btSketchAdd(struct btSketch *s, uint64_t value) {
+    uint64_t count = BT_LOAD(s->count);
+    if (0 == count || value < BT_LOAD(s->min)) {
+        BT_STORE(s->min, value);
+    }
+    if (0 == count || value > BT_LOAD(s->max)) {
+        BT_STORE(s->max, value);
+    }
+    int bucket = btSketchBucket(value);
+    BT_STORE(s->buckets[bucket], BT_LOAD(s->buckets[bucket]) + 1);
+    BT_STORE(s->sum, BT_LOAD(s->sum) + value);
+    BT_STORE(s->count, count + 1);
+}
+
+/*
+ * Adds the counts of from into into.
+ */
+static inline void btSketchMerge(struct btSketch *into, const struct btSketch *from) {
+    uint64_t count = BT_LOAD(from->count);
+    if (0 == count) {
+        return;
+    }
+    if (0 == into->count || BT_LOAD(from->min) < into->min) {
+        into->min = BT_LOAD(from->min);
+    }
+    if (0 == into->count || BT_LOAD(from->max) > into->max) {
+        into->max = BT_LOAD(from->max);
+    }
+    for (int i = 0; i < BT_SKETCH_BUCKETS; i++) {
+        into->buckets[i] += BT_LOAD(from->buckets[i]);
+    }
+    into->sum += BT_LOAD(from->sum);
+    into->count += count;
+}
+
+/*
+ * Returns the value at quantile q (0 to 1), or 0 for an empty sketch.
+ */
+static inline uint64_t btSketchQuantile(const struct btSketch *s, double q) {
+    uint64_t total = 0, seen = 0;
+    for (int i = 0; i < BT_SKETCH_BUCKETS; i++) {
+        total += s->buckets[i];
+    }
+    if (0 == total) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (total - 1));
+    for (int i = 0; i < BT_SKETCH_BUCKETS; i++) {
+        seen += s->buckets[i];
+        if (seen > rank) {
+            uint64_t value = btSketchValue(i);
+            return value < s->min ? s->min : value > s->max ? s->max : value;
+        }
+    }
+    return s->max;
+}
+
+
+#define BT_TELEMETRY_MAGIC 0x4d544842   /* "BHTM" */
+#define BT_TELEMETRY_VERSION 1
+#define BT_TELEMETRY_RECORDS 64         /* Most records per datagram */
+#define BT_TELEMETRY_PATH "/run/brainthrottle-telemetry"
+
+enum {
+    BT_TELEMETRY_ACTIVITY = 1,          /* A seat's scrolls in one minute */
+    BT_TELEMETRY_EPISODE,               /* A penalty, when it ended */
+};
+
+struct btTelemetryHeader {
+    uint32_t magic;                     /* BT_TELEMETRY_MAGIC */
+    uint16_t version;                   /* BT_TELEMETRY_VERSION */
+    uint16_t count;                     /* Records that follow */
+    uint64_t agent;                     /* Unique per sender, e.g. its pid and start time */
+    uint64_t sequence;                  /* Datagrams the agent made before this one, sent or not */
+};
+
+struct btTelemetryRecord {
+    uint64_t time;                      /* Unix ms: the minute (ACTIVITY) or the end (EPISODE) */
+    uint32_t uid;                       /* The seat's user */
+    uint16_t seat;
+    uint8_t type;                       /* BT_TELEMETRY_* */
+    uint8_t reserved;
+    uint32_t events;                    /* Scroll events in the minute, or that extended the penalty */
+    uint32_t duration;                  /* EPISODE: how long it lasted (ms) */
+    uint64_t volume;                    /* ACTIVITY: summed scrollDiff; EPISODE: peak score */
+};
+
+
+/*
+ * Fills addr from a telemetry address: a Unix socket path if it has a '/',
+ * else "PORT" (on 127.0.0.1) or "HOST:PORT" with a numeric IPv4 HOST.
+ * Returns 0, or -1 if it can't be parsed.
+ */
+static inline int btTelemetryAddress(const char *address, struct sockaddr_storage *addr,
+        socklen_t *len) {
+    memset(addr, 0, sizeof(*addr));
+    if (strchr(address, '/')) {
+        struct sockaddr_un *un = (struct sockaddr_un *)addr;
+        if (strlen(address) >= sizeof(un->sun_path)) {
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, address);
+        *len = sizeof(*un);
+        return 0;
+    }
+
+    struct sockaddr_in *in = (struct sockaddr_in *)addr;
+    char host[64] = "127.0.0.1";
+    const char *colon = strrchr(address, ':');
+    if (colon) {
+        if ((size_t)(colon - address) >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, address, colon - address);
+        host[colon - address] = 0;
+        address = colon + 1;
+    }
+    char *end;
+    long port = strtol(address, &end, 10);
+    if (*end || port <= 0 || port > 65535 || 1 != inet_pton(AF_INET, host, &in->sin_addr)) {
+        return -1;
+    }
+    in->sin_family = AF_INET;
+    in->sin_port = htons((uint16_t)port);
+    *len = sizeof(*in);
+    return 0;
+}
+
+
+struct btScroll {
+    uint64_t time;                      /* CLOCK_MONOTONIC ns (not the status page's clock), or 0 for now */
+    int32_t scrollX;                    /* Wheel detents, as in REL_HWHEEL */
+    int32_t scrollY;                    /* Wheel detents, as in REL_WHEEL */
+};
+
+#endif
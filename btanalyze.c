@@ -0,0 +1,1471 @@
+/* btanalyze.c **
+ *
+ * Offline analysis of brainthrottle traces (brainthrottle -T, format in
+ * brainthrottle.h). Reports skim episodes (penalty to restore), the sizes
+ * of scroll bursts, and how often a burst ends up penalized, over traces of
+ * any size.
+ *
+ *
+ * Design  **
+ *
+ * Traces are mapped, never read(). Each file is cut into chunks of whole
+ * records and a pool of threads takes chunks from a shared counter. A
+ * thread scans its chunk once, keeping per-seat state: bursts (runs of
+ * scrolls with no gap longer than -g) and penalties that start and end
+ * inside the chunk are counted there and then; the pieces cut by the
+ * chunk's edges are kept and stitched together, in file order, once every
+ * chunk is done. The results are the same for any chunk size or thread
+ * count.
+ *
+ * Most records are scrolls continuing the current burst. With AVX2 these
+ * are checked and summed four at a time (same seat, scroll type, no gap),
+ * falling back to the record-at-a-time loop at anything else.
+ *
+ * Columnar traces (bttrace.h) are chunked by whole blocks; each thread
+ * decodes a block at a time into a buffer and scans that.
+ *
+ * With -m the traces are instead used to train the model detector
+ * (btmodel.h), see Training below.
+ *
+ *
+ * Compile and Run **
+ *
+ * $ cc -O2 -march=native -pthread -o btanalyze btanalyze.c -lm
+ * $ ./btanalyze trace...
+ *
+ * Options:
+ *
+ *   -t THREADS     Scan with THREADS threads (default: one per CPU)
+ *   -g SECONDS     A gap longer than this ends a burst (default 10, like
+ *                  brainthrottle's restoreTimeoutSec)
+ *   -s             Scan one record at a time, without AVX2
+ *   -b MB          Benchmark: write an MB synthetic trace, time scans of
+ *                  it with 1 to THREADS threads, compress it and time
+ *                  decoding and scanning that, then exit
+ *   -z OUT         Compress the one raw trace given to a columnar trace
+ *                  at OUT, then exit
+ *   -m OUT         Train a model for brainthrottle's model detector on the
+ *                  labeled scrolls in the traces, write it to OUT and exit
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "brainthrottle.h"
+#include "bttrace.h"
+#include "btmodel.h"
+
+
+/*
+ * Limits
+ */
+#define kMaxSeats 256                   // Seats tracked; records for others are skipped
+#define kHistogramBuckets 40            // Power-of-two buckets
+#define kChunkRecords (1 << 20)         // Records per chunk (16 MB)
+#define kMaxThreads 256
+#define kBenchmarkRuns 3                // Best of this many scans per setting
+
+const uint64_t kNsecPerSec = 1000000000ULL;
+const uint64_t kNsecPerMsec = 1000000ULL;
+
+
+/*
+ * Analysis state
+ */
+struct piece {                          // Part of a burst
+    uint64_t volume;                    // Summed scroll values
+    uint32_t events;
+    bool penalized;                     // A penalty started during it
+};
+
+struct seatState {                      // One seat within one chunk
+    bool seen;                          // Any scroll yet
+    bool split;                         // A gap has ended the first piece
+    bool leadPenalty;                   // A penalty started before the first scroll
+    bool penaltyEvents;                 // Any penalty or restore yet
+    bool open;                          // Penalty still running
+    uint64_t firstTime;                 // First scroll
+    uint64_t lastTime;                  // Last scroll
+    uint64_t firstRestore;              // Restore before any penalty, or 0
+    uint64_t openSince;                 // When the running penalty started
+    struct piece head;                  // Up to the first gap (all of it if !split)
+    struct piece tail;                  // After the last gap
+};
+
+struct stats {
+    uint64_t records;
+    uint64_t scrolls;
+    uint64_t penalties;
+    uint64_t restores;
+    uint64_t skipped;                   // Unknown type or seat >= kMaxSeats
+    uint64_t volume;
+    uint64_t bursts;
+    uint64_t penalizedBursts;
+    uint64_t burstSizes[kHistogramBuckets]; // By volume
+    uint64_t episodes;
+    uint64_t openEpisodes;              // Penalties still running at the end
+    uint64_t episodeNs;
+    uint64_t longestNs;
+    uint64_t episodeLengths[kHistogramBuckets]; // By ms
+};
+
+struct trace {                          // A mapped trace, raw or columnar
+    const struct btTraceRecord *records;  // Raw: the records
+    const struct btColumnBlock **blocks;  // Columnar: the blocks, found by walking their headers
+    size_t count;                       // Records
+    size_t numBlocks;
+    void *map;
+    size_t size;
+};
+
+struct chunk {
+    const struct btTraceRecord *records;  // Raw traces
+    const struct btColumnBlock **blocks;  // Columnar traces, decoded as they are scanned
+    size_t count;                       // Records, or blocks
+    struct stats stats;
+    struct seatState *seats;            // kMaxSeats
+};
+
+struct scan {
+    struct chunk *chunks;
+    size_t numChunks;
+    _Atomic size_t next;                // Next chunk to take
+    int64_t gap;                        // Burst gap (ns)
+    bool simd;
+};
+
+bool useSimd = true;                    // False with -s
+int64_t burstGap = 10 * 1000000000LL;   // -g, in ns
+
+
+/*
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * kNsecPerSec + ts.tv_nsec;
+}
+
+
+/*
+ * Returns the power-of-two histogram bucket for value.
+ */
+int bucketOf(uint64_t value) {
+    int bucket = value ? 64 - __builtin_clzll(value) : 0;
+    return bucket < kHistogramBuckets ? bucket : kHistogramBuckets - 1;
+}
+
+
+/*
+ * Counts a finished burst.
+ */
+void countBurst(struct stats *st, const struct piece *p) {
+    if (0 == p->events) {
+        return;
+    }
+    st->bursts++;
+    st->penalizedBursts += p->penalized;
+    st->burstSizes[bucketOf(p->volume)]++;
+}
+
+
+/*
+ * Counts a finished penalty.
+ */
+void countEpisode(struct stats *st, uint64_t start, uint64_t end) {
+    uint64_t length = end > start ? end - start : 0;
+    st->episodes++;
+    st->episodeNs += length;
+    if (length > st->longestNs) {
+        st->longestNs = length;
+    }
+    st->episodeLengths[bucketOf(length / kNsecPerMsec)]++;
+}
+
+
+/*
+ * Adds one scroll to its seat's current burst, ending the burst first if
+ * the gap since the seat's last scroll is too long.
+ */
+static inline void scanScroll(struct stats *st, struct seatState *s, uint64_t time,
+    uint32_t value, int64_t gap) {
+    if (!s->seen) {
+        s->seen = true;
+        s->firstTime = time;
+    } else if ((int64_t)(time - s->lastTime) > gap) {
+        if (s->split) {
+            countBurst(st, &s->tail);
+        }
+        s->split = true;
+        memset(&s->tail, 0, sizeof(s->tail));
+    }
+    struct piece *p = s->split ? &s->tail : &s->head;
+    p->volume += value;
+    p->events++;
+    s->lastTime = time;
+}
+
+
+/*
+ * Consumes records four at a time for as long as all four are scrolls by
+ * seat that continue its burst. Returns how many records were consumed.
+ */
+#ifdef __AVX2__
+size_t scanRun(struct stats *st, struct seatState *s, uint16_t seat,
+    const struct btTraceRecord *r, size_t count, int64_t gap) {
+    const __m256i key = _mm256_set1_epi64x((uint64_t)BT_EVENT_SCROLL << 16 | seat);
+    const __m256i keyMask = _mm256_set1_epi64x(0xffffff);
+    const __m256i valueMask = _mm256_set1_epi64x(0xffffffff);
+    const __m256i gaps = _mm256_set1_epi64x(gap);
+    __m256i volume = _mm256_setzero_si256();
+    uint64_t last = s->lastTime;
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+
+        // Two records per register: time, then value/seat/type
+
+        __m256i a = _mm256_loadu_si256((const __m256i *)&r[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i *)&r[i + 2]);
+        __m256i times = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), 0xd8);
+        __m256i meta = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), 0xd8);
+
+
+        // All four must be this seat's scrolls with no gap before any
+
+        __m256i kinds = _mm256_and_si256(_mm256_srli_epi64(meta, 32), keyMask);
+        __m256i before = _mm256_blend_epi32(_mm256_permute4x64_epi64(times, 0x90),
+            _mm256_set1_epi64x(last), 0x03);
+        __m256i late = _mm256_cmpgt_epi64(_mm256_sub_epi64(times, before), gaps);
+        __m256i bad = _mm256_or_si256(late, _mm256_xor_si256(_mm256_cmpeq_epi64(kinds, key),
+            _mm256_set1_epi64x(-1)));
+        if (!_mm256_testz_si256(bad, bad)) {
+            break;
+        }
+        volume = _mm256_add_epi64(volume, _mm256_and_si256(meta, valueMask));
+        last = r[i + 3].time;
+    }
+    if (0 == i) {
+        return 0;
+    }
+
+    uint64_t sums[4];
+    _mm256_storeu_si256((__m256i *)sums, volume);
+    uint64_t total = sums[0] + sums[1] + sums[2] + sums[3];
+    struct piece *p = s->split ? &s->tail : &s->head;
+    p->volume += total;
+    p->events += i;
+    s->lastTime = last;
+    st->scrolls += i;
+    st->volume += total;
+    return i;
+}
+#else
+size_t scanRun(struct stats *st, struct seatState *s, uint16_t seat,
+    const struct btTraceRecord *r, size_t count, int64_t gap) {
+    return 0;                           // Every record takes the scalar loop
+}
+#endif
+
+
+/*
+ * Scans count of a chunk's records, counting what finishes inside the
+ * chunk and leaving the rest in its seat states.
+ */
+void scanRecords(struct chunk *c, const struct btTraceRecord *r, size_t count, int64_t gap, bool simd) {
+    struct stats *st = &c->stats;
+    int lastSeat = -1;                  // Seat of the last scroll, if the last record was one
+
+    st->records += count;
+    for (size_t i = 0; i < count; ) {
+        if (simd && lastSeat >= 0) {
+            i += scanRun(st, &c->seats[lastSeat], (uint16_t)lastSeat, &r[i], count - i, gap);
+            if (i >= count) {
+                break;
+            }
+        }
+        const struct btTraceRecord *e = &r[i++];
+        if (e->seat >= kMaxSeats) {
+            st->skipped++;
+            lastSeat = -1;
+            continue;
+        }
+        struct seatState *s = &c->seats[e->seat];
+
+        lastSeat = -1;
+        switch (e->type) {
+        case BT_EVENT_SCROLL:
+            scanScroll(st, s, e->time, (uint32_t)e->value, gap);
+            st->scrolls++;
+            st->volume += (uint32_t)e->value;
+            lastSeat = e->seat;
+            break;
+        case BT_EVENT_PENALTY:
+            if (!s->seen) {
+                s->leadPenalty = true;
+            } else {
+                (s->split ? &s->tail : &s->head)->penalized = true;
+            }
+            if (!s->open) {
+                s->open = true;
+                s->openSince = e->time;
+            }
+            s->penaltyEvents = true;
+            st->penalties++;
+            break;
+        case BT_EVENT_RESTORE:
+            if (s->open) {
+                countEpisode(st, s->openSince, e->time);
+                s->open = false;
+            } else if (!s->penaltyEvents) {
+                s->firstRestore = e->time;
+            }
+            s->penaltyEvents = true;
+            st->restores++;
+            break;
+        case BT_EVENT_REVERSE:
+        case BT_EVENT_KEY:
+        case BT_EVENT_LABEL:
+            break;                      // For the trainer (-m)
+        default:
+            st->skipped++;
+        }
+    }
+}
+
+
+/*
+ * Scans one chunk, decoding it a block at a time if it is columnar.
+ */
+void scanChunk(struct chunk *c, int64_t gap, bool simd) {
+    struct btTraceRecord records[BT_COLUMN_BLOCK];
+
+    if (NULL == c->blocks) {
+        scanRecords(c, c->records, c->count, gap, simd);
+        return;
+    }
+    for (size_t i = 0; i < c->count; i++) {
+        int n = btColumnDecode(c->blocks[i], records);
+        if (n < 0) {
+            fprintf(stderr, "Damaged block of %u records skipped\n", c->blocks[i]->count);
+            c->stats.records += c->blocks[i]->count;
+            c->stats.skipped += c->blocks[i]->count;
+            continue;
+        }
+        scanRecords(c, records, n, gap, simd);
+    }
+}
+
+
+/*
+ * Scan thread. Takes chunks until there are none left.
+ */
+void *scanThread(void *arg) {
+    struct scan *scan = arg;
+
+    for (;;) {
+        size_t i = atomic_fetch_add(&scan->next, 1);
+        if (i >= scan->numChunks) {
+            return NULL;
+        }
+        scanChunk(&scan->chunks[i], scan->gap, scan->simd);
+    }
+}
+
+
+/*
+ * Adds b's counts to a.
+ */
+void addStats(struct stats *a, const struct stats *b) {
+    a->records += b->records;
+    a->scrolls += b->scrolls;
+    a->penalties += b->penalties;
+    a->restores += b->restores;
+    a->skipped += b->skipped;
+    a->volume += b->volume;
+    a->bursts += b->bursts;
+    a->penalizedBursts += b->penalizedBursts;
+    a->episodes += b->episodes;
+    a->openEpisodes += b->openEpisodes;
+    a->episodeNs += b->episodeNs;
+    if (b->longestNs > a->longestNs) {
+        a->longestNs = b->longestNs;
+    }
+    for (int i = 0; i < kHistogramBuckets; i++) {
+        a->burstSizes[i] += b->burstSizes[i];
+        a->episodeLengths[i] += b->episodeLengths[i];
+    }
+}
+
+
+/*
+ * Joins the chunks' edge pieces in file order: a burst or penalty left
+ * open by one chunk continues into the next chunk that has that seat.
+ */
+void stitchChunks(struct stats *total, struct chunk *chunks, size_t numChunks, int64_t gap) {
+    struct seatState *carry = calloc(kMaxSeats, sizeof(struct seatState));
+
+    for (size_t c = 0; c < numChunks; c++) {
+        addStats(total, &chunks[c].stats);
+        for (int i = 0; i < kMaxSeats; i++) {
+            struct seatState *s = &chunks[c].seats[i];
+            struct seatState *k = &carry[i];    // k->seen: a burst is open; k->head is it
+
+
+            // Penalties: a restore before any penalty ends the carried one
+
+            if (s->firstRestore && k->open) {
+                countEpisode(total, k->openSince, s->firstRestore);
+                k->open = false;
+            }
+            if (s->penaltyEvents) {
+                k->open = s->open;
+                k->openSince = s->openSince;
+            }
+
+
+            // Bursts: the chunk's head continues the carried burst unless
+            // there was a gap first
+
+            if (s->leadPenalty && k->seen) {
+                k->head.penalized = true;
+            }
+            if (!s->seen) {
+                continue;
+            }
+            if (k->seen && (int64_t)(s->firstTime - k->lastTime) > gap) {
+                countBurst(total, &k->head);
+                k->seen = false;
+            }
+            if (k->seen) {
+                k->head.volume += s->head.volume;
+                k->head.events += s->head.events;
+                k->head.penalized |= s->head.penalized;
+            } else {
+                k->head = s->head;
+                k->seen = true;
+            }
+            if (s->split) {
+                countBurst(total, &k->head);
+                k->head = s->tail;
+            }
+            k->lastTime = s->lastTime;
+        }
+    }
+
+
+    // The trace is over: bursts still open end here
+
+    for (int i = 0; i < kMaxSeats; i++) {
+        if (carry[i].seen) {
+            countBurst(total, &carry[i].head);
+        }
+        total->openEpisodes += carry[i].open;
+    }
+    free(carry);
+}
+
+
+/*
+ * Scans a trace with threads threads in chunks of chunkRecords (whole
+ * blocks, for columnar traces) and adds the results to total.
+ */
+void analyze(struct stats *total, const struct trace *trace, int threads, size_t chunkRecords, bool simd) {
+    size_t chunkBlocks = chunkRecords > BT_COLUMN_BLOCK ? chunkRecords / BT_COLUMN_BLOCK : 1;
+    size_t count = trace->blocks ? trace->numBlocks : trace->count;
+    size_t perChunk = trace->blocks ? chunkBlocks : chunkRecords;
+    pthread_t pool[kMaxThreads];
+    struct scan scan;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.numChunks = (count + perChunk - 1) / perChunk;
+    scan.chunks = calloc(scan.numChunks ? scan.numChunks : 1, sizeof(struct chunk));
+    scan.gap = burstGap;
+    scan.simd = simd;
+    if (NULL == scan.chunks) {
+        fprintf(stderr, "Error allocating chunks; bailing\n");
+        exit(-1);
+    }
+    for (size_t i = 0; i < scan.numChunks; i++) {
+        if (trace->blocks) {
+            scan.chunks[i].blocks = trace->blocks + i * perChunk;
+        } else {
+            scan.chunks[i].records = trace->records + i * perChunk;
+        }
+        scan.chunks[i].count = i + 1 < scan.numChunks ? perChunk : count - i * perChunk;
+        scan.chunks[i].seats = calloc(kMaxSeats, sizeof(struct seatState));
+        if (NULL == scan.chunks[i].seats) {
+            fprintf(stderr, "Error allocating chunks; bailing\n");
+            exit(-1);
+        }
+    }
+
+    if (threads > (int)scan.numChunks) {
+        threads = scan.numChunks ? (int)scan.numChunks : 1;
+    }
+    for (int i = 1; i < threads; i++) {
+        if (0 != pthread_create(&pool[i], NULL, &scanThread, &scan)) {
+            fprintf(stderr, "Error starting scan thread; bailing\n");
+            exit(-1);
+        }
+    }
+    scanThread(&scan);
+    for (int i = 1; i < threads; i++) {
+        pthread_join(pool[i], NULL);
+    }
+
+    stitchChunks(total, scan.chunks, scan.numChunks, scan.gap);
+    for (size_t i = 0; i < scan.numChunks; i++) {
+        free(scan.chunks[i].seats);
+    }
+    free(scan.chunks);
+}
+
+
+/*
+ * Maps a raw or columnar trace and checks its header. Columnar traces
+ * also get their block list. Returns 0, or -1 after saying why not.
+ */
+int mapTrace(const char *path, struct trace *trace) {
+    struct btColumnReader reader;
+    struct stat st;
+
+    memset(trace, 0, sizeof(*trace));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (-1 == fd || -1 == fstat(fd, &st)) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        if (-1 != fd) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (st.st_size < (off_t)sizeof(struct btTraceHeader)) {
+        fprintf(stderr, "%s: not a brainthrottle trace\n", path);
+        close(fd);
+        return -1;
+    }
+    trace->size = st.st_size;
+    trace->map = mmap(NULL, trace->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == trace->map) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    madvise(trace->map, trace->size, MADV_SEQUENTIAL);
+
+
+    // Columnar: walk the block headers once for the list chunks are cut from
+
+    if (0 == btColumnReaderInit(&reader, trace->map, trace->size)) {
+        const struct btColumnBlock *b;
+        size_t capacity = 0;
+        while ((b = btColumnNextBlock(&reader))) {
+            if (trace->numBlocks == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                trace->blocks = realloc(trace->blocks, capacity * sizeof(*trace->blocks));
+                if (NULL == trace->blocks) {
+                    fprintf(stderr, "Error allocating block list; bailing\n");
+                    exit(-1);
+                }
+            }
+            trace->blocks[trace->numBlocks++] = b;
+            trace->count += b->count;
+        }
+        if (reader.next != reader.end) {
+            fprintf(stderr, "%s: truncated after %zu records\n", path, trace->count);
+        }
+        if (NULL == trace->blocks) {
+            trace->blocks = malloc(sizeof(*trace->blocks));
+        }
+        return 0;
+    }
+
+    const struct btTraceHeader *header = trace->map;
+    if (BT_TRACE_MAGIC != header->magic || BT_TRACE_VERSION != header->version ||
+        sizeof(struct btTraceRecord) != header->recordSize) {
+        fprintf(stderr, "%s: not a brainthrottle trace (or another version)\n", path);
+        munmap(trace->map, trace->size);
+        return -1;
+    }
+    trace->count = (trace->size - sizeof(*header)) / sizeof(struct btTraceRecord);
+    trace->records = (const struct btTraceRecord *)(header + 1);
+    return 0;
+}
+
+
+/*
+ * Unmaps a trace.
+ */
+void unmapTrace(struct trace *trace) {
+    munmap(trace->map, trace->size);
+    free(trace->blocks);
+}
+
+
+/*
+ * Writes a raw trace's records to path as a columnar trace. Returns 0, or
+ * -1 after saying why not.
+ */
+int compressTrace(const struct trace *trace, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (NULL == file) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct btColumnWriter *w = malloc(sizeof(*w));
+    if (NULL == w) {
+        fprintf(stderr, "Error allocating writer; bailing\n");
+        exit(-1);
+    }
+    int result = btColumnWriterInit(w, file);
+    for (size_t i = 0; 0 == result && i < trace->count; i++) {
+        btColumnWrite(w, &trace->records[i]);
+    }
+    if (0 == result) {
+        result = btColumnWriterFinish(w);
+    }
+    if (0 != fclose(file)) {
+        result = -1;
+    }
+    if (0 != result) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    }
+    free(w);
+    return result;
+}
+
+
+/*
+ * Returns the smallest power of two below which at least fraction of a
+ * histogram's counts fall.
+ */
+uint64_t histogramQuantile(const uint64_t *histogram, double fraction) {
+    uint64_t total = 0, seen = 0;
+
+    for (int i = 0; i < kHistogramBuckets; i++) {
+        total += histogram[i];
+    }
+    for (int i = 0; i < kHistogramBuckets; i++) {
+        seen += histogram[i];
+        if (total && seen >= fraction * total) {
+            return 1ULL << i;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Prints a power-of-two histogram with bars, skipping empty buckets.
+ */
+void printHistogram(const uint64_t *histogram, const char *unit) {
+    uint64_t most = 1;
+
+    for (int i = 0; i < kHistogramBuckets; i++) {
+        if (histogram[i] > most) {
+            most = histogram[i];
+        }
+    }
+    for (int i = 0; i < kHistogramBuckets; i++) {
+        if (histogram[i]) {
+            printf("  < %-10llu %-3s %12llu  %.*s\n", 1ULL << i, unit, (unsigned long long)histogram[i],
+                (int)(40 * histogram[i] / most), "########################################");
+        }
+    }
+}
+
+
+/*
+ * Prints the analysis.
+ */
+void printStats(const struct stats *st) {
+    printf("%llu records: %llu scrolls (volume %llu), %llu penalties, %llu restores, %llu skipped\n",
+        (unsigned long long)st->records, (unsigned long long)st->scrolls,
+        (unsigned long long)st->volume, (unsigned long long)st->penalties,
+        (unsigned long long)st->restores, (unsigned long long)st->skipped);
+    printf("\nBursts: %llu, %llu penalized (hit rate %.2f%%), %.2f penalties per 1000 scrolls\n",
+        (unsigned long long)st->bursts, (unsigned long long)st->penalizedBursts,
+        st->bursts ? 100.0 * st->penalizedBursts / st->bursts : 0.0,
+        st->scrolls ? 1000.0 * st->penalties / st->scrolls : 0.0);
+    printf("Burst volume p50 < %llu, p90 < %llu, p99 < %llu\n",
+        (unsigned long long)histogramQuantile(st->burstSizes, 0.5),
+        (unsigned long long)histogramQuantile(st->burstSizes, 0.9),
+        (unsigned long long)histogramQuantile(st->burstSizes, 0.99));
+    printHistogram(st->burstSizes, "");
+    printf("\nSkim episodes: %llu (%llu still open), mean %.1f s, longest %.1f s\n",
+        (unsigned long long)st->episodes, (unsigned long long)st->openEpisodes,
+        st->episodes ? (double)st->episodeNs / st->episodes / kNsecPerSec : 0.0,
+        (double)st->longestNs / kNsecPerSec);
+    printHistogram(st->episodeLengths, "ms");
+}
+
+
+/*
+ * Returns a pseudo-random number below range.
+ */
+uint32_t benchmarkRandom(uint64_t *seed, uint32_t range) {
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32_t)((*seed >> 33) % range);
+}
+
+
+/*
+ * Writes a synthetic trace of about megabytes MB to path: four seats taking
+ * turns at bursts of scrolling, with a penalty (and a restore 5 s later)
+ * whenever a burst passes 1000, like brainthrottle's default threshold.
+ * Returns the number of records.
+ */
+size_t writeBenchmarkTrace(const char *path, size_t megabytes) {
+    struct btTraceHeader header = { BT_TRACE_MAGIC, BT_TRACE_VERSION, sizeof(struct btTraceRecord), 0 };
+    size_t count = megabytes * 1024 * 1024 / sizeof(struct btTraceRecord);
+    size_t size = sizeof(header) + count * sizeof(struct btTraceRecord);
+    uint64_t restoreAt[4] = { 0 };
+    uint64_t seed = 1, time = kNsecPerSec;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (-1 == fd || -1 == ftruncate(fd, size)) {
+        fprintf(stderr, "Error creating %s: %s; bailing\n", path, strerror(errno));
+        exit(-1);
+    }
+    struct btTraceHeader *out = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == out) {
+        fprintf(stderr, "Error mapping %s: %s; bailing\n", path, strerror(errno));
+        exit(-1);
+    }
+    *out = header;
+
+    struct btTraceRecord *r = (struct btTraceRecord *)(out + 1);
+    size_t n = 0;
+    while (n < count) {
+        uint16_t seat = benchmarkRandom(&seed, 4);
+        uint32_t length = 20 + benchmarkRandom(&seed, 400);
+        int64_t total = 0;
+        bool penalized = false;
+
+        time += kNsecPerSec * (1 + benchmarkRandom(&seed, 20));
+        for (uint32_t j = 0; j < length && n < count; j++) {
+            time += kNsecPerMsec * (5 + benchmarkRandom(&seed, 50));
+            for (int s = 0; s < 4 && n < count; s++) {
+                if (restoreAt[s] && restoreAt[s] <= time) {
+                    r[n++] = (struct btTraceRecord){ restoreAt[s], 0, (uint16_t)s, BT_EVENT_RESTORE, 0 };
+                    restoreAt[s] = 0;
+                }
+            }
+            if (n == count) {
+                break;
+            }
+            int32_t value = 2 + benchmarkRandom(&seed, 10);
+            r[n++] = (struct btTraceRecord){ time, value, seat, BT_EVENT_SCROLL, 0 };
+            total += value;
+            if (total >= 1000 && n < count) {
+                if (!penalized && !restoreAt[seat]) {
+                    r[n++] = (struct btTraceRecord){ time, (int32_t)total, seat, BT_EVENT_PENALTY, 0 };
+                }
+                penalized = true;
+                restoreAt[seat] = time + 5 * kNsecPerSec;
+            }
+        }
+    }
+    munmap(out, size);
+    return count;
+}
+
+
+/*
+ * Times scans of a synthetic trace with each thread count up to threads,
+ * with and without AVX2, and checks that every setting (and a run with
+ * tiny chunks) gives the same results. Then does the same for the trace
+ * compressed to columnar, timing the compression and decoding too.
+ */
+void runBenchmark(size_t megabytes, int threads) {
+    const char *path = "/tmp/btanalyze-benchmark.trace";
+    const char *columnPath = "/tmp/btanalyze-benchmark.btc";
+    struct btTraceRecord records[BT_COLUMN_BLOCK];
+    struct trace raw, columns;
+    struct stats expected, got;
+
+    printf("Writing a %zu MB synthetic trace to %s\n", megabytes, path);
+    writeBenchmarkTrace(path, megabytes);
+    if (0 != mapTrace(path, &raw)) {
+        exit(-1);
+    }
+    size_t count = raw.count, size = raw.size;
+
+
+    // Reference: one thread, one record at a time, then tiny chunks
+
+    memset(&expected, 0, sizeof(expected));
+    analyze(&expected, &raw, 1, count, false);
+    memset(&got, 0, sizeof(got));
+    analyze(&got, &raw, 1, 4093, true);
+    printf("Chunked scan %s the single-chunk scan\n",
+        memcmp(&expected, &got, sizeof(got)) ? "DIFFERS FROM" : "matches");
+
+    for (int simd = 0; simd < 2; simd++) {
+#ifndef __AVX2__
+        if (simd) {
+            printf("(built without AVX2; compile with -march=native for the vector scan)\n");
+            break;
+        }
+#endif
+        for (int t = 1; t <= threads; t = t < threads && t * 2 > threads ? threads : t * 2) {
+            uint64_t best = UINT64_MAX;
+            for (int run = 0; run < kBenchmarkRuns; run++) {
+                memset(&got, 0, sizeof(got));
+                uint64_t start = nowNs();
+                analyze(&got, &raw, t, kChunkRecords, simd);
+                uint64_t elapsed = nowNs() - start;
+                best = elapsed < best ? elapsed : best;
+            }
+            printf("%-6s %3d thread(s): %7.2f GB/s, %5.2f ns per record%s\n", simd ? "avx2" : "scalar",
+                t, (double)size / best, (double)best / count,
+                memcmp(&expected, &got, sizeof(got)) ? "  RESULTS DIFFER" : "");
+        }
+    }
+
+
+    // Columnar: compress, decode alone, then scan
+
+    uint64_t start = nowNs();
+    if (0 != compressTrace(&raw, columnPath) || 0 != mapTrace(columnPath, &columns)) {
+        exit(-1);
+    }
+    uint64_t elapsed = nowNs() - start;
+    printf("\nColumnar: %.1f MB, %.1fx smaller, %.2f bytes per record, written at %.0f M records/s\n",
+        columns.size / 1048576.0, (double)size / columns.size, (double)columns.size / count,
+        count * 1000.0 / elapsed);
+    size_t decoded = 0;
+    for (size_t i = 0; i < columns.numBlocks; i++) {
+        int n = btColumnDecode(columns.blocks[i], records);
+        if (n < 0 || decoded + n > count ||
+            0 != memcmp(records, raw.records + decoded, n * sizeof(*records))) {
+            break;
+        }
+        decoded += n;
+    }
+    printf("Decoded trace %s the raw trace\n", decoded == count ? "matches" : "DIFFERS FROM");
+    uint64_t best = UINT64_MAX;
+    for (int run = 0; run < kBenchmarkRuns; run++) {
+        start = nowNs();
+        for (size_t i = 0; i < columns.numBlocks; i++) {
+            btColumnDecode(columns.blocks[i], records);
+        }
+        elapsed = nowNs() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+    printf("decode   1 thread(s): %6.0f M records/s, %5.2f ns per record\n", count * 1000.0 / best,
+        (double)best / count);
+    for (int t = 1; t <= threads; t = t < threads && t * 2 > threads ? threads : t * 2) {
+        best = UINT64_MAX;
+        for (int run = 0; run < kBenchmarkRuns; run++) {
+            memset(&got, 0, sizeof(got));
+            start = nowNs();
+            analyze(&got, &columns, t, kChunkRecords, useSimd);
+            elapsed = nowNs() - start;
+            best = elapsed < best ? elapsed : best;
+        }
+        printf("columnar %d thread(s): %6.0f M records/s, %5.2f ns per record%s\n", t,
+            count * 1000.0 / best, (double)best / count,
+            memcmp(&expected, &got, sizeof(got)) ? "  RESULTS DIFFER" : "");
+    }
+
+    printf("\n");
+    printStats(&expected);
+    unmapTrace(&columns);
+    unmapTrace(&raw);
+    unlink(columnPath);
+    unlink(path);
+}
+
+
+/*
+ * Training
+ *
+ * -m fits btmodel.h's logistic regression to the labels in traces (the
+ * label control command). Features are extracted as the live detector
+ * would, one window per seat, with threads taking every threads'th seat
+ * so each seat's inputs stay in order. The fit runs on standardized
+ * features, a Newton step per pass, each pass summing gradients and
+ * Hessians over equal shards of the samples in parallel. Samples from
+ * every fifth minute are held out to measure accuracy. The result is
+ * folded back into fixed-point weights over the raw features.
+ */
+#define kModelParams (BT_MODEL_FEATURES + 1)
+#define kTrainPasses 25
+#define kTrainRidge 1e-3                // L2 penalty on standardized weights
+
+struct sample {
+    int32_t features[BT_MODEL_FEATURES];
+    int8_t label;                       // 1 skimming, 0 reading
+    bool holdout;
+};
+
+struct extraction {                     // One extraction thread
+    const struct trace *trace;
+    int thread;
+    int threads;
+    struct sample *samples;
+    size_t count;
+    size_t capacity;
+};
+
+struct modelSeat {                      // A seat's window while extracting
+    struct btModelWindow window;
+    bool reversed;                      // The next scroll follows a BT_EVENT_REVERSE
+    int label;                          // Last BT_EVENT_LABEL, -1 if none
+};
+
+struct training {                       // Shared by the threads of one pass
+    const struct sample *samples;
+    size_t count;
+    double classWeight[2];              // So reading and skimming count the same overall
+    double mean[BT_MODEL_FEATURES];
+    double scale[BT_MODEL_FEATURES];    // 1 / standard deviation
+    double weights[kModelParams];       // Bias first, on standardized features
+    struct btModel model;               // Fixed point, for the last pass
+};
+
+struct trainShard {
+    struct training *training;
+    size_t from;
+    size_t to;
+    double gradient[kModelParams];
+    double hessian[kModelParams][kModelParams];
+    double loss;
+    uint64_t trained;                   // Training samples
+    uint64_t trainedCorrect;            // ... the float model gets right
+    uint64_t held[2];                   // Held-out samples, by label
+    uint64_t heldCorrect[2];            // ... the float model gets right
+    uint64_t fixedCorrect[2];           // ... the fixed-point model gets right
+    uint64_t agree;                     // Held out, float and fixed point agree
+};
+
+
+/*
+ * Feeds one record to its seat's window, adding a sample for labeled
+ * scrolls.
+ */
+void extractRecord(struct extraction *x, struct modelSeat *s, const struct btTraceRecord *r) {
+    int32_t features[BT_MODEL_FEATURES];
+
+    switch (r->type) {
+    case BT_EVENT_REVERSE:
+        s->reversed = true;
+        return;
+    case BT_EVENT_KEY:
+        btModelAdd(&s->window, r->time / 1000, 0, BT_MODEL_KEY);
+        return;
+    case BT_EVENT_LABEL:
+        s->label = r->value;
+        return;
+    case BT_EVENT_SCROLL:
+        break;
+    default:
+        return;
+    }
+    btModelAdd(&s->window, r->time / 1000, (uint32_t)r->value, s->reversed ? BT_MODEL_REVERSE : 0);
+    s->reversed = false;
+    if ((0 != s->label && 1 != s->label) || !btModelFeatures(&s->window, features)) {
+        return;
+    }
+    if (x->count == x->capacity) {
+        x->capacity = x->capacity ? x->capacity * 2 : 65536;
+        x->samples = realloc(x->samples, x->capacity * sizeof(struct sample));
+        if (NULL == x->samples) {
+            fprintf(stderr, "Error allocating samples; bailing\n");
+            exit(-1);
+        }
+    }
+    struct sample *out = &x->samples[x->count++];
+    memcpy(out->features, features, sizeof(features));
+    out->label = (int8_t)s->label;
+    out->holdout = 4 == r->time / (60 * kNsecPerSec) % 5;
+}
+
+
+/*
+ * Feeds the records of this thread's seats to their windows.
+ */
+void extractRecords(struct extraction *x, struct modelSeat *seats, const struct btTraceRecord *r,
+        size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (r[i].seat < kMaxSeats && x->thread == r[i].seat % x->threads) {
+            extractRecord(x, &seats[r[i].seat], &r[i]);
+        }
+    }
+}
+
+
+/*
+ * Extraction thread. Reads the whole trace, keeping only its own seats.
+ */
+void *extractThread(void *arg) {
+    struct extraction *x = arg;
+    struct btTraceRecord records[BT_COLUMN_BLOCK];
+    const struct trace *trace = x->trace;
+
+    struct modelSeat *seats = calloc(kMaxSeats, sizeof(struct modelSeat));
+    if (NULL == seats) {
+        fprintf(stderr, "Error allocating seats; bailing\n");
+        exit(-1);
+    }
+    for (int i = 0; i < kMaxSeats; i++) {
+        seats[i].label = -1;
+    }
+    if (NULL == trace->blocks) {
+        extractRecords(x, seats, trace->records, trace->count);
+    }
+    for (size_t i = 0; trace->blocks && i < trace->numBlocks; i++) {
+        int n = btColumnDecode(trace->blocks[i], records);
+        if (n > 0) {
+            extractRecords(x, seats, records, n);
+        }
+    }
+    free(seats);
+    return NULL;
+}
+
+
+/*
+ * Returns the standardized value of feature i of sample s.
+ */
+double standardized(const struct training *t, const struct sample *s, int i) {
+    return (s->features[i] / (double)(1 << BT_MODEL_SHIFT) - t->mean[i]) * t->scale[i];
+}
+
+
+/*
+ * Training thread, one shard of one pass: sums the class-weighted logistic
+ * loss over training samples, its gradient and Hessian, and how many
+ * samples each model gets right.
+ */
+void *trainThread(void *arg) {
+    struct trainShard *shard = arg;
+    const struct training *t = shard->training;
+    double z[kModelParams];
+
+    z[0] = 1;
+    for (size_t n = shard->from; n < shard->to; n++) {
+        const struct sample *s = &t->samples[n];
+        double score = t->weights[0];
+        for (int i = 0; i < BT_MODEL_FEATURES; i++) {
+            z[i + 1] = standardized(t, s, i);
+            score += t->weights[i + 1] * z[i + 1];
+        }
+        bool skimming = score > 0;
+        if (s->holdout) {
+            bool fixed = btModelScore(&t->model, s->features) > 0;
+            shard->held[s->label]++;
+            shard->heldCorrect[s->label] += skimming == s->label;
+            shard->fixedCorrect[s->label] += fixed == s->label;
+            shard->agree += fixed == skimming;
+            continue;
+        }
+
+        double p = 1 / (1 + exp(-score));
+        double weight = t->classWeight[s->label];
+        shard->loss -= weight * (s->label ? log(p + 1e-12) : log(1 - p + 1e-12));
+        for (int i = 0; i < kModelParams; i++) {
+            shard->gradient[i] += weight * (p - s->label) * z[i];
+            for (int j = 0; j <= i; j++) {
+                shard->hessian[i][j] += weight * p * (1 - p) * z[i] * z[j];
+            }
+        }
+        shard->trained++;
+        shard->trainedCorrect += skimming == s->label;
+    }
+    return NULL;
+}
+
+
+/*
+ * Solves a x = b in place (b becomes x) by Gaussian elimination with
+ * partial pivoting.
+ */
+void solve(double a[kModelParams][kModelParams], double *b) {
+    for (int col = 0; col < kModelParams; col++) {
+        int pivot = col;
+        for (int row = col + 1; row < kModelParams; row++) {
+            if (fabs(a[row][col]) > fabs(a[pivot][col])) {
+                pivot = row;
+            }
+        }
+        for (int k = 0; k < kModelParams; k++) {
+            double swap = a[col][k];
+            a[col][k] = a[pivot][k];
+            a[pivot][k] = swap;
+        }
+        double swap = b[col];
+        b[col] = b[pivot];
+        b[pivot] = swap;
+        for (int row = col + 1; row < kModelParams; row++) {
+            double f = a[row][col] / a[col][col];
+            for (int k = col; k < kModelParams; k++) {
+                a[row][k] -= f * a[col][k];
+            }
+            b[row] -= f * b[col];
+        }
+    }
+    for (int row = kModelParams - 1; row >= 0; row--) {
+        for (int k = row + 1; k < kModelParams; k++) {
+            b[row] -= a[row][k] * b[k];
+        }
+        b[row] /= a[row][row];
+    }
+}
+
+
+/*
+ * Rounds value to the nearest int32_t, saturating.
+ */
+int32_t toFixed(double value) {
+    return value >= INT32_MAX ? INT32_MAX : value <= INT32_MIN ? INT32_MIN : (int32_t)llround(value);
+}
+
+
+/*
+ * Folds the standardized weights into fixed-point weights over raw
+ * features.
+ */
+void quantizeModel(struct training *t) {
+    double bias = t->weights[0];
+    double one = 1 << BT_MODEL_WEIGHT_SHIFT;
+
+    for (int i = 0; i < BT_MODEL_FEATURES; i++) {
+        double w = t->weights[i + 1] * t->scale[i];
+        bias -= w * t->mean[i];
+        t->model.weights[i] = toFixed(w * one);
+    }
+    t->model.bias = toFixed(bias * one);
+}
+
+
+/*
+ * Runs one pass of trainThread over every sample on threads threads and
+ * sums the shards into total.
+ */
+void trainPass(struct training *t, int threads, struct trainShard *total) {
+    pthread_t pool[kMaxThreads];
+    struct trainShard *shards = calloc(threads, sizeof(struct trainShard));
+
+    if (NULL == shards) {
+        fprintf(stderr, "Error allocating shards; bailing\n");
+        exit(-1);
+    }
+    for (int i = 0; i < threads; i++) {
+        shards[i].training = t;
+        shards[i].from = t->count * i / threads;
+        shards[i].to = t->count * (i + 1) / threads;
+        if (i > 0 && 0 != pthread_create(&pool[i], NULL, &trainThread, &shards[i])) {
+            fprintf(stderr, "Error starting training thread; bailing\n");
+            exit(-1);
+        }
+    }
+    trainThread(&shards[0]);
+    memset(total, 0, sizeof(*total));
+    for (int i = 0; i < threads; i++) {
+        if (i > 0) {
+            pthread_join(pool[i], NULL);
+        }
+        for (int j = 0; j < kModelParams; j++) {
+            total->gradient[j] += shards[i].gradient[j];
+            for (int k = 0; k <= j; k++) {
+                total->hessian[j][k] += shards[i].hessian[j][k];
+            }
+        }
+        total->loss += shards[i].loss;
+        total->trained += shards[i].trained;
+        total->trainedCorrect += shards[i].trainedCorrect;
+        for (int j = 0; j < 2; j++) {
+            total->held[j] += shards[i].held[j];
+            total->heldCorrect[j] += shards[i].heldCorrect[j];
+            total->fixedCorrect[j] += shards[i].fixedCorrect[j];
+        }
+        total->agree += shards[i].agree;
+    }
+    free(shards);
+}
+
+
+/*
+ * Extracts labeled samples from traces, fits a model and writes it to
+ * path. Returns 0, or -1 after saying why not.
+ */
+int trainModel(char **paths, int numPaths, int threads, const char *path) {
+    pthread_t pool[kMaxThreads];
+    struct extraction *x = calloc(threads, sizeof(struct extraction));
+    struct training t;
+    struct trainShard total;
+    size_t records = 0;
+
+    if (NULL == x) {
+        fprintf(stderr, "Error allocating extraction; bailing\n");
+        exit(-1);
+    }
+
+
+    // Extract samples, seats split across threads
+
+    uint64_t start = nowNs();
+    for (int p = 0; p < numPaths; p++) {
+        struct trace trace;
+        if (0 != mapTrace(paths[p], &trace)) {
+            return -1;
+        }
+        for (int i = 0; i < threads; i++) {
+            x[i].trace = &trace;
+            x[i].thread = i;
+            x[i].threads = threads;
+            if (i > 0 && 0 != pthread_create(&pool[i], NULL, &extractThread, &x[i])) {
+                fprintf(stderr, "Error starting extraction thread; bailing\n");
+                exit(-1);
+            }
+        }
+        extractThread(&x[0]);
+        for (int i = 1; i < threads; i++) {
+            pthread_join(pool[i], NULL);
+        }
+        records += trace.count;
+        unmapTrace(&trace);
+    }
+    memset(&t, 0, sizeof(t));
+    for (int i = 0; i < threads; i++) {
+        t.count += x[i].count;
+    }
+    struct sample *samples = malloc((t.count ? t.count : 1) * sizeof(struct sample));
+    if (NULL == samples) {
+        fprintf(stderr, "Error allocating samples; bailing\n");
+        exit(-1);
+    }
+    size_t byLabel[2] = { 0, 0 };       // Training samples
+    size_t skims = 0, n = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(samples + n, x[i].samples, x[i].count * sizeof(struct sample));
+        n += x[i].count;
+        free(x[i].samples);
+    }
+    free(x);
+    for (n = 0; n < t.count; n++) {
+        skims += samples[n].label;
+        byLabel[samples[n].label] += !samples[n].holdout;
+    }
+    t.samples = samples;
+    printf("%zu records, %zu labeled scrolls (%zu skimming) in %.2f s\n", records, t.count, skims,
+        (double)(nowNs() - start) / kNsecPerSec);
+    if (0 == byLabel[0] || 0 == byLabel[1]) {
+        fprintf(stderr, "Training needs scrolls labeled both skim and read (control command label)\n");
+        free(samples);
+        return -1;
+    }
+
+
+    // Standardize, then Newton steps on the ridge-penalized loss
+
+    start = nowNs();
+    size_t trained = byLabel[0] + byLabel[1];
+    t.classWeight[0] = trained / (2.0 * byLabel[0]);
+    t.classWeight[1] = trained / (2.0 * byLabel[1]);
+    for (int i = 0; i < BT_MODEL_FEATURES; i++) {
+        double sum = 0, squares = 0;
+        for (size_t n = 0; n < t.count; n++) {
+            double f = samples[n].features[i] / (double)(1 << BT_MODEL_SHIFT);
+            sum += f;
+            squares += f * f;
+        }
+        t.mean[i] = sum / t.count;
+        double variance = squares / t.count - t.mean[i] * t.mean[i];
+        t.scale[i] = variance > 1e-9 ? 1 / sqrt(variance) : 1;
+    }
+    for (int pass = 0; pass < kTrainPasses; pass++) {
+        double step[kModelParams];
+        trainPass(&t, threads, &total);
+        for (int i = 0; i < kModelParams; i++) {
+            step[i] = total.gradient[i] / trained + (i ? kTrainRidge * t.weights[i] : 0);
+            for (int j = 0; j <= i; j++) {
+                total.hessian[i][j] /= trained;
+                total.hessian[j][i] = total.hessian[i][j];
+            }
+            total.hessian[i][i] += i ? kTrainRidge : 1e-9;
+        }
+        solve(total.hessian, step);
+        double size = 0;
+        for (int i = 0; i < kModelParams; i++) {
+            t.weights[i] -= step[i];
+            size += fabs(step[i]);
+        }
+        if (size < 1e-9) {
+            break;
+        }
+    }
+    quantizeModel(&t);
+    trainPass(&t, threads, &total);
+    uint64_t held = total.held[0] + total.held[1];
+    printf("Trained on %zu samples in %.2f s with %d thread(s): log loss %.4f, %.2f%% right\n",
+        trained, (double)(nowNs() - start) / kNsecPerSec, threads, total.loss / trained,
+        100.0 * total.trainedCorrect / trained);
+    printf("Held out %llu samples: %.2f%% of reading and %.2f%% of skimming right; in fixed point "
+        "%.2f%% and %.2f%% (agrees with float on %.2f%%)\n", (unsigned long long)held,
+        100.0 * total.heldCorrect[0] / (total.held[0] ? total.held[0] : 1),
+        100.0 * total.heldCorrect[1] / (total.held[1] ? total.held[1] : 1),
+        100.0 * total.fixedCorrect[0] / (total.held[0] ? total.held[0] : 1),
+        100.0 * total.fixedCorrect[1] / (total.held[1] ? total.held[1] : 1),
+        100.0 * total.agree / (held ? held : 1));
+
+
+    // Time inference as the detector runs it: window, features, score
+
+    struct btModelWindow window;
+    int32_t features[BT_MODEL_FEATURES];
+    uint64_t time = 0, seed = 1;
+    int64_t skimming = 0;
+    int runs = 10000000;
+    memset(&window, 0, sizeof(window));
+    start = nowNs();
+    for (int i = 0; i < runs; i++) {
+        time += 5000 + benchmarkRandom(&seed, 100000);
+        btModelAdd(&window, time, 1 + benchmarkRandom(&seed, 8), 0 == i % 16 ? BT_MODEL_REVERSE : 0);
+        skimming += btModelFeatures(&window, features) && btModelScore(&t.model, features) > 0;
+    }
+    printf("Inference: %.1f ns per scroll (window, features and score; %lld skimming)\n",
+        (double)(nowNs() - start) / runs, (long long)skimming);
+    free(samples);
+
+    FILE *file = fopen(path, "w");
+    if (NULL == file) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(file, "# brainthrottle model (btmodel.h): bias, then weights\n%d", t.model.bias);
+    for (int i = 0; i < BT_MODEL_FEATURES; i++) {
+        fprintf(file, ",%d", t.model.weights[i]);
+    }
+    fprintf(file, "\n");
+    if (0 != fclose(file)) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    printf("Wrote %s; use it with brainthrottle -o detector=model -o model=%s\n", path, path);
+    return 0;
+}
+
+
+/*
+ * Entry point. Analyzes each trace named on the command line, trains a
+ * model on them (-m), or runs the benchmark.
+ */
+int main(int argc, char **argv) {
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    size_t benchmarkMegabytes = 0;
+    const char *columnPath = NULL;
+    const char *modelPath = NULL;
+    struct stats total;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:g:sb:z:m:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'g':
+            burstGap = (int64_t)(atof(optarg) * kNsecPerSec);
+            break;
+        case 's':
+            useSimd = false;
+            break;
+        case 'b':
+            benchmarkMegabytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            columnPath = optarg;
+            break;
+        case 'm':
+            modelPath = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-g gap-seconds] [-s] [-b megabytes] [-z columnar-out] [-m model-out] trace...\n", argv[0]);
+            return -1;
+        }
+    }
+    if (threads < 1) {
+        threads = 1;
+    } else if (threads > kMaxThreads) {
+        threads = kMaxThreads;
+    }
+    if (benchmarkMegabytes > 0) {
+        runBenchmark(benchmarkMegabytes, threads);
+        return 0;
+    }
+    if (optind >= argc || (columnPath && optind + 1 != argc)) {
+        fprintf(stderr, "usage: %s [-t threads] [-g gap-seconds] [-s] [-b megabytes] [-z columnar-out] [-m model-out] trace...\n", argv[0]);
+        return -1;
+    }
+
+
+    // -m: train a model from the labels in the traces
+
+    if (modelPath) {
+        return trainModel(argv + optind, argc - optind, threads, modelPath);
+    }
+
+
+    // -z: compress one raw trace
+
+    if (columnPath) {
+        struct trace trace;
+        if (0 != mapTrace(argv[optind], &trace)) {
+            return -1;
+        }
+        if (trace.blocks) {
+            fprintf(stderr, "%s: already columnar\n", argv[optind]);
+            return -1;
+        }
+        if (0 != compressTrace(&trace, columnPath)) {
+            return -1;
+        }
+        struct stat st;
+        if (0 == stat(columnPath, &st)) {
+            printf("%zu records: %.1f MB to %.1f MB (%.1fx)\n", trace.count, trace.size / 1048576.0,
+                st.st_size / 1048576.0, (double)trace.size / st.st_size);
+        }
+        unmapTrace(&trace);
+        return 0;
+    }
+
+
+    // Traces are analyzed one after another; bursts and penalties never
+    // carry from one file into the next
+
+    memset(&total, 0, sizeof(total));
+    uint64_t start = nowNs();
+    size_t bytes = 0;
+    for (int i = optind; i < argc; i++) {
+        struct trace trace;
+        if (0 != mapTrace(argv[i], &trace)) {
+            return -1;
+        }
+        analyze(&total, &trace, threads, kChunkRecords, useSimd);
+        bytes += trace.size;
+        unmapTrace(&trace);
+    }
+    uint64_t elapsed = nowNs() - start;
+    printStats(&total);
+    printf("\nScanned %.1f MB in %.3f s (%.2f GB/s) with %d thread(s)\n", bytes / 1048576.0,
+        (double)elapsed / kNsecPerSec, (double)bytes / elapsed, threads);
+    return 0;
+}
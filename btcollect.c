@@ -0,0 +1,770 @@
+/* btcollect.c **
+ *
+ * Fleet telemetry collector for brainthrottle (-F, format in
+ * brainthrottle.h). brainthrottle agents on the same machine push batched
+ * records of their seats' scrolling per minute and of each penalty; the
+ * collector sums them into per-user and per-hour tables and prints them
+ * every interval, on SIGUSR1 and at exit.
+ *
+ *
+ * Design  **
+ *
+ * Records are received and counted by a pool of shard threads, each with
+ * tables of its own, so ingest shares no lock or counter between threads.
+ * All shards read the one Unix socket; the kernel hands each datagram to a
+ * single one of them. For UDP each shard has its own socket in a
+ * SO_REUSEPORT group, which spreads agents across shards by address. Shards
+ * take datagrams in batches with recvmmsg.
+ *
+ * A table is an open-addressed hash of counters: per user, keyed by uid,
+ * and per hour, keyed by the hour's Unix time. Everything counted is a
+ * sum, so a report adds the shards' tables together, taking each shard's
+ * own lock in turn; a shard holds its lock while it counts one batch.
+ *
+ * Agents drop what they can't send rather than wait, and number their
+ * datagrams. Each shard also keeps, per agent, the datagrams it got and
+ * the highest sequence number seen, so the report can tell how many never
+ * arrived whichever shards the rest went to.
+ *
+ *
+ * Compile and Run **
+ *
+ * $ cc -O2 -pthread -o btcollect btcollect.c
+ * $ ./btcollect
+ *
+ * Options:
+ *
+ *   -s PATH        Listen on the Unix datagram socket PATH (default
+ *                  BT_TELEMETRY_PATH)
+ *   -p PORT        Listen on UDP port PORT on 127.0.0.1 too
+ *   -t THREADS     Shard across THREADS threads (default: one per CPU)
+ *   -i SECONDS     Print the tables every SECONDS (default 3600)
+ *   -b AGENTS      Benchmark: AGENTS simulated agents push datagrams as fast
+ *                  as they can, over the Unix socket and then UDP, to 1 to
+ *                  THREADS shards; print the ingest rates and exit
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "brainthrottle.h"
+
+
+/*
+ * Limits
+ */
+#define kMaxThreads 256
+#define kBatch 64                       // Datagrams per recvmmsg
+#define kTableStart 1024                // Initial slots per table, a power of two
+#define kReceiveBuffer (4 << 20)        // SO_RCVBUF asked for
+#define kBenchmarkSeconds 3
+#define kBenchmarkUsers 500             // Simulated agents' users are spread over this many
+
+const uint64_t kNsecPerSec = 1000000000ULL;
+const uint64_t kMsecPerHour = 3600000ULL;
+
+
+/*
+ * Tables
+ */
+struct tally {
+    uint64_t records;
+    uint64_t events;                    // Scroll events
+    uint64_t volume;                    // Summed scrollDiff
+    uint64_t episodes;                  // Penalties
+    uint64_t penalizedMs;
+    uint64_t datagrams;                 // Agents table: datagrams received
+    uint64_t sequences;                 // ... highest sequence + 1
+};
+
+struct tableSlot {
+    uint64_t key;
+    bool used;
+    struct tally tally;
+};
+
+struct table {
+    struct tableSlot *slots;
+    size_t size;                        // A power of two
+    size_t used;
+};
+
+struct shard {
+    pthread_t thread;
+    int fds[2];                         // Unix socket (shared), UDP socket (own)
+    int numFds;
+    int udpFd;                          // Own UDP socket, or -1
+    _Atomic bool stopping;
+    pthread_mutex_t lock;               // Held while counting a batch, and by reports
+    struct table users;
+    struct table hours;
+    struct table agents;
+    uint64_t datagrams;
+    uint64_t records;
+    uint64_t malformed;                 // Datagrams that weren't telemetry
+} __attribute__((aligned(64)));
+
+volatile sig_atomic_t stop;
+
+
+/*
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * kNsecPerSec + ts.tv_nsec;
+}
+
+
+/*
+ * Empties a table, allocating its first slots if it has none.
+ */
+void initTable(struct table *t) {
+    free(t->slots);
+    t->size = kTableStart;
+    t->used = 0;
+    t->slots = calloc(t->size, sizeof(struct tableSlot));
+    if (NULL == t->slots) {
+        fprintf(stderr, "Error allocating table; bailing\n");
+        exit(-1);
+    }
+}
+
+
+/*
+ * Returns the tally for key in t, adding it if it's new. Grows the table
+ * to keep it at most half full.
+ */
+struct tally *findTally(struct table *t, uint64_t key) {
+    if (2 * (t->used + 1) > t->size) {
+        struct table grown = { calloc(2 * t->size, sizeof(struct tableSlot)), 2 * t->size, 0 };
+        if (NULL == grown.slots) {
+            fprintf(stderr, "Error growing table; bailing\n");
+            exit(-1);
+        }
+        for (size_t i = 0; i < t->size; i++) {
+            if (t->slots[i].used) {
+                *findTally(&grown, t->slots[i].key) = t->slots[i].tally;
+            }
+        }
+        free(t->slots);
+        *t = grown;
+    }
+
+    size_t i = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (t->size - 1);
+    while (t->slots[i].used && t->slots[i].key != key) {
+        i = (i + 1) & (t->size - 1);
+    }
+    if (!t->slots[i].used) {
+        t->slots[i].used = true;
+        t->slots[i].key = key;
+        t->used++;
+    }
+    return &t->slots[i].tally;
+}
+
+
+/*
+ * Adds every tally in from to the same key's in into.
+ */
+void addTable(struct table *into, const struct table *from) {
+    for (size_t i = 0; i < from->size; i++) {
+        const struct tableSlot *s = &from->slots[i];
+        if (!s->used) {
+            continue;
+        }
+        struct tally *t = findTally(into, s->key);
+        t->records += s->tally.records;
+        t->events += s->tally.events;
+        t->volume += s->tally.volume;
+        t->episodes += s->tally.episodes;
+        t->penalizedMs += s->tally.penalizedMs;
+        t->datagrams += s->tally.datagrams;
+        if (s->tally.sequences > t->sequences) {
+            t->sequences = s->tally.sequences;
+        }
+    }
+}
+
+
+/*
+ * Counts one datagram into the shard's tables. Called with the shard's
+ * lock.
+ */
+void countDatagram(struct shard *s, const void *buf, size_t len) {
+    const struct btTelemetryHeader *h = buf;
+    const struct btTelemetryRecord *r = (const struct btTelemetryRecord *)(h + 1);
+
+    if (len < sizeof(*h) || BT_TELEMETRY_MAGIC != h->magic || BT_TELEMETRY_VERSION != h->version ||
+        len != sizeof(*h) + h->count * sizeof(struct btTelemetryRecord)) {
+        s->malformed++;
+        return;
+    }
+    struct tally *agent = findTally(&s->agents, h->agent);
+    agent->datagrams++;
+    if (h->sequence + 1 > agent->sequences) {
+        agent->sequences = h->sequence + 1;
+    }
+    s->datagrams++;
+    s->records += h->count;
+
+    for (int i = 0; i < h->count; i++, r++) {
+        struct tally *user = findTally(&s->users, r->uid);
+        struct tally *hour = findTally(&s->hours, r->time - r->time % kMsecPerHour);
+        user->records++;
+        hour->records++;
+        if (BT_TELEMETRY_ACTIVITY == r->type) {
+            user->events += r->events;
+            user->volume += r->volume;
+            hour->events += r->events;
+            hour->volume += r->volume;
+        } else if (BT_TELEMETRY_EPISODE == r->type) {
+            user->episodes++;
+            user->penalizedMs += r->duration;
+            hour->episodes++;
+            hour->penalizedMs += r->duration;
+        }
+    }
+}
+
+
+/*
+ * Shard thread: receives batches of datagrams and counts them until
+ * stopping is set and its sockets are shut down.
+ */
+void *shardThread(void *arg) {
+    struct shard *s = arg;
+    static __thread char buffers[kBatch][sizeof(struct btTelemetryHeader) +
+        BT_TELEMETRY_RECORDS * sizeof(struct btTelemetryRecord) + 1];
+    struct mmsghdr messages[kBatch];
+    struct iovec iovs[kBatch];
+    struct pollfd polls[2];
+
+    for (int i = 0; i < kBatch; i++) {
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = sizeof(buffers[i]);
+        memset(&messages[i], 0, sizeof(messages[i]));
+        messages[i].msg_hdr.msg_iov = &iovs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    for (int i = 0; i < s->numFds; i++) {
+        polls[i].fd = s->fds[i];
+        polls[i].events = POLLIN;
+    }
+
+    while (!atomic_load_explicit(&s->stopping, memory_order_relaxed)) {
+
+
+        // With one socket, block in recvmmsg; with two, wait for either
+
+        if (s->numFds > 1 && poll(polls, s->numFds, -1) < 0) {
+            continue;
+        }
+        for (int f = 0; f < s->numFds; f++) {
+            if (s->numFds > 1 && !(polls[f].revents & (POLLIN | POLLHUP))) {
+                continue;
+            }
+            int n = recvmmsg(s->fds[f], messages, kBatch,
+                s->numFds > 1 ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+            if (n <= 0) {
+                continue;
+            }
+            pthread_mutex_lock(&s->lock);
+            for (int i = 0; i < n; i++) {
+                if (messages[i].msg_len > 0) {
+                    countDatagram(s, buffers[i], messages[i].msg_len);
+                }
+            }
+            pthread_mutex_unlock(&s->lock);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Opens the Unix datagram socket at path, replacing a stale one, and lets
+ * anyone send to it. Returns the fd or -1.
+ */
+int listenUnix(const char *path) {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    struct stat st;
+
+    if (0 != btTelemetryAddress(path, &addr, &len)) {
+        fprintf(stderr, "bad socket path %s\n", path);
+        return -1;
+    }
+    if (0 == lstat(path, &st) && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (-1 == fd || 0 != bind(fd, (struct sockaddr *)&addr, len)) {
+        fprintf(stderr, "cannot listen on %s (error %d)\n", path, errno);
+        if (-1 != fd) {
+            close(fd);
+        }
+        return -1;
+    }
+    chmod(path, 0666);
+    int size = kReceiveBuffer;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    return fd;
+}
+
+
+/*
+ * Opens one of the SO_REUSEPORT group of UDP sockets on 127.0.0.1:*port.
+ * A port of 0 picks one and stores it. Returns the fd or -1.
+ */
+int listenUdp(int *port) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int on = 1;
+    int size = kReceiveBuffer;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)*port);
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (-1 == fd || 0 != setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) ||
+        0 != bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        0 != getsockname(fd, (struct sockaddr *)&addr, &len)) {
+        fprintf(stderr, "cannot listen on UDP port %d (error %d)\n", *port, errno);
+        if (-1 != fd) {
+            close(fd);
+        }
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+
+/*
+ * Starts count shards on unixFd (-1 for none) and, if udpPort isn't NULL,
+ * a UDP socket each on *udpPort. A port of 0 picks one and stores it.
+ * Returns false if a socket couldn't be opened.
+ */
+bool startShards(struct shard *shards, int count, int unixFd, int *udpPort) {
+    for (int i = 0; i < count; i++) {
+        struct shard *s = &shards[i];
+        memset(s, 0, sizeof(*s));
+        pthread_mutex_init(&s->lock, NULL);
+        initTable(&s->users);
+        initTable(&s->hours);
+        initTable(&s->agents);
+        s->udpFd = -1;
+        if (-1 != unixFd) {
+            s->fds[s->numFds++] = unixFd;
+        }
+        if (NULL != udpPort) {
+            s->udpFd = listenUdp(udpPort);
+            if (-1 == s->udpFd) {
+                return false;
+            }
+            s->fds[s->numFds++] = s->udpFd;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (0 != pthread_create(&shards[i].thread, NULL, &shardThread, &shards[i])) {
+            fprintf(stderr, "Error starting shard thread; bailing\n");
+            exit(-1);
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Stops and joins count shards and closes their UDP sockets. Shutting a
+ * socket down wakes whoever is blocked on it.
+ */
+void stopShards(struct shard *shards, int count) {
+    for (int i = 0; i < count; i++) {
+        atomic_store(&shards[i].stopping, true);
+    }
+    for (int i = 0; i < count; i++) {
+        for (int f = 0; f < shards[i].numFds; f++) {
+            shutdown(shards[i].fds[f], SHUT_RD);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_join(shards[i].thread, NULL);
+        if (-1 != shards[i].udpFd) {
+            close(shards[i].udpFd);
+        }
+    }
+}
+
+
+/*
+ * Adds the shards' tables and counts into total, whose tables must be
+ * initialized, taking each shard's lock in turn.
+ */
+void mergeShards(struct shard *total, struct shard *shards, int count) {
+    for (int i = 0; i < count; i++) {
+        struct shard *s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        addTable(&total->users, &s->users);
+        addTable(&total->hours, &s->hours);
+        addTable(&total->agents, &s->agents);
+        total->datagrams += s->datagrams;
+        total->records += s->records;
+        total->malformed += s->malformed;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+
+/*
+ * Orders table slots by key, unused last, for qsort.
+ */
+int compareSlots(const void *a, const void *b) {
+    const struct tableSlot *x = a;
+    const struct tableSlot *y = b;
+    if (x->used != y->used) {
+        return x->used ? -1 : 1;
+    }
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+
+/*
+ * Prints one tally.
+ */
+void printTally(const char *label, const struct tally *t) {
+    printf("%-22s %10llu scrolls %12llu volume %8llu penalties %10.1f s penalized\n", label,
+        (unsigned long long)t->events, (unsigned long long)t->volume,
+        (unsigned long long)t->episodes, t->penalizedMs / 1000.0);
+}
+
+
+/*
+ * Prints the per-user and per-hour tables and the datagram counts, from
+ * every shard.
+ */
+void printTables(struct shard *shards, int count) {
+    struct shard total;
+    char label[64];
+
+    memset(&total, 0, sizeof(total));
+    initTable(&total.users);
+    initTable(&total.hours);
+    initTable(&total.agents);
+    mergeShards(&total, shards, count);
+
+    qsort(total.users.slots, total.users.size, sizeof(struct tableSlot), &compareSlots);
+    for (size_t i = 0; i < total.users.used; i++) {
+        snprintf(label, sizeof(label), "user %llu", (unsigned long long)total.users.slots[i].key);
+        printTally(label, &total.users.slots[i].tally);
+    }
+    qsort(total.hours.slots, total.hours.size, sizeof(struct tableSlot), &compareSlots);
+    for (size_t i = 0; i < total.hours.used; i++) {
+        time_t hour = (time_t)(total.hours.slots[i].key / 1000);
+        struct tm tm;
+        strftime(label, sizeof(label), "%Y-%m-%d %H:00", localtime_r(&hour, &tm));
+        printTally(label, &total.hours.slots[i].tally);
+    }
+
+    uint64_t lost = 0;
+    for (size_t i = 0; i < total.agents.size; i++) {
+        const struct tally *t = &total.agents.slots[i].tally;
+        lost += t->sequences > t->datagrams ? t->sequences - t->datagrams : 0;
+    }
+    printf("%zu agents: %llu datagrams (%llu records) received, %llu lost, %llu malformed\n",
+        total.agents.used, (unsigned long long)total.datagrams,
+        (unsigned long long)total.records, (unsigned long long)lost,
+        (unsigned long long)total.malformed);
+    fflush(stdout);
+    free(total.users.slots);
+    free(total.hours.slots);
+    free(total.agents.slots);
+}
+
+
+/*
+ * Benchmark agents
+ */
+struct agentThread {
+    pthread_t thread;
+    const struct sockaddr_storage *addr;
+    socklen_t addrLength;
+    int first;                          // Agents first to first + count - 1
+    int count;
+    uint64_t deadline;
+    uint64_t sent;                      // Datagrams sent
+    uint64_t dropped;                   // Datagrams the socket wouldn't take
+};
+
+
+/*
+ * Sends datagrams for a range of simulated agents, round robin, as fast
+ * as the sockets take them, until the deadline. Like brainthrottle's
+ * sender, never waits: a datagram the socket won't take is dropped.
+ */
+void *agentThread(void *arg) {
+    struct agentThread *a = arg;
+    struct {
+        struct btTelemetryHeader header;
+        struct btTelemetryRecord records[BT_TELEMETRY_RECORDS];
+    } datagram;
+    int fds[a->count];
+    uint64_t sequences[a->count];
+    uint64_t seed = a->first + 1;
+    uint64_t start = (uint64_t)time(NULL) * 1000;
+
+    for (int i = 0; i < a->count; i++) {
+        fds[i] = socket(a->addr->ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (-1 == fds[i] || 0 != connect(fds[i], (const struct sockaddr *)a->addr, a->addrLength)) {
+            fprintf(stderr, "agent cannot connect (error %d); bailing\n", errno);
+            exit(-1);
+        }
+        sequences[i] = 0;
+    }
+    memset(&datagram, 0, sizeof(datagram));
+    datagram.header.magic = BT_TELEMETRY_MAGIC;
+    datagram.header.version = BT_TELEMETRY_VERSION;
+    datagram.header.count = BT_TELEMETRY_RECORDS;
+
+    for (uint64_t round = 0; nowNs() < a->deadline; round++) {
+        for (int i = 0; i < a->count; i++) {
+            int agent = a->first + i;
+            for (int j = 0; j < BT_TELEMETRY_RECORDS; j++) {
+                struct btTelemetryRecord *r = &datagram.records[j];
+                seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                r->time = start - (seed >> 20) % (24 * kMsecPerHour);
+                r->uid = 1000 + agent % kBenchmarkUsers;
+                r->seat = (uint16_t)(j & 3);
+                r->type = 0 == (seed >> 33) % 20 ? BT_TELEMETRY_EPISODE : BT_TELEMETRY_ACTIVITY;
+                r->events = 1 + (seed >> 50) % 200;
+                r->duration = BT_TELEMETRY_EPISODE == r->type ? 1000 + (seed >> 45) % 30000 : 0;
+                r->volume = r->events * 3;
+            }
+            datagram.header.agent = (uint64_t)agent;
+            datagram.header.sequence = sequences[i]++;
+            if (sizeof(datagram) == send(fds[i], &datagram, sizeof(datagram), MSG_DONTWAIT)) {
+                a->sent++;
+            } else {
+                a->dropped++;
+            }
+        }
+    }
+    for (int i = 0; i < a->count; i++) {
+        close(fds[i]);
+    }
+    return NULL;
+}
+
+
+/*
+ * Runs agents simulated agents against count shards on one transport for
+ * kBenchmarkSeconds and prints what got through.
+ */
+void benchmarkShards(const char *transport, int agents, int count, int unixFd, int *udpPort,
+    struct sockaddr_storage *addr, socklen_t addrLength) {
+    struct shard *shards = aligned_alloc(64, count * sizeof(struct shard));
+    int senders = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    senders = senders < agents ? senders : agents;
+    struct agentThread threads[senders];
+
+    if (NULL == shards || !startShards(shards, count, unixFd, udpPort)) {
+        fprintf(stderr, "cannot start shards; bailing\n");
+        exit(-1);
+    }
+    if (NULL != udpPort) {
+        ((struct sockaddr_in *)addr)->sin_port = htons((uint16_t)*udpPort);
+    }
+    uint64_t start = nowNs();
+    for (int i = 0; i < senders; i++) {
+        struct agentThread *a = &threads[i];
+        memset(a, 0, sizeof(*a));
+        a->addr = addr;
+        a->addrLength = addrLength;
+        a->first = agents * i / senders;
+        a->count = agents * (i + 1) / senders - a->first;
+        a->deadline = start + kBenchmarkSeconds * kNsecPerSec;
+        if (0 != pthread_create(&a->thread, NULL, &agentThread, a)) {
+            fprintf(stderr, "Error starting agent thread; bailing\n");
+            exit(-1);
+        }
+    }
+    uint64_t sent = 0;
+    uint64_t dropped = 0;
+    for (int i = 0; i < senders; i++) {
+        pthread_join(threads[i].thread, NULL);
+        sent += threads[i].sent;
+        dropped += threads[i].dropped;
+    }
+    uint64_t elapsed = nowNs() - start;
+    usleep(100000);
+    stopShards(shards, count);
+
+
+    // Every received record should be in the tables, once
+
+    struct shard total;
+    memset(&total, 0, sizeof(total));
+    initTable(&total.users);
+    initTable(&total.hours);
+    initTable(&total.agents);
+    mergeShards(&total, shards, count);
+    uint64_t userRecords = 0;
+    uint64_t hourRecords = 0;
+    for (size_t i = 0; i < total.users.size; i++) {
+        userRecords += total.users.slots[i].tally.records;
+    }
+    for (size_t i = 0; i < total.hours.size; i++) {
+        hourRecords += total.hours.slots[i].tally.records;
+    }
+    printf("%-4s %3d shard(s): %9.0f records/s received, %5.1f%% dropped by agents, "
+        "%5.1f%% lost in flight, %zu users, %zu hours%s\n", transport, count,
+        (double)total.records * kNsecPerSec / elapsed,
+        sent + dropped ? 100.0 * dropped / (sent + dropped) : 0,
+        sent ? 100.0 * (sent - total.datagrams) / sent : 0, total.users.used, total.hours.used,
+        userRecords == total.records && hourRecords == total.records && 0 == total.malformed ?
+        "" : " (tables don't add up)");
+    for (int i = 0; i < count; i++) {
+        free(shards[i].users.slots);
+        free(shards[i].hours.slots);
+        free(shards[i].agents.slots);
+    }
+    free(total.users.slots);
+    free(total.hours.slots);
+    free(total.agents.slots);
+    free(shards);
+}
+
+
+/*
+ * Benchmarks ingest by agents simulated agents over a temporary Unix
+ * socket and then loopback UDP, with 1, 2, 4, ... threads shards.
+ */
+void runBenchmark(int agents, int threads) {
+    char path[64];
+    struct sockaddr_storage addr;
+    socklen_t addrLength = 0;
+
+    printf("%d agents sending %d-record datagrams for %d s each:\n", agents, BT_TELEMETRY_RECORDS,
+        kBenchmarkSeconds);
+    snprintf(path, sizeof(path), "/tmp/btcollect-benchmark.%d", (int)getpid());
+    for (int count = 1; ; count = count * 2 < threads ? count * 2 : threads) {
+        int fd = listenUnix(path);
+        if (-1 == fd) {
+            exit(-1);
+        }
+        btTelemetryAddress(path, &addr, &addrLength);
+        benchmarkShards("unix", agents, count, fd, NULL, &addr, addrLength);
+        close(fd);
+        unlink(path);
+        if (count == threads) {
+            break;
+        }
+    }
+    btTelemetryAddress("1", &addr, &addrLength);
+    for (int count = 1; ; count = count * 2 < threads ? count * 2 : threads) {
+        int port = 0;
+        benchmarkShards("udp", agents, count, -1, &port, &addr, addrLength);
+        if (count == threads) {
+            break;
+        }
+    }
+}
+
+
+int main(int argc, char **argv) {
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *path = BT_TELEMETRY_PATH;
+    int udpPort = -1;                   // No UDP
+    int interval = 3600;
+    int benchmarkAgents = 0;
+    sigset_t signals;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:p:t:i:b:")) != -1) {
+        switch (opt) {
+        case 's':
+            path = optarg;
+            break;
+        case 'p':
+            udpPort = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'b':
+            benchmarkAgents = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s socket-path] [-p udp-port] [-t threads] [-i seconds] [-b agents]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (threads < 1) {
+        threads = 1;
+    } else if (threads > kMaxThreads) {
+        threads = kMaxThreads;
+    }
+    if (benchmarkAgents > 0) {
+        runBenchmark(benchmarkAgents, threads);
+        return 0;
+    }
+
+
+    // Signals are taken by the main thread with sigwait, so block them
+    // before the shards start
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    int unixFd = listenUnix(path);
+    struct shard *shards = aligned_alloc(64, threads * sizeof(struct shard));
+    if (-1 == unixFd || NULL == shards || !startShards(shards, threads, unixFd, -1 == udpPort ? NULL : &udpPort)) {
+        return -1;
+    }
+    printf("collecting on %s", path);
+    if (-1 != udpPort) {
+        printf(" and UDP port %d", udpPort);
+    }
+    printf(" with %d shard(s)\n", threads);
+    fflush(stdout);
+
+    alarm(interval);
+    for (;;) {
+        int signo;
+        sigwait(&signals, &signo);
+        printTables(shards, threads);
+        if (SIGALRM == signo) {
+            alarm(interval);
+        } else if (SIGUSR1 != signo) {
+            break;
+        }
+    }
+    unlink(path);
+    return 0;
+}
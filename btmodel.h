@@ -0,0 +1,206 @@
+/* btmodel.h **
+ *
+ * The feature extractor and fixed-point classifier behind brainthrottle's
+ * model detector (-o detector=model), shared with the trainer (btanalyze
+ * -m) so both see exactly the same features. Plain C, no dependencies,
+ * header only.
+ *
+ *
+ * Features **
+ *
+ * A detector keeps its last BT_MODEL_WINDOW inputs (scrolls and navigation
+ * keys) in a struct btModelWindow, with running sums updated as inputs
+ * enter and leave it, so extracting features never walks the window. The
+ * features are fixed point with BT_MODEL_SHIFT fraction bits:
+ *
+ *   0  log2 of inputs per second
+ *   1  log2 of scroll volume (summed scrollDiff) per second
+ *   2  mean log2 of the gaps between inputs, in microseconds
+ *   3  fraction of gaps under BT_MODEL_SHORT_GAP_US
+ *   4  fraction of scrolls that reversed direction
+ *   5  fraction of inputs that were navigation keys
+ *   6  log2 of the inputs since the last gap of BT_MODEL_BURST_GAP_US
+ *   7  log2 of the mean scrollDiff
+ *
+ *
+ * Model **
+ *
+ * Logistic regression: the input is skimming when the bias plus the
+ * weighted features is above 0 (a probability above one half). Weights
+ * are fixed point with 16 fraction bits, so inference is eight integer
+ * multiply-adds. Models are written as one line of nine integers, the
+ * bias and then the weights, which is also how -o model= takes them.
+ *
+ *   struct btModelWindow window;
+ *   memset(&window, 0, sizeof(window));
+ *   btModelAdd(&window, timeUs, scrollDiff, reversed ? BT_MODEL_REVERSE : 0);
+ *   int32_t features[BT_MODEL_FEATURES];
+ *   if (btModelFeatures(&window, features) && btModelScore(&model, features) > 0) {
+ *       ... skimming
+ *   }
+ */
+
+#ifndef BTMODEL_H
+#define BTMODEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define BT_MODEL_WINDOW 32              /* Inputs in the window, a power of two */
+#define BT_MODEL_FEATURES 8
+#define BT_MODEL_SHIFT 8                /* Fraction bits of features */
+#define BT_MODEL_WEIGHT_SHIFT 16        /* Fraction bits of weights and scores */
+#define BT_MODEL_MIN_INPUTS 8           /* No decision until the window has this many */
+#define BT_MODEL_SHORT_GAP_US 50000
+#define BT_MODEL_BURST_GAP_US 2000000
+
+enum {
+    BT_MODEL_REVERSE = 1,               /* The scroll went the other way from the last one */
+    BT_MODEL_KEY = 2,                   /* A navigation key rather than a scroll */
+};
+
+struct btModel {
+    int32_t bias;
+    int32_t weights[BT_MODEL_FEATURES];
+};
+
+struct btModelWindow {
+    uint64_t times[BT_MODEL_WINDOW];    /* Microseconds */
+    uint32_t values[BT_MODEL_WINDOW];   /* scrollDiff, 0 for keys */
+    uint8_t flags[BT_MODEL_WINDOW];     /* BT_MODEL_* */
+    uint64_t count;                     /* Inputs ever added */
+    uint64_t volume;                    /* Sums over the window */
+    int64_t logGaps;
+    uint32_t shortGaps;
+    uint32_t reversals;
+    uint32_t keys;
+    uint32_t burst;                     /* Inputs since the last long gap, not capped */
+};
+
+
+/*
+ * Returns log2(value) with BT_MODEL_SHIFT fraction bits, interpolating
+ * linearly between powers of two; 0 for 0.
+ */
+static inline int32_t btModelLog2(uint64_t value) {
+    if (0 == value) {
+        return 0;
+    }
+    int top = 63 - __builtin_clzll(value);
+    return top << BT_MODEL_SHIFT | (int32_t)((value << (63 - top)) >> (63 - BT_MODEL_SHIFT) & 0xff);
+}
+
+/*
+ * Adds (sign 1) or removes (sign -1) the gap between two inputs.
+ */
+static inline void btModelGap(struct btModelWindow *w, uint64_t from, uint64_t to, int sign) {
+    uint64_t gap = to > from ? to - from : 0;
+    w->logGaps += sign * btModelLog2(gap);
+    w->shortGaps += sign * (gap < BT_MODEL_SHORT_GAP_US);
+}
+
+/*
+ * Adds an input at timeUs to the window, pushing out the oldest one.
+ */
+static inline void btModelAdd(struct btModelWindow *w, uint64_t timeUs, uint32_t value, int flags) {
+    uint32_t slot = w->count % BT_MODEL_WINDOW;
+
+    if (w->count >= BT_MODEL_WINDOW) {
+        btModelGap(w, w->times[slot], w->times[(slot + 1) % BT_MODEL_WINDOW], -1);
+        w->volume -= w->values[slot];
+        w->reversals -= w->flags[slot] & BT_MODEL_REVERSE;
+        w->keys -= (w->flags[slot] & BT_MODEL_KEY) >> 1;
+    }
+    if (w->count > 0) {
+        uint64_t last = w->times[(w->count - 1) % BT_MODEL_WINDOW];
+        btModelGap(w, last, timeUs, 1);
+        if (timeUs > last && timeUs - last >= BT_MODEL_BURST_GAP_US) {
+            w->burst = 0;
+        }
+    }
+    w->times[slot] = timeUs;
+    w->values[slot] = value;
+    w->flags[slot] = (uint8_t)flags;
+    w->volume += value;
+    w->reversals += flags & BT_MODEL_REVERSE;
+    w->keys += (flags & BT_MODEL_KEY) >> 1;
+    w->burst++;
+    w->count++;
+}
+
+/*
+ * Fills features from the window. Returns false, leaving them alone, if
+ * the window has fewer than BT_MODEL_MIN_INPUTS inputs.
+ */
+static inline bool btModelFeatures(const struct btModelWindow *w, int32_t *features) {
+    if (w->count < BT_MODEL_MIN_INPUTS) {
+        return false;
+    }
+    uint32_t inputs = w->count < BT_MODEL_WINDOW ? (uint32_t)w->count : BT_MODEL_WINDOW;
+    uint32_t gaps = inputs - 1;
+    uint64_t newest = w->times[(w->count - 1) % BT_MODEL_WINDOW];
+    uint64_t oldest = w->times[(w->count - inputs) % BT_MODEL_WINDOW];
+    int32_t span = btModelLog2(newest > oldest ? newest - oldest : 1);
+    int32_t volume = btModelLog2(1 + w->volume);
+
+    features[0] = btModelLog2(gaps * 1000000ULL) - span;
+    features[1] = btModelLog2((1 + w->volume) * 1000000ULL) - span;
+    features[2] = (int32_t)(w->logGaps / gaps);
+    features[3] = (int32_t)((w->shortGaps << BT_MODEL_SHIFT) / gaps);
+    features[4] = (int32_t)((w->reversals << BT_MODEL_SHIFT) / inputs);
+    features[5] = (int32_t)((w->keys << BT_MODEL_SHIFT) / inputs);
+    features[6] = btModelLog2(w->burst);
+    features[7] = volume - btModelLog2(1 + inputs - w->keys);
+    return true;
+}
+
+/*
+ * Returns the model's score for features, with BT_MODEL_WEIGHT_SHIFT
+ * fraction bits. Above 0 means skimming.
+ */
+static inline int64_t btModelScore(const struct btModel *m, const int32_t *features) {
+    int64_t score = 0;
+    for (int i = 0; i < BT_MODEL_FEATURES; i++) {
+        score += (int64_t)m->weights[i] * features[i];
+    }
+    return m->bias + (score >> BT_MODEL_SHIFT);
+}
+
+/*
+ * Parses a model written as nine integers separated by commas, spaces or
+ * newlines: the bias, then the weights. Lines starting with # are
+ * skipped. Returns 0, or -1 if text isn't a model.
+ */
+static inline int btModelParse(const char *text, struct btModel *m) {
+    int32_t values[BT_MODEL_FEATURES + 1];
+    int count = 0;
+
+    while (*text) {
+        char *end;
+        if ('#' == *text) {
+            while (*text && '\n' != *text) {
+                text++;
+            }
+        } else if (',' == *text || ' ' == *text || '\t' == *text || '\r' == *text || '\n' == *text) {
+            text++;
+        } else {
+            long value = strtol(text, &end, 10);
+            if (end == text || count == BT_MODEL_FEATURES + 1 || value < INT32_MIN || value > INT32_MAX) {
+                return -1;
+            }
+            values[count++] = (int32_t)value;
+            text = end;
+        }
+    }
+    if (BT_MODEL_FEATURES + 1 != count) {
+        return -1;
+    }
+    m->bias = values[0];
+    for (int i = 0; i < BT_MODEL_FEATURES; i++) {
+        m->weights[i] = values[i + 1];
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,511 @@
+/* bttrace.h **
+ *
+ * Compressed columnar traces: a streaming writer and a reader for long-term
+ * storage of brainthrottle traces (struct btTraceRecord, see
+ * brainthrottle.h). Plain C, no dependencies, header only.
+ *
+ *
+ * Format **
+ *
+ * A struct btColumnHeader, then blocks of up to BT_COLUMN_BLOCK events.
+ * Each block starts with a struct btColumnBlock carrying statistics (time
+ * range, event counts, scroll volume), so readers can skip blocks they
+ * don't need without decoding them. Its four columns follow: time, value,
+ * seat, type. Times are stored as differences from the previous event (or
+ * differences of those, whichever packs smaller), divided by their common
+ * factor: evdev times are whole microseconds. Each column is then stored
+ * either bit-packed after subtracting the smallest value, at the width
+ * that fits most values with the few that don't (the pause before a
+ * burst) listed separately, or as zigzag varint runs of equal values;
+ * again whichever is smaller. Seats and types change rarely and come out
+ * as a handful of runs per block.
+ *
+ *   struct btColumnWriter *w = malloc(sizeof(*w));
+ *   btColumnWriterInit(w, file);
+ *   btColumnWrite(w, &record);          ... for every record
+ *   btColumnWriterFinish(w);
+ *
+ *   struct btColumnReader r;
+ *   btColumnReaderInit(&r, mapped, size);
+ *   const struct btColumnBlock *b;
+ *   struct btTraceRecord records[BT_COLUMN_BLOCK];
+ *   while ((b = btColumnNextBlock(&r))) {
+ *       if (b->maxTime < from) continue;
+ *       int n = btColumnDecode(b, records);
+ *       ...
+ *   }
+ */
+
+#ifndef BTTRACE_H
+#define BTTRACE_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "brainthrottle.h"
+
+#define BT_COLUMN_MAGIC 0x43544842      /* "BHTC" */
+#define BT_COLUMN_VERSION 1
+#define BT_COLUMN_BLOCK 4096            /* Events per block, at most */
+#define BT_COLUMN_PAD 8                 /* Zero bytes after packed data, for 64-bit loads */
+#define BT_COLUMN_MAX (16 + BT_COLUMN_BLOCK * 20) /* Largest encoded column: two varints per event */
+
+enum {
+    BT_COLUMN_PACKED = 1,               /* varint zigzag min, width byte, varint exceptions,
+                                           (index delta, value) varints, packed bits */
+    BT_COLUMN_RUNS,                     /* varint count, then (zigzag value, length) varints */
+    BT_COLUMN_SECOND = 0x10,            /* Time column holds differences of differences */
+};
+
+struct btColumnHeader {
+    uint32_t magic;                     /* BT_COLUMN_MAGIC */
+    uint32_t version;                   /* BT_COLUMN_VERSION */
+    uint32_t blockEvents;               /* BT_COLUMN_BLOCK */
+    uint32_t reserved;
+};
+
+struct btColumnBlock {
+    uint32_t bytes;                     /* Encoded columns after this header, padded to 8 */
+    uint32_t count;                     /* Events */
+    uint64_t firstTime;                 /* Time of the first event; times are decoded from it */
+    uint64_t minTime;
+    uint64_t maxTime;
+    uint64_t volume;                    /* Summed values of scroll events */
+    uint32_t scrolls;
+    uint32_t penalties;
+    uint32_t restores;
+    uint32_t reserved;
+};
+
+struct btColumnWriter {
+    FILE *file;
+    uint32_t count;                     /* Records buffered for the current block */
+    uint64_t blocks;                    /* Blocks written */
+    uint64_t bytes;                     /* Bytes written */
+    int error;                          /* errno of the first failed write, or 0 */
+    struct btTraceRecord records[BT_COLUMN_BLOCK];
+    int64_t values[BT_COLUMN_BLOCK];
+    uint8_t columns[4 * BT_COLUMN_MAX + 32];
+    uint8_t scratch[2][BT_COLUMN_MAX];
+};
+
+struct btColumnReader {
+    const uint8_t *next;                /* Next block header */
+    const uint8_t *end;
+};
+
+
+static inline uint64_t btZigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t btUnzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline int btPutVarint(uint8_t *p, uint64_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+static inline const uint8_t *btGetVarint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t byte = *p++;
+        *v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Encodes count values as whichever of the two column forms is smaller.
+ * Returns the encoded length.
+ */
+static inline size_t btEncodeColumn(uint8_t *out, uint8_t scratch[2][BT_COLUMN_MAX],
+        const int64_t *values, uint32_t count, uint8_t flags) {
+    uint32_t widths[65] = { 0 };
+    int64_t min = values[0];
+
+    for (uint32_t i = 1; i < count; i++) {
+        min = values[i] < min ? values[i] : min;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t v = (uint64_t)values[i] - (uint64_t)min;
+        widths[v ? 64 - __builtin_clzll(v) : 0]++;
+    }
+
+
+    /* Bit-packed, relative to the minimum, at the width that packs
+       smallest once the values too wide for it are set aside as
+       exceptions (index, value) at about five bytes each. Widths over 56
+       bits would not fit one unaligned 64-bit load. */
+
+    int width = 0;
+    size_t best = SIZE_MAX;
+    uint32_t wider = count, exceptions = 0;
+    for (int w = 0; w <= 56; w++) {
+        wider -= widths[w];
+        size_t cost = ((size_t)count * w + 7) / 8 + (size_t)wider * 5;
+        if (cost < best) {
+            best = cost;
+            width = w;
+            exceptions = wider;
+        }
+    }
+    uint64_t limit = width ? ~0ULL >> (64 - width) : 0;
+    uint8_t *p = scratch[0];
+    size_t packed = 0;
+    p[packed++] = BT_COLUMN_PACKED | flags;
+    packed += btPutVarint(p + packed, btZigzag(min));
+    p[packed++] = (uint8_t)width;
+    packed += btPutVarint(p + packed, exceptions);
+    for (uint32_t i = 0, last = 0; i < count && exceptions; i++) {
+        uint64_t v = (uint64_t)values[i] - (uint64_t)min;
+        if (v > limit) {
+            packed += btPutVarint(p + packed, i - last);
+            packed += btPutVarint(p + packed, v);
+            last = i;
+        }
+    }
+    size_t bytes = ((size_t)count * width + 7) / 8 + BT_COLUMN_PAD;
+    memset(p + packed, 0, bytes);
+    for (uint32_t i = 0; i < count && width; i++) {
+        uint64_t v = (uint64_t)values[i] - (uint64_t)min;
+        size_t bit = (size_t)i * width;
+        uint64_t word;
+        memcpy(&word, p + packed + bit / 8, sizeof(word));
+        word |= (v > limit ? 0 : v) << (bit % 8);
+        memcpy(p + packed + bit / 8, &word, sizeof(word));
+    }
+    packed += bytes;
+
+
+    /* Runs of equal values, given up once they are no smaller */
+
+    size_t runs = 1 + 10, numRuns = 0;
+    p = scratch[1];
+    for (uint32_t i = 0; i < count && runs < packed; ) {
+        uint32_t j = i + 1;
+        while (j < count && values[j] == values[i]) {
+            j++;
+        }
+        runs += btPutVarint(p + runs, btZigzag(values[i]));
+        runs += btPutVarint(p + runs, j - i);
+        numRuns++;
+        i = j;
+    }
+    if (runs < packed) {
+        out[0] = BT_COLUMN_RUNS | flags;
+        int n = btPutVarint(out + 1, numRuns);
+        memcpy(out + 1 + n, p + 11, runs - 11);
+        return runs - 10 + n;
+    }
+    memcpy(out, scratch[0], packed);
+    return packed;
+}
+
+
+/*
+ * Decodes a column of count values into values. Returns the byte after
+ * it, or NULL if it is damaged.
+ */
+static inline const uint8_t *btDecodeColumn(const uint8_t *p, const uint8_t *end,
+        int64_t *values, uint32_t count, uint8_t *flags) {
+    uint64_t v;
+
+    if (p >= end) {
+        return NULL;
+    }
+    *flags = *p & BT_COLUMN_SECOND;
+    if (BT_COLUMN_PACKED == (*p++ & 0x0f)) {
+        uint64_t exceptions;
+        if (!(p = btGetVarint(p, end, &v)) || p >= end) {
+            return NULL;
+        }
+        uint64_t min = (uint64_t)btUnzigzag(v);
+        int width = *p++;
+        if (width > 56 || !(p = btGetVarint(p, end, &exceptions)) || exceptions > count) {
+            return NULL;
+        }
+        const uint8_t *patches = p;
+        for (uint64_t i = 0; i < exceptions; i++) {
+            if (!(p = btGetVarint(p, end, &v)) || !(p = btGetVarint(p, end, &v))) {
+                return NULL;
+            }
+        }
+        size_t bytes = ((size_t)count * width + 7) / 8 + BT_COLUMN_PAD;
+        if (bytes > (size_t)(end - p)) {
+            return NULL;
+        }
+        if (0 == width) {
+            for (uint32_t i = 0; i < count; i++) {
+                values[i] = (int64_t)min;
+            }
+        } else {
+            uint64_t mask = ~0ULL >> (64 - width);
+            const uint8_t *q = p;
+            unsigned shift = 0;
+            for (uint32_t i = 0; i < count; i++) {
+                uint64_t word;
+                memcpy(&word, q, sizeof(word));
+                values[i] = (int64_t)(min + ((word >> shift) & mask));
+                shift += width;
+                q += shift / 8;
+                shift %= 8;
+            }
+        }
+        uint64_t index = 0, delta;
+        for (uint64_t i = 0; i < exceptions; i++) {
+            patches = btGetVarint(patches, p, &delta);
+            patches = btGetVarint(patches, p, &v);
+            index += delta;
+            if (index >= count) {
+                return NULL;
+            }
+            values[index] = (int64_t)(min + v);
+        }
+        return p + bytes;
+    }
+
+    uint64_t numRuns, length;
+    uint32_t i = 0;
+    if (!(p = btGetVarint(p, end, &numRuns))) {
+        return NULL;
+    }
+    for (uint64_t run = 0; run < numRuns; run++) {
+        if (!(p = btGetVarint(p, end, &v)) || !(p = btGetVarint(p, end, &length)) ||
+            length > count - i) {
+            return NULL;
+        }
+        int64_t value = btUnzigzag(v);
+        for (uint64_t j = 0; j < length; j++) {
+            values[i++] = value;
+        }
+    }
+    return i == count ? p : NULL;
+}
+
+
+/*
+ * Returns the greatest common factor of a and b.
+ */
+static inline uint64_t btGcd(uint64_t a, uint64_t b) {
+    while (b) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+
+/*
+ * Encodes and writes the buffered records as one block.
+ */
+static inline void btColumnFlush(struct btColumnWriter *w) {
+    struct btColumnBlock block;
+    const struct btTraceRecord *r = w->records;
+    uint32_t count = w->count;
+    size_t bytes = 0;
+
+    if (0 == count) {
+        return;
+    }
+    memset(&block, 0, sizeof(block));
+    block.count = count;
+    block.firstTime = r[0].time;
+    block.minTime = block.maxTime = r[0].time;
+    for (uint32_t i = 0; i < count; i++) {
+        block.minTime = r[i].time < block.minTime ? r[i].time : block.minTime;
+        block.maxTime = r[i].time > block.maxTime ? r[i].time : block.maxTime;
+        if (BT_EVENT_SCROLL == r[i].type) {
+            block.scrolls++;
+            block.volume += (uint32_t)r[i].value;
+        }
+        block.penalties += BT_EVENT_PENALTY == r[i].type;
+        block.restores += BT_EVENT_RESTORE == r[i].type;
+    }
+
+
+    /* Times: differences from the previous event over their common
+       factor, or the differences of those if they pack smaller */
+
+    uint64_t scale = 0;
+    for (uint32_t i = 1; i < count; i++) {
+        int64_t delta = (int64_t)(r[i].time - r[i - 1].time);
+        scale = btGcd(scale, delta < 0 ? -(uint64_t)delta : (uint64_t)delta);
+    }
+    scale = scale && scale <= INT64_MAX ? scale : 1;
+    bytes += btPutVarint(w->columns, scale);
+    w->values[0] = 0;
+    for (uint32_t i = 1; i < count; i++) {
+        w->values[i] = (int64_t)(r[i].time - r[i - 1].time) / (int64_t)scale;
+    }
+    uint8_t *first = w->columns + bytes;
+    size_t firstBytes = btEncodeColumn(first, w->scratch, w->values, count, 0);
+    for (uint32_t i = count - 1; i > 1; i--) {
+        w->values[i] = (int64_t)((uint64_t)w->values[i] - (uint64_t)w->values[i - 1]);
+    }
+    uint8_t *second = first + firstBytes;
+    size_t secondBytes = count > 2 ? btEncodeColumn(second, w->scratch, w->values, count, BT_COLUMN_SECOND) : SIZE_MAX;
+    if (secondBytes < firstBytes) {
+        memmove(first, second, secondBytes);
+        firstBytes = secondBytes;
+    }
+    bytes += firstBytes;
+
+
+    /* Values, seats and types as they are */
+
+    for (int column = 0; column < 3; column++) {
+        for (uint32_t i = 0; i < count; i++) {
+            w->values[i] = 0 == column ? r[i].value : 1 == column ? r[i].seat : r[i].type;
+        }
+        bytes += btEncodeColumn(w->columns + bytes, w->scratch, w->values, count, 0);
+    }
+
+    while (bytes % 8) {
+        w->columns[bytes++] = 0;        // Keeps the next block header aligned
+    }
+    block.bytes = (uint32_t)bytes;
+    if (!w->error && (1 != fwrite(&block, sizeof(block), 1, w->file) ||
+        (bytes && 1 != fwrite(w->columns, bytes, 1, w->file)))) {
+        w->error = errno ? errno : EIO;
+    }
+    w->bytes += sizeof(block) + bytes;
+    w->blocks++;
+    w->count = 0;
+}
+
+
+/*
+ * Starts a columnar trace on file. Returns 0, or -1 with errno set.
+ */
+static inline int btColumnWriterInit(struct btColumnWriter *w, FILE *file) {
+    struct btColumnHeader header = { BT_COLUMN_MAGIC, BT_COLUMN_VERSION, BT_COLUMN_BLOCK, 0 };
+
+    w->file = file;
+    w->count = 0;
+    w->blocks = 0;
+    w->error = 0;
+    w->bytes = sizeof(header);
+    return 1 == fwrite(&header, sizeof(header), 1, file) ? 0 : -1;
+}
+
+static inline void btColumnWrite(struct btColumnWriter *w, const struct btTraceRecord *r) {
+    w->records[w->count++] = *r;
+    if (BT_COLUMN_BLOCK == w->count) {
+        btColumnFlush(w);
+    }
+}
+
+
+/*
+ * Writes the last, partial block and flushes the file. Returns 0, or -1
+ * with errno set if any write failed.
+ */
+static inline int btColumnWriterFinish(struct btColumnWriter *w) {
+    btColumnFlush(w);
+    if (0 != fflush(w->file) && !w->error) {
+        w->error = errno;
+    }
+    errno = w->error;
+    return w->error ? -1 : 0;
+}
+
+
+/*
+ * Starts reading a columnar trace mapped (or read) at data. Returns 0, or
+ * -1 if it is not one.
+ */
+static inline int btColumnReaderInit(struct btColumnReader *r, const void *data, size_t size) {
+    const struct btColumnHeader *header = (const struct btColumnHeader *)data;
+
+    if (size < sizeof(*header) || BT_COLUMN_MAGIC != header->magic ||
+        BT_COLUMN_VERSION != header->version || header->blockEvents > BT_COLUMN_BLOCK) {
+        return -1;
+    }
+    r->next = (const uint8_t *)(header + 1);
+    r->end = (const uint8_t *)data + size;
+    return 0;
+}
+
+
+/*
+ * Returns the next block's header (without decoding it), or NULL at the
+ * end of the trace or at a truncated block.
+ */
+static inline const struct btColumnBlock *btColumnNextBlock(struct btColumnReader *r) {
+    const struct btColumnBlock *b = (const struct btColumnBlock *)r->next;
+
+    if ((size_t)(r->end - r->next) < sizeof(*b) ||
+        b->bytes > (size_t)(r->end - r->next) - sizeof(*b) || b->count > BT_COLUMN_BLOCK) {
+        return NULL;
+    }
+    r->next += sizeof(*b) + b->bytes;
+    return b;
+}
+
+
+/*
+ * Decodes a block into out, which must have room for BT_COLUMN_BLOCK
+ * records. Returns the number of records, or -1 if the block is damaged.
+ */
+static inline int btColumnDecode(const struct btColumnBlock *b, struct btTraceRecord *out) {
+    int64_t values[BT_COLUMN_BLOCK];
+    const uint8_t *p = (const uint8_t *)(b + 1);
+    const uint8_t *end = p + b->bytes;
+    uint32_t count = b->count;
+    uint64_t scale;
+    uint8_t flags;
+
+    if (0 == count) {
+        return 0;
+    }
+    if (!(p = btGetVarint(p, end, &scale)) || !(p = btDecodeColumn(p, end, values, count, &flags))) {
+        return -1;
+    }
+    if (flags) {
+        for (uint32_t i = 2; i < count; i++) {
+            values[i] = (int64_t)((uint64_t)values[i] + (uint64_t)values[i - 1]);
+        }
+    }
+    uint64_t time = b->firstTime;
+    for (uint32_t i = 0; i < count; i++) {
+        time += (uint64_t)values[i] * scale;
+        out[i].time = time;
+        out[i].reserved = 0;
+    }
+
+    if (!(p = btDecodeColumn(p, end, values, count, &flags))) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        out[i].value = (int32_t)values[i];
+    }
+    if (!(p = btDecodeColumn(p, end, values, count, &flags))) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        out[i].seat = (uint16_t)values[i];
+    }
+    if (!(p = btDecodeColumn(p, end, values, count, &flags))) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        out[i].type = (uint8_t)values[i];
+    }
+    return (int)count;
+}
+
+#endif